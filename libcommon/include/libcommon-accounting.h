@@ -0,0 +1,200 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMON_ACCOUNTING_H
+#define COMMON_ACCOUNTING_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file include/libcommon-accounting.h
+ * @brief Counts the memory that large buffers take, per kind of buffer.
+ * @author Roel Janssen
+ */
+
+
+/**
+ * @ingroup common
+ * @{
+ * 
+ *   @defgroup common_accounting Accounting
+ *   @{
+ *
+ * This module keeps track of the memory that volumes, masks, slices,
+ * pixel buffers, lookup tables, undo history and caches take. Every
+ * allocation is counted in a category, both for the program as a whole and
+ * for the owner it is made for, such as a Serie. For each, the current
+ * usage and the highest usage so far are kept.
+ *
+ * A budget can be set for the whole program. It does not stop allocations,
+ * but caches and read-ahead can ask whether the program is over it, and
+ * hold back when it is.
+ *
+ * All functions can be called from any thread.
+ */
+
+
+/**
+ * The kinds of memory that are counted.
+ */
+typedef enum
+{
+  ACCOUNTING_VOLUME,
+  ACCOUNTING_MASK,
+  ACCOUNTING_SLICE,
+  ACCOUNTING_PIXBUF,
+  ACCOUNTING_LUT,
+  ACCOUNTING_HISTORY,
+  ACCOUNTING_CACHE,
+  ACCOUNTING_TOTAL
+} AccountingCategory;
+
+
+/**
+ * The usage of a category, in bytes.
+ */
+typedef struct
+{
+  unsigned long long current;
+  unsigned long long peak;
+} AccountingUsage;
+
+
+/**
+ * The usage of an owner, per category and in total (ACCOUNTING_TOTAL).
+ * It should start out zeroed.
+ */
+typedef struct
+{
+  AccountingUsage usage[ACCOUNTING_TOTAL + 1];
+} Accounting;
+
+
+/**
+ * This function counts an allocation.
+ *
+ * @param owner     The owner to count it for as well, or NULL.
+ * @param category  The kind of memory.
+ * @param bytes     The size of the allocation.
+ */
+void common_accounting_add (Accounting *owner, AccountingCategory category,
+                            unsigned long long bytes);
+
+
+/**
+ * This function counts that memory was freed.
+ *
+ * @param owner     The owner it was counted for, or NULL.
+ * @param category  The kind of memory.
+ * @param bytes     The size of the allocation.
+ */
+void common_accounting_remove (Accounting *owner, AccountingCategory category,
+                               unsigned long long bytes);
+
+
+/**
+ * This function counts that an allocation changed its size.
+ *
+ * @param owner     The owner it was counted for, or NULL.
+ * @param category  The kind of memory.
+ * @param previous  The size it had.
+ * @param bytes     The size it has now.
+ */
+void common_accounting_resize (Accounting *owner, AccountingCategory category,
+                               unsigned long long previous, unsigned long long bytes);
+
+
+/**
+ * This function removes everything that is counted for an owner from the
+ * program as a whole, and sets its current usage to zero. It is used when
+ * the owner is freed.
+ *
+ * @param owner  The owner.
+ */
+void common_accounting_release (Accounting *owner);
+
+
+/**
+ * This function returns the usage of a category.
+ *
+ * @param owner     The owner, or NULL for the program as a whole.
+ * @param category  The kind of memory, or ACCOUNTING_TOTAL for all.
+ *
+ * @return The current and highest usage.
+ */
+AccountingUsage common_accounting_get_usage (Accounting *owner, AccountingCategory category);
+
+
+/**
+ * This function returns a name for a category, for display.
+ *
+ * @param category  The kind of memory.
+ *
+ * @return A static string.
+ */
+const char *common_accounting_category_name (AccountingCategory category);
+
+
+/**
+ * This function sets the budget for the program as a whole.
+ *
+ * @param bytes  The budget, or 0 for none.
+ */
+void common_accounting_set_budget (unsigned long long bytes);
+
+
+/**
+ * This function returns the budget for the program as a whole.
+ *
+ * @return The budget, or 0 when there is none.
+ */
+unsigned long long common_accounting_get_budget ();
+
+
+/**
+ * This function returns how much can still be allocated before the
+ * budget is reached.
+ *
+ * @return The bytes left, 0 when over budget, or ULLONG_MAX without a
+ *         budget.
+ */
+unsigned long long common_accounting_get_headroom ();
+
+
+/**
+ * This function tells whether the program uses more than its budget.
+ *
+ * @return 1 when over budget, 0 otherwise.
+ */
+short int common_accounting_under_pressure ();
+
+
+/**
+ *   @} 
+ * @}
+ */
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//COMMON_ACCOUNTING_H
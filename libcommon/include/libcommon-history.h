@@ -21,6 +21,10 @@
 #define COMMON_HISTORY_H
 
 #include "libcommon-list.h"
+#include <pthread.h>
+
+#define HISTORY_MEMORY_BUDGET    (256ULL << 20)  /*! The default bytes of history in memory. */
+#define HISTORY_DISK_BUDGET      (4ULL << 30)    /*! The default bytes of history on disk. */
 
 /**
  * @file include/libcommon-history.h
@@ -40,7 +44,16 @@
  * them. This effectively delivers the common undo functionality found in 
  * programs.
  *
- * To use this module you need to add zlib support to your build system.
+ * States are compressed on a thread of their own, so saving one only takes
+ * the time to copy it.
+ *
+ * All history lists share a memory budget. When they take more, the oldest
+ * elements are moved to a temporary file, and read back when they are
+ * needed. When that file grows beyond its own budget, the oldest elements
+ * are dropped, and undoing stops at them.
+ *
+ * To use this module you need to add zlib support to your build system,
+ * and link against pthreads.
  *
  * @note This module depends on the @ref common_list "Common::List" module.
  */
@@ -60,14 +73,57 @@ typedef enum
 } HistoryAction;
 
 
+/**
+ * This type is used to apply the difference between two states.
+ */
+typedef short int (*HistoryApplyFunc) (void *delta, void *user_data);
+
+
 /**
  * This type is used to store a history element.
  */
-typedef struct
+typedef struct s_History
 {
   void *data;
   unsigned long data_len;
   unsigned long compressed_len;
+
+  /**
+   * The copy of the state while it is being compressed, and the thread that
+   * compresses it. A compressed_len of 0 means the state is not compressed.
+   */
+  void *pending_data;
+  int compression_level;
+  pthread_t thread;
+  short int pending;
+
+  /**
+   * The difference with the previous state, for elements that are saved
+   * with common_history_save_delta.
+   */
+  void *delta;
+  unsigned long delta_len;
+
+  /**
+   * Where the element is in the file the history spills to, or -1 when it
+   * is not there. An element that was dropped to stay within the budget
+   * holds no data anymore.
+   */
+  long long spill_offset;
+  unsigned long spill_len;
+  short int dropped;
+
+  /**
+   * The bytes in memory that were last counted for the element. See
+   * libcommon-accounting.h.
+   */
+  unsigned long long accounted;
+
+  /**
+   * The elements of all history lists, in the order they were saved.
+   */
+  struct s_History *older;
+  struct s_History *newer;
 } History;
 
 
@@ -80,7 +136,8 @@ void common_history_destroy_element (void *data);
 
 /**
  * Using this function, a state can be saved so it can be retrieved later.
- * @note The state becomes the active state immediately.
+ * @note The state becomes the active state immediately. The data is copied,
+ *       and compressed in the background.
  * @param list      A pointer to the current history list.
  * @param data      The data that belongs to the state that is 
  *                  active after applying the action.
@@ -91,6 +148,48 @@ void common_history_destroy_element (void *data);
 List* common_history_save_state (List *list, void *data, unsigned long data_len);
 
 
+/**
+ * This function sets how hard states that are saved from now on are
+ * compressed.
+ * @param level  A zlib compression level, from 0 (no compression) to 9.
+ *               The default is 1, the fastest.
+ */
+void common_history_set_compression_level (int level);
+
+
+/**
+ * Using this function, the difference with the previous state can be saved,
+ * instead of the complete state.
+ * @note The state becomes the active state immediately.
+ * @param list           A pointer to the current history list.
+ * @param delta      The difference with the previous state, or NULL for the
+ *                   first state. The history takes it over, and frees it
+ *                   with free().
+ * @param delta_len  The number of bytes of the delta. It is stored as a
+ *                   single block, so it can be moved to disk.
+ *
+ * @return A pointer to a list element on success, NULL on failure.
+ */
+List* common_history_save_delta (List *list, void *delta, unsigned long delta_len);
+
+
+/**
+ * Using this function, the history can be stepped through by applying the
+ * differences between the states. The apply function is given the delta of
+ * each state that is passed. It must undo the delta when going back, and
+ * redo it when going forward.
+ * @param list       A pointer to the current history linked list.
+ * @param te_Action  The action to be performed.
+ * @param apply      The function that applies a delta.
+ * @param user_data  The data to pass to the apply function.
+ *
+ * @return A pointer to the list element of the state that is active after
+ *         applying the action.
+ */
+List* common_history_apply_delta (List *list, HistoryAction te_Action,
+                                  HistoryApplyFunc apply, void *user_data);
+
+
 /**
  * Using this function, a previous or next state can be loaded.
  * @param list       A pointer to the current history linked list.
@@ -103,6 +202,30 @@ List* common_history_save_state (List *list, void *data, unsigned long data_len)
 List* common_history_load_state (List *list, HistoryAction te_Action, void **output);
 
 
+/**
+ * This function sets how much the history lists may take together.
+ * @param memory  The number of bytes to keep in memory.
+ * @param disk    The number of bytes to keep in the temporary file.
+ */
+void common_history_set_budget (unsigned long long memory, unsigned long long disk);
+
+
+/**
+ * This function returns the number of bytes the history lists take in
+ * memory.
+ * @return The memory usage of all history lists.
+ */
+unsigned long long common_history_get_memory_usage ();
+
+
+/**
+ * This function returns the number of bytes the history lists take in the
+ * temporary file.
+ * @return The disk usage of all history lists.
+ */
+unsigned long long common_history_get_disk_usage ();
+
+
 /**
  *   @} 
  * @}
@@ -0,0 +1,142 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMON_IOHINT_H
+#define COMMON_IOHINT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file include/libcommon-iohint.h
+ * @brief A small interface to tell the kernel how files will be read.
+ * @author Roel Janssen
+ */
+
+
+/**
+ * @ingroup common
+ * @{
+ * 
+ *   @defgroup common_iohint I/O hints
+ *   @{
+ *
+ * This module tells the kernel which parts of a file are about to be
+ * read, so it can read them ahead while the program is busy with
+ * something else. The hints never change what is read. They only help
+ * when the data is not in the page cache yet, for example on a cold
+ * spinning disk or on network storage.
+ *
+ * Every hint is counted, so the effect of the hints can be measured.
+ */
+
+
+/**
+ * The number of hints that have been given.
+ */
+typedef struct
+{
+  /**
+   * The number of files that were announced to be read sequentially.
+   */
+  unsigned long long sequential;
+
+  /**
+   * The number of ranges that were asked to be read ahead, and their
+   * total size in bytes.
+   */
+  unsigned long long willneed;
+  unsigned long long willneed_bytes;
+
+  /**
+   * The number of hints the kernel did not accept.
+   */
+  unsigned long long failed;
+} IoHintCounters;
+
+
+/**
+ * This function turns the hints on or off. They are on by default.
+ *
+ * @param enabled  1 to give hints, 0 to skip them.
+ */
+void common_iohint_set_enabled (short int enabled);
+
+
+/**
+ * This function announces that a range of an open file will be read from
+ * start to end, and asks the kernel to start reading it.
+ *
+ * @param fd      The file descriptor.
+ * @param offset  The first byte of the range.
+ * @param length  The number of bytes in the range, or 0 for up to the end.
+ */
+void common_iohint_sequential (int fd, unsigned long long offset,
+                               unsigned long long length);
+
+
+/**
+ * This function asks the kernel to read a range of an open file ahead.
+ *
+ * @param fd      The file descriptor.
+ * @param offset  The first byte of the range.
+ * @param length  The number of bytes in the range.
+ */
+void common_iohint_willneed (int fd, unsigned long long offset,
+                             unsigned long long length);
+
+
+/**
+ * This function asks the kernel to read a range of a file that is not
+ * open yet ahead, so that it is in the page cache when it is opened.
+ *
+ * @param path    The file to read ahead.
+ * @param offset  The first byte of the range.
+ * @param length  The number of bytes in the range, or 0 for up to the end.
+ */
+void common_iohint_prefetch_file (const char *path, unsigned long long offset,
+                                  unsigned long long length);
+
+
+/**
+ * This function returns the number of hints given so far.
+ *
+ * @param counters  The structure to fill.
+ */
+void common_iohint_get_counters (IoHintCounters *counters);
+
+
+/**
+ * This function sets all counters back to zero.
+ */
+void common_iohint_reset_counters ();
+
+
+/**
+ *   @} 
+ * @}
+ */
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//COMMON_IOHINT_H
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMON_THREAD_H
+#define COMMON_THREAD_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @file include/libcommon-thread.h
+ * @brief A small interface to split work over a number of threads.
+ * @author Roel Janssen
+ */
+
+
+/**
+ * @ingroup common
+ * @{
+ * 
+ *   @defgroup common_thread Thread
+ *   @{
+ *
+ * This module splits a range of work in contiguous chunks and runs a
+ * callback for each chunk on its own thread. The calling thread handles
+ * the first chunk itself and returns when all chunks are done.
+ *
+ * To use this module you need to link against pthreads.
+ */
+
+
+/**
+ * The callback type that handles one chunk of a range.
+ *
+ * @param start      The first element of the chunk.
+ * @param end        One past the last element of the chunk.
+ * @param worker     The index of the worker handling the chunk, which is
+ *                   smaller than the number of workers the range was
+ *                   split for.
+ * @param user_data  The data passed to common_thread_parallel_for().
+ */
+typedef void (*ThreadRangeCallback) (unsigned long long start,
+                                     unsigned long long end,
+                                     unsigned int worker,
+                                     void *user_data);
+
+
+/**
+ * This function returns the maximum number of workers that will be used
+ * by the calling thread. Unless set otherwise, it is the number of online
+ * processors.
+ *
+ * @return The maximum number of workers.
+ */
+unsigned int common_thread_number_of_workers ();
+
+
+/**
+ * This function limits the number of workers that will be used.
+ *
+ * @param workers  The number of workers, or 0 to use the number of online
+ *                 processors.
+ */
+void common_thread_set_number_of_workers (unsigned int workers);
+
+
+/**
+ * This function limits the number of workers that will be used by the
+ * calling thread only, for example to give each of several jobs that run
+ * at once a share of the workers.
+ *
+ * @param workers  The number of workers, or 0 to use the number set with
+ *                 common_thread_set_number_of_workers().
+ */
+void common_thread_set_thread_workers (unsigned int workers);
+
+
+/**
+ * This function splits a range in chunks and handles the chunks in parallel.
+ *
+ * @param length     The number of elements in the range.
+ * @param min_chunk  The minimum number of elements worth a thread.
+ * @param workers    The maximum number of workers to use, for example the
+ *                   number that per-worker data was allocated for, or 0 to
+ *                   use common_thread_number_of_workers().
+ * @param callback   The function to call for each chunk.
+ * @param user_data  Data to pass to the callback.
+ *
+ * @return The number of workers that were used.
+ */
+unsigned int common_thread_parallel_for (unsigned long long length,
+                                         unsigned long long min_chunk,
+                                         unsigned int workers,
+                                         ThreadRangeCallback callback,
+                                         void *user_data);
+
+
+/**
+ *   @} 
+ * @}
+ */
+
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//COMMON_THREAD_H
@@ -0,0 +1,215 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libcommon-accounting.h"
+
+#include <limits.h>
+#include <stdlib.h>
+
+/*----------------------------------------------------------------------------.
+ | LOCAL VARIABLES                                                            |
+ '----------------------------------------------------------------------------*/
+static Accounting ts_Program;
+static unsigned long long ui64_Budget = 0;
+
+static const char *pc_CategoryNames[ACCOUNTING_TOTAL + 1] =
+{
+  "Volumes", "Masks", "Slices", "Pixel buffers", "Lookup tables",
+  "Undo history", "Caches", "Total"
+};
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_RAISE_PEAK                                               |
+ | This function sets a peak to a new current value when that is higher.      |
+ '----------------------------------------------------------------------------*/
+static void
+common_accounting_raise_peak (AccountingUsage *usage, unsigned long long current)
+{
+  unsigned long long peak = __atomic_load_n (&usage->peak, __ATOMIC_RELAXED);
+
+  while (current > peak
+         && !__atomic_compare_exchange_n (&usage->peak, &peak, current, 1,
+                                          __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_CHANGE                                                   |
+ | This function adds a (two's complement) difference to a category and to   |
+ | the total of an owner.                                                     |
+ '----------------------------------------------------------------------------*/
+static void
+common_accounting_change (Accounting *owner, AccountingCategory category,
+                          unsigned long long difference, short int b_Grows)
+{
+  unsigned long long current;
+
+  current = __atomic_add_fetch (&owner->usage[category].current, difference, __ATOMIC_RELAXED);
+  if (b_Grows) common_accounting_raise_peak (&owner->usage[category], current);
+
+  current = __atomic_add_fetch (&owner->usage[ACCOUNTING_TOTAL].current, difference, __ATOMIC_RELAXED);
+  if (b_Grows) common_accounting_raise_peak (&owner->usage[ACCOUNTING_TOTAL], current);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_ADD                                                      |
+ | This function counts an allocation.                                        |
+ '----------------------------------------------------------------------------*/
+void
+common_accounting_add (Accounting *owner, AccountingCategory category,
+                       unsigned long long bytes)
+{
+  if (category >= ACCOUNTING_TOTAL || bytes == 0) return;
+
+  if (owner != NULL) common_accounting_change (owner, category, bytes, 1);
+  common_accounting_change (&ts_Program, category, bytes, 1);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_REMOVE                                                   |
+ | This function counts that memory was freed.                                |
+ '----------------------------------------------------------------------------*/
+void
+common_accounting_remove (Accounting *owner, AccountingCategory category,
+                          unsigned long long bytes)
+{
+  if (category >= ACCOUNTING_TOTAL || bytes == 0) return;
+
+  if (owner != NULL) common_accounting_change (owner, category, -bytes, 0);
+  common_accounting_change (&ts_Program, category, -bytes, 0);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_RESIZE                                                   |
+ | This function counts that an allocation changed its size.                  |
+ '----------------------------------------------------------------------------*/
+void
+common_accounting_resize (Accounting *owner, AccountingCategory category,
+                          unsigned long long previous, unsigned long long bytes)
+{
+  if (bytes > previous)
+    common_accounting_add (owner, category, bytes - previous);
+  else
+    common_accounting_remove (owner, category, previous - bytes);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_RELEASE                                                  |
+ | This function removes all that is counted for an owner.                    |
+ '----------------------------------------------------------------------------*/
+void
+common_accounting_release (Accounting *owner)
+{
+  int category;
+
+  if (owner == NULL) return;
+
+  for (category = 0; category < ACCOUNTING_TOTAL; category++)
+  {
+    unsigned long long bytes = __atomic_exchange_n (&owner->usage[category].current, 0, __ATOMIC_RELAXED);
+    if (bytes == 0) continue;
+
+    __atomic_sub_fetch (&owner->usage[ACCOUNTING_TOTAL].current, bytes, __ATOMIC_RELAXED);
+    common_accounting_change (&ts_Program, category, -bytes, 0);
+  }
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_GET_USAGE                                                |
+ | This function returns the usage of a category.                             |
+ '----------------------------------------------------------------------------*/
+AccountingUsage
+common_accounting_get_usage (Accounting *owner, AccountingCategory category)
+{
+  AccountingUsage ts_Usage = { 0, 0 };
+
+  if (category > ACCOUNTING_TOTAL) return ts_Usage;
+  if (owner == NULL) owner = &ts_Program;
+
+  ts_Usage.current = __atomic_load_n (&owner->usage[category].current, __ATOMIC_RELAXED);
+  ts_Usage.peak = __atomic_load_n (&owner->usage[category].peak, __ATOMIC_RELAXED);
+
+  return ts_Usage;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_CATEGORY_NAME                                            |
+ | This function returns a name for a category.                               |
+ '----------------------------------------------------------------------------*/
+const char *
+common_accounting_category_name (AccountingCategory category)
+{
+  if (category > ACCOUNTING_TOTAL) return "Unknown";
+  return pc_CategoryNames[category];
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_SET_BUDGET                                               |
+ | This function sets the budget for the program as a whole.                  |
+ '----------------------------------------------------------------------------*/
+void
+common_accounting_set_budget (unsigned long long bytes)
+{
+  __atomic_store_n (&ui64_Budget, bytes, __ATOMIC_RELAXED);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_GET_BUDGET                                               |
+ | This function returns the budget for the program as a whole.               |
+ '----------------------------------------------------------------------------*/
+unsigned long long
+common_accounting_get_budget ()
+{
+  return __atomic_load_n (&ui64_Budget, __ATOMIC_RELAXED);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_GET_HEADROOM                                             |
+ | This function returns how much can be allocated within the budget.         |
+ '----------------------------------------------------------------------------*/
+unsigned long long
+common_accounting_get_headroom ()
+{
+  unsigned long long budget = common_accounting_get_budget ();
+  unsigned long long current = __atomic_load_n (&ts_Program.usage[ACCOUNTING_TOTAL].current, __ATOMIC_RELAXED);
+
+  if (budget == 0) return ULLONG_MAX;
+  return (current < budget) ? budget - current : 0;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_ACCOUNTING_UNDER_PRESSURE                                           |
+ | This function tells whether the program uses more than its budget.         |
+ '----------------------------------------------------------------------------*/
+short int
+common_accounting_under_pressure ()
+{
+  return (common_accounting_get_headroom () == 0);
+}
@@ -17,14 +17,318 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE
 #include "libcommon-history.h"
 #include "libcommon-debug.h"
+#include "libcommon-accounting.h"
 
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
 #include <zlib.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+static int common_history_compression_level = Z_BEST_SPEED;
+
+// All history elements of all lists, from the oldest to the newest. The
+// budgets apply to all of them together.
+static History *common_history_oldest = NULL;
+static History *common_history_newest = NULL;
+
+static unsigned long long common_history_memory_budget = HISTORY_MEMORY_BUDGET;
+static unsigned long long common_history_disk_budget = HISTORY_DISK_BUDGET;
+
+// Elements that do not fit in memory are appended to this file, which is
+// removed as soon as it is created.
+static int common_history_log = -1;
+static unsigned long long common_history_log_end = 0;
+
+
+static void *
+common_history_compress (void *data)
+{
+  History *history = (History *)data;
+
+  unsigned long compressed_len = compressBound (history->data_len);
+  void *compressed = malloc (compressed_len);
+
+  if (compressed != NULL
+      && compress2 (compressed, &compressed_len, history->pending_data,
+                    history->data_len, history->compression_level) == Z_OK)
+  {
+    free (history->pending_data);
+    history->data = compressed;
+    history->compressed_len = compressed_len;
+  }
+  else
+  {
+    // Keep the state as it is, rather than losing it.
+    free (compressed);
+    history->data = history->pending_data;
+    history->compressed_len = 0;
+  }
+
+  history->pending_data = NULL;
+  return NULL;
+}
+
+
+static void
+common_history_wait (History *history)
+{
+  if (history == NULL || !history->pending) return;
+
+  pthread_join (history->thread, NULL);
+  history->pending = 0;
+}
+
+
+static void
+common_history_register (History *history)
+{
+  history->older = common_history_newest;
+  history->newer = NULL;
+
+  if (common_history_newest != NULL)
+    common_history_newest->newer = history;
+  else
+    common_history_oldest = history;
+
+  common_history_newest = history;
+}
+
+
+static void
+common_history_unregister (History *history)
+{
+  if (history->older != NULL)
+    history->older->newer = history->newer;
+  else
+    common_history_oldest = history->newer;
+
+  if (history->newer != NULL)
+    history->newer->older = history->older;
+  else
+    common_history_newest = history->older;
+
+  history->older = NULL;
+  history->newer = NULL;
+}
+
+
+// The bytes an element takes in memory. While it is being compressed,
+// that is the size of its copy.
+static unsigned long long
+common_history_memory_size (History *history)
+{
+  if (history->pending) return history->data_len;
+
+  if (history->data != NULL)
+    return (history->compressed_len > 0) ? history->compressed_len : history->data_len;
+
+  if (history->delta != NULL)
+    return history->delta_len;
+
+  return 0;
+}
+
+
+static void
+common_history_account (History *history)
+{
+  unsigned long long size = common_history_memory_size (history);
+
+  common_accounting_resize (NULL, ACCOUNTING_HISTORY, history->accounted, size);
+  history->accounted = size;
+}
+
+
+static void
+common_history_spill_release (History *history)
+{
+  if (history->spill_offset < 0) return;
+
+  #ifdef FALLOC_FL_PUNCH_HOLE
+  fallocate (common_history_log, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+             history->spill_offset, history->spill_len);
+  #endif
+
+  history->spill_offset = -1;
+  history->spill_len = 0;
+}
+
+
+// Moves an element from memory to the log. An element that was read back
+// from the log still has its place there, so it is only written once.
+static short int
+common_history_spill (History *history)
+{
+  if (history->pending) return 0;
+
+  void **payload = (history->data != NULL) ? &history->data : &history->delta;
+  unsigned long long length = common_history_memory_size (history);
+
+  if (*payload == NULL) return 0;
+
+  if (history->spill_offset < 0)
+  {
+    if (common_history_log < 0)
+    {
+      const char *directory = getenv ("TMPDIR");
+      char *path = calloc (1, strlen ((directory != NULL) ? directory : "/tmp") + 32);
+      assert (path != NULL);
+
+      sprintf (path, "%s/clmedview-history-XXXXXX", (directory != NULL) ? directory : "/tmp");
+      common_history_log = mkstemp (path);
+      if (common_history_log >= 0) unlink (path);
+
+      free (path);
+      if (common_history_log < 0)
+      {
+        debug_warning ("Could not create a file for the undo history.");
+        return 0;
+      }
+    }
+
+    unsigned long long written = 0;
+    while (written < length)
+    {
+      ssize_t result = pwrite (common_history_log, (char *)*payload + written, length - written,
+                               common_history_log_end + written);
+      if (result <= 0)
+      {
+        debug_warning ("Could not write the undo history to disk.");
+        return 0;
+      }
+
+      written += result;
+    }
+
+    history->spill_offset = common_history_log_end;
+    history->spill_len = length;
+    common_history_log_end += length;
+  }
+
+  free (*payload), *payload = NULL;
+  common_history_account (history);
+
+  return 1;
+}
+
+
+// Reads an element back from the log, when it is not in memory.
+static short int
+common_history_restore (History *history)
+{
+  common_history_wait (history);
+
+  if (history->dropped) return 0;
+  if (history->data != NULL || history->delta != NULL || history->spill_offset < 0) return 1;
+
+  void *payload = malloc (history->spill_len);
+  if (payload == NULL) return 0;
+
+  unsigned long long done = 0;
+  while (done < history->spill_len)
+  {
+    ssize_t result = pread (common_history_log, (char *)payload + done, history->spill_len - done,
+                            history->spill_offset + done);
+    if (result <= 0)
+    {
+      debug_error ("Could not read the undo history from disk.");
+      free (payload);
+      return 0;
+    }
+
+    done += result;
+  }
+
+  if (history->data_len > 0)
+    history->data = payload;
+  else
+    history->delta = payload;
+
+  common_history_account (history);
+
+  return 1;
+}
+
+
+// Frees what an element holds. The element stays in its list, so undoing
+// stops at it.
+static void
+common_history_drop (History *history)
+{
+  common_history_wait (history);
+
+  free (history->data), history->data = NULL;
+  free (history->delta), history->delta = NULL;
+  common_history_spill_release (history);
+
+  history->dropped = 1;
+  common_history_account (history);
+}
+
+
+// Keeps the history within its budgets. The newest element and the
+// current one stay where they are, because they are needed next.
+static void
+common_history_enforce_budget (History *current)
+{
+  History *history;
+  unsigned long long memory;
+  unsigned long long disk;
+
+  // Elements that were compressed since they were counted take less now.
+  for (history = common_history_oldest; history != NULL; history = history->newer)
+  {
+    if (history->pending && pthread_tryjoin_np (history->thread, NULL) == 0)
+      history->pending = 0;
+
+    if (!history->pending) common_history_account (history);
+  }
+
+  memory = common_history_get_memory_usage ();
+
+  // The oldest elements go to disk first. When that fails, they are
+  // dropped, because running out of memory is worse than a shorter history.
+  for (history = common_history_oldest;
+       history != NULL && memory > common_history_memory_budget;
+       history = history->newer)
+  {
+    if (history == current || history == common_history_newest) continue;
+
+    unsigned long long size = common_history_memory_size (history);
+    if (size == 0 || history->pending) continue;
+
+    if (!common_history_spill (history))
+      common_history_drop (history);
+
+    memory -= size;
+  }
+
+  disk = common_history_get_disk_usage ();
+  for (history = common_history_oldest;
+       history != NULL && disk > common_history_disk_budget;
+       history = history->newer)
+  {
+    if (history->spill_offset < 0) continue;
+    if (history == current || history == common_history_newest) continue;
+
+    disk -= history->spill_len;
+    common_history_drop (history);
+  }
+
+  // Without anything on disk, the log can start over.
+  if (disk == 0 && common_history_log >= 0 && common_history_log_end > 0)
+  {
+    if (ftruncate (common_history_log, 0) == 0)
+      common_history_log_end = 0;
+  }
+}
 
 
 void
@@ -35,16 +339,20 @@ common_history_destroy_element (void *data)
   History *history = (History *)data;
   if (history == NULL) return;
 
+  common_history_wait (history);
+  common_history_unregister (history);
+  common_history_spill_release (history);
+  common_accounting_remove (NULL, ACCOUNTING_HISTORY, history->accounted);
+
   free (history->data);
+  free (history->delta);
   free (history);
 }
 
 
-List *
-common_history_save_state (List *list, void *data, unsigned long data_len)
+static List *
+common_history_new_entry (List *list, History *history)
 {
-  debug_functions ();
-
   // Add a new entry to the list.
   List *new_entry = calloc (1, sizeof (List));
   assert (new_entry != NULL);
@@ -56,37 +364,128 @@ common_history_save_state (List *list, void *data, unsigned long data_len)
     List *next = list_next (list);
     while (next != NULL)
     {
+      List *following = list_next (next);
       common_history_destroy_element (next->data);
-      next = list_next (next);
+      free (next);
+      next = following;
     }
 
     new_entry->previous = list;
     list->next = new_entry;
   }
 
-  // Compress the data.
+  history->spill_offset = -1;
+  common_history_register (history);
+  common_history_account (history);
+  new_entry->data = history;
+
+  common_history_enforce_budget (history);
+
+  return new_entry;
+}
+
+
+List *
+common_history_save_state (List *list, void *data, unsigned long data_len)
+{
+  debug_functions ();
+
   History *new_data = calloc (1, sizeof (History));
   assert (new_data != NULL);
-  
-  unsigned long compressed_len = compressBound (data_len);
-  void *compressed = calloc (1, compressed_len);
-  assert (compressed != NULL);
 
-  if (compress (compressed, &compressed_len, data, data_len) == Z_OK)
+  // Copying is fast. The compression is left to a thread of its own, so
+  // the caller can go on right away.
+  new_data->pending_data = malloc (data_len);
+  if (new_data->pending_data == NULL)
   {
-    new_data->data = compressed;
-    new_data->compressed_len = compressed_len;
-    new_data->data_len = data_len;
-    new_entry->data = new_data;
+    debug_error ("Not enough memory to save the state.");
+    free (new_data);
+    return list;
   }
+
+  memcpy (new_data->pending_data, data, data_len);
+  new_data->data_len = data_len;
+  new_data->compression_level = common_history_compression_level;
+
+  if (pthread_create (&new_data->thread, NULL, common_history_compress, new_data) == 0)
+    new_data->pending = 1;
   else
+    common_history_compress (new_data);
+
+  return common_history_new_entry (list, new_data);
+}
+
+
+void
+common_history_set_compression_level (int level)
+{
+  common_history_compression_level = level;
+}
+
+
+List *
+common_history_save_delta (List *list, void *delta, unsigned long delta_len)
+{
+  debug_functions ();
+
+  History *new_data = calloc (1, sizeof (History));
+  assert (new_data != NULL);
+
+  new_data->delta = delta;
+  new_data->delta_len = (delta != NULL) ? delta_len : 0;
+
+  return common_history_new_entry (list, new_data);
+}
+
+
+List *
+common_history_apply_delta (List *list, HistoryAction te_Action,
+                            HistoryApplyFunc apply, void *user_data)
+{
+  debug_functions ();
+
+  assert (apply != NULL);
+  if (list == NULL) return NULL;
+
+  History *history;
+
+  switch (te_Action)
   {
-    free (compressed);
-    compressed = NULL;
-    return list;
+    case HISTORY_PREVIOUS:
+    case HISTORY_FIRST:
+      // Undoing a state takes its own delta.
+      while (list->previous != NULL)
+      {
+        history = list->data;
+        if (history != NULL && (history->delta != NULL || history->spill_offset >= 0 || history->dropped)
+            && (!common_history_restore (history) || !apply (history->delta, user_data)))
+          break;
+
+        list = list->previous;
+        if (te_Action == HISTORY_PREVIOUS) break;
+      }
+      break;
+    case HISTORY_NEXT:
+    case HISTORY_LAST:
+      // Redoing a state takes the delta of the next one.
+      while (list->next != NULL)
+      {
+        history = list->next->data;
+        if (history != NULL && (history->delta != NULL || history->spill_offset >= 0 || history->dropped)
+            && (!common_history_restore (history) || !apply (history->delta, user_data)))
+          break;
+
+        list = list->next;
+        if (te_Action == HISTORY_NEXT) break;
+      }
+      break;
+    default:
+      return NULL;
   }
 
-  return new_entry;
+  common_history_enforce_budget (list->data);
+
+  return list;
 }
 
 
@@ -98,33 +497,81 @@ common_history_load_state (List *list, HistoryAction te_Action, void **output)
   assert (output != NULL);
   if (list == NULL) return NULL;
 
+  List *target;
+
   switch (te_Action)
   {
     case HISTORY_PREVIOUS:
-      list = list_safe_previous (list);
+      target = list_safe_previous (list);
       break;
     case HISTORY_NEXT:
-      list = list_safe_next (list);
+      target = list_safe_next (list);
       break;
     case HISTORY_LAST:
-      list = list_last (list);
+      target = list_last (list);
       break;
     case HISTORY_FIRST:
-      list = list_nth (list, 1);
+      target = list_nth (list, 1);
       break;
     default:
       return NULL;
   }
 
-  History *list_data = list->data;
-  if (list_data == NULL) return list;
+  History *list_data = target->data;
+  if (list_data == NULL) return target;
+
+  // Only the state that is loaded has to be compressed by now. A state
+  // that was dropped to stay within the budget cannot be loaded.
+  if (!common_history_restore (list_data) || list_data->data == NULL) return list;
 
   if (*output == NULL)
     *output = calloc (1, list_data->data_len);
-  
+
   assert (*output != NULL);
 
-  uncompress (*output, &list_data->data_len, list_data->data, list_data->compressed_len);
+  if (list_data->compressed_len == 0)
+    memcpy (*output, list_data->data, list_data->data_len);
+  else
+    uncompress (*output, &list_data->data_len, list_data->data, list_data->compressed_len);
 
-  return list;
+  common_history_enforce_budget (list_data);
+
+  return target;
+}
+
+
+void
+common_history_set_budget (unsigned long long memory, unsigned long long disk)
+{
+  common_history_memory_budget = memory;
+  common_history_disk_budget = disk;
+
+  common_history_enforce_budget (NULL);
+}
+
+
+unsigned long long
+common_history_get_memory_usage ()
+{
+  History *history;
+  unsigned long long usage = 0;
+
+  for (history = common_history_oldest; history != NULL; history = history->newer)
+    usage += common_history_memory_size (history);
+
+  return usage;
+}
+
+
+unsigned long long
+common_history_get_disk_usage ()
+{
+  History *history;
+  unsigned long long usage = 0;
+
+  for (history = common_history_oldest; history != NULL; history = history->newer)
+    if (history->spill_offset >= 0)
+      usage += history->spill_len;
+
+  return usage;
 }
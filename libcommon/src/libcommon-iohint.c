@@ -0,0 +1,180 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#define _GNU_SOURCE
+
+#include "libcommon-iohint.h"
+#include "libcommon-debug.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+/*----------------------------------------------------------------------------.
+ | LOCAL VARIABLES                                                            |
+ '----------------------------------------------------------------------------*/
+static short int b_Enabled = 1;
+static IoHintCounters ts_Counters;
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_ADVISE                                                       |
+ | This function gives a single hint and counts the failures.                 |
+ '----------------------------------------------------------------------------*/
+static short int
+common_iohint_advise (int fd, unsigned long long offset,
+                      unsigned long long length, int advice)
+{
+  #ifdef POSIX_FADV_NORMAL
+  if (posix_fadvise (fd, offset, length, advice) == 0)
+    return 1;
+  #else
+  (void)fd; (void)offset; (void)length; (void)advice;
+  #endif
+
+  __atomic_add_fetch (&ts_Counters.failed, 1, __ATOMIC_RELAXED);
+  return 0;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_SET_ENABLED                                                  |
+ | This function turns the hints on or off.                                   |
+ '----------------------------------------------------------------------------*/
+void
+common_iohint_set_enabled (short int enabled)
+{
+  __atomic_store_n (&b_Enabled, (enabled != 0), __ATOMIC_RELAXED);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_SEQUENTIAL                                                   |
+ | This function announces a sequential read of a range.                      |
+ '----------------------------------------------------------------------------*/
+void
+common_iohint_sequential (int fd, unsigned long long offset,
+                          unsigned long long length)
+{
+  if (fd < 0 || !__atomic_load_n (&b_Enabled, __ATOMIC_RELAXED)) return;
+
+  // A sequential hint makes the kernel read ahead further than usual. The
+  // second hint starts reading the range right away.
+  #ifdef POSIX_FADV_SEQUENTIAL
+  if (common_iohint_advise (fd, offset, length, POSIX_FADV_SEQUENTIAL))
+    __atomic_add_fetch (&ts_Counters.sequential, 1, __ATOMIC_RELAXED);
+  #endif
+
+  common_iohint_willneed (fd, offset, length);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_WILLNEED                                                     |
+ | This function asks the kernel to read a range ahead.                       |
+ '----------------------------------------------------------------------------*/
+void
+common_iohint_willneed (int fd, unsigned long long offset,
+                        unsigned long long length)
+{
+  if (fd < 0 || !__atomic_load_n (&b_Enabled, __ATOMIC_RELAXED)) return;
+
+  #ifdef POSIX_FADV_WILLNEED
+  if (common_iohint_advise (fd, offset, length, POSIX_FADV_WILLNEED))
+  {
+    __atomic_add_fetch (&ts_Counters.willneed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&ts_Counters.willneed_bytes, length, __ATOMIC_RELAXED);
+  }
+  #endif
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_PREFETCH_FILE                                                |
+ | This function reads a range of a file that is not open yet ahead.          |
+ '----------------------------------------------------------------------------*/
+void
+common_iohint_prefetch_file (const char *path, unsigned long long offset,
+                             unsigned long long length)
+{
+  int fd;
+
+  if (path == NULL || !__atomic_load_n (&b_Enabled, __ATOMIC_RELAXED)) return;
+
+  fd = open (path, O_RDONLY);
+  if (fd < 0)
+  {
+    __atomic_add_fetch (&ts_Counters.failed, 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  if (length == 0)
+  {
+    struct stat statbuf;
+    if (fstat (fd, &statbuf) == 0 && (unsigned long long)statbuf.st_size > offset)
+      length = statbuf.st_size - offset;
+  }
+
+  // The pages stay in the page cache after the file is closed.
+  #ifdef __linux__
+  if (readahead (fd, offset, length) == 0)
+  {
+    __atomic_add_fetch (&ts_Counters.willneed, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch (&ts_Counters.willneed_bytes, length, __ATOMIC_RELAXED);
+  }
+  else
+    __atomic_add_fetch (&ts_Counters.failed, 1, __ATOMIC_RELAXED);
+  #else
+  common_iohint_willneed (fd, offset, length);
+  #endif
+
+  close (fd);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_GET_COUNTERS                                                 |
+ | This function returns the number of hints given so far.                    |
+ '----------------------------------------------------------------------------*/
+void
+common_iohint_get_counters (IoHintCounters *counters)
+{
+  if (counters == NULL) return;
+
+  counters->sequential = __atomic_load_n (&ts_Counters.sequential, __ATOMIC_RELAXED);
+  counters->willneed = __atomic_load_n (&ts_Counters.willneed, __ATOMIC_RELAXED);
+  counters->willneed_bytes = __atomic_load_n (&ts_Counters.willneed_bytes, __ATOMIC_RELAXED);
+  counters->failed = __atomic_load_n (&ts_Counters.failed, __ATOMIC_RELAXED);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_IOHINT_RESET_COUNTERS                                               |
+ | This function sets all counters back to zero.                              |
+ '----------------------------------------------------------------------------*/
+void
+common_iohint_reset_counters ()
+{
+  __atomic_store_n (&ts_Counters.sequential, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&ts_Counters.willneed, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&ts_Counters.willneed_bytes, 0, __ATOMIC_RELAXED);
+  __atomic_store_n (&ts_Counters.failed, 0, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libcommon-thread.h"
+#include "libcommon-debug.h"
+
+#include <stdlib.h>
+#include <assert.h>
+#include <unistd.h>
+#include <pthread.h>
+
+/*----------------------------------------------------------------------------.
+ | LOCAL TYPES                                                                |
+ '----------------------------------------------------------------------------*/
+typedef struct
+{
+  unsigned long long start;
+  unsigned long long end;
+  unsigned int worker;
+  ThreadRangeCallback callback;
+  void *user_data;
+} ThreadChunk;
+
+static unsigned int ui32_NumberOfWorkers = 0;
+static __thread unsigned int ui32_ThreadWorkers = 0;
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_THREAD_RUN_CHUNK                                                    |
+ | This function is the entry point of a worker thread.                       |
+ '----------------------------------------------------------------------------*/
+static void*
+common_thread_run_chunk (void *data)
+{
+  ThreadChunk *chunk = (ThreadChunk *)data;
+  chunk->callback (chunk->start, chunk->end, chunk->worker, chunk->user_data);
+  return NULL;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_THREAD_NUMBER_OF_WORKERS                                            |
+ | This function returns the maximum number of workers.                       |
+ '----------------------------------------------------------------------------*/
+unsigned int
+common_thread_number_of_workers ()
+{
+  // Several threads may ask at once, for example while loading files.
+  unsigned int workers = __atomic_load_n (&ui32_NumberOfWorkers, __ATOMIC_RELAXED);
+  if (workers == 0)
+  {
+    long processors = sysconf (_SC_NPROCESSORS_ONLN);
+    workers = (processors > 0) ? processors : 1;
+    __atomic_store_n (&ui32_NumberOfWorkers, workers, __ATOMIC_RELAXED);
+  }
+
+  if (ui32_ThreadWorkers > 0 && ui32_ThreadWorkers < workers)
+    workers = ui32_ThreadWorkers;
+
+  return workers;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_THREAD_SET_NUMBER_OF_WORKERS                                        |
+ | This function limits the number of workers.                                |
+ '----------------------------------------------------------------------------*/
+void
+common_thread_set_number_of_workers (unsigned int workers)
+{
+  __atomic_store_n (&ui32_NumberOfWorkers, workers, __ATOMIC_RELAXED);
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_THREAD_SET_THREAD_WORKERS                                           |
+ | This function limits the number of workers of the calling thread.          |
+ '----------------------------------------------------------------------------*/
+void
+common_thread_set_thread_workers (unsigned int workers)
+{
+  ui32_ThreadWorkers = workers;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | COMMON_THREAD_PARALLEL_FOR                                                 |
+ | This function handles the chunks of a range in parallel.                   |
+ '----------------------------------------------------------------------------*/
+unsigned int
+common_thread_parallel_for (unsigned long long length,
+                            unsigned long long min_chunk,
+                            unsigned int workers,
+                            ThreadRangeCallback callback,
+                            void *user_data)
+{
+  debug_functions ();
+
+  unsigned int counter;
+
+  if (workers == 0)
+    workers = common_thread_number_of_workers ();
+
+  if (length == 0 || callback == NULL) return 0;
+  if (min_chunk == 0) min_chunk = 1;
+
+  if (length / min_chunk < workers)
+    workers = (length / min_chunk > 0) ? length / min_chunk : 1;
+
+  // Don't bother with threads for a single chunk.
+  if (workers == 1)
+  {
+    callback (0, length, 0, user_data);
+    return 1;
+  }
+
+  ThreadChunk *chunks = calloc (workers, sizeof (ThreadChunk));
+  pthread_t *threads = calloc (workers, sizeof (pthread_t));
+  assert (chunks != NULL && threads != NULL);
+
+  for (counter = 0; counter < workers; counter++)
+  {
+    chunks[counter].start = length * counter / workers;
+    chunks[counter].end = length * (counter + 1) / workers;
+    chunks[counter].worker = counter;
+    chunks[counter].callback = callback;
+    chunks[counter].user_data = user_data;
+  }
+
+  // The calling thread takes the first chunk itself. When a thread cannot
+  // be started, its chunk is handled by the calling thread as well.
+  for (counter = 1; counter < workers; counter++)
+  {
+    if (pthread_create (&threads[counter], NULL, common_thread_run_chunk, &chunks[counter]) != 0)
+      chunks[counter].callback = NULL;
+  }
+
+  callback (chunks[0].start, chunks[0].end, 0, user_data);
+
+  for (counter = 1; counter < workers; counter++)
+  {
+    if (chunks[counter].callback != NULL)
+      pthread_join (threads[counter], NULL);
+    else
+      callback (chunks[counter].start, chunks[counter].end, counter, user_data);
+  }
+
+  free (threads), threads = NULL;
+  free (chunks), chunks = NULL;
+
+  return workers;
+}
@@ -78,6 +78,10 @@ typedef struct
 
   char c_key_bindings[14]; /*< An array with key bindings. */
 
+  te_SerieLayout e_serie_layout; /* The in-memory layout for loaded series. */
+
+  short int b_memory_readout;   /* Show the memory usage in the sidebar. */
+
 } Configuration;
 
 
@@ -122,6 +126,16 @@ typedef struct
  */
 #define CONFIGURATION_KEY(c,k)             c->c_key_bindings[k]
 
+/**
+ * Returns the in-memory layout to use for loaded series.
+ */
+#define CONFIGURATION_SERIE_LAYOUT(c)      c->e_serie_layout
+
+/**
+ * Returns whether the memory usage is shown in the sidebar.
+ */
+#define CONFIGURATION_MEMORY_READOUT(c)    c->b_memory_readout
+
 /**
  * Returns a list of lookup tables.
  */
@@ -36,8 +36,14 @@
  *
  * This module provides a histogram widget for a dataset. It can only draw
  * itself on a Cairo surface.
+ *
+ * The histogram is counted on all threads, each into a histogram of its
+ * own, which are added up at the end. It can be limited to a single
+ * timepoint.
  */
 
+#define HISTOGRAM_ALL_TIME_POINTS -1
+
 /**
  * A type that contains the necesarry data for a histogram.
  */
@@ -45,12 +51,34 @@ typedef struct
 {
   char *title;
 
+  /**
+   * The number of voxels in each bin, and the number of bins.
+   */
   int *data;
   unsigned int data_len;
 
+  /**
+   * The x-coordinates hold the lowest and highest value of the dataset, and
+   * the y-coordinates the lowest and highest number of voxels in a bin.
+   */
   Coordinate minimum;
   Coordinate maximum;
 
+  /**
+   * The value of the first bin. Bin i holds the value first_value + i.
+   */
+  int first_value;
+
+  /**
+   * The timepoint to count, or HISTOGRAM_ALL_TIME_POINTS.
+   */
+  int time_point;
+
+  /**
+   * The number of voxels in all bins.
+   */
+  unsigned long long voxels;
+
 } Histogram;
 
 /**
@@ -61,7 +89,17 @@ typedef struct
 Histogram * histogram_new (void);
 
 /**
- * Function to set the data for the histogram widget.
+ * Function to limit the histogram to a single timepoint. It is used by
+ * the next call to histogram_set_serie().
+ *
+ * @param histogram   The Histogram to set the timepoint for.
+ * @param time_point  The timepoint, or HISTOGRAM_ALL_TIME_POINTS.
+ */
+void histogram_set_time_point (Histogram *histogram, int time_point);
+
+/**
+ * Function to set the data for the histogram widget. The voxels are
+ * counted on all threads. A lazy Serie is read completely first.
  *
  * @param histogram  The Histogram to set the data for.
  * @param serie      The Serie that contains the data.
@@ -1,15 +1,166 @@
 #include "libhistogram.h"
 #include "libmemory-serie.h"
+#include "libmemory-brick.h"
+#include "libcommon-thread.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
 #include <math.h>
 
+/* Rows of voxels are counted in parallel. Small volumes are not worth the
+ * threads. */
+#define HISTOGRAM_MIN_CHUNK 256
+
+/* Voxels that are read from a brick file are read this many at a time, with
+ * a single lock of the cache. */
+#define HISTOGRAM_RUN 256
+
+typedef struct
+{
+  Histogram *histogram;
+  Serie *serie;
+  unsigned int first_time_point;
+  unsigned int *partial;
+} HistogramJob;
+
+
+/* Walks 'run' voxels of 'type' and counts them in the partial histogram of
+ * the worker. */
+#define HISTOGRAM_COUNT_LOOP(type, convert)                                     \
+  {                                                                             \
+    const type *values = (const type *)pv_values;                               \
+    long long bin;                                                              \
+    for (i = 0; i < run; i++)                                                   \
+    {                                                                           \
+      bin = (long long)convert (values[i]) - first;                             \
+      counts[(bin < 0) ? 0 : (bin >= bins) ? bins - 1 : bin]++;                 \
+    }                                                                           \
+  }
+
+#define HISTOGRAM_TO_INT(x) ((long long)(x))
+#define HISTOGRAM_ROUND_TO_INT(x) ((long long)roundf(x))
+
+
+/* Returns the number of voxels from x on that are next to each other in
+ * memory. */
+static short int
+histogram_run_length (Serie *serie, short int x)
+{
+  short int run = serie->matrix.i16_x - x;
+  short int limit = run;
+
+  if (serie->data == NULL)
+    limit = HISTOGRAM_RUN - (x % HISTOGRAM_RUN);
+  else if (serie->e_Layout == SERIE_LAYOUT_BRICKED)
+    limit = SERIE_BRICK_SIZE - (x & (SERIE_BRICK_SIZE - 1));
+
+  return (limit < run) ? limit : run;
+}
+
+
+static void
+histogram_count_rows (unsigned long long start, unsigned long long end,
+                      unsigned int worker, void *user_data)
+{
+  HistogramJob *job = (HistogramJob *)user_data;
+  Histogram *histogram = job->histogram;
+  Serie *serie = job->serie;
+
+  unsigned int *counts = job->partial + (unsigned long long)worker * histogram->data_len;
+  long long first = histogram->first_value;
+  long long bins = histogram->data_len;
+  unsigned int element_size = memory_serie_get_memory_space (serie);
+  unsigned char buffer[HISTOGRAM_RUN * sizeof (double)];
+
+  unsigned long long row;
+  short int x, run, i;
+
+  for (row = start; row < end; row++)
+  {
+    short int y = row % serie->matrix.i16_y;
+    short int z = (row / serie->matrix.i16_y) % serie->matrix.i16_z;
+    unsigned short int t = job->first_time_point + row / ((unsigned long long)serie->matrix.i16_y * serie->matrix.i16_z);
+
+    if (serie->data != NULL && !memory_serie_ensure_slice (serie, z, t))
+      continue;
+
+    for (x = 0; x < serie->matrix.i16_x; x += run)
+    {
+      const void *pv_values;
+
+      run = histogram_run_length (serie, x);
+
+      if (serie->data != NULL)
+        pv_values = (const char *)serie->data + memory_serie_get_voxel_offset (serie, x, y, z, t);
+      else
+      {
+        i = memory_brick_read_row (serie->ps_BrickCache, x, y, z, t, run, buffer);
+        if (i < run)
+          memset (buffer + i * element_size, 0, (run - i) * element_size);
+
+        pv_values = buffer;
+      }
+
+      switch (serie->data_type)
+      {
+        case MEMORY_TYPE_INT8    : HISTOGRAM_COUNT_LOOP (signed char, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_INT16   : HISTOGRAM_COUNT_LOOP (short int, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_INT32   : HISTOGRAM_COUNT_LOOP (int, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_INT64   : HISTOGRAM_COUNT_LOOP (long long, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_UINT8   : HISTOGRAM_COUNT_LOOP (unsigned char, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_UINT16  : HISTOGRAM_COUNT_LOOP (unsigned short int, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_UINT32  : HISTOGRAM_COUNT_LOOP (unsigned int, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_UINT64  : HISTOGRAM_COUNT_LOOP (unsigned long long, HISTOGRAM_TO_INT); break;
+        case MEMORY_TYPE_FLOAT32 : HISTOGRAM_COUNT_LOOP (float, HISTOGRAM_ROUND_TO_INT); break;
+        case MEMORY_TYPE_FLOAT64 : HISTOGRAM_COUNT_LOOP (double, HISTOGRAM_ROUND_TO_INT); break;
+        default : break;
+      }
+    }
+  }
+}
+
+
+/* Sets the lowest and highest number of voxels in a bin, and the total. */
+static void
+histogram_update_range (Histogram *histogram)
+{
+  unsigned int bin;
+
+  histogram->voxels = 0;
+  histogram->minimum.y = (histogram->data_len > 0) ? histogram->data[0] : 0;
+  histogram->maximum.y = histogram->minimum.y;
+
+  for (bin = 0; bin < histogram->data_len; bin++)
+  {
+    histogram->voxels += histogram->data[bin];
+
+    if (histogram->data[bin] > histogram->maximum.y)
+      histogram->maximum.y = histogram->data[bin];
+
+    if (histogram->data[bin] < histogram->minimum.y)
+      histogram->minimum.y = histogram->data[bin];
+  }
+}
+
+
 Histogram *
 histogram_new (void)
 {
-  return calloc (1, sizeof (Histogram));
+  Histogram *histogram = calloc (1, sizeof (Histogram));
+  if (histogram == NULL) return NULL;
+
+  histogram->time_point = HISTOGRAM_ALL_TIME_POINTS;
+
+  return histogram;
+}
+
+void
+histogram_set_time_point (Histogram *histogram, int time_point)
+{
+  if (histogram == NULL) return;
+  histogram->time_point = (time_point < 0) ? HISTOGRAM_ALL_TIME_POINTS : time_point;
 }
 
 void
@@ -17,58 +168,64 @@ histogram_set_serie (Histogram *histogram, Serie *serie)
 {
   if (histogram == NULL || serie == NULL) return;
 
+  free (histogram->data), histogram->data = NULL;
+  free (histogram->title), histogram->title = NULL;
+  histogram->data_len = 0;
+  histogram->voxels = 0;
+
+  if (serie->data == NULL && serie->ps_BrickCache == NULL) return;
+
+  /* The range of a lazy Serie is only known when all of it is read. */
+  if (memory_serie_load_all (serie) != 0) return;
+
   /* Obtain the minimum and maximum value of the dataset. */
   histogram->minimum.x = serie->i32_MinimumValue;
   histogram->maximum.x = serie->i32_MaximumValue;
 
-  /* Allocate memory for the histogram data. */
-  int shift = abs(histogram->minimum.x);
-  histogram->data_len = histogram->maximum.x + shift;
-  histogram->data = calloc (sizeof (int), histogram->data_len);
+  /* Allocate memory for the histogram data. Both the minimum and the
+   * maximum have a bin. */
+  long long range = (long long)serie->i32_MaximumValue - serie->i32_MinimumValue;
+  if (range < 0) return;
+
+  histogram->first_value = serie->i32_MinimumValue;
+  histogram->data_len = range + 1;
+  histogram->data = calloc (histogram->data_len, sizeof (int));
+  assert (histogram->data != NULL);
 
-  void **data = serie->data;
+  histogram->title = calloc (1, strlen (serie->name) + 1);
+  histogram->title = strcpy (histogram->title, serie->name);
 
-   if (data == NULL) return;
+  unsigned int time_points = serie->num_time_series;
+  HistogramJob job;
+  job.histogram = histogram;
+  job.serie = serie;
+  job.first_time_point = 0;
 
-  /* Set the data points.  */
-  unsigned int blob_size = serie->matrix.i16_x * serie->matrix.i16_y * serie->matrix.i16_z;
-  unsigned int index;
-  int data_index;
-  for (index = 0; index < (unsigned int)blob_size; index++)
+  if (histogram->time_point != HISTOGRAM_ALL_TIME_POINTS)
   {
-    data_index = 0;
+    if (histogram->time_point >= serie->num_time_series) return;
 
-    switch (serie->data_type)
-    {
-      case MEMORY_TYPE_INT8    : data_index = *((unsigned char *)data) + shift; break;
-      case MEMORY_TYPE_INT16   : data_index = *((short int *)data) + shift; break;
-      case MEMORY_TYPE_INT32   : data_index = *((int *)data) + shift; break;
-      case MEMORY_TYPE_INT64   : data_index = *((long *)data) + shift; break;
-      case MEMORY_TYPE_UINT8   : data_index = *((unsigned char *)data) + shift; break;
-      case MEMORY_TYPE_UINT16  : data_index = *((unsigned short int *)data) + shift; break;
-      case MEMORY_TYPE_UINT32  : data_index = *((unsigned int *)data) + shift; break;
-      case MEMORY_TYPE_UINT64  : data_index = *((unsigned long *)data) + shift; break;
-
-      // TODO: Is roundf() really correct here?
-      case MEMORY_TYPE_FLOAT32 : data_index = (int)(roundf(*((float *)data))) + shift; break;
-      case MEMORY_TYPE_FLOAT64 : data_index = (int)(roundf(*((double *)data))) + shift; break;
-      default : break;
-    }    
-
-    /* Update histogram column. */
-    histogram->data[data_index] += 1;
-
-    /* Check for maximum value. */
-    if (histogram->data[data_index] > histogram->maximum.y)
-      histogram->maximum.y = histogram->data[data_index];
-
-    /* Check for minimum value. */
-    if (histogram->data[data_index] < histogram->minimum.y)
-      histogram->minimum.y = histogram->data[data_index];
+    job.first_time_point = histogram->time_point;
+    time_points = 1;
   }
 
-  histogram->title = calloc (1, strlen (serie->name) + 1);
-  histogram->title = strcpy (histogram->title, serie->name);
+  /* Each worker counts in a histogram of its own, so no counts have to be
+   * shared between threads. */
+  unsigned int workers = common_thread_number_of_workers ();
+  job.partial = calloc ((unsigned long long)workers * histogram->data_len, sizeof (unsigned int));
+  assert (job.partial != NULL);
+
+  common_thread_parallel_for ((unsigned long long)serie->matrix.i16_y * serie->matrix.i16_z * time_points,
+                              HISTOGRAM_MIN_CHUNK, workers, histogram_count_rows, &job);
+
+  unsigned int worker, bin;
+  for (worker = 0; worker < workers; worker++)
+    for (bin = 0; bin < histogram->data_len; bin++)
+      histogram->data[bin] += job.partial[(unsigned long long)worker * histogram->data_len + bin];
+
+  free (job.partial), job.partial = NULL;
+
+  histogram_update_range (histogram);
 }
 
 void
@@ -59,12 +59,25 @@ short int i16_memory_io_dicom_relativePosition(Coordinate3D *ps_referencePositio
                                                Coordinate3D *ps_pixel_dimension);
 
 /**
- * Load a single dicom file from disk to the selected memory.
+ * Quickly check whether a file looks like a dicom file, by looking at the
+ * 128 byte preamble and the "DICM" magic, without parsing the header.
+ *
+ * @param pc_dicom        Filename/path of the file to check
  *
- * @param ps_patient      patient struct, to store study related information
- * @param ps_study        study struct, to store study related information
- * @param ps_serie        serie struct, to store study related information
- * @param pc_dicom        Filename/path of the header file
+ * @return 1 when the file looks like a dicom file, 0 otherwise.
+ */
+short int i16_memory_io_dicom_isDicomFile(const char *pc_dicom);
+
+/**
+ * Load the header of a single dicom file from disk to the selected memory.
+ * The header is parsed in a single pass, which stops at the pixel data.
+ *
+ * @param ps_patient          patient struct, to store study related information
+ * @param ps_study            study struct, to store study related information
+ * @param ps_serie            serie struct, to store study related information
+ * @param pl_PixelDataOffset  Output for the file offset of the pixel data, or -1 when it cannot be read directly
+ * @param pl_PixelDataLength  Output for the length of the pixel data in bytes
+ * @param pc_dicom            Filename/path of the header file
  *
  * @return 0 or FALSE if function executes wrong, 1 or TRUE if execution is correct
  */
@@ -77,21 +90,60 @@ short int i16_memory_io_dicom_loadMetaData(Patient *ps_patient,
                                            short int *pi16_TemporalPositionIdentifier,
                                            short int *pi16_StackPositionIdentifier,
                                            te_DCM_ComplexImageComponent *pe_DCM_CIC,
+                                           long *pl_PixelDataOffset,
+                                           long *pl_PixelDataLength,
                                            const char *pc_dicom);
 
 
+/**
+ * Read a range of pixel data from a dicom file directly into memory.
+ *
+ * @param pc_dicom        Filename/path of the dicom file
+ * @param pv_Destination  Memory to read the pixel data into
+ * @param l_Offset        File offset of the pixel data
+ * @param l_Length        Number of bytes to read
+ *
+ * @return 0 or FALSE if function executes wrong, 1 or TRUE if execution is correct
+ */
+short int i16_memory_io_dicom_readPixelData(const char *pc_dicom,
+                                            void *pv_Destination,
+                                            long l_Offset,
+                                            long l_Length);
+
 /**
  * Load a single dicom file from disk to the selected memory.
  *
- * @param serie           The selected memory to store all needed parameters in
- * @param pc_dicom        Filename/path of the header file
- * @param i16_SliceNumber Input to know slice position
+ * @param serie               The selected memory to store all needed parameters in
+ * @param pc_dicom            Filename/path of the header file
+ * @param i16_SliceNumber     Input to know slice position
+ * @param l_PixelDataOffset   File offset of the pixel data as found by i16_memory_io_dicom_loadMetaData, or -1
+ * @param l_PixelDataLength   Length of the pixel data as found by i16_memory_io_dicom_loadMetaData
  *
  * @return 0 or FALSE if function executes wrong, 1 or TRUE if execution is correct
  */
 short int i16_memory_io_dicom_loadSingleSlice(Serie *ps_serie,
                                               const char *pc_dicom,
                                               short int i16_SliceNumber,
-                                              short int i16_timeFrameNumber);
+                                              short int i16_timeFrameNumber,
+                                              long l_PixelDataOffset,
+                                              long l_PixelDataLength);
+
+/**
+ * Load all frames of a multi-frame dicom file, such as an enhanced MR or
+ * CT object, from disk to the selected memory. The frames fill the serie
+ * in the order in which they are stored: all slices of the first
+ * timepoint, then those of the second, and so on.
+ *
+ * @param serie               The selected memory, with its matrix and number of timepoints set
+ * @param pc_dicom            Filename/path of the dicom file
+ * @param l_PixelDataOffset   File offset of the pixel data as found by i16_memory_io_dicom_loadMetaData, or -1
+ * @param l_PixelDataLength   Length of the pixel data as found by i16_memory_io_dicom_loadMetaData
+ *
+ * @return 0 or FALSE if function executes wrong, 1 or TRUE if execution is correct
+ */
+short int i16_memory_io_dicom_loadMultiFrame(Serie *ps_serie,
+                                             const char *pc_dicom,
+                                             long l_PixelDataOffset,
+                                             long l_PixelDataLength);
 
 #endif//NIFTII_NIFTII_H
@@ -24,6 +24,7 @@
 #include <stdlib.h>
 
 #include "../src/nifti/include/nifti1.h"
+#include "../src/nifti/include/nifti2.h"
 #include "libmemory.h"
 #include "libmemory-serie.h"
 #include "libcommon-algebra.h"
@@ -31,6 +32,8 @@
 
 #define MIN_HEADER_SIZE 348
 #define NII_HEADER_SIZE 352
+#define NII2_MIN_HEADER_SIZE 540
+#define NII2_HEADER_SIZE 544
 
 /**
  * Determine the type of the file.
@@ -52,6 +55,32 @@ te_ImageIOFiletype memory_io_niftii_file_type (const char *path);
  */
 short int memory_io_niftii_load (Serie *serie, const char *header, const char *image);
 
+/**
+ * Load a niftii file lazily: only its header is read, and the slices of the
+ * image data are read from the file when they are needed. See
+ * memory_serie_set_lazy().
+ *
+ * @param serie  The selected memory to store all needed parameters in
+ * @param header Filename/path of the header file
+ * @param image  Filename/path of the image file
+ *
+ * @return 0 or FALSE if function executes wrong, 1 or TRUE if execution is correct
+ */
+short int memory_io_niftii_load_lazy (Serie *serie, const char *header, const char *image);
+
+/**
+ * Load a niftii file for streaming: like memory_io_niftii_load_lazy(), but
+ * the image data is never kept in memory as a whole. Its slices are read
+ * from the file every time they are needed. See memory_serie_set_streaming().
+ *
+ * @param serie  The selected memory to store all needed parameters in
+ * @param header Filename/path of the header file
+ * @param image  Filename/path of the image file
+ *
+ * @return 0 or FALSE if function executes wrong, 1 or TRUE if execution is correct
+ */
+short int memory_io_niftii_load_streaming (Serie *serie, const char *header, const char *image);
+
 /**
  * Save a niftii file from memory to disk
  *
@@ -63,4 +92,47 @@ short int memory_io_niftii_load (Serie *serie, const char *header, const char *i
  */
 short int memory_io_niftii_save (Serie *serie, const char *pc_File, const char *pc_ImageFile);
 
+/**
+ * Save a niftii file from memory to disk, and keep track of the progress.
+ * The file is written to a temporary file first, which is synced to disk and
+ * renamed to its final name afterwards.
+ *
+ * @param serie               The selected memory to store all needed parameters in
+ * @param header              Filename/path of the header file
+ * @param image               Filename/path of the image file
+ * @param pui64_BytesWritten  Counter that is atomically increased with every written block, or NULL
+ *
+ * @return 0 when the file has been written, 1 otherwise.
+ */
+short int memory_io_niftii_save_with_progress (Serie *serie, const char *pc_File, const char *pc_ImageFile,
+                                               unsigned long long *pui64_BytesWritten);
+
+/**
+ * Write only the changed parts of a serie into an existing single-file niftii.
+ * The regions to write are taken from the dirty slabs of the serie. This only
+ * works when the file on disk has the same header as the one we would write.
+ *
+ * @param serie               The serie to write the dirty slabs of
+ * @param pc_File             Filename/path of the .nii file to update
+ * @param pui64_BytesWritten  Counter that is atomically increased with every written block, or NULL
+ *
+ * @return 0 when the file has been updated, 1 when it has to be written completely.
+ */
+short int memory_io_niftii_update (Serie *serie, const char *pc_File, unsigned long long *pui64_BytesWritten);
+
+/**
+ * Save a niftii file from memory to disk as a gzip compressed single file.
+ * The image data is split into independent gzip members, which are deflated
+ * in parallel. Tools that read .nii.gz files read such files as well.
+ *
+ * @param serie               The serie to save
+ * @param pc_File             Filename/path of the .nii.gz file
+ * @param i32_Level           The zlib compression level (0-9, or -1 for the default)
+ * @param pui64_BytesWritten  Counter that is atomically increased with every compressed block, or NULL
+ *
+ * @return 0 when the file has been written, 1 otherwise.
+ */
+short int memory_io_niftii_save_compressed (Serie *serie, const char *pc_File, int i32_Level,
+                                            unsigned long long *pui64_BytesWritten);
+
 #endif//NIFTII_NIFTII_H
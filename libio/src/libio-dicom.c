@@ -18,11 +18,15 @@
  */
 
 #include "libcommon-debug.h"
+#include "libcommon-iohint.h"
+#include "libcommon-thread.h"
 #include "libio-dicom.h"
 
 #include <string.h>
 #include <stdio.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <byteswap.h>
 #include <math.h>
 
@@ -30,6 +34,123 @@
 #include "dicom/include/zz.h"
 #include "dicom/include/zz_priv.h"
 
+#define DICOM_PREAMBLE_SIZE 128
+
+// The pixel data of a multi-frame file is read by several threads when
+// each of them gets at least this many bytes.
+#define DICOM_BULK_MIN_CHUNK (8 << 20)
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* LOCAL FUNCTIONS                                                                                    */
+/*                                                                                                    */
+/*                                                                                                    */
+
+short int b_memory_io_dicom_pread_all (int i32_File, void *pv_Destination, long l_Offset, long l_Length)
+{
+  ssize_t s_BytesRead;
+  long l_BytesDone = 0;
+
+  // pread may return less than asked for, so keep going until everything
+  // is in.
+  while (l_BytesDone < l_Length)
+  {
+    s_BytesRead = pread (i32_File, (char *)pv_Destination + l_BytesDone, l_Length - l_BytesDone, l_Offset + l_BytesDone);
+    if (s_BytesRead < 0 && errno == EINTR)
+    {
+      continue;
+    }
+    else if (s_BytesRead <= 0)
+    {
+      break;
+    }
+
+    l_BytesDone += s_BytesRead;
+  }
+
+  return (l_BytesDone == l_Length);
+}
+
+
+// Tells whether the bytes at the start of a file are a plausible first
+// element of an old ACR-NEMA style file: a little endian tag of the
+// identifying group (0x0008), followed by a valid VR and length.
+short int b_memory_io_dicom_isAcrNemaStart (const unsigned char *pu8_Start, size_t s_Length)
+{
+  unsigned short int ui16_Element;
+  unsigned long ui32_Length;
+  size_t s_Next;
+
+  if (s_Length < 8 || pu8_Start[0] != 0x08 || pu8_Start[1] != 0x00) return 0;
+
+  ui16_Element = pu8_Start[2] | (pu8_Start[3] << 8);
+
+  // With an explicit VR, the length follows the VR in two bytes, or in four
+  // bytes after two reserved ones for the VRs that can hold a lot.
+  switch ((pu8_Start[4] << 8) | pu8_Start[5])
+  {
+    case OB: case OW: case OF: case SQ: case UN: case UT:
+      if (s_Length < 12 || pu8_Start[6] != 0 || pu8_Start[7] != 0) return 0;
+      ui32_Length = pu8_Start[8] | (pu8_Start[9] << 8) | (pu8_Start[10] << 16) | ((unsigned long)pu8_Start[11] << 24);
+      return (ui16_Element != 0x0000) && (ui32_Length == 0xFFFFFFFF || ui32_Length % 2 == 0);
+
+    case AE: case AS: case AT: case CS: case DA: case DS: case DT: case FL:
+    case FD: case IS: case LO: case LT: case PN: case SH: case SL: case SS:
+    case ST: case TM: case UI: case UL: case US:
+      ui32_Length = pu8_Start[6] | (pu8_Start[7] << 8);
+      if (ui16_Element == 0x0000)
+        return (pu8_Start[4] == 'U' && pu8_Start[5] == 'L' && ui32_Length == 4);
+
+      return (ui32_Length % 2 == 0);
+
+    default:
+      break;
+  }
+
+  // Otherwise the VR is implicit, and the length takes four bytes. The
+  // length of a group is four bytes long, and any other length is even.
+  ui32_Length = pu8_Start[4] | (pu8_Start[5] << 8) | (pu8_Start[6] << 16) | ((unsigned long)pu8_Start[7] << 24);
+  if (ui16_Element == 0x0000 && ui32_Length != 4) return 0;
+  if (ui32_Length != 0xFFFFFFFF && ui32_Length % 2 != 0) return 0;
+
+  // When the next element was read as well, it has to be of the same group,
+  // in ascending order.
+  s_Next = 8 + (size_t)ui32_Length;
+  if (ui32_Length != 0xFFFFFFFF && s_Next + 4 <= s_Length)
+  {
+    return (pu8_Start[s_Next] == 0x08 && pu8_Start[s_Next + 1] == 0x00
+            && (pu8_Start[s_Next + 2] | (pu8_Start[s_Next + 3] << 8)) > ui16_Element);
+  }
+
+  return 1;
+}
+
+
+typedef struct
+{
+  int i32_File;
+  unsigned char *pu8_Destination;
+  long l_Offset;
+  long l_FrameSize;
+  short int b_Failed;
+} ts_dicom_BulkReadJob;
+
+
+void v_memory_io_dicom_read_frames (unsigned long long start, unsigned long long end,
+                                    unsigned int worker, void *user_data)
+{
+  ts_dicom_BulkReadJob *ps_Job = (ts_dicom_BulkReadJob *)user_data;
+  (void)worker;
+
+  if (!b_memory_io_dicom_pread_all (ps_Job->i32_File,
+                                    ps_Job->pu8_Destination + start * ps_Job->l_FrameSize,
+                                    ps_Job->l_Offset + start * ps_Job->l_FrameSize,
+                                    (end - start) * ps_Job->l_FrameSize))
+  {
+    __atomic_store_n (&ps_Job->b_Failed, 1, __ATOMIC_RELAXED);
+  }
+}
+
 /*                                                                                                    */
 /*                                                                                                    */
 /* GLOBAL FUNCTIONS                                                                                   */
@@ -51,6 +172,39 @@ short int i16_memory_io_dicom_relativePosition(Coordinate3D *ps_referencePositio
 }
 
 
+short int i16_memory_io_dicom_isDicomFile(const char *pc_dicom)
+{
+  FILE *p_File;
+  unsigned char c_Preamble[DICOM_PREAMBLE_SIZE + 4];
+  size_t s_BytesRead;
+
+  p_File = fopen (pc_dicom, "rb");
+  if (p_File == NULL)
+  {
+    return 0;
+  }
+
+  s_BytesRead = fread (c_Preamble, 1, sizeof (c_Preamble), p_File);
+  fclose (p_File);
+
+  // Part 10 files start with a 128 byte preamble followed by "DICM".
+  if ((s_BytesRead == sizeof (c_Preamble)) &&
+      (memcmp (&c_Preamble[DICOM_PREAMBLE_SIZE], "DICM", 4) == 0))
+  {
+    return 1;
+  }
+
+  // Old ACR-NEMA style files have no preamble, and start directly with an
+  // element of the identifying group.
+  if (b_memory_io_dicom_isAcrNemaStart (c_Preamble, s_BytesRead))
+  {
+    return 1;
+  }
+
+  return 0;
+}
+
+
 short int i16_memory_io_dicom_loadMetaData(Patient *ps_patient,
                                            Study *ps_study,
                                            Serie *ps_serie,
@@ -60,6 +214,8 @@ short int i16_memory_io_dicom_loadMetaData(Patient *ps_patient,
                                            short int *pi16_TemporalPositionIdentifier,
                                            short int *pi16_StackPositionIdentifier,
                                            te_DCM_ComplexImageComponent *pe_DCM_CIC,
+                                           long *pl_PixelDataOffset,
+                                           long *pl_PixelDataLength,
                                            const char *pc_dicom)
 {
   struct zzfile szz, *zz;
@@ -77,19 +233,40 @@ short int i16_memory_io_dicom_loadMetaData(Patient *ps_patient,
     return 0;
   }
 
-
-
   char c_currentPatientID[MAX_LEN_LO];
   char c_currentStudyInstanceUID[MAX_LEN_LO];
   char c_currentSerieInstanceUID[MAX_LEN_LO];
   char c_ComplexImageComponent[MAX_LEN_LO];
 
+  char c_PatientsName[sizeof(ps_patient->name)];
+  char c_StudyDescription[sizeof(ps_study->name)];
+  char c_SeriesDescription[sizeof(ps_serie->name)];
+
+  unsigned short int u16_BitsAllocated = 0;
+  short int i16_NumberOfFrames = 0;
+  short int i16_Rows = 0;
+  short int i16_Columns = 0;
+  float f_RescaleIntercept = ps_serie->offset;
+  float f_RescaleSlope = ps_serie->slope;
+  Coordinate3D ts_PixelDimension = ps_serie->pixel_dimension;
+  unsigned short int u16_NumberOfTemporalPositions = 1;
+
   memset(c_currentPatientID,'\0',MAX_LEN_LO);
   memset(c_currentStudyInstanceUID,'\0',MAX_LEN_LO);
   memset(c_currentSerieInstanceUID,'\0',MAX_LEN_LO);
   memset(c_ComplexImageComponent,'\0',MAX_LEN_LO);
-
-
+  memset(c_PatientsName,'\0',sizeof(c_PatientsName));
+  memset(c_StudyDescription,'\0',sizeof(c_StudyDescription));
+  memset(c_SeriesDescription,'\0',sizeof(c_SeriesDescription));
+  memset(imageposvector,0,sizeof(imageposvector));
+  memset(imageorientation,0,sizeof(imageorientation));
+
+  *pl_PixelDataOffset = -1;
+  *pl_PixelDataLength = 0;
+
+  // Collect everything in a single pass over the header. The values are
+  // only committed to the patient, study and serie when the UIDs match, so
+  // a file of another serie doesn't overwrite anything.
   zziterinit(zz);
   while (zziternext(zz, &group, &element, &len))
   {
@@ -104,13 +281,108 @@ short int i16_memory_io_dicom_loadMetaData(Patient *ps_patient,
       case DCM_SeriesInstanceUID:
         zzgetstring(zz, c_currentSerieInstanceUID, sizeof(c_currentSerieInstanceUID)-1);
         break;
+      case DCM_BitsAllocated:
+        u16_BitsAllocated = zzgetuint16(zz, 0);
+        break;
+      case DCM_NumberOfFrames:
+        zzgetstring(zz, value, sizeof(value) - 1);
+        i16_NumberOfFrames = atoi(value);
+        break;
+      case DCM_Rows:
+        i16_Rows = zzgetuint16(zz, 0);
+        break;
+      case DCM_Columns:
+        i16_Columns = zzgetuint16(zz, 0);
+        break;
+      case DCM_PatientsName:
+        zzgetstring(zz, c_PatientsName, sizeof(c_PatientsName) - 1);
+        break;
+      case DCM_StudyDescription:
+        zzgetstring(zz, c_StudyDescription, sizeof(c_StudyDescription) - 1);
+        break;
+      case DCM_SeriesDescription:
+        zzgetstring(zz, c_SeriesDescription, sizeof(c_SeriesDescription) - 1);
+        break;
+      case DCM_ImagePositionPatient:		// DS, 3 values
+        zzrDS(zz, 3, imageposvector);
+        break;
+      case DCM_ImageOrientationPatient:	// DS, 6 values
+        zzrDS(zz, 6, imageorientation);
+        break;
+      case DCM_RescaleIntercept:	// DS, the b in m*SV + b
+        zzgetstring(zz, value, sizeof(value) - 1);
+        f_RescaleIntercept = atof(value);
+        break;
+      case DCM_RescaleSlope:		// DS, the m in m*SV + b
+        zzgetstring(zz, value, sizeof(value) - 1);
+        f_RescaleSlope = atof(value);
+        break;
+      case DCM_PixelSpacing:
+        zzrDS(zz, 2, tmpd);
+        ts_PixelDimension.x = tmpd[0];
+        ts_PixelDimension.y = tmpd[1];
+        break;
+      case DCM_SliceThickness:
+        zzrDS(zz, 1, tmpd);
+        ts_PixelDimension.z = tmpd[0];
+        break;
+      case DCM_NumberOfTemporalPositions:
+        zzrDS(zz, 1, tmpd);
+        u16_NumberOfTemporalPositions = tmpd[0];
+        break;
+      case DCM_TemporalPositionIdentifier:
+        zzrDS(zz, 1, tmpd);
+        *pi16_TemporalPositionIdentifier = tmpd[0];
+        break;
+      case DCM_InStackPositionNumber:
+        zzrDS(zz, 1, tmpd);
+        *pi16_StackPositionIdentifier = tmpd[0];
+        break;
+      case DCM_ComplexImageComponent:
+        zzgetstring(zz, c_ComplexImageComponent, sizeof(c_ComplexImageComponent) - 1);
+
+        if (memcmp("MAGNITUDE", c_ComplexImageComponent,9)==0)
+        {
+          *pe_DCM_CIC = DCM_CIC_MAGNITUDE;
+        }
+        else if (memcmp("PHASE", c_ComplexImageComponent,5)==0)
+        {
+          *pe_DCM_CIC = DCM_CIC_PHASE;
+        }
+        else if (memcmp("REAL", c_ComplexImageComponent,4)==0)
+        {
+          *pe_DCM_CIC = DCM_CIC_REAL;
+        }
+        else if (memcmp("IMAGINARY", c_ComplexImageComponent,9)==0)
+        {
+          *pe_DCM_CIC = DCM_CIC_IMAGINARY;
+        }
+        else if (memcmp("MIXED", c_ComplexImageComponent,5)==0)
+        {
+          *pe_DCM_CIC = DCM_CIC_MIXED;
+        }
+        break;
+
+      case DCM_PixelData:
+        // Encapsulated (compressed) pixel data has an undefined length and
+        // cannot be read directly from the file.
+        if (zz->current.length != UNLIMITED && zz->current.length > 0)
+        {
+          *pl_PixelDataOffset = zz->current.pos;
+          *pl_PixelDataLength = zz->current.length;
+        }
+        break;
+
       default : break;
     }
-    if ((c_currentPatientID[0] != '\0') && (c_currentStudyInstanceUID[0] != '\0') &&  (c_currentSerieInstanceUID[0] != '\0'))
+
+    // Everything we need is in front of the pixel data.
+    if (ZZ_KEY(group, element) == DCM_PixelData)
     {
       break;
     }
   }
+  zz = zzclose(zz);
 
   if ((ps_patient->c_patientID[0] == '\0') &&
       (ps_study->c_studyInstanceUID[0] == '\0') &&
@@ -120,169 +392,104 @@ short int i16_memory_io_dicom_loadMetaData(Patient *ps_patient,
     memcpy(ps_patient->c_patientID,c_currentPatientID,strlen(c_currentPatientID));
     memcpy(ps_study->c_studyInstanceUID,c_currentStudyInstanceUID,strlen(c_currentStudyInstanceUID));
     memcpy(ps_serie->c_serieInstanceUID,c_currentSerieInstanceUID,strlen(c_currentSerieInstanceUID));
-    ps_serie->pc_filename = calloc(1,strlen(pc_dicom));
-    memcpy(ps_serie->pc_filename,pc_dicom, strlen(pc_dicom));
+  }
 
+  if ((memcmp(ps_patient->c_patientID, c_currentPatientID,sizeof(ps_patient->c_patientID))!=0) ||
+      (memcmp(ps_study->c_studyInstanceUID, c_currentStudyInstanceUID,sizeof(ps_study->c_studyInstanceUID))!=0) ||
+      (memcmp(ps_serie->c_serieInstanceUID, c_currentSerieInstanceUID,sizeof(ps_serie->c_serieInstanceUID))!=0))
+  {
+    return 0;
   }
 
-  if ((memcmp(ps_patient->c_patientID, c_currentPatientID,sizeof(ps_patient->c_patientID))==0) &&
-           (memcmp(ps_study->c_studyInstanceUID, c_currentStudyInstanceUID,sizeof(ps_study->c_studyInstanceUID))==0) &&
-           (memcmp(ps_serie->c_serieInstanceUID, c_currentSerieInstanceUID,sizeof(ps_serie->c_serieInstanceUID))==0))
+  if (u16_BitsAllocated != 16)
   {
-    ps_serie->pc_filename = calloc(1, strlen(pc_dicom));
-    strcpy(ps_serie->pc_filename,pc_dicom);
+    return 0;
+  }
 
-    ps_serie->input_type = MUMC_FILETYPE_DICOM;
+  free(ps_serie->pc_filename);
+  ps_serie->pc_filename = calloc(1, strlen(pc_dicom) + 1);
+  strcpy(ps_serie->pc_filename,pc_dicom);
+
+  ps_serie->input_type = MUMC_FILETYPE_DICOM;
+  ps_serie->data_type = MEMORY_TYPE_UINT16;
+
+  ps_serie->i16_QuaternionCode = COORDINATES_SCANNER_ANAT;
+  ps_serie->num_time_series = u16_NumberOfTemporalPositions;
+
+  if (i16_NumberOfFrames > 0) ps_serie->matrix.i16_z = i16_NumberOfFrames;
+  if (i16_Rows > 0) ps_serie->matrix.i16_y = i16_Rows;
+  if (i16_Columns > 0) ps_serie->matrix.i16_x = i16_Columns;
+
+  if (c_PatientsName[0] != '\0') strcpy(ps_patient->name, c_PatientsName);
+  if (c_StudyDescription[0] != '\0') strcpy(ps_study->name, c_StudyDescription);
+  if (c_SeriesDescription[0] != '\0') strcpy(ps_serie->name, c_SeriesDescription);
+
+  ps_serie->offset = f_RescaleIntercept;
+  ps_serie->slope = f_RescaleSlope;
+  ps_serie->pixel_dimension = ts_PixelDimension;
+
+  ps_SlicePosition->x = imageposvector[0];
+  ps_SlicePosition->y = imageposvector[1];
+  ps_SlicePosition->z = imageposvector[2];
+
+  ps_XVector->x = imageorientation[0];
+  ps_XVector->y = imageorientation[1];
+  ps_XVector->z = imageorientation[2];
+  ps_YVector->x = imageorientation[3];
+  ps_YVector->y = imageorientation[4];
+  ps_YVector->z = imageorientation[5];
+
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][0] = -imageorientation[0];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][1] = -imageorientation[3];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][2] =  -(imageorientation[1] * imageorientation[5] -
+                                                      imageorientation[2] * imageorientation[4]);
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][3] = 0;
+
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][0] = -imageorientation[1];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][1] = -imageorientation[4];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][2] =  -(imageorientation[2] * imageorientation[3] -
+                                                      imageorientation[0] * imageorientation[5]);
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][3] = 0;
+
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][0] = imageorientation[2];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][1] = imageorientation[5];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][2] = (imageorientation[0] * imageorientation[4] -
+                                                     imageorientation[1] * imageorientation[3]);
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][3] = 0;
+
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][0] = -imageposvector[0];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][1] = -imageposvector[1];
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][2] = imageposvector[2];;
+  ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][3] = 1;
 
-    ps_serie->i16_QuaternionCode = COORDINATES_SCANNER_ANAT;
-    ps_serie->num_time_series = 1;
+  return 1;
+}
 
-    zzclose(zz);
-    zz = zzopen(pc_dicom, "r", &szz);
-    zziterinit(zz);
-    while (zziternext(zz, &group, &element, &len))
-    {
-      switch (ZZ_KEY(group, element))
-      {
-        case DCM_BitsAllocated:
-          ps_serie->data_type = ( zzgetuint16(zz, 0) == 16) ? MEMORY_TYPE_UINT16 : MEMORY_TYPE_ERROR;
-          if (ps_serie->data_type == MEMORY_TYPE_ERROR)
-          {
-            return 0;
-          }
-          break;
-
-        case DCM_NumberOfFrames:
-          zzgetstring(zz, value, sizeof(value) - 1);
-          ps_serie->matrix.i16_z = (float)(atoi(value));
-          break;
-        case DCM_Rows:
-          ps_serie->matrix.i16_y = (float)(zzgetuint16(zz, 0));
-          break;
-        case DCM_Columns:
-          ps_serie->matrix.i16_x = (float)(zzgetuint16(zz, 0));
-          break;
-        case DCM_PatientsName:
-          zzgetstring(zz, ps_patient->name, sizeof(ps_patient->name) - 1);
-          break;
-        case DCM_StudyDescription:
-          zzgetstring(zz, ps_study->name, sizeof(ps_study->name) - 1);
-          break;
-        case DCM_SeriesDescription:
-          zzgetstring(zz, ps_serie->name, sizeof(ps_serie->name) - 1);
-          break;
-        case DCM_ImagePositionPatient:		// DS, 3 values
-          zzrDS(zz, 3, imageposvector);
-          ps_SlicePosition->x = imageposvector[0];
-          ps_SlicePosition->y = imageposvector[1];
-          ps_SlicePosition->z = imageposvector[2];
-          break;
-        case DCM_ImageOrientationPatient:	// DS, 6 values
-          zzrDS(zz, 6, imageorientation);
-          ps_XVector->x = imageorientation[0];
-          ps_XVector->y = imageorientation[1];
-          ps_XVector->z = imageorientation[2];
-          ps_YVector->x = imageorientation[3];
-          ps_YVector->y = imageorientation[4];
-          ps_YVector->z = imageorientation[5];
-          break;
-        case DCM_RescaleIntercept:	// DS, the b in m*SV + b
-          zzgetstring(zz, value, sizeof(value) - 1);
-          ps_serie->offset = atof(value);
-          break;
-        case DCM_RescaleSlope:		// DS, the m in m*SV + b
-          zzgetstring(zz, value, sizeof(value) - 1);
-          ps_serie->slope = atof(value);
-          break;
-        case DCM_PixelSpacing:
-          zzrDS(zz, 2, tmpd);
-          ps_serie->pixel_dimension.x = tmpd[0];
-          ps_serie->pixel_dimension.y = tmpd[1];
-          break;
-        case DCM_SliceThickness:
-          zzrDS(zz, 1, tmpd);
-          ps_serie->pixel_dimension.z = tmpd[0];
-          break;
-        case DCM_NumberOfTemporalPositions:
-          zzrDS(zz, 1, tmpd);
-          ps_serie->num_time_series = tmpd[0];
-          break;
-        case DCM_TemporalPositionIdentifier:
-          zzrDS(zz, 1, tmpd);
-          *pi16_TemporalPositionIdentifier = tmpd[0];
-          break;
-        case DCM_InStackPositionNumber:
-          zzrDS(zz, 1, tmpd);
-          *pi16_StackPositionIdentifier = tmpd[0];
-          break;
-        case DCM_ComplexImageComponent:
-          zzgetstring(zz, c_ComplexImageComponent, sizeof(c_ComplexImageComponent) - 1);
-
-          if (memcmp("MAGNITUDE", c_ComplexImageComponent,9)==0)
-          {
-            *pe_DCM_CIC = DCM_CIC_MAGNITUDE;
-          }
-          else if (memcmp("PHASE", c_ComplexImageComponent,5)==0)
-          {
-            *pe_DCM_CIC = DCM_CIC_PHASE;
-          }
-          else if (memcmp("REAL", c_ComplexImageComponent,4)==0)
-          {
-            *pe_DCM_CIC = DCM_CIC_REAL;
-          }
-          else if (memcmp("IMAGINARY", c_ComplexImageComponent,9)==0)
-          {
-            *pe_DCM_CIC = DCM_CIC_IMAGINARY;
-          }
-          else if (memcmp("MIXED", c_ComplexImageComponent,5)==0)
-          {
-            *pe_DCM_CIC = DCM_CIC_MIXED;
-          }
-
-          break;
-
-
-
-
-        default : break;
-      }
-    }
-    zz = zzclose(zz);
-
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][0] = -imageorientation[0];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][1] = -imageorientation[3];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][2] =  -(imageorientation[1] * imageorientation[5] -
-                                                        imageorientation[2] * imageorientation[4]);
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[0][3] = 0;
-
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][0] = -imageorientation[1];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][1] = -imageorientation[4];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][2] =  -(imageorientation[2] * imageorientation[3] -
-                                                        imageorientation[0] * imageorientation[5]);
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[1][3] = 0;
-
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][0] = imageorientation[2];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][1] = imageorientation[5];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][2] = (imageorientation[0] * imageorientation[4] -
-                                                       imageorientation[1] * imageorientation[3]);
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][3] = 0;
-
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][0] = -imageposvector[0];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][1] = -imageposvector[1];
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][2] = imageposvector[2];;
-    ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][3] = 1;
+short int i16_memory_io_dicom_readPixelData(const char *pc_dicom, void *pv_Destination, long l_Offset, long l_Length)
+{
+  int i32_File;
+  short int b_Success;
 
-    return 1;
-  }
-  else
+  i32_File = open (pc_dicom, O_RDONLY);
+  if (i32_File < 0)
   {
-  	zz = zzclose(zz);
     return 0;
   }
-  return 0;
+
+  // Read straight into the destination.
+  b_Success = b_memory_io_dicom_pread_all (i32_File, pv_Destination, l_Offset, l_Length);
+
+  close (i32_File);
+  return b_Success;
 }
 
-short int i16_memory_io_dicom_loadSingleSlice(Serie *ps_serie, const char *pc_dicom, short int i16_SliceNumber, short int i16_timeFrameNumber)
+
+short int i16_memory_io_dicom_loadSingleSlice(Serie *ps_serie,
+                                              const char *pc_dicom,
+                                              short int i16_SliceNumber,
+                                              short int i16_timeFrameNumber,
+                                              long l_PixelDataOffset,
+                                              long l_PixelDataLength)
 {
   struct zzfile szz, *zz;
   uint16_t group, element;
@@ -293,6 +500,42 @@ short int i16_memory_io_dicom_loadSingleSlice(Serie *ps_serie, const char *pc_di
   short int i16_BytesToRead;
   int i32_PixelsInSlice, i32_MemoryPerSlice, i32_MemoryOffset, i32_MemoryPerVolume, i32_MemoryInBlob;
 
+  if (ps_serie->data == NULL)
+  {
+    if (ps_serie->matrix.i16_z == 0)
+    {
+      ps_serie->matrix.i16_z = 1;
+    }
+
+    i16_BytesToRead = 2;
+    i32_PixelsInSlice = ps_serie->matrix.i16_x * ps_serie->matrix.i16_y * ps_serie->matrix.i16_z;
+    i32_MemoryPerVolume = i16_BytesToRead * i32_PixelsInSlice;
+    i32_MemoryInBlob = i32_MemoryPerVolume * ps_serie->num_time_series;
+
+    ps_serie->data = calloc (1, i32_MemoryInBlob);
+    ps_serie->pv_OutOfBlobValue = calloc (1, i16_BytesToRead);
+  }
+
+  i16_BytesToRead = 2;
+  i32_PixelsInSlice = ps_serie->matrix.i16_x * ps_serie->matrix.i16_y;
+  i32_MemoryPerSlice = i16_BytesToRead * i32_PixelsInSlice;
+
+  i32_MemoryOffset= i16_timeFrameNumber * i32_MemoryPerSlice * ps_serie->matrix.i16_z;
+  i32_MemoryOffset+=i16_SliceNumber * i32_MemoryPerSlice;
+
+  pv_data=ps_serie->data;
+  pv_data+=i32_MemoryOffset;
+
+  // Uncompressed little endian pixel data at a known offset is read
+  // directly into the serie, without parsing the file again.
+  if (l_PixelDataOffset >= 0 && l_PixelDataLength >= i32_MemoryPerSlice)
+  {
+    if (i16_memory_io_dicom_readPixelData(pc_dicom, pv_data, l_PixelDataOffset, i32_MemoryPerSlice))
+    {
+      return 1;
+    }
+  }
+
   zz = zzopen(pc_dicom, "r", &szz);
   if (!zz)
   {
@@ -302,47 +545,92 @@ short int i16_memory_io_dicom_loadSingleSlice(Serie *ps_serie, const char *pc_di
   zziterinit(zz);
   while (zziternext(zz, &group, &element, &len))
   {
-    switch (ZZ_KEY(group, element))
+    if (ZZ_KEY(group, element) == DCM_PixelData)
     {
-      case DCM_PixelData:
-        if (ps_serie->data == NULL)
-        {
-          if (ps_serie->matrix.i16_z == 0)
-          {
-            ps_serie->matrix.i16_z = 1;
-          }
+      void *pv_tmpData=zireadbuf(zz->zi, i32_MemoryPerSlice );
+      memcpy(pv_data,pv_tmpData, i32_MemoryPerSlice );
 
-          i16_BytesToRead = 2;
-          i32_PixelsInSlice = ps_serie->matrix.i16_x * ps_serie->matrix.i16_y * ps_serie->matrix.i16_z;
-          i32_MemoryPerVolume = i16_BytesToRead * i32_PixelsInSlice;
-          i32_MemoryInBlob = i32_MemoryPerVolume * ps_serie->num_time_series;
+      zifreebuf(zz->zi, pv_tmpData, i32_MemoryPerSlice );
+      break;
+    }
+  }
+  zz = zzclose(zz);
+  return 1;
+}
 
-          ps_serie->data = calloc (1, i32_MemoryInBlob);
-          ps_serie->pv_OutOfBlobValue = calloc (1, i16_BytesToRead);
 
-        }
+short int i16_memory_io_dicom_loadMultiFrame(Serie *ps_serie,
+                                             const char *pc_dicom,
+                                             long l_PixelDataOffset,
+                                             long l_PixelDataLength)
+{
+  struct zzfile szz, *zz;
+  uint16_t group, element;
+  long len;
 
-        i16_BytesToRead = 2;
-        i32_PixelsInSlice = ps_serie->matrix.i16_x * ps_serie->matrix.i16_y;
-        i32_MemoryPerSlice = i16_BytesToRead * i32_PixelsInSlice;
+  long l_FrameSize = (long)ps_serie->matrix.i16_x * ps_serie->matrix.i16_y * 2;
+  long l_Frames = (long)ps_serie->matrix.i16_z * ps_serie->num_time_series;
+  long l_MemoryInBlob = l_FrameSize * l_Frames;
 
-        i32_MemoryOffset= i16_timeFrameNumber * i32_MemoryPerSlice * ps_serie->matrix.i16_z;
-        i32_MemoryOffset+=i16_SliceNumber * i32_MemoryPerSlice;
+  if (ps_serie->data == NULL)
+  {
+    ps_serie->data = calloc (1, l_MemoryInBlob);
+    ps_serie->pv_OutOfBlobValue = calloc (1, 2);
 
+    if (ps_serie->data == NULL || ps_serie->pv_OutOfBlobValue == NULL)
+    {
+      return 0;
+    }
+  }
 
-        pv_data=ps_serie->data;
-        pv_data+=i32_MemoryOffset;
+  // The frames are stored one after the other, with the slices of a
+  // timepoint together, which is exactly how the serie keeps them. So the
+  // whole pixel data element goes into the serie in one go.
+  if (l_PixelDataOffset >= 0 && l_PixelDataLength >= l_MemoryInBlob)
+  {
+    int i32_File = open (pc_dicom, O_RDONLY);
+    if (i32_File >= 0)
+    {
+      ts_dicom_BulkReadJob ts_Job;
+      ts_Job.i32_File = i32_File;
+      ts_Job.pu8_Destination = ps_serie->data;
+      ts_Job.l_Offset = l_PixelDataOffset;
+      ts_Job.l_FrameSize = l_FrameSize;
+      ts_Job.b_Failed = 0;
+
+      common_iohint_sequential (i32_File, l_PixelDataOffset, l_MemoryInBlob);
+
+      // Large files are read by several threads, each with its own range
+      // of frames.
+      common_thread_parallel_for (l_Frames, (DICOM_BULK_MIN_CHUNK + l_FrameSize - 1) / l_FrameSize, 0,
+                                  v_memory_io_dicom_read_frames, &ts_Job);
+
+      close (i32_File);
+      if (!ts_Job.b_Failed)
+      {
+        return 1;
+      }
+    }
+  }
 
-        void *pv_tmpData=zireadbuf(zz->zi, i32_MemoryPerSlice );
-        memcpy(pv_data,pv_tmpData, i32_MemoryPerSlice );
+  zz = zzopen(pc_dicom, "r", &szz);
+  if (!zz)
+  {
+    return 0;
+  }
 
-        zifreebuf(zz->zi, pv_tmpData, i32_MemoryPerSlice );
+  zziterinit(zz);
+  while (zziternext(zz, &group, &element, &len))
+  {
+    if (ZZ_KEY(group, element) == DCM_PixelData)
+    {
+      void *pv_tmpData=zireadbuf(zz->zi, l_MemoryInBlob);
+      memcpy(ps_serie->data, pv_tmpData, l_MemoryInBlob);
 
-        break;
-      default : break;
+      zifreebuf(zz->zi, pv_tmpData, l_MemoryInBlob);
+      break;
     }
   }
   zz = zzclose(zz);
   return 1;
 }
-
@@ -18,13 +18,55 @@
  */
 
 #include "nifti/include/nifti1.h"
+#include "nifti/include/nifti2.h"
 #include "libio-nifti.h"
 #include "libcommon-debug.h"
+#include "libcommon-iohint.h"
+#include "libcommon-thread.h"
+#include "libcommon-unused.h"
 
+#include <assert.h>
 #include <string.h>
+#include <limits.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
 #include <byteswap.h>
 #include <math.h>
+#include <zlib.h>
+
+// Large writes keep the number of system calls down, while still giving
+// regular progress updates.
+#define NIFTII_WRITE_CHUNK_SIZE (8 * 1024 * 1024)
+
+// Compressed files are written as a series of independent gzip members of
+// this much uncompressed data each, so they can be deflated in parallel.
+#define NIFTII_GZIP_MEMBER_SIZE (4 * 1024 * 1024)
+
+// The number of members to keep in memory per worker before writing them.
+#define NIFTII_GZIP_MEMBERS_PER_WORKER 4
+
+// Where the voxels of a slice of a lazy serie are in a niftii file.
+typedef struct
+{
+  char *pc_FileName;
+  unsigned long long ui64_Offset;
+  short int b_Swapped;
+} ts_NIFTII_SliceSource;
+
+typedef struct
+{
+  Serie *ps_Serie;
+  unsigned char *pu8_Data;
+  unsigned long long ui64_DataSize;
+  unsigned long long ui64_FirstMember;
+  int i32_Level;
+  unsigned char **ppu8_Members;
+  unsigned long *pul_MemberSizes;
+  short int b_Failed;
+  unsigned long long *pui64_BytesWritten;
+} ts_NIFTII_CompressJob;
 
 /*                                                                                                    */
 /*                                                                                                    */
@@ -36,14 +78,40 @@ MemoryDataType e_NIFTII_ConvertNIFTIIToMemoryDataType (short i16_datatype);
 short int i16_NIFTII_ConvertMemoryDataTypeToNIFTII (MemoryDataType te_DataType);
 short int i16_NIFTII_GetMemorySizePerElement (short i16_datatype);
 short int i16_NIFTII_GetBitPix (short i16_datatype);
-short int b_NIFTII_ReadHeaderToMemory (const char* pc_FileName, nifti_1_header* ps_Header);
-short int b_NIFTII_ReadVolumeToMemory (const char* pc_FileName, int i32_offset, int i32_MemoryInVolume, void *pv_Data);
-short int b_NIFTII_WriteHeaderToFile (const char* pc_FileName, void *pv_Data);
-short int b_NIFTII_WriteImageToFile (const char* pc_FileName, int i32_BytesToWrite, int i32_PixelsInVolume, int i32_BLOB_Offset, void *pv_Data);
-void v_NIFTII_convert_data_big_to_little_endian(Serie *serie);
+short int i16_NIFTII_ReadHeaderToMemory (const char* pc_FileName, nifti_2_header* ps_Header, short int *pb_Swapped);
+short int b_NIFTII_ReadVolumeToMemory (const char* pc_FileName, unsigned long long ui64_Offset, unsigned long long ui64_MemoryInVolume, void *pv_Data);
+int i32_NIFTII_CreateTemporaryFile (const char* pc_FileName, char **ppc_TemporaryName);
+short int b_NIFTII_CommitTemporaryFile (const char* pc_FileName, char *pc_TemporaryName, int i32_File, short int b_Success);
+short int b_NIFTII_WriteAll (int i32_File, void *pv_Data, unsigned long long ui64_DataSize, unsigned long long *pui64_BytesWritten);
+short int b_NIFTII_WriteSerie (int i32_File, Serie *serie, unsigned long long ui64_DataSize, unsigned long long *pui64_BytesWritten);
+short int b_NIFTII_PwriteAll (int i32_File, void *pv_Data, unsigned long long ui64_DataSize, unsigned long long ui64_Offset, unsigned long long *pui64_BytesWritten);
+short int b_NIFTII_WriteFile (const char* pc_FileName, void *pv_Header, int i32_HeaderSize, Serie *serie, unsigned long long ui64_DataSize, unsigned long long *pui64_BytesWritten);
+short int b_NIFTII_DeflateMember (void *pv_Data, unsigned long ul_DataSize, int i32_Level, unsigned char **ppu8_Member, unsigned long *pul_MemberSize);
+void v_NIFTII_CompressMembers (unsigned long long ui64_Start, unsigned long long ui64_End, unsigned int ui32_Worker, void *pv_Job);
+void v_NIFTII_FillHeader (Serie *serie, nifti_2_header *ps_Header);
+unsigned int ui32_NIFTII_BuildHeader (Serie *serie, short int b_SingleFile, unsigned char *pu8_Header);
+void v_NIFTII_Header1To2 (nifti_1_header *ps_Header1, nifti_2_header *ps_Header2);
+void v_NIFTII_Header2To1 (nifti_2_header *ps_Header2, nifti_1_header *ps_Header1);
+unsigned long long ui64_NIFTII_GetMemoryInBlob (Serie *serie);
+void v_NIFTII_SwapData (MemoryDataType e_DataType, unsigned long long ui64_Elements, void *pv_Data);
+short int i16_NIFTII_LoadLazySlice (Serie *serie, short int i16_Slice, unsigned short int u16_TimePoint, void *pv_Source);
+void v_NIFTII_DestroySliceSource (void *pv_Source);
+short int i16_NIFTII_SetLazy (Serie *serie, const char *pc_FileName, unsigned long long ui64_Offset, short int b_Swapped);
+short int i16_NIFTII_Load (Serie *serie, const char *pc_Filename, const char *pc_Image, short int b_Lazy, short int b_Streaming);
+void v_NIFTII_swap_8bytes( size_t n , void *ar );
 void v_NIFTII_swap_4bytes( size_t n , void *ar );
+void v_NIFTII_swap_8bytes( size_t n , void *ar )
+{
+  size_t ii;
+  unsigned long long *pui64_Value = (unsigned long long *)ar;
+
+  for (ii = 0; ii < n; ii++)
+    pui64_Value[ii] = __bswap_64 (pui64_Value[ii]);
+}
+
 void v_NIFTII_swap_2bytes( size_t n , void *ar );
 void v_NIFTII_swap_header( struct nifti_1_header *h /*, int is_nifti*/ );
+void v_NIFTII_swap_header2( struct nifti_2_header *h );
 
 
 MemoryDataType
@@ -177,13 +245,13 @@ i16_NIFTII_GetBitPix (short i16_datatype)
   {
     case DT_NONE          : ui8_bitpix =  0; break;
     case DT_BINARY        : ui8_bitpix =  1; break;
-    case DT_UNSIGNED_CHAR : ui8_bitpix =  1; break;
+    case DT_UNSIGNED_CHAR : ui8_bitpix =  8; break;
     case DT_INT8          : ui8_bitpix =  8; break;
 
     case DT_SIGNED_SHORT  : ui8_bitpix = 16; break;
     case DT_UINT16        : ui8_bitpix = 16; break;
 
-    case DT_SIGNED_INT    : ui8_bitpix =  8; break;
+    case DT_SIGNED_INT    : ui8_bitpix = 32; break;
     case DT_UINT32        : ui8_bitpix = 32; break;
     case DT_INT64         : ui8_bitpix = 64; break;
 
@@ -206,13 +274,16 @@ i16_NIFTII_GetBitPix (short i16_datatype)
 }
 
 short int
-b_NIFTII_ReadHeaderToMemory(const char* pc_FileName, nifti_1_header* ps_Header)
+i16_NIFTII_ReadHeaderToMemory (const char* pc_FileName, nifti_2_header* ps_Header, short int *pb_Swapped)
 {
   debug_functions ();
 
   FILE *pf_InputFile;
-  unsigned int ui32_FileSize;
-  unsigned char uc_Extention[4]={255,0,0,0};
+  unsigned char pu8_Header[NII2_MIN_HEADER_SIZE];
+  unsigned int ui32_HeaderSize;
+  int i32_SizeOfHeader;
+  short int i16_Version;
+  short int b_Swapped;
 
   pf_InputFile = fopen (pc_FileName, "rb");
   if( pf_InputFile==NULL)
@@ -221,155 +292,570 @@ b_NIFTII_ReadHeaderToMemory(const char* pc_FileName, nifti_1_header* ps_Header)
     return 0;
   }
 
-  fseek(pf_InputFile, 0, SEEK_END);
-  ui32_FileSize = ftell (pf_InputFile);
-  fseek (pf_InputFile, 0, SEEK_SET);
+  // The first field tells the version of the header, and its byte order.
+  if (fread (pu8_Header, 1, sizeof (int), pf_InputFile) != sizeof (int))
+  {
+    debug_error ("Error while reading the file '%s'.", pc_FileName);
+    fclose (pf_InputFile);
+    return 0;
+  }
 
-  unsigned int ui32_BytesRead = fread (ps_Header, 1, MIN_HEADER_SIZE, pf_InputFile);
-  if (ui32_BytesRead != MIN_HEADER_SIZE)
+  memcpy (&i32_SizeOfHeader, pu8_Header, sizeof (int));
+  if (i32_SizeOfHeader == NII2_MIN_HEADER_SIZE || (int)__bswap_32 (i32_SizeOfHeader) == NII2_MIN_HEADER_SIZE)
+  {
+    i16_Version = 2;
+    ui32_HeaderSize = NII2_MIN_HEADER_SIZE;
+    b_Swapped = (i32_SizeOfHeader != NII2_MIN_HEADER_SIZE);
+  }
+  else if (i32_SizeOfHeader == MIN_HEADER_SIZE || (int)__bswap_32 (i32_SizeOfHeader) == MIN_HEADER_SIZE)
+  {
+    // Both NIfTI-1 and Analyze 7.5 headers.
+    i16_Version = 1;
+    ui32_HeaderSize = MIN_HEADER_SIZE;
+    b_Swapped = (i32_SizeOfHeader != MIN_HEADER_SIZE);
+  }
+  else
+  {
+    debug_error ("The file '%s' does not start with a known header.", pc_FileName);
+    fclose (pf_InputFile);
+    return 0;
+  }
+
+  unsigned int ui32_BytesRead = fread (pu8_Header + sizeof (int), 1, ui32_HeaderSize - sizeof (int), pf_InputFile);
+  fclose (pf_InputFile);
+
+  if (ui32_BytesRead != ui32_HeaderSize - sizeof (int))
   {
     debug_error ("Error while reading the file '%s'.", pc_FileName);
     return 0;
   }
 
-  if (ui32_FileSize != MIN_HEADER_SIZE)
+  // Extensions that may follow the header are not read. The image data
+  // is found through vox_offset, which lies beyond them.
+  if (i16_Version == 2)
   {
-    fread (&uc_Extention[0], 4, 1, pf_InputFile);
-    if (uc_Extention[0] != 0)
-    {
-      // No support for a strange extention file, so exit application
-      debug_error ("There is currently no support for extended datasets.");
-      return 0;
-    }
+    memcpy (ps_Header, pu8_Header, NII2_MIN_HEADER_SIZE);
+    if (b_Swapped)
+      v_NIFTII_swap_header2 (ps_Header);
+  }
+  else
+  {
+    nifti_1_header ts_Header1;
+    memcpy (&ts_Header1, pu8_Header, MIN_HEADER_SIZE);
+    if (b_Swapped)
+      v_NIFTII_swap_header (&ts_Header1);
+
+    v_NIFTII_Header1To2 (&ts_Header1, ps_Header);
   }
 
-  fclose(pf_InputFile);
-  return 1;
+  if (pb_Swapped != NULL)
+    *pb_Swapped = b_Swapped;
+
+  return i16_Version;
 }
 
 short int
-b_NIFTII_ReadVolumeToMemory (const char* pc_FileName, int i32_offset, int i32_MemoryInVolume, void *pv_Data)
+b_NIFTII_ReadVolumeToMemory (const char* pc_FileName, unsigned long long ui64_Offset,
+                             unsigned long long ui64_MemoryInVolume, void *pv_Data)
 {
   debug_functions ();
 
-  FILE *pf_InputFile;
+  int i32_File;
+  ssize_t s_Read;
+  unsigned long long ui64_Done = 0;
 
-  pf_InputFile = fopen (pc_FileName, "rb");
-  if( pf_InputFile == NULL)
+  i32_File = open (pc_FileName, O_RDONLY);
+  if (i32_File < 0)
   {
     debug_error ("Could not open the file '%s'.", pc_FileName);
     return 0;
   }
 
-  fseek (pf_InputFile, i32_offset, SEEK_SET);
-  fread (pv_Data, 1, i32_MemoryInVolume, pf_InputFile);
+  // The volume is read front to back in one go.
+  common_iohint_sequential (i32_File, ui64_Offset, ui64_MemoryInVolume);
 
-  fclose (pf_InputFile);
+  // Volumes can be larger than a single read is allowed to be.
+  while (ui64_Done < ui64_MemoryInVolume)
+  {
+    unsigned long long ui64_Chunk = ui64_MemoryInVolume - ui64_Done;
+    if (ui64_Chunk > NIFTII_WRITE_CHUNK_SIZE)
+      ui64_Chunk = NIFTII_WRITE_CHUNK_SIZE;
+
+    s_Read = pread (i32_File, (char *)pv_Data + ui64_Done, ui64_Chunk, ui64_Offset + ui64_Done);
+    if (s_Read < 0 && errno == EINTR)
+      continue;
+
+    if (s_Read <= 0)
+      break;
+
+    ui64_Done += s_Read;
+  }
+
+  close (i32_File);
+
+  if (ui64_Done < ui64_MemoryInVolume)
+  {
+    debug_error ("The file '%s' holds less data than its header describes.", pc_FileName);
+    return 0;
+  }
 
   return 1;
 }
 
-short int
-b_NIFTII_WriteHeaderToFile(const char* pc_FileName, void *pv_Data)
+int
+i32_NIFTII_CreateTemporaryFile (const char* pc_FileName, char **ppc_TemporaryName)
 {
   debug_functions ();
 
-  FILE *pf_OutputFile;
+  int i32_File;
+  struct stat statbuf;
+  mode_t t_Mode = 0644;
+
+  // Write to a temporary file next to the destination, and only move it
+  // in place once everything is on disk. A crash or full disk halfway
+  // through never leaves a truncated file behind.
+  *ppc_TemporaryName = calloc (1, strlen (pc_FileName) + 8);
+  if (*ppc_TemporaryName == NULL) return -1;
 
-  pf_OutputFile = fopen (pc_FileName, "wb");
-  if( pf_OutputFile==NULL)
+  sprintf (*ppc_TemporaryName, "%s.XXXXXX", pc_FileName);
+  i32_File = mkstemp (*ppc_TemporaryName);
+  if (i32_File < 0)
   {
     debug_error ("Could not open the file '%s'.", pc_FileName);
-    return 0;
+    free (*ppc_TemporaryName), *ppc_TemporaryName = NULL;
+    return -1;
+  }
+
+  // Keep the permissions of a file we replace.
+  if (stat (pc_FileName, &statbuf) == 0)
+    t_Mode = statbuf.st_mode & 0777;
+
+  fchmod (i32_File, t_Mode);
+
+  return i32_File;
+}
+
+short int
+b_NIFTII_CommitTemporaryFile (const char* pc_FileName, char *pc_TemporaryName, int i32_File, short int b_Success)
+{
+  debug_functions ();
+
+  if (b_Success && fsync (i32_File) != 0)
+    b_Success = 0;
+
+  if (close (i32_File) != 0)
+    b_Success = 0;
+
+  if (b_Success && rename (pc_TemporaryName, pc_FileName) != 0)
+    b_Success = 0;
+
+  if (!b_Success)
+  {
+    debug_error ("Error while writing the file '%s'.", pc_FileName);
+    unlink (pc_TemporaryName);
+  }
+
+  free (pc_TemporaryName);
+  return b_Success;
+}
+
+short int
+b_NIFTII_WriteAll (int i32_File, void *pv_Data, unsigned long long ui64_DataSize,
+                   unsigned long long *pui64_BytesWritten)
+{
+  unsigned long long ui64_Done = 0;
+  ssize_t s_Written;
+
+  while (ui64_Done < ui64_DataSize)
+  {
+    unsigned long long ui64_Chunk = ui64_DataSize - ui64_Done;
+    if (ui64_Chunk > NIFTII_WRITE_CHUNK_SIZE)
+      ui64_Chunk = NIFTII_WRITE_CHUNK_SIZE;
+
+    s_Written = write (i32_File, (char *)pv_Data + ui64_Done, ui64_Chunk);
+    if (s_Written < 0 && errno == EINTR)
+      continue;
+
+    if (s_Written <= 0)
+      return 0;
+
+    ui64_Done += s_Written;
+    if (pui64_BytesWritten != NULL)
+      __atomic_add_fetch (pui64_BytesWritten, s_Written, __ATOMIC_RELAXED);
   }
-  fwrite (pv_Data, 1, NII_HEADER_SIZE, pf_OutputFile);
 
-  fclose(pf_OutputFile);
   return 1;
 }
 
+// Writes the data of a Serie. Data that is not in memory in linear order
+// is read a chunk at a time.
+short int
+b_NIFTII_WriteSerie (int i32_File, Serie *serie, unsigned long long ui64_DataSize,
+                     unsigned long long *pui64_BytesWritten)
+{
+  unsigned long long ui64_Done, ui64_Chunk;
+  unsigned char *pu8_Chunk;
+  short int b_Success = 1;
+
+  if (memory_serie_has_linear_data (serie))
+    return b_NIFTII_WriteAll (i32_File, serie->data, ui64_DataSize, pui64_BytesWritten);
+
+  pu8_Chunk = malloc (NIFTII_WRITE_CHUNK_SIZE);
+  if (pu8_Chunk == NULL) return 0;
+
+  for (ui64_Done = 0; b_Success && ui64_Done < ui64_DataSize; ui64_Done += ui64_Chunk)
+  {
+    ui64_Chunk = ui64_DataSize - ui64_Done;
+    if (ui64_Chunk > NIFTII_WRITE_CHUNK_SIZE)
+      ui64_Chunk = NIFTII_WRITE_CHUNK_SIZE;
+
+    b_Success = (memory_serie_read_linear (serie, ui64_Done, ui64_Chunk, pu8_Chunk) == 0)
+             && b_NIFTII_WriteAll (i32_File, pu8_Chunk, ui64_Chunk, pui64_BytesWritten);
+  }
+
+  free (pu8_Chunk), pu8_Chunk = NULL;
+  return b_Success;
+}
+
 short int
-b_NIFTII_WriteImageToFile (const char* pc_FileName, int i32_BytesToWrite, int i32_PixelsInVolume, int i32_BLOB_Offset, void *pv_Data)
+b_NIFTII_PwriteAll (int i32_File, void *pv_Data, unsigned long long ui64_DataSize,
+                    unsigned long long ui64_Offset, unsigned long long *pui64_BytesWritten)
+{
+  unsigned long long ui64_Done = 0;
+  ssize_t s_Written;
+
+  while (ui64_Done < ui64_DataSize)
+  {
+    s_Written = pwrite (i32_File, (char *)pv_Data + ui64_Done, ui64_DataSize - ui64_Done, ui64_Offset + ui64_Done);
+    if (s_Written < 0 && errno == EINTR)
+      continue;
+
+    if (s_Written <= 0)
+      return 0;
+
+    ui64_Done += s_Written;
+    if (pui64_BytesWritten != NULL)
+      __atomic_add_fetch (pui64_BytesWritten, s_Written, __ATOMIC_RELAXED);
+  }
+
+  return 1;
+}
+
+short int
+b_NIFTII_WriteFile (const char* pc_FileName, void *pv_Header, int i32_HeaderSize,
+                    Serie *serie, unsigned long long ui64_DataSize,
+                    unsigned long long *pui64_BytesWritten)
 {
   debug_functions ();
 
-  FILE *pf_OutputFile;
+  char *pc_TemporaryName;
+  int i32_File;
+  short int b_Success = 1;
+
+  i32_File = i32_NIFTII_CreateTemporaryFile (pc_FileName, &pc_TemporaryName);
+  if (i32_File < 0) return 0;
 
-  pf_OutputFile = fopen (pc_FileName, "ab");
+  if (pv_Header != NULL && write (i32_File, pv_Header, i32_HeaderSize) != i32_HeaderSize)
+    b_Success = 0;
+
+  if (b_Success && serie != NULL)
+    b_Success = b_NIFTII_WriteSerie (i32_File, serie, ui64_DataSize, pui64_BytesWritten);
+
+  return b_NIFTII_CommitTemporaryFile (pc_FileName, pc_TemporaryName, i32_File, b_Success);
+}
 
-  if( pf_OutputFile==NULL)
+short int
+b_NIFTII_DeflateMember (void *pv_Data, unsigned long ul_DataSize, int i32_Level,
+                        unsigned char **ppu8_Member, unsigned long *pul_MemberSize)
+{
+  z_stream ts_Stream;
+  memset (&ts_Stream, 0, sizeof (z_stream));
+
+  // A window of 15 bits plus 16 makes zlib write a gzip header and trailer.
+  if (deflateInit2 (&ts_Stream, i32_Level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return 0;
+
+  unsigned long ul_Bound = deflateBound (&ts_Stream, ul_DataSize);
+  *ppu8_Member = malloc (ul_Bound);
+  if (*ppu8_Member == NULL)
   {
-    debug_error ("Could not open the file '%s'.", pc_FileName);
+    deflateEnd (&ts_Stream);
     return 0;
   }
 
-  fseek(pf_OutputFile, i32_BLOB_Offset, SEEK_SET);
-  fwrite(pv_Data, i32_BytesToWrite, i32_PixelsInVolume, pf_OutputFile);
+  ts_Stream.next_in = pv_Data;
+  ts_Stream.avail_in = ul_DataSize;
+  ts_Stream.next_out = *ppu8_Member;
+  ts_Stream.avail_out = ul_Bound;
+
+  if (deflate (&ts_Stream, Z_FINISH) != Z_STREAM_END)
+  {
+    deflateEnd (&ts_Stream);
+    free (*ppu8_Member), *ppu8_Member = NULL;
+    return 0;
+  }
+
+  *pul_MemberSize = ts_Stream.total_out;
+  deflateEnd (&ts_Stream);
 
-  fclose(pf_OutputFile);
   return 1;
 }
 
 void
-v_NIFTII_convert_data_big_to_little_endian (Serie *serie)
+v_NIFTII_CompressMembers (unsigned long long ui64_Start, unsigned long long ui64_End,
+                          UNUSED unsigned int ui32_Worker, void *pv_Job)
 {
-  short int num_bytes = memory_serie_get_memory_space(serie);
+  ts_NIFTII_CompressJob *ps_Job = pv_Job;
+  unsigned long long ui64_Member, ui64_Offset, ui64_Size;
+  unsigned char *pu8_Data, *pu8_Buffer = NULL;
 
-  unsigned int i32_memory_size = serie->matrix.i16_x * serie->matrix.i16_y * serie->matrix.i16_z * serie->num_time_series;
-  unsigned int i32_blobCnt;
+  // Without linear data in memory, each member is read before it is deflated.
+  if (ps_Job->pu8_Data == NULL)
+  {
+    pu8_Buffer = malloc (NIFTII_GZIP_MEMBER_SIZE);
+    if (pu8_Buffer == NULL)
+    {
+      __atomic_store_n (&ps_Job->b_Failed, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  }
 
-  void *pv_Data=serie->data;
-  switch (serie->data_type)
+  for (ui64_Member = ui64_Start; ui64_Member < ui64_End; ui64_Member++)
   {
-    case MEMORY_TYPE_INT8    :
-    case MEMORY_TYPE_UINT8   :
-      break;
-    case MEMORY_TYPE_INT16   :
-    case MEMORY_TYPE_UINT16  :
+    ui64_Offset = (ps_Job->ui64_FirstMember + ui64_Member) * NIFTII_GZIP_MEMBER_SIZE;
+    ui64_Size = ps_Job->ui64_DataSize - ui64_Offset;
+    if (ui64_Size > NIFTII_GZIP_MEMBER_SIZE)
+      ui64_Size = NIFTII_GZIP_MEMBER_SIZE;
+
+    pu8_Data = ps_Job->pu8_Data + ui64_Offset;
+    if (pu8_Buffer != NULL)
+    {
+      pu8_Data = pu8_Buffer;
+      if (memory_serie_read_linear (ps_Job->ps_Serie, ui64_Offset, ui64_Size, pu8_Buffer) != 0)
       {
-        unsigned short int x16_Value;
+        __atomic_store_n (&ps_Job->b_Failed, 1, __ATOMIC_RELAXED);
+        continue;
+      }
+    }
 
-        for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-        {
-          x16_Value = (unsigned short int)(*(unsigned short int *)(pv_Data));
-          (*(unsigned short int *)(pv_Data)) = __bswap_16(x16_Value);
+    if (!b_NIFTII_DeflateMember (pu8_Data, ui64_Size, ps_Job->i32_Level,
+                                 &ps_Job->ppu8_Members[ui64_Member],
+                                 &ps_Job->pul_MemberSizes[ui64_Member]))
+    {
+      __atomic_store_n (&ps_Job->b_Failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
 
-          pv_Data+=num_bytes;
-        }
-      }
-      break;
-    case MEMORY_TYPE_INT32   :
-    case MEMORY_TYPE_UINT32  :
-    case MEMORY_TYPE_FLOAT32 :
-      {
-        unsigned int x32_Value;
+    if (ps_Job->pui64_BytesWritten != NULL)
+      __atomic_add_fetch (ps_Job->pui64_BytesWritten, ui64_Size, __ATOMIC_RELAXED);
+  }
 
-        for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-        {
-          x32_Value = (unsigned int)(*(unsigned int *)(pv_Data));
-          (*(unsigned int *)(pv_Data)) = __bswap_32(x32_Value);
+  free (pu8_Buffer), pu8_Buffer = NULL;
+}
 
-          pv_Data+=num_bytes;
-        }
-      }
-      break;
-    case MEMORY_TYPE_INT64   :
-    case MEMORY_TYPE_UINT64  :
-    case MEMORY_TYPE_FLOAT64 :
-      {
-        unsigned long long x64_Value;
+void
+v_NIFTII_FillHeader (Serie *serie, nifti_2_header *ps_Header)
+{
+  ps_Header->dim[0] = (serie->num_time_series>1) ? 4 : 3;
+  ps_Header->dim[1] = serie->matrix.i16_x;
+  ps_Header->dim[2] = serie->matrix.i16_y;
+  ps_Header->dim[3] = serie->matrix.i16_z;
+  ps_Header->dim[4] = serie->num_time_series;
 
-        for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-        {
-          x64_Value = (unsigned long long)(*(unsigned long long *)(pv_Data));
-          (*(unsigned long long *)(pv_Data)) = __bswap_64(x64_Value);
+  ps_Header->pixdim[1] = serie->pixel_dimension.x;
+  ps_Header->pixdim[2] = serie->pixel_dimension.y;
+  ps_Header->pixdim[3] = serie->pixel_dimension.z;
 
-          pv_Data+=num_bytes;
-        }
-      }
-      break;
-    default : break;
+  ps_Header->scl_slope = serie->slope;
+  ps_Header->scl_inter = serie->offset;
+
+  ps_Header->qform_code = serie->i16_QuaternionCode;
+
+  // Analyze files and niftii pairs are loaded without a quaternion.
+  if (serie->ps_Quaternion != NULL)
+  {
+    ps_Header->quatern_b = serie->ps_Quaternion->I;
+    ps_Header->quatern_c = serie->ps_Quaternion->J;
+    ps_Header->quatern_d = serie->ps_Quaternion->K;
+  }
+
+  if (serie->ps_QuaternationOffset != NULL)
+  {
+    ps_Header->qoffset_x = serie->ps_QuaternationOffset->I;
+    ps_Header->qoffset_y = serie->ps_QuaternationOffset->J;
+    ps_Header->qoffset_z = serie->ps_QuaternationOffset->K;
+  }
+
+  ps_Header->pixdim[0] = serie->d_Qfac;
+
+  ps_Header->sform_code = serie->i16_StandardSpaceCode;
+
+  ps_Header->srow_x[0] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[0][0];
+  ps_Header->srow_x[1] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[1][0];
+  ps_Header->srow_x[2] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[2][0];
+  ps_Header->srow_x[3] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[3][0];
+
+  ps_Header->srow_y[0] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[0][1];
+  ps_Header->srow_y[1] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[1][1];
+  ps_Header->srow_y[2] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[2][1];
+  ps_Header->srow_y[3] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[3][1];
+
+  ps_Header->srow_z[0] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[0][2];
+  ps_Header->srow_z[1] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[1][2];
+  ps_Header->srow_z[2] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[2][2];
+  ps_Header->srow_z[3] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[3][2];
+
+
+  ps_Header->datatype = i16_NIFTII_ConvertMemoryDataTypeToNIFTII(serie->data_type);
+  ps_Header->bitpix = i16_NIFTII_GetBitPix (serie->raw_data_type);
+}
+
+void
+v_NIFTII_Header1To2 (nifti_1_header *ps_Header1, nifti_2_header *ps_Header2)
+{
+  int i32_Cnt;
+
+  memset (ps_Header2, 0, sizeof (nifti_2_header));
+
+  ps_Header2->sizeof_hdr = ps_Header1->sizeof_hdr;
+  memcpy (ps_Header2->magic, ps_Header1->magic, sizeof (ps_Header1->magic));
+  ps_Header2->datatype = ps_Header1->datatype;
+  ps_Header2->bitpix = ps_Header1->bitpix;
+
+  for (i32_Cnt = 0; i32_Cnt < 8; i32_Cnt++)
+  {
+    ps_Header2->dim[i32_Cnt] = ps_Header1->dim[i32_Cnt];
+    ps_Header2->pixdim[i32_Cnt] = ps_Header1->pixdim[i32_Cnt];
+  }
+
+  ps_Header2->intent_p1 = ps_Header1->intent_p1;
+  ps_Header2->intent_p2 = ps_Header1->intent_p2;
+  ps_Header2->intent_p3 = ps_Header1->intent_p3;
+  ps_Header2->vox_offset = ps_Header1->vox_offset;
+  ps_Header2->scl_slope = ps_Header1->scl_slope;
+  ps_Header2->scl_inter = ps_Header1->scl_inter;
+  ps_Header2->cal_max = ps_Header1->cal_max;
+  ps_Header2->cal_min = ps_Header1->cal_min;
+  ps_Header2->slice_duration = ps_Header1->slice_duration;
+  ps_Header2->toffset = ps_Header1->toffset;
+  ps_Header2->slice_start = ps_Header1->slice_start;
+  ps_Header2->slice_end = ps_Header1->slice_end;
+  memcpy (ps_Header2->descrip, ps_Header1->descrip, sizeof (ps_Header1->descrip));
+  memcpy (ps_Header2->aux_file, ps_Header1->aux_file, sizeof (ps_Header1->aux_file));
+  ps_Header2->qform_code = ps_Header1->qform_code;
+  ps_Header2->sform_code = ps_Header1->sform_code;
+  ps_Header2->quatern_b = ps_Header1->quatern_b;
+  ps_Header2->quatern_c = ps_Header1->quatern_c;
+  ps_Header2->quatern_d = ps_Header1->quatern_d;
+  ps_Header2->qoffset_x = ps_Header1->qoffset_x;
+  ps_Header2->qoffset_y = ps_Header1->qoffset_y;
+  ps_Header2->qoffset_z = ps_Header1->qoffset_z;
+
+  for (i32_Cnt = 0; i32_Cnt < 4; i32_Cnt++)
+  {
+    ps_Header2->srow_x[i32_Cnt] = ps_Header1->srow_x[i32_Cnt];
+    ps_Header2->srow_y[i32_Cnt] = ps_Header1->srow_y[i32_Cnt];
+    ps_Header2->srow_z[i32_Cnt] = ps_Header1->srow_z[i32_Cnt];
   }
+
+  ps_Header2->slice_code = ps_Header1->slice_code;
+  ps_Header2->xyzt_units = ps_Header1->xyzt_units;
+  ps_Header2->intent_code = ps_Header1->intent_code;
+  memcpy (ps_Header2->intent_name, ps_Header1->intent_name, sizeof (ps_Header1->intent_name));
+  ps_Header2->dim_info = ps_Header1->dim_info;
+}
+
+void
+v_NIFTII_Header2To1 (nifti_2_header *ps_Header2, nifti_1_header *ps_Header1)
+{
+  int i32_Cnt;
+
+  memset (ps_Header1, 0, sizeof (nifti_1_header));
+
+  ps_Header1->sizeof_hdr = MIN_HEADER_SIZE;
+  ps_Header1->datatype = ps_Header2->datatype;
+  ps_Header1->bitpix = ps_Header2->bitpix;
+
+  for (i32_Cnt = 0; i32_Cnt < 8; i32_Cnt++)
+  {
+    ps_Header1->dim[i32_Cnt] = ps_Header2->dim[i32_Cnt];
+    ps_Header1->pixdim[i32_Cnt] = ps_Header2->pixdim[i32_Cnt];
+  }
+
+  ps_Header1->intent_p1 = ps_Header2->intent_p1;
+  ps_Header1->intent_p2 = ps_Header2->intent_p2;
+  ps_Header1->intent_p3 = ps_Header2->intent_p3;
+  ps_Header1->vox_offset = ps_Header2->vox_offset;
+  ps_Header1->scl_slope = ps_Header2->scl_slope;
+  ps_Header1->scl_inter = ps_Header2->scl_inter;
+  ps_Header1->cal_max = ps_Header2->cal_max;
+  ps_Header1->cal_min = ps_Header2->cal_min;
+  ps_Header1->slice_duration = ps_Header2->slice_duration;
+  ps_Header1->toffset = ps_Header2->toffset;
+  ps_Header1->slice_start = ps_Header2->slice_start;
+  ps_Header1->slice_end = ps_Header2->slice_end;
+  memcpy (ps_Header1->descrip, ps_Header2->descrip, sizeof (ps_Header1->descrip));
+  memcpy (ps_Header1->aux_file, ps_Header2->aux_file, sizeof (ps_Header1->aux_file));
+  ps_Header1->qform_code = ps_Header2->qform_code;
+  ps_Header1->sform_code = ps_Header2->sform_code;
+  ps_Header1->quatern_b = ps_Header2->quatern_b;
+  ps_Header1->quatern_c = ps_Header2->quatern_c;
+  ps_Header1->quatern_d = ps_Header2->quatern_d;
+  ps_Header1->qoffset_x = ps_Header2->qoffset_x;
+  ps_Header1->qoffset_y = ps_Header2->qoffset_y;
+  ps_Header1->qoffset_z = ps_Header2->qoffset_z;
+
+  for (i32_Cnt = 0; i32_Cnt < 4; i32_Cnt++)
+  {
+    ps_Header1->srow_x[i32_Cnt] = ps_Header2->srow_x[i32_Cnt];
+    ps_Header1->srow_y[i32_Cnt] = ps_Header2->srow_y[i32_Cnt];
+    ps_Header1->srow_z[i32_Cnt] = ps_Header2->srow_z[i32_Cnt];
+  }
+
+  ps_Header1->slice_code = ps_Header2->slice_code;
+  ps_Header1->xyzt_units = ps_Header2->xyzt_units;
+  ps_Header1->intent_code = ps_Header2->intent_code;
+  memcpy (ps_Header1->intent_name, ps_Header2->intent_name, sizeof (ps_Header1->intent_name));
+  ps_Header1->dim_info = ps_Header2->dim_info;
+}
+
+unsigned int
+ui32_NIFTII_BuildHeader (Serie *serie, short int b_SingleFile, unsigned char *pu8_Header)
+{
+  nifti_2_header ts_Header;
+
+  memset (&ts_Header, 0, sizeof (nifti_2_header));
+  memset (pu8_Header, 0, NII2_HEADER_SIZE);
+
+  v_NIFTII_FillHeader (serie, &ts_Header);
+
+  // A serie that came from a NIfTI-2 file is written as one again, and so
+  // is a serie with more timepoints than a NIfTI-1 header can describe.
+  if (serie->u8_NiftiVersion == 2 || serie->num_time_series > SHRT_MAX)
+  {
+    ts_Header.sizeof_hdr = NII2_MIN_HEADER_SIZE;
+    ts_Header.vox_offset = (b_SingleFile) ? NII2_HEADER_SIZE : 0;
+    memcpy (ts_Header.magic, (b_SingleFile) ? "n+2\0\r\n\032\n" : "ni2\0\r\n\032\n", 8);
+
+    memcpy (pu8_Header, &ts_Header, NII2_MIN_HEADER_SIZE);
+    return NII2_HEADER_SIZE;
+  }
+
+  nifti_1_header ts_Header1;
+  v_NIFTII_Header2To1 (&ts_Header, &ts_Header1);
+
+  ts_Header1.vox_offset = (b_SingleFile) ? NII_HEADER_SIZE : 0;
+  memcpy (ts_Header1.magic, (b_SingleFile) ? "n+1" : "ni1", 4);
+
+  memcpy (pu8_Header, &ts_Header1, MIN_HEADER_SIZE);
+  return NII_HEADER_SIZE;
+}
+
+unsigned long long
+ui64_NIFTII_GetMemoryInBlob (Serie *serie)
+{
+  return (unsigned long long)i16_NIFTII_GetMemorySizePerElement (serie->raw_data_type) *
+         serie->matrix.i16_x * serie->matrix.i16_y * serie->matrix.i16_z * serie->num_time_series;
 }
 
 void v_NIFTII_swap_2bytes( size_t n , void *ar )
@@ -468,6 +954,49 @@ void v_NIFTII_swap_header( struct nifti_1_header *h /*, int is_nifti*/ )
    return ;
 }
 
+void v_NIFTII_swap_header2( struct nifti_2_header *h )
+{
+   v_NIFTII_swap_4bytes(1, &h->sizeof_hdr);
+   v_NIFTII_swap_2bytes(1, &h->datatype);
+   v_NIFTII_swap_2bytes(1, &h->bitpix);
+
+   v_NIFTII_swap_8bytes(8, h->dim);
+   v_NIFTII_swap_8bytes(1, &h->intent_p1);
+   v_NIFTII_swap_8bytes(1, &h->intent_p2);
+   v_NIFTII_swap_8bytes(1, &h->intent_p3);
+   v_NIFTII_swap_8bytes(8, h->pixdim);
+
+   v_NIFTII_swap_8bytes(1, &h->vox_offset);
+   v_NIFTII_swap_8bytes(1, &h->scl_slope);
+   v_NIFTII_swap_8bytes(1, &h->scl_inter);
+   v_NIFTII_swap_8bytes(1, &h->cal_max);
+   v_NIFTII_swap_8bytes(1, &h->cal_min);
+   v_NIFTII_swap_8bytes(1, &h->slice_duration);
+   v_NIFTII_swap_8bytes(1, &h->toffset);
+   v_NIFTII_swap_8bytes(1, &h->slice_start);
+   v_NIFTII_swap_8bytes(1, &h->slice_end);
+
+   v_NIFTII_swap_4bytes(1, &h->qform_code);
+   v_NIFTII_swap_4bytes(1, &h->sform_code);
+
+   v_NIFTII_swap_8bytes(1, &h->quatern_b);
+   v_NIFTII_swap_8bytes(1, &h->quatern_c);
+   v_NIFTII_swap_8bytes(1, &h->quatern_d);
+   v_NIFTII_swap_8bytes(1, &h->qoffset_x);
+   v_NIFTII_swap_8bytes(1, &h->qoffset_y);
+   v_NIFTII_swap_8bytes(1, &h->qoffset_z);
+
+   v_NIFTII_swap_8bytes(4, h->srow_x);
+   v_NIFTII_swap_8bytes(4, h->srow_y);
+   v_NIFTII_swap_8bytes(4, h->srow_z);
+
+   v_NIFTII_swap_4bytes(1, &h->slice_code);
+   v_NIFTII_swap_4bytes(1, &h->xyzt_units);
+   v_NIFTII_swap_4bytes(1, &h->intent_code);
+
+   return ;
+}
+
 
 /*                                                                                                    */
 /*                                                                                                    */
@@ -484,11 +1013,11 @@ memory_io_niftii_file_type (const char *pc_File)
   //Check if file exists
   if (access (pc_File, F_OK) != 0) return 1;
 
-  nifti_1_header *ps_Header;
+  nifti_2_header *ps_Header;
   char ac_SwapHeaderImage[512];
   te_ImageIOFiletype e_FileType;
 
-  ps_Header = (nifti_1_header *)(calloc(1, sizeof (nifti_1_header)));
+  ps_Header = (nifti_2_header *)(calloc(1, sizeof (nifti_2_header)));
   e_FileType = MUMC_FILETYPE_NOT_KNOWN;
 
   // find extention in string
@@ -501,7 +1030,7 @@ memory_io_niftii_file_type (const char *pc_File)
   if ((!strcasecmp (ac_Extention, ".nii")) || (!strcasecmp (ac_Extention, ".hdr")))
   {
     //check if this file contains a valid header
-    if(b_NIFTII_ReadHeaderToMemory((char *)pc_File, ps_Header))
+    if(i16_NIFTII_ReadHeaderToMemory((char *)pc_File, ps_Header, NULL))
     {
       e_FileType= MUMC_FILETYPE_NOT_KNOWN;
     }
@@ -526,7 +1055,9 @@ memory_io_niftii_file_type (const char *pc_File)
   }
   else if (strcasecmp(ac_Extention, ".img")==0)
   {
-    strncpy(ac_SwapHeaderImage, pc_File, sizeof(ac_SwapHeaderImage));
+    // The type is in the header that belongs to the image.
+    snprintf (ac_SwapHeaderImage, sizeof (ac_SwapHeaderImage), "%.*s.hdr",
+              (int)(ac_Extention - pc_File), pc_File);
     e_FileType = memory_io_niftii_file_type (ac_SwapHeaderImage);
   }
   else if (strcasecmp(ac_Extention, ".dcm")==0)
@@ -544,8 +1075,112 @@ memory_io_niftii_file_type (const char *pc_File)
   return e_FileType;
 }
 
+// Swaps voxels to the native byte order, for the same types as
+// memory_serie_ingest_data() does.
+void
+v_NIFTII_SwapData (MemoryDataType e_DataType, unsigned long long ui64_Elements, void *pv_Data)
+{
+  switch (e_DataType)
+  {
+    case MEMORY_TYPE_INT16   :
+    case MEMORY_TYPE_UINT16  : v_NIFTII_swap_2bytes (ui64_Elements, pv_Data); break;
+    case MEMORY_TYPE_INT32   :
+    case MEMORY_TYPE_UINT32  :
+    case MEMORY_TYPE_FLOAT32 : v_NIFTII_swap_4bytes (ui64_Elements, pv_Data); break;
+    case MEMORY_TYPE_INT64   :
+    case MEMORY_TYPE_UINT64  :
+    case MEMORY_TYPE_FLOAT64 : v_NIFTII_swap_8bytes (ui64_Elements, pv_Data); break;
+    default                  : break;
+  }
+}
+
+short int
+i16_NIFTII_LoadLazySlice (Serie *serie, short int i16_Slice, unsigned short int u16_TimePoint, void *pv_Source)
+{
+  ts_NIFTII_SliceSource *ps_Source = pv_Source;
+  unsigned long long ui64_PixelsInSlice = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y;
+  unsigned long long ui64_MemoryPerSlice = ui64_PixelsInSlice * memory_serie_get_memory_space (serie);
+  unsigned char *pu8_Slice = (unsigned char *)serie->data +
+                             ((unsigned long long)u16_TimePoint * serie->matrix.i16_z + i16_Slice) * ui64_MemoryPerSlice;
+
+  if (!b_NIFTII_ReadVolumeToMemory (ps_Source->pc_FileName, ps_Source->ui64_Offset, ui64_MemoryPerSlice, pu8_Slice))
+    return 0;
+
+  if (ps_Source->b_Swapped)
+    v_NIFTII_SwapData (serie->data_type, ui64_PixelsInSlice, pu8_Slice);
+
+  return 1;
+}
+
+void
+v_NIFTII_DestroySliceSource (void *pv_Source)
+{
+  ts_NIFTII_SliceSource *ps_Source = pv_Source;
+
+  free (ps_Source->pc_FileName), ps_Source->pc_FileName = NULL;
+  free (ps_Source), ps_Source = NULL;
+}
+
+// Makes a serie read its slices from the image data at ui64_Offset in a
+// niftii file when they are needed.
+short int
+i16_NIFTII_SetLazy (Serie *serie, const char *pc_FileName, unsigned long long ui64_Offset, short int b_Swapped)
+{
+  unsigned int ui32_Slice, ui32_Slices = (unsigned int)serie->matrix.i16_z * serie->num_time_series;
+  unsigned long long ui64_MemoryPerSlice = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y *
+                                           memory_serie_get_memory_space (serie);
+  ts_NIFTII_SliceSource *ps_Source;
+  void **ppv_Sources;
+
+  ppv_Sources = calloc (ui32_Slices, sizeof (void *));
+  assert (ppv_Sources != NULL);
+
+  for (ui32_Slice = 0; ui32_Slice < ui32_Slices; ui32_Slice++)
+  {
+    ps_Source = calloc (1, sizeof (ts_NIFTII_SliceSource));
+    assert (ps_Source != NULL);
+
+    ps_Source->pc_FileName = calloc (1, strlen (pc_FileName) + 1);
+    assert (ps_Source->pc_FileName != NULL);
+    strcpy (ps_Source->pc_FileName, pc_FileName);
+
+    ps_Source->ui64_Offset = ui64_Offset + ui32_Slice * ui64_MemoryPerSlice;
+    ps_Source->b_Swapped = b_Swapped;
+    ppv_Sources[ui32_Slice] = ps_Source;
+  }
+
+  if (memory_serie_set_lazy (serie, i16_NIFTII_LoadLazySlice, ppv_Sources, v_NIFTII_DestroySliceSource) != 0)
+  {
+    for (ui32_Slice = 0; ui32_Slice < ui32_Slices; ui32_Slice++)
+      v_NIFTII_DestroySliceSource (ppv_Sources[ui32_Slice]);
+
+    free (ppv_Sources), ppv_Sources = NULL;
+    return 1;
+  }
+
+  return 0;
+}
+
 short int
 memory_io_niftii_load (Serie *serie, const char *pc_Filename, const char *pc_Image)
+{
+  return i16_NIFTII_Load (serie, pc_Filename, pc_Image, 0, 0);
+}
+
+short int
+memory_io_niftii_load_lazy (Serie *serie, const char *pc_Filename, const char *pc_Image)
+{
+  return i16_NIFTII_Load (serie, pc_Filename, pc_Image, 1, 0);
+}
+
+short int
+memory_io_niftii_load_streaming (Serie *serie, const char *pc_Filename, const char *pc_Image)
+{
+  return i16_NIFTII_Load (serie, pc_Filename, pc_Image, 1, 1);
+}
+
+short int
+i16_NIFTII_Load (Serie *serie, const char *pc_Filename, const char *pc_Image, short int b_Lazy, short int b_Streaming)
 {
   debug_functions ();
 
@@ -553,26 +1188,33 @@ memory_io_niftii_load (Serie *serie, const char *pc_Filename, const char *pc_Ima
 
   short int i16_BytesToRead;
   short int i16_wasSwapped=0;
-  int i32_PixelsInSlice, i32_MemoryPerSlice, i32_MemoryVolume;
+  short int i16_Version;
+  unsigned long long ui64_PixelsInSlice, ui64_MemoryPerSlice, ui64_MemoryVolume;
 
 
-  nifti_1_header *ps_Header;
-  ps_Header = (nifti_1_header *)(calloc (1, sizeof (nifti_1_header)));
+  nifti_2_header *ps_Header;
+  ps_Header = (nifti_2_header *)(calloc (1, sizeof (nifti_2_header)));
   if (ps_Header == NULL) return 0;
 
-  b_NIFTII_ReadHeaderToMemory ((char *)pc_Filename, ps_Header);
-  // check endiane
+  // NIfTI-1 headers are widened to NIfTI-2 headers, and swapped to the
+  // native byte order.
+  i16_Version = i16_NIFTII_ReadHeaderToMemory ((char *)pc_Filename, ps_Header, &i16_wasSwapped);
 
-  if (ps_Header->sizeof_hdr == 1543569408)
+  if ((i16_Version != 0) && (ps_Header->intent_code == NIFTI_INTENT_NONE))
   {
-    v_NIFTII_swap_header(ps_Header);
-    i16_wasSwapped=1;
-  }
+    if (ps_Header->dim[1] < 1 || ps_Header->dim[1] > SHRT_MAX
+        || ps_Header->dim[2] < 1 || ps_Header->dim[2] > SHRT_MAX
+        || ps_Header->dim[3] < 1 || ps_Header->dim[3] > SHRT_MAX
+        || ps_Header->dim[4] > USHRT_MAX)
+    {
+      debug_error ("The dimensions of '%s' are not supported.", pc_Filename);
+      free (ps_Header), ps_Header = NULL;
+      return 0;
+    }
 
-  if ((ps_Header->sizeof_hdr == MIN_HEADER_SIZE) && (ps_Header->intent_code == NIFTI_INTENT_NONE))
-  {
 //    serie->pv_Header = ps_Header;
     serie->e_SerieType = SERIE_ORIGINAL;
+    serie->u8_NiftiVersion = i16_Version;
     serie->matrix.i16_x = ps_Header->dim[1];
     serie->matrix.i16_y = ps_Header->dim[2];
     serie->matrix.i16_z = ps_Header->dim[3];
@@ -580,7 +1222,7 @@ memory_io_niftii_load (Serie *serie, const char *pc_Filename, const char *pc_Ima
 
 
 
-    serie->num_time_series = ps_Header->dim[4];
+    serie->num_time_series = (ps_Header->dim[0] < 4 || ps_Header->dim[4] < 1) ? 1 : ps_Header->dim[4];
 
 
     if ((ps_Header->pixdim[0] == -1) || (ps_Header->pixdim[0] == 1))
@@ -610,9 +1252,9 @@ memory_io_niftii_load (Serie *serie, const char *pc_Filename, const char *pc_Ima
     serie->input_type=memory_io_niftii_file_type((char *)pc_Filename);
 
     // check if niftii is true niftii or analyze file
-    if (memcmp(ps_Header->magic, "n+1\0", 4) == 0)
+    if (memcmp(ps_Header->magic, "n+1\0", 4) == 0 || memcmp(ps_Header->magic, "n+2\0", 4) == 0)
     {
-      //File is in a niftii1 format read quaternions en standard space matrix
+      //File is in a niftii format read quaternions en standard space matrix
 
       serie->i16_QuaternionCode = ps_Header->qform_code;
 
@@ -698,30 +1340,54 @@ memory_io_niftii_load (Serie *serie, const char *pc_Filename, const char *pc_Ima
 
     i16_BytesToRead = i16_NIFTII_GetMemorySizePerElement (ps_Header->datatype);
 
-    i32_PixelsInSlice = serie->matrix.i16_x * serie->matrix.i16_y;
-    i32_MemoryPerSlice = i16_BytesToRead * i32_PixelsInSlice;
-    i32_MemoryVolume = i32_MemoryPerSlice * serie->matrix.i16_z * serie->num_time_series;
+    ui64_PixelsInSlice = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y;
+    ui64_MemoryPerSlice = i16_BytesToRead * ui64_PixelsInSlice;
+    ui64_MemoryVolume = ui64_MemoryPerSlice * serie->matrix.i16_z * serie->num_time_series;
 
 
-    serie->data = calloc (1, i32_MemoryVolume);
+    unsigned long long ui64_Offset;
+    unsigned long long ui64_HeaderSize = (i16_Version == 2) ? NII2_HEADER_SIZE : NII_HEADER_SIZE;
+    const char *pc_DataFile = (pc_Image == NULL) ? pc_Filename : pc_Image;
+
+    if (pc_Image==NULL)
+    {
+      // Image and header file are the same. Header extensions, if any,
+      // lie between the header and vox_offset.
+      ui64_Offset = (ps_Header->vox_offset >= (long long)ui64_HeaderSize)
+                    ? (unsigned long long)ps_Header->vox_offset
+                    : ui64_HeaderSize;
+    }
+    else
+      ui64_Offset = (ps_Header->vox_offset > 0) ? (unsigned long long)ps_Header->vox_offset : 0;
+
     serie->pv_OutOfBlobValue = calloc (1, i16_BytesToRead);
 
+    // A streaming serie reads its slices straight from the file whenever
+    // they are needed, so the volume is never allocated as a whole.
+    if (b_Streaming && i16_NIFTII_SetLazy (serie, pc_DataFile, ui64_Offset, i16_wasSwapped) == 0)
+    {
+      free (ps_Header), ps_Header = NULL;
+      return 1;
+    }
+
+    serie->data = calloc (1, ui64_MemoryVolume);
+
     if (serie->data != NULL)
     {
-      int i32_Offset;
-      if (pc_Image==NULL)
+      // A lazy serie swaps and ranges its slices as they are read.
+      if (b_Lazy && i16_NIFTII_SetLazy (serie, pc_DataFile, ui64_Offset, i16_wasSwapped) == 0)
       {
-        // Image and header file are the same;
-        i32_Offset=352;
-        b_NIFTII_ReadVolumeToMemory ((char *)pc_Filename, i32_Offset, i32_MemoryVolume, serie->data);
-
-        if (i16_wasSwapped)
-        {
-          v_NIFTII_convert_data_big_to_little_endian(serie);
-        }
+        free (ps_Header), ps_Header = NULL;
+        return 1;
       }
+
+      b_NIFTII_ReadVolumeToMemory (pc_DataFile, ui64_Offset, ui64_MemoryVolume, serie->data);
     }
-    memory_serie_set_upper_and_lower_borders_from_data(serie);
+
+    free (ps_Header), ps_Header = NULL;
+
+    // Swap the data to the native byte order and find its range in one go.
+    memory_serie_ingest_data (serie, i16_wasSwapped);
     return 1;
   }
 
@@ -732,95 +1398,217 @@ memory_io_niftii_load (Serie *serie, const char *pc_Filename, const char *pc_Ima
     #endif
   }
 
+  free (ps_Header), ps_Header = NULL;
   return 0;
 }
 
 short int
 memory_io_niftii_save (Serie *serie, const char *pc_File, const char *pc_ImageFile)
+{
+  return memory_io_niftii_save_with_progress (serie, pc_File, pc_ImageFile, NULL);
+}
+
+short int
+memory_io_niftii_save_with_progress (Serie *serie, const char *pc_File, const char *pc_ImageFile,
+                                     unsigned long long *pui64_BytesWritten)
 {
   debug_functions ();
 
-  short int i16_BytesToWrite;
-  int i32_PixelsInSlice, i32_MemoryPerSlice, i32_MemoryVolume, i32_MemoryInBlob;
+  short int b_Success;
+  unsigned long long ui64_MemoryInBlob;
+  unsigned char pu8_Header[NII2_HEADER_SIZE];
+  unsigned int ui32_HeaderSize;
 
-  nifti_1_header *ps_Header;
-  ps_Header = calloc (1, NII_HEADER_SIZE);
-  if (ps_Header == NULL) return 1;
+  ui64_MemoryInBlob = ui64_NIFTII_GetMemoryInBlob (serie);
 
-  ps_Header->sizeof_hdr = MIN_HEADER_SIZE;
+  // If the File should be saved as two files
+  if (pc_ImageFile == NULL)
+  {
+    ui32_HeaderSize = ui32_NIFTII_BuildHeader (serie, 1, pu8_Header);
+    b_Success = b_NIFTII_WriteFile (pc_File, pu8_Header, ui32_HeaderSize, serie, ui64_MemoryInBlob, pui64_BytesWritten);
+  }
+  else
+  {
+    ui32_HeaderSize = ui32_NIFTII_BuildHeader (serie, 0, pu8_Header);
+    b_Success = b_NIFTII_WriteFile (pc_File, pu8_Header, ui32_HeaderSize, NULL, 0, pui64_BytesWritten)
+             && b_NIFTII_WriteFile (pc_ImageFile, NULL, 0, serie, ui64_MemoryInBlob, pui64_BytesWritten);
+  }
 
-  ps_Header->dim[0] = (serie->num_time_series>1) ? 4 : 3;
-  ps_Header->dim[1] = serie->matrix.i16_x;
-  ps_Header->dim[2] = serie->matrix.i16_y;
-  ps_Header->dim[3] = serie->matrix.i16_z;
-  ps_Header->dim[4] = serie->num_time_series;
+  return (b_Success) ? 0 : 1;
+}
 
-  ps_Header->pixdim[1] = serie->pixel_dimension.x;
-  ps_Header->pixdim[2] = serie->pixel_dimension.y;
-  ps_Header->pixdim[3] = serie->pixel_dimension.z;
 
-  ps_Header->scl_slope = serie->slope;
-  ps_Header->scl_inter = serie->offset;
+short int
+memory_io_niftii_update (Serie *serie, const char *pc_File, unsigned long long *pui64_BytesWritten)
+{
+  debug_functions ();
 
-  ps_Header->qform_code = serie->i16_QuaternionCode;
-  ps_Header->quatern_b = serie->ps_Quaternion->I;
-  ps_Header->quatern_c = serie->ps_Quaternion->J;
-  ps_Header->quatern_d = serie->ps_Quaternion->K;
+  int i32_File;
+  struct stat statbuf;
+  unsigned long long ui64_MemoryInBlob, ui64_Slabs, ui64_Slab, ui64_Start, ui64_End, ui64_Chunk;
+  unsigned char *pu8_Chunk = NULL;
+  unsigned char pc_Existing[NII2_HEADER_SIZE];
+  unsigned char pu8_Header[NII2_HEADER_SIZE];
+  unsigned int ui32_HeaderSize;
+  short int b_Success = 1;
 
-  ps_Header->qoffset_x = serie->ps_QuaternationOffset->I;
-  ps_Header->qoffset_y = serie->ps_QuaternationOffset->J;
-  ps_Header->qoffset_z = serie->ps_QuaternationOffset->K;
+  if (serie == NULL || serie->pu8_DirtySlabs == NULL) return 1;
 
-  ps_Header->pixdim[0] = serie->d_Qfac;
+  ui32_HeaderSize = ui32_NIFTII_BuildHeader (serie, 1, pu8_Header);
+  ui64_MemoryInBlob = ui64_NIFTII_GetMemoryInBlob (serie);
 
-  ps_Header->sform_code = serie->i16_StandardSpaceCode;
+  i32_File = open (pc_File, O_RDWR);
+  if (i32_File < 0)
+    return 1;
 
-  ps_Header->srow_x[0] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[0][0];
-  ps_Header->srow_x[1] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[1][0];
-  ps_Header->srow_x[2] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[2][0];
-  ps_Header->srow_x[3] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[3][0];
+  // The file can only be patched when it has the exact same layout as the
+  // one we would write. Otherwise the geometry or the type changed, and the
+  // whole file has to be written again.
+  if (fstat (i32_File, &statbuf) != 0
+      || (unsigned long long)statbuf.st_size != ui32_HeaderSize + ui64_MemoryInBlob
+      || pread (i32_File, pc_Existing, ui32_HeaderSize, 0) != (ssize_t)ui32_HeaderSize
+      || memcmp (pc_Existing, pu8_Header, ui32_HeaderSize) != 0)
+  {
+    debug_extra ("The layout of '%s' changed. Writing the complete file.", pc_File);
+    close (i32_File);
+    return 1;
+  }
 
-  ps_Header->srow_y[0] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[0][1];
-  ps_Header->srow_y[1] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[1][1];
-  ps_Header->srow_y[2] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[2][1];
-  ps_Header->srow_y[3] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[3][1];
+  if (!memory_serie_has_linear_data (serie))
+  {
+    pu8_Chunk = malloc (NIFTII_WRITE_CHUNK_SIZE);
+    if (pu8_Chunk == NULL)
+    {
+      close (i32_File);
+      return 1;
+    }
+  }
 
-  ps_Header->srow_z[0] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[0][2];
-  ps_Header->srow_z[1] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[1][2];
-  ps_Header->srow_z[2] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[2][2];
-  ps_Header->srow_z[3] = serie->t_StandardSpaceIJKtoXYZ.af_Matrix[3][2];
+  // Write each run of consecutive dirty slabs with a single call.
+  ui64_Slabs = (ui64_MemoryInBlob + SERIE_DIRTY_SLAB_SIZE - 1) / SERIE_DIRTY_SLAB_SIZE;
+  for (ui64_Slab = 0; b_Success && ui64_Slab < ui64_Slabs; ui64_Slab++)
+  {
+    if (!serie->pu8_DirtySlabs[ui64_Slab]) continue;
 
+    ui64_Start = ui64_Slab * SERIE_DIRTY_SLAB_SIZE;
+    while (ui64_Slab + 1 < ui64_Slabs && serie->pu8_DirtySlabs[ui64_Slab + 1])
+      ui64_Slab++;
 
-  ps_Header->datatype = i16_NIFTII_ConvertMemoryDataTypeToNIFTII(serie->data_type);
-  ps_Header->bitpix = i16_NIFTII_GetBitPix (serie->raw_data_type);
+    ui64_End = (ui64_Slab + 1) * SERIE_DIRTY_SLAB_SIZE;
+    if (ui64_End > ui64_MemoryInBlob)
+      ui64_End = ui64_MemoryInBlob;
 
-  i16_BytesToWrite = i16_NIFTII_GetMemorySizePerElement (serie->raw_data_type);
-  i32_PixelsInSlice = serie->matrix.i16_x * serie->matrix.i16_y;
-  i32_MemoryPerSlice = i16_BytesToWrite * i32_PixelsInSlice;
-  i32_MemoryVolume = i32_MemoryPerSlice * serie->matrix.i16_z;
-  i32_MemoryInBlob = i32_MemoryVolume * serie->num_time_series;
+    if (pu8_Chunk == NULL)
+      b_Success = b_NIFTII_PwriteAll (i32_File, (char *)serie->data + ui64_Start, ui64_End - ui64_Start,
+                                      ui32_HeaderSize + ui64_Start, pui64_BytesWritten);
 
-  // If the File should be saved as two files
-  if (pc_ImageFile == NULL)
+    // Data that is not in memory in linear order is read a chunk at a time.
+    for (; b_Success && pu8_Chunk != NULL && ui64_Start < ui64_End; ui64_Start += ui64_Chunk)
+    {
+      ui64_Chunk = ui64_End - ui64_Start;
+      if (ui64_Chunk > NIFTII_WRITE_CHUNK_SIZE)
+        ui64_Chunk = NIFTII_WRITE_CHUNK_SIZE;
+
+      b_Success = (memory_serie_read_linear (serie, ui64_Start, ui64_Chunk, pu8_Chunk) == 0)
+               && b_NIFTII_PwriteAll (i32_File, pu8_Chunk, ui64_Chunk, ui32_HeaderSize + ui64_Start,
+                                      pui64_BytesWritten);
+    }
+  }
+
+  free (pu8_Chunk), pu8_Chunk = NULL;
+
+  if (b_Success && fdatasync (i32_File) != 0)
+    b_Success = 0;
+
+  if (close (i32_File) != 0)
+    b_Success = 0;
+
+  if (!b_Success)
   {
-    ps_Header->vox_offset = NII_HEADER_SIZE;
-    memccpy (ps_Header->magic, "n+1", 1, 3);
+    debug_error ("Error while updating the file '%s'.", pc_File);
+    return 1;
+  }
+
+  return 0;
+}
+
 
-    b_NIFTII_WriteHeaderToFile (pc_File, ps_Header);
-    b_NIFTII_WriteImageToFile (pc_File, 1, i32_MemoryInBlob, NII_HEADER_SIZE, serie->data);
+short int
+memory_io_niftii_save_compressed (Serie *serie, const char *pc_File, int i32_Level,
+                                  unsigned long long *pui64_BytesWritten)
+{
+  debug_functions ();
+
+  char *pc_TemporaryName;
+  int i32_File;
+  short int b_Success;
+  unsigned char *pu8_Member = NULL;
+  unsigned long ul_MemberSize = 0;
+  unsigned long long ui64_Members, ui64_Batch, ui64_Member, ui64_InBatch;
+  ts_NIFTII_CompressJob ts_Job;
+  unsigned char pu8_Header[NII2_HEADER_SIZE];
+  unsigned int ui32_HeaderSize;
+
+  ui32_HeaderSize = ui32_NIFTII_BuildHeader (serie, 1, pu8_Header);
+
+  memset (&ts_Job, 0, sizeof (ts_NIFTII_CompressJob));
+  ts_Job.ps_Serie = serie;
+  ts_Job.pu8_Data = (memory_serie_has_linear_data (serie)) ? serie->data : NULL;
+  ts_Job.ui64_DataSize = ui64_NIFTII_GetMemoryInBlob (serie);
+  ts_Job.i32_Level = i32_Level;
+  ts_Job.pui64_BytesWritten = pui64_BytesWritten;
+
+  ui64_Members = (ts_Job.ui64_DataSize + NIFTII_GZIP_MEMBER_SIZE - 1) / NIFTII_GZIP_MEMBER_SIZE;
+  ui64_Batch = common_thread_number_of_workers () * NIFTII_GZIP_MEMBERS_PER_WORKER;
+
+  ts_Job.ppu8_Members = calloc (ui64_Batch, sizeof (unsigned char *));
+  ts_Job.pul_MemberSizes = calloc (ui64_Batch, sizeof (unsigned long));
+  assert (ts_Job.ppu8_Members != NULL && ts_Job.pul_MemberSizes != NULL);
+
+  i32_File = i32_NIFTII_CreateTemporaryFile (pc_File, &pc_TemporaryName);
+  if (i32_File < 0)
+  {
+    free (ts_Job.ppu8_Members);
+    free (ts_Job.pul_MemberSizes);
+    return 1;
   }
-  else
+
+  // The header goes into a member of its own, so that the members of the
+  // image data all start at a multiple of NIFTII_GZIP_MEMBER_SIZE.
+  b_Success = b_NIFTII_DeflateMember (pu8_Header, ui32_HeaderSize, i32_Level, &pu8_Member, &ul_MemberSize)
+           && b_NIFTII_WriteAll (i32_File, pu8_Member, ul_MemberSize, NULL);
+
+  free (pu8_Member), pu8_Member = NULL;
+
+  // Deflate a batch of members in parallel, and append them to the file in
+  // order. Gzip readers simply concatenate the output of all members.
+  for (ts_Job.ui64_FirstMember = 0;
+       b_Success && ts_Job.ui64_FirstMember < ui64_Members;
+       ts_Job.ui64_FirstMember += ui64_Batch)
   {
-    ps_Header->vox_offset = 0;
-    memccpy (ps_Header->magic, "ni1", 1, 3);
+    ui64_InBatch = ui64_Members - ts_Job.ui64_FirstMember;
+    if (ui64_InBatch > ui64_Batch)
+      ui64_InBatch = ui64_Batch;
+
+    common_thread_parallel_for (ui64_InBatch, 1, 0, v_NIFTII_CompressMembers, &ts_Job);
+
+    for (ui64_Member = 0; ui64_Member < ui64_InBatch; ui64_Member++)
+    {
+      if (b_Success && !ts_Job.b_Failed)
+        b_Success = b_NIFTII_WriteAll (i32_File, ts_Job.ppu8_Members[ui64_Member],
+                                       ts_Job.pul_MemberSizes[ui64_Member], NULL);
+
+      free (ts_Job.ppu8_Members[ui64_Member]), ts_Job.ppu8_Members[ui64_Member] = NULL;
+    }
 
-    b_NIFTII_WriteHeaderToFile (pc_File, ps_Header);
-    b_NIFTII_WriteImageToFile (pc_ImageFile, 1, i32_MemoryInBlob, 0, serie->data);
+    if (ts_Job.b_Failed)
+      b_Success = 0;
   }
 
-  free (ps_Header);
-  ps_Header = NULL;
+  free (ts_Job.ppu8_Members), ts_Job.ppu8_Members = NULL;
+  free (ts_Job.pul_MemberSizes), ts_Job.pul_MemberSizes = NULL;
 
-  return 0;
-}
+  b_Success = b_NIFTII_CommitTemporaryFile (pc_File, pc_TemporaryName, i32_File, b_Success);
 
+  return (b_Success) ? 0 : 1;
+}
@@ -0,0 +1,75 @@
+/** \file nifti2.h
+    \brief Definition of the nifti2 header, as laid down by the Data Format
+           Working Group of the NIfTI initiative (2011).
+
+    The NIFTI-2 header carries the same information as the NIFTI-1 header
+    (see nifti1.h, whose datatype, intent and xform codes apply unchanged),
+    but widens the dimensions and the data offset to 64 bits and stores all
+    floating point fields in double precision. A number of ANALYZE 7.5
+    leftovers are dropped, and the fields are reordered for alignment.
+ */
+
+#ifndef _NIFTI2_HEADER_
+#define _NIFTI2_HEADER_
+
+#include <stdint.h>
+
+/*---------------------------------------------------------------------------*/
+/* HEADER STRUCT DECLARATION:
+   -------------------------
+   The header is 540 bytes long, and is followed by a 4 byte extension
+   flag, as in NIFTI-1. In a single file (.nii) the data starts at
+   vox_offset, which is at least 544.
+
+   The magic field is "n+2\0\r\n\032\n" for single file datasets and
+   "ni2\0\r\n\032\n" for datasets with a separate .img file. The trailing
+   bytes catch files that went through a text-mode transfer.
+-----------------------------------------------------------------------------*/
+
+#pragma pack(push, 1)
+
+struct nifti_2_header {  /* NIFTI-2 usage           */  /* offset */
+   int32_t sizeof_hdr;   /*!< MUST be 540            */  /*    0   */
+   char    magic[8];     /*!< MUST be valid signature*/  /*    4   */
+   int16_t datatype;     /*!< Defines data type!     */  /*   12   */
+   int16_t bitpix;       /*!< Number bits/voxel.     */  /*   14   */
+   int64_t dim[8];       /*!< Data array dimensions. */  /*   16   */
+   double  intent_p1;    /*!< 1st intent parameter.  */  /*   80   */
+   double  intent_p2;    /*!< 2nd intent parameter.  */  /*   88   */
+   double  intent_p3;    /*!< 3rd intent parameter.  */  /*   96   */
+   double  pixdim[8];    /*!< Grid spacings.         */  /*  104   */
+   int64_t vox_offset;   /*!< Offset into .nii file  */  /*  168   */
+   double  scl_slope;    /*!< Data scaling: slope.   */  /*  176   */
+   double  scl_inter;    /*!< Data scaling: offset.  */  /*  184   */
+   double  cal_max;      /*!< Max display intensity  */  /*  192   */
+   double  cal_min;      /*!< Min display intensity  */  /*  200   */
+   double  slice_duration;/*!< Time for 1 slice.     */  /*  208   */
+   double  toffset;      /*!< Time axis shift.       */  /*  216   */
+   int64_t slice_start;  /*!< First slice index.     */  /*  224   */
+   int64_t slice_end;    /*!< Last slice index.      */  /*  232   */
+   char    descrip[80];  /*!< any text you like.     */  /*  240   */
+   char    aux_file[24]; /*!< auxiliary filename.    */  /*  320   */
+   int32_t qform_code;   /*!< NIFTI_XFORM_* code.    */  /*  344   */
+   int32_t sform_code;   /*!< NIFTI_XFORM_* code.    */  /*  348   */
+   double  quatern_b;    /*!< Quaternion b param.    */  /*  352   */
+   double  quatern_c;    /*!< Quaternion c param.    */  /*  360   */
+   double  quatern_d;    /*!< Quaternion d param.    */  /*  368   */
+   double  qoffset_x;    /*!< Quaternion x shift.    */  /*  376   */
+   double  qoffset_y;    /*!< Quaternion y shift.    */  /*  384   */
+   double  qoffset_z;    /*!< Quaternion z shift.    */  /*  392   */
+   double  srow_x[4];    /*!< 1st row affine transform. */  /*  400 */
+   double  srow_y[4];    /*!< 2nd row affine transform. */  /*  432 */
+   double  srow_z[4];    /*!< 3rd row affine transform. */  /*  464 */
+   int32_t slice_code;   /*!< Slice timing order.    */  /*  496   */
+   int32_t xyzt_units;   /*!< Units of pixdim[1..4]  */  /*  500   */
+   int32_t intent_code;  /*!< NIFTI_INTENT_* code.   */  /*  504   */
+   char    intent_name[16]; /*!< 'name' or meaning of data. */ /* 508 */
+   char    dim_info;     /*!< MRI slice ordering.    */  /*  524   */
+   char    unused_str[15]; /*!< unused, filled with \0 */ /* 525   */
+} ;                      /**** 540 bytes total ****/
+
+#pragma pack(pop)
+
+typedef struct nifti_2_header nifti_2_header ;
+
+#endif /* _NIFTI2_HEADER_ */
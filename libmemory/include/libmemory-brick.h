@@ -0,0 +1,270 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMORY_BRICK_H
+#define MEMORY_BRICK_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libmemory.h"
+#include "libmemory-serie.h"
+
+#include <pthread.h>
+
+#define BRICK_DEFAULT_SIZE       32                        /*! Voxels along each edge of a brick. */
+#define BRICK_DEFAULT_BUDGET     (1024ULL * 1024 * 1024)   /*! Bytes of bricks to keep in memory. */
+#define BRICK_FILE_EXTENSION     ".clmvb"
+
+
+/**
+ * @file   include/libmemory-brick.h
+ * @brief  An on-disk cache of a Serie, stored in bricks that are loaded on demand.
+ * @author Roel Janssen
+ */
+
+
+/**
+ * @ingroup memory
+ * @{
+ *   @defgroup memory_brick Brick
+ *   @{
+ *
+ * This module stores the volume of a Serie in fixed-size 3D bricks on disk,
+ * each optionally deflate-compressed, behind an index of all bricks. A Serie
+ * that is backed by such a file has no 'data' of its own. Instead, bricks are
+ * read from disk when a voxel inside them is needed, and kept in a cache
+ * that drops the least recently used bricks when it grows over its budget.
+ *
+ * This allows viewing volumes that do not fit into memory.
+ */
+
+
+/**
+ * A brick that is currently held in memory.
+ */
+typedef struct s_CachedBrick
+{
+  unsigned long long ui64_Brick;
+  struct s_CachedBrick *ps_Previous;
+  struct s_CachedBrick *ps_Next;
+  unsigned char pu8_Data[];
+} CachedBrick;
+
+
+/**
+ * A voxel to read with memory_brick_read_voxels(), and where to store its
+ * value.
+ */
+typedef struct s_BrickVoxel
+{
+  short int i16_X;
+  short int i16_Y;
+  short int i16_Z;
+  void *pv_Value;
+} BrickVoxel;
+
+
+/**
+ * This structure describes an opened brick file and its cache.
+ */
+typedef struct s_BrickCache
+{
+  /**
+   * The file descriptor of the brick file.
+   */
+  int i32_File;
+
+  /**
+   * The number of voxels along each edge of a brick.
+   */
+  unsigned int ui32_BrickSize;
+
+  /**
+   * The size of the volume, and the number of bricks along each axis.
+   */
+  ts_Coordinate3DInt ts_Matrix;
+  unsigned short int u16_NumberOfTimeSeries;
+  unsigned int ui32_BricksX;
+  unsigned int ui32_BricksY;
+  unsigned int ui32_BricksZ;
+  unsigned long long ui64_NumberOfBricks;
+
+  /**
+   * The number of bytes per voxel and per uncompressed brick.
+   */
+  unsigned int ui32_ElementSize;
+  unsigned long long ui64_BrickBytes;
+
+  /**
+   * Where each brick is in the file, and how many bytes it takes there.
+   * A length equal to ui64_BrickBytes means the brick is not compressed.
+   */
+  unsigned long long *pui64_Offsets;
+  unsigned int *pui32_Lengths;
+
+  /**
+   * The bricks in memory, indexed by brick number, and the same bricks in
+   * order of use. The head of the list is the most recently used brick.
+   */
+  CachedBrick **pps_Resident;
+  CachedBrick *ps_MostRecent;
+  CachedBrick *ps_LeastRecent;
+
+  /**
+   * The number of bytes that may be held in memory, and that are.
+   */
+  unsigned long long ui64_MemoryBudget;
+  unsigned long long ui64_MemoryInUse;
+
+  /**
+   * Where the memory of the cached bricks is counted. The cache also gives
+   * bricks back when the program is over its budget.
+   */
+  Accounting *ps_Accounting;
+
+  /**
+   * The number of brick lookups that found their brick in memory, and the
+   * number that had to read it from disk.
+   */
+  unsigned long long ui64_Hits;
+  unsigned long long ui64_Misses;
+
+  pthread_mutex_t t_Lock;
+} BrickCache;
+
+
+/**
+ * This function writes the volume of a Serie to a brick file. The Serie is
+ * read one slab of bricks at a time with memory_serie_read_linear(), so it
+ * does not have to be in memory as a whole.
+ *
+ * @param serie               The Serie to write.
+ * @param pc_Path             The file to write.
+ * @param b_Compress          1 to deflate the bricks, 0 to store them as they are.
+ * @param pui64_BytesWritten  Counter that is atomically increased with every converted brick, or NULL.
+ *
+ * @return 0 when the file has been written, 1 otherwise.
+ */
+short int memory_brick_write (Serie *serie, const char *pc_Path, short int b_Compress,
+                              unsigned long long *pui64_BytesWritten);
+
+
+/**
+ * This function opens a brick file and fills in the properties of a Serie
+ * from it. The Serie is backed by the returned cache from then on.
+ *
+ * @param serie              The Serie to fill in.
+ * @param pc_Path            The brick file to open.
+ * @param ui64_MemoryBudget  The number of bytes of bricks to keep in memory.
+ *
+ * @return The cache for the file, or NULL when it cannot be opened.
+ */
+BrickCache *memory_brick_open (Serie *serie, const char *pc_Path, unsigned long long ui64_MemoryBudget);
+
+
+/**
+ * This function opens the brick file of a cache once more, with a cache of
+ * its own, so that another Serie can read it independently. The bricks
+ * stay readable even when the file is replaced in the meantime.
+ *
+ * @param ps_Cache  The cache of the file to open again.
+ * @param serie     The Serie that the new cache is for. Its properties are
+ *                  not changed.
+ *
+ * @return The new cache, or NULL when the file cannot be opened again.
+ */
+BrickCache *memory_brick_reopen (BrickCache *ps_Cache, Serie *serie);
+
+
+/**
+ * This function copies the value of one voxel out of a brick file, loading
+ * the brick that holds it when it is not in memory.
+ *
+ * @param ps_Cache  The cache to read from.
+ * @param i16_X     The x-coordinate of the voxel.
+ * @param i16_Y     The y-coordinate of the voxel.
+ * @param i16_Z     The z-coordinate of the voxel.
+ * @param u16_T     The timepoint of the voxel.
+ * @param pv_Value  Where to store the value, which takes ui32_ElementSize bytes.
+ *
+ * @return 1 on success, 0 when the voxel could not be read.
+ */
+short int memory_brick_read_voxel (BrickCache *ps_Cache, short int i16_X, short int i16_Y,
+                                   short int i16_Z, unsigned short int u16_T, void *pv_Value);
+
+
+/**
+ * This function copies a run of voxels along the x-axis out of a brick file.
+ * The cache is locked once for the whole run, and each brick the run passes
+ * through is looked up once.
+ *
+ * @param ps_Cache     The cache to read from.
+ * @param i16_X        The x-coordinate of the first voxel.
+ * @param i16_Y        The y-coordinate of the voxels.
+ * @param i16_Z        The z-coordinate of the voxels.
+ * @param u16_T        The timepoint of the voxels.
+ * @param ui32_Voxels  The number of voxels to read.
+ * @param pv_Values    Where to store the values, ui32_ElementSize bytes each.
+ *
+ * @return The number of voxels that were read. This is less than asked for
+ *         at the edge of the volume, or when a brick could not be read.
+ */
+unsigned int memory_brick_read_row (BrickCache *ps_Cache, short int i16_X, short int i16_Y,
+                                    short int i16_Z, unsigned short int u16_T,
+                                    unsigned int ui32_Voxels, void *pv_Values);
+
+
+/**
+ * This function copies a number of voxels of one timepoint out of a brick
+ * file, under a single lock of the cache. A brick is only looked up again
+ * when a voxel lies in another brick than the one before it.
+ *
+ * @param ps_Cache     The cache to read from.
+ * @param u16_T        The timepoint of the voxels.
+ * @param ps_Voxels    The voxels to read, and where to store their values.
+ * @param ui32_Voxels  The number of voxels.
+ *
+ * @return The number of voxels that were read. The value of a voxel that
+ *         lies outside the volume, or that could not be read, is left as
+ *         it was.
+ */
+unsigned int memory_brick_read_voxels (BrickCache *ps_Cache, unsigned short int u16_T,
+                                       BrickVoxel *ps_Voxels, unsigned int ui32_Voxels);
+
+
+/**
+ * This function closes a brick file and frees its cache.
+ *
+ * @param ps_Cache  The cache to close.
+ */
+void memory_brick_close (BrickCache *ps_Cache);
+
+
+/**
+ *   @}
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//MEMORY_BRICK_H
@@ -25,6 +25,8 @@
 #include "libio-nifti.h"
 #include "libio-dicom.h"
 
+#include <pthread.h>
+
 
 /**
  * @file   include/lib-memory-io.h
@@ -59,16 +61,273 @@ Tree *pt_memory_io_load_file (Tree **ppt_study, char *pc_path);
 //short int memory_io_load_file (Tree **patient_tree, char *path, Serie **pp_serie);
 
 /**
- * This function saves a serie to a file.
+ * This function sets the compression level used for .nii.gz files.
+ *
+ * @param i32_Level  A zlib compression level from 0 (none) to 9 (best),
+ *                   or -1 for zlib's default.
+ */
+void memory_io_set_compression_level (int i32_Level);
+
+
+/**
+ * This function returns the compression level used for .nii.gz files.
+ *
+ * @return The zlib compression level.
+ */
+int memory_io_get_compression_level ();
+
+
+/**
+ * This function sets the number of bytes that a Serie which is loaded from
+ * a brick file may keep in memory. It applies to files loaded afterwards.
+ *
+ * @param ui64_Bytes  The memory budget in bytes.
+ */
+void memory_io_set_brick_memory_budget (unsigned long long ui64_Bytes);
+
+
+/**
+ * This function saves a serie to a file. The extension of the path picks
+ * the format: ".nii" for a single-file niftii, ".gz" for a compressed one,
+ * ".hdr" or ".img" for a niftii pair and BRICK_FILE_EXTENSION for a brick
+ * file, which is compressed unless the compression level is 0. A path
+ * without an extension gets the one of the format the serie was loaded
+ * from.
  *
  * @param serie  The serie to save to disk.
  * @param path   A valid filename.
  *
- * @return 1 on success, 0 on failure.
+ * @return 0 on success, 1 on failure or for an unknown format.
  */
 short int memory_io_save_file (Serie *serie, const char *path);
 
 
+/**
+ * This structure keeps track of a save that runs in the background.
+ */
+typedef struct
+{
+  /**
+   * The serie that is being saved, and the copy of it that is being written.
+   */
+  Serie *ps_Serie;
+  Serie *ps_Snapshot;
+
+  /**
+   * The path to write to.
+   */
+  char *pc_Path;
+
+  /**
+   * The file or directory that is converted, when the job converts rather
+   * than saves a serie. See memory_io_convert_file_async().
+   */
+  char *pc_Source;
+
+  /**
+   * The number of bytes of image data written so far, and in total.
+   */
+  unsigned long long ui64_BytesWritten;
+  unsigned long long ui64_BytesTotal;
+
+  /**
+   * Set when the writer is done, and the result of the save.
+   */
+  short int b_Finished;
+  short int i16_Result;
+
+  /**
+   * The thread that writes the snapshot, and the number of workers it may
+   * use, which is that of the thread that started the job.
+   */
+  pthread_t t_Thread;
+  unsigned int ui32_Workers;
+  short int b_Joined;
+} SaveJob;
+
+
+/**
+ * This function takes a snapshot of a serie and saves it to a file from a
+ * background thread. The serie can be modified as soon as this function
+ * returns, but it must stay alive until memory_io_save_job_finish() is called.
+ *
+ * @param serie  The serie to save to disk.
+ * @param path   A valid filename.
+ *
+ * @return A SaveJob to follow the save with, or NULL on failure.
+ */
+SaveJob *memory_io_save_file_async (Serie *serie, const char *path);
+
+
+/**
+ * This function converts a niftii file or a dicom directory to a brick file
+ * from a background thread. The source is read one slab at a time while
+ * the bricks are written, so it never has to fit in memory. Follow and
+ * finish the conversion like a background save.
+ *
+ * @param pc_Source       The niftii file or dicom directory to convert.
+ * @param pc_Destination  The brick file to write.
+ *
+ * @return A SaveJob to follow the conversion with, or NULL on failure.
+ */
+SaveJob *memory_io_convert_file_async (const char *pc_Source, const char *pc_Destination);
+
+
+/**
+ * This function returns how far a background save has come.
+ *
+ * @param ps_Job  The SaveJob to get the progress of.
+ *
+ * @return A value between 0 and 1.
+ */
+float memory_io_save_job_get_progress (SaveJob *ps_Job);
+
+
+/**
+ * This function tells whether a background save is done.
+ *
+ * @param ps_Job  The SaveJob to check.
+ *
+ * @return 1 when the save is done, 0 otherwise.
+ */
+short int memory_io_save_job_is_finished (SaveJob *ps_Job);
+
+
+/**
+ * This function waits for a background save to finish and cleans it up.
+ *
+ * @param ps_Job  The SaveJob to finish.
+ *
+ * @return 0 when the file has been written, 1 otherwise.
+ */
+short int memory_io_save_job_finish (SaveJob *ps_Job);
+
+
+/**
+ * The number of files that load jobs read at the same time by default.
+ */
+#define MEMORY_IO_DEFAULT_LOAD_CONCURRENCY 4
+
+
+/**
+ * This structure keeps track of a set of files that are loaded in the
+ * background.
+ */
+typedef struct
+{
+  /**
+   * The files (or DICOM directories) to load.
+   */
+  char **ppc_Paths;
+  unsigned int ui32_Paths;
+
+  /**
+   * The loaded serie of each path, in a tree of its own until it is merged.
+   */
+  Tree **ppt_Series;
+
+  /**
+   * For each path: 0 while it is loading, 1 when it is done, and 2 when it
+   * has been merged (or failed to load).
+   */
+  unsigned char *pu8_Loaded;
+
+  /**
+   * The next path to hand out, the number of paths that are done, and the
+   * number of paths that could not be loaded.
+   */
+  unsigned int ui32_NextPath;
+  unsigned int ui32_Done;
+  unsigned int ui32_Failed;
+
+  /**
+   * The threads that load the files.
+   */
+  pthread_t *pt_Threads;
+  unsigned int ui32_Threads;
+} LoadJob;
+
+
+/**
+ * This function sets whether dicom series are loaded lazily. A lazy serie
+ * only reads its metadata while loading. The pixel data of a slice is read
+ * when the slice is first viewed, and a background thread reads the other
+ * slices in the meantime.
+ *
+ * @param b_Lazy  1 to load dicom series lazily, 0 to read them at once.
+ */
+void memory_io_set_lazy_dicom (short int b_Lazy);
+
+
+/**
+ * This function sets how many files all load jobs together read at the
+ * same time.
+ *
+ * @param ui32_Loads  The maximum number of files to read at the same time,
+ *                    or 0 for MEMORY_IO_DEFAULT_LOAD_CONCURRENCY.
+ */
+void memory_io_set_load_concurrency (unsigned int ui32_Loads);
+
+
+/**
+ * This function starts loading a set of files in the background. The
+ * memory tree is not touched until the loaded series are merged into it
+ * with memory_io_load_job_merge_next().
+ *
+ * @param ppc_Paths   The files (or DICOM directories) to load.
+ * @param ui32_Paths  The number of paths.
+ *
+ * @return A LoadJob to follow the loading with, or NULL on failure.
+ */
+LoadJob *memory_io_load_files_async (char **ppc_Paths, unsigned int ui32_Paths);
+
+
+/**
+ * This function merges the next serie that has been loaded into a memory
+ * tree. Call it from the thread that owns the tree, until it returns NULL,
+ * to add all series that are done so far.
+ *
+ * @param ps_Job     The LoadJob to take the serie from.
+ * @param ppt_study  The study to merge into, as in pt_memory_io_load_file().
+ *                   When it points to NULL, it is set to the study of the
+ *                   first merged serie.
+ *
+ * @return The merged serie, or NULL when no new serie is ready.
+ */
+Tree *memory_io_load_job_merge_next (LoadJob *ps_Job, Tree **ppt_study);
+
+
+/**
+ * This function returns how far a background load has come.
+ *
+ * @param ps_Job  The LoadJob to get the progress of.
+ *
+ * @return A value between 0 and 1.
+ */
+float memory_io_load_job_get_progress (LoadJob *ps_Job);
+
+
+/**
+ * This function tells whether all files of a background load are done.
+ *
+ * @param ps_Job  The LoadJob to check.
+ *
+ * @return 1 when all files are done, 0 otherwise.
+ */
+short int memory_io_load_job_is_finished (LoadJob *ps_Job);
+
+
+/**
+ * This function waits for a background load to finish and cleans it up.
+ * Series that have not been merged are destroyed.
+ *
+ * @param ps_Job  The LoadJob to finish.
+ *
+ * @return The number of files that could not be loaded.
+ */
+unsigned int memory_io_load_job_finish (LoadJob *ps_Job);
+
+
 /**
  *   @}
  * @}
@@ -28,6 +28,7 @@ extern "C" {
 #include "libcommon.h"
 #include "libcommon-list.h"
 #include "libcommon-algebra.h"
+#include "libcommon-accounting.h"
 #include "libmemory.h"
 
 #define COORDINATES_UNKNOWN      0  /*! Arbitrary coordinates (Method 1). */
@@ -36,6 +37,11 @@ extern "C" {
 #define COORDINATES_TALAIRACH    3  /*! Coordinates aligned to Talairach-Tournoux Atlas; (0,0,0)=AC, etc. */
 #define COORDINATES_MNI_152      4  /*! MNI 152 normalized coordinates. */
 
+#define SERIE_DIRTY_SLAB_SIZE    65536  /*! Bytes of data covered by one dirty flag. */
+
+#define SERIE_BRICK_SHIFT        3      /*! Log2 of the voxels along each edge of an in-memory brick. */
+#define SERIE_BRICK_SIZE         (1 << SERIE_BRICK_SHIFT)
+
 
 /**
  * @file   include/lib-memory-serie.h
@@ -62,6 +68,24 @@ typedef enum
   SERIE_MASK
 } te_SerieType;
 
+typedef enum
+{
+  SERIE_LAYOUT_LINEAR,
+  SERIE_LAYOUT_BRICKED
+} te_SerieLayout;
+
+/**
+ * The volume data of a Serie when it is shared with other Series. The data
+ * is freed when the last Serie that refers to it lets go of it. See
+ * memory_serie_share_data().
+ */
+typedef struct s_SerieBuffer
+{
+  void *pv_Data;
+  unsigned long long ui64_Size;
+  unsigned int ui32_References;
+} SerieBuffer;
+
 /**
  * This structure is the base element to store serie information.
  */
@@ -137,6 +161,13 @@ typedef struct
    */
   te_ImageIOFiletype input_type;
 
+  /**
+   * The version of the NIfTI header the Serie was loaded from (1 or 2), or 0
+   * when it did not come from a NIfTI file. A NIfTI-2 Serie is saved with a
+   * NIfTI-2 header again.
+   */
+  unsigned char u8_NiftiVersion;
+
   /**
    * The number of time series in the Serie.
    */
@@ -150,6 +181,22 @@ typedef struct
    */
   void *data;
 
+  /**
+   * The buffer 'data' lives in when it is shared with other Series, or NULL
+   * when 'data' belongs to this Serie alone. Shared data is read-only: call
+   * memory_serie_make_writable() before writing to it.
+   */
+  SerieBuffer *ps_Buffer;
+
+  /**
+   * The order of the voxels in 'data'. A linear Serie is stored x-fastest,
+   * then y, z and time. A bricked Serie is stored in cubes of
+   * SERIE_BRICK_SIZE voxels along each edge (padded at the borders), so that
+   * neighbouring voxels along every axis are close together in memory.
+   * Use memory_serie_get_voxel_offset() to find a voxel in either layout.
+   */
+  te_SerieLayout e_Layout;
+
   /**
    * A pointer to the value that is pointed to for all values that are not
    * inside the volume of the Serie.
@@ -243,9 +290,149 @@ typedef struct
   te_MemoryImageDirection e_ImageDirection_J;
   te_MemoryImageDirection e_ImageDirection_K;
 
+  /**
+  * The file that held the same data as this Serie when it was last loaded
+  * or saved, or NULL when there is no such file.
+  */
+  char *pc_SyncedFile;
+
+  /**
+  * One flag per SERIE_DIRTY_SLAB_SIZE bytes of the data in linear order,
+  * set for the parts that changed since the Serie was in sync with
+  * 'pc_SyncedFile'.
+  */
+  unsigned char *pu8_DirtySlabs;
+
+  /**
+  * The brick file this Serie reads its voxels from, when 'data' is NULL
+  * because the volume is kept on disk. See libmemory-brick.h.
+  */
+  struct s_BrickCache *ps_BrickCache;
+
+  /**
+  * The slices of a lazy Serie that have not been read yet, and where to
+  * read them from, or NULL when all data is in memory. See
+  * memory_serie_set_lazy().
+  */
+  struct s_SerieLazyData *ps_Lazy;
+
+  /**
+  * The bricks of a Serie that only stores its non-zero parts, or NULL.
+  * Such a Serie has no 'data'. See libmemory-sparse.h.
+  */
+  struct s_SparseMask *ps_Sparse;
+
+  /**
+  * The undo history of a mask, or NULL when nothing has been drawn on it.
+  * See libcommon-history.h.
+  */
+  struct _List *pll_History;
+
+  /**
+  * The memory this Serie takes, and the slices and buffers made of it.
+  * See libcommon-accounting.h.
+  */
+  Accounting ts_Accounting;
+
 } Serie;
 
 
+/**
+ * The function that reads one slice of a lazy Serie into its data.
+ *
+ * @param serie          The Serie to read the slice of.
+ * @param i16_Slice      The slice to read.
+ * @param u16_TimePoint  The timepoint of the slice.
+ * @param pv_Source      What was registered for this slice, for example a
+ *                       file name and the offset of the pixel data in it.
+ *
+ * @return 1 when the slice has been read, 0 otherwise.
+ */
+typedef short int (*SerieSliceLoader) (Serie *serie, short int i16_Slice,
+                                       unsigned short int u16_TimePoint, void *pv_Source);
+
+
+/**
+ * This function marks a range of the data of a Serie as changed, so that it
+ * is written on the next incremental save.
+ *
+ * @param serie        The Serie that changed.
+ * @param ui64_Offset  The byte offset of the change in 'data'.
+ * @param ui64_Length  The number of bytes that changed.
+ */
+void memory_serie_mark_dirty (Serie *serie, unsigned long long ui64_Offset, unsigned long long ui64_Length);
+
+
+/**
+ * This function records that the data of a Serie equals the data in a file,
+ * and clears all dirty slabs.
+ *
+ * @param serie    The Serie that is in sync.
+ * @param pc_Path  The file it is in sync with, or NULL to forget about it.
+ */
+void memory_serie_set_synced_file (Serie *serie, const char *pc_Path);
+
+
+/**
+ * This function makes a Serie lazy: its slices are only read when they are
+ * needed. A background thread reads the remaining slices in the meantime,
+ * starting near the slices that were needed last. The layout of the Serie
+ * must be linear. When its data is not allocated, the Serie streams right
+ * away, see memory_serie_set_streaming().
+ *
+ * The minimum and maximum value of the Serie are updated as slices come in.
+ *
+ * @param serie             The Serie to make lazy.
+ * @param pf_LoadSlice      The function that reads a slice.
+ * @param ppv_Sources       One source per slice, for all timepoints (slice
+ *                          z of timepoint t is at t * matrix.i16_z + z).
+ *                          The Serie takes ownership of the array.
+ * @param pf_DestroySource  The function to free a source with, or NULL.
+ *
+ * @return 0 on success, 1 otherwise.
+ */
+short int memory_serie_set_lazy (Serie *serie, SerieSliceLoader pf_LoadSlice, void **ppv_Sources,
+                                 void (*pf_DestroySource) (void *));
+
+
+/**
+ * This function makes sure a slice of a Serie is in memory. For a Serie
+ * that is not lazy, it does nothing.
+ *
+ * @param serie          The Serie.
+ * @param i16_Slice      The slice that is needed.
+ * @param u16_TimePoint  The timepoint of the slice.
+ *
+ * @return 1 when the slice is in memory, 0 when it could not be read.
+ */
+short int memory_serie_ensure_slice (Serie *serie, short int i16_Slice, unsigned short int u16_TimePoint);
+
+
+/**
+ * This function reads all slices of a lazy Serie that are not in memory
+ * yet, after which the Serie is no longer lazy.
+ *
+ * @param serie  The Serie.
+ *
+ * @return 0 when all data is in memory, 1 otherwise.
+ */
+short int memory_serie_load_all (Serie *serie);
+
+
+/**
+ * This function stops the background reader of a lazy Serie, and makes
+ * memory_serie_read_linear() read the slices that are not in memory
+ * straight from their source, without keeping them. It is meant for a
+ * Serie that is only opened to be converted, so that it never has to fit
+ * in memory.
+ *
+ * @param serie  The lazy Serie.
+ *
+ * @return 0 on success, 1 when the Serie is not lazy.
+ */
+short int memory_serie_set_streaming (Serie *serie);
+
+
 /**
  * This function returns a unique identifier for a Serie.
  * @return A unique identifier for a Serie.
@@ -292,6 +479,149 @@ MemoryDataType memory_serie_get_memory_type (Serie *serie);
 short int memory_serie_get_memory_space (Serie *serie);
 
 
+/**
+ * This function returns the number of bytes (space) for a memory type.
+ *
+ * @param e_Type  The memory type to get the memory space for.
+ *
+ * @return The number of bytes per voxel for e_Type, or 0 when it is unknown.
+ */
+short int memory_serie_get_type_space (MemoryDataType e_Type);
+
+
+/**
+ * This function returns the number of bytes that the data of a Serie
+ * takes in its current layout.
+ *
+ * @param serie  The Serie to get the data size for.
+ *
+ * @return The number of bytes allocated for 'data'.
+ */
+unsigned long long memory_serie_get_data_size (Serie *serie);
+
+
+/**
+ * This function counts the memory that 'data' takes, as a volume or as a
+ * mask. It is called when 'data' was allocated, replaced or freed.
+ *
+ * @param serie  The Serie to count the data of.
+ */
+void memory_serie_account_data (Serie *serie);
+
+
+/**
+ * This function returns where a voxel is in the data of a Serie, taking
+ * its layout into account. The coordinates must be inside the volume.
+ *
+ * @param serie  The Serie to look in.
+ * @param i16_X  The x-coordinate of the voxel.
+ * @param i16_Y  The y-coordinate of the voxel.
+ * @param i16_Z  The z-coordinate of the voxel.
+ * @param u16_T  The timepoint of the voxel.
+ *
+ * @return The byte offset of the voxel in 'data'.
+ */
+unsigned long long memory_serie_get_voxel_offset (Serie *serie, short int i16_X, short int i16_Y,
+                                                  short int i16_Z, unsigned short int u16_T);
+
+
+/**
+ * This function reorders the data of a Serie into another layout. Since
+ * byte ranges of the old layout no longer apply, the Serie is no longer
+ * considered in sync with a file afterwards.
+ *
+ * @param serie     The Serie to reorder.
+ * @param e_Layout  The layout to convert to.
+ *
+ * @return 0 when the data is in the requested layout, 1 otherwise.
+ */
+short int memory_serie_set_layout (Serie *serie, te_SerieLayout e_Layout);
+
+
+/**
+ * This function returns a copy of the data of a Serie in linear order,
+ * whatever the layout of the Serie is, and also for a sparse Serie. This is for code that walks the
+ * data as one x-fastest array, such as the file writers.
+ *
+ * @param serie  The Serie to copy the data of.
+ *
+ * @return A newly allocated buffer that the caller must free, or NULL.
+ */
+void *memory_serie_copy_linear_data (Serie *serie);
+
+
+/**
+ * This function tells whether 'data' holds the complete volume of a Serie
+ * in linear order, so that it can be read as one x-fastest array.
+ *
+ * @param serie  The Serie to check.
+ *
+ * @return 1 when 'data' can be read directly, 0 otherwise.
+ */
+short int memory_serie_has_linear_data (Serie *serie);
+
+
+/**
+ * This function reads part of the data of a Serie as it would be in
+ * linear order, whatever keeps the data: memory in either layout, sparse
+ * bricks, a brick file or the slices of a lazy Serie. Writers use it to
+ * walk a Serie a piece at a time, without a linear copy of all of it.
+ *
+ * Pending writes to a sparse Serie must have been flushed. Several threads
+ * can read from the same Serie at once.
+ *
+ * @param serie        The Serie to read from.
+ * @param ui64_Offset  The byte offset to start at in the linear data.
+ * @param ui64_Length  The number of bytes to read.
+ * @param pv_Buffer    Where to put the bytes.
+ *
+ * @return 0 on success, 1 otherwise.
+ */
+short int memory_serie_read_linear (Serie *serie, unsigned long long ui64_Offset,
+                                    unsigned long long ui64_Length, void *pv_Buffer);
+
+
+/**
+ * This function lets a Serie use the same data as another one, without
+ * copying it. Both keep reading the shared data until one of them calls
+ * memory_serie_make_writable(), which gives that one a copy of its own.
+ *
+ * Only the data of originals is shared. Masks and overlays are written
+ * through the pointers their slices hold, so they cannot tell when a
+ * copy would be needed.
+ *
+ * @param ps_Source  The Serie to share the data of. Its data must be in
+ *                   memory, and not sparse.
+ * @param ps_Target  The Serie to give the data to. Its own data is let go
+ *                   of, and its layout is set to that of ps_Source.
+ *
+ * @return 0 when the data is shared, 1 when it cannot be.
+ */
+short int memory_serie_share_data (Serie *ps_Source, Serie *ps_Target);
+
+
+/**
+ * This function gives a Serie a copy of its data when it shares it with
+ * other Series, so that it can be written to.
+ *
+ * @param serie  The Serie that is about to write to its data.
+ *
+ * @return 0 when the data can be written to, 1 when there is not enough
+ *         memory for the copy.
+ */
+short int memory_serie_make_writable (Serie *serie);
+
+
+/**
+ * This function makes data that a Serie shared, but no longer does, its
+ * own again, so that it is counted for the Serie instead of for the
+ * program as a whole. Call it when another Serie let go of the data.
+ *
+ * @param serie  The Serie that may be the last to refer to its data.
+ */
+void memory_serie_reclaim_data (Serie *serie);
+
+
 /**
  * This function set the minimum and maximum value of a Serie.
  *
@@ -299,8 +629,20 @@ short int memory_serie_get_memory_space (Serie *serie);
  */
 void memory_serie_set_upper_and_lower_borders_from_data(Serie *serie);
 
+/**
+ * This function walks the data of a Serie once to convert its byte order
+ * (when needed) and to set the minimum and maximum value. The work is split
+ * over a number of threads.
+ *
+ * @param serie        The Serie to process.
+ * @param b_SwapBytes  1 when the data is in the opposite byte order, 0 otherwise.
+ */
+void memory_serie_ingest_data (Serie *serie, short int b_SwapBytes);
+
 /**
  * This function creates a new (mask)serie which is cloned from the original serie.
+ * The mask is sparse: it only takes memory for the parts that are painted on.
+ * Its voxels are unsigned bytes, which holds every label the brush can paint.
  *
  * @param serie The serie to clone from.
  *
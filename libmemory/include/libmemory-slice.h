@@ -122,6 +122,23 @@ typedef struct
    */
   void *data;
 
+  /**
+   * The voxel values that 'data' points to, when the serie is kept in a
+   * brick file instead of in memory.
+   */
+  void *pv_BrickValues;
+
+  /**
+   * The voxels that 'data' points to, when the serie is sparse and their
+   * bricks were not allocated when the slice was taken.
+   */
+  struct s_SparsePlane *ps_SparsePlane;
+
+  /**
+   * The bytes of 'data' and 'pv_BrickValues', as counted for the serie.
+   */
+  unsigned long long ui64_AccountedBytes;
+
   /**
    * Viewport Change (widht, height, strides etc)
    */
@@ -0,0 +1,362 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MEMORY_SPARSE_H
+#define MEMORY_SPARSE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "libmemory.h"
+#include "libmemory-serie.h"
+
+#define SPARSE_BRICK_SHIFT       4      /*! Log2 of the voxels along each edge of a sparse brick. */
+#define SPARSE_BRICK_SIZE        (1 << SPARSE_BRICK_SHIFT)
+
+
+/**
+ * @file   include/libmemory-sparse.h
+ * @brief  A volume that only stores the bricks that hold non-zero voxels.
+ * @author Roel Janssen
+ */
+
+
+/**
+ * @ingroup memory
+ * @{
+ *   @defgroup memory_sparse Sparse
+ *   @{
+ *
+ * This module stores the volume of a Serie in bricks of SPARSE_BRICK_SIZE
+ * voxels along each edge, per timepoint. A brick in which all voxels are
+ * zero is not allocated, and neither is anything for a timepoint that has
+ * not been written to. This suits masks, which are mostly empty.
+ *
+ * A Serie that is stored this way has no 'data' of its own. Slices of it
+ * point into the allocated bricks, and into a plane of their own for the
+ * voxels in bricks that are not. Values written to such a plane, for
+ * example by a painting plugin, are moved into the bricks when the slice is
+ * taken again, or when the volume is flushed.
+ */
+
+
+/**
+ * The voxels of one slice that lie in bricks that were not allocated when
+ * the slice was taken.
+ */
+typedef struct s_SparsePlane
+{
+  /**
+   * The volume the plane belongs to, or NULL when it has been destroyed.
+   */
+  struct s_SparseMask *ps_Mask;
+
+  /**
+   * The timepoint of the slice, and its number of pixels.
+   */
+  unsigned short int u16_TimePoint;
+  unsigned int ui32_Pixels;
+
+  /**
+   * For each pixel, one more than the linear index of its voxel within the
+   * timepoint, with the top bit set when the pixel points into an allocated
+   * brick, or 0 when the pixel is not taken of the volume.
+   */
+  unsigned long long *pui64_Voxels;
+
+  /**
+   * The values the slice points to, and the same values as they were
+   * when they were last moved into the volume. For pixels in a brick, only
+   * the latter is kept, so that a brick only counts as changed when it was
+   * painted on through the slice.
+   */
+  unsigned char *pu8_Values;
+  unsigned char *pu8_Committed;
+
+  struct s_SparsePlane *ps_Previous;
+  struct s_SparsePlane *ps_Next;
+} SparsePlane;
+
+
+/**
+ * This structure describes a sparse volume.
+ */
+typedef struct s_SparseMask
+{
+  /**
+   * The size of the volume, and the number of bricks along each axis.
+   */
+  ts_Coordinate3DInt ts_Matrix;
+  unsigned short int u16_NumberOfTimeSeries;
+  unsigned int ui32_BricksX;
+  unsigned int ui32_BricksY;
+  unsigned int ui32_BricksZ;
+  unsigned long long ui64_BricksPerTimePoint;
+
+  /**
+   * The number of bytes per voxel and per brick.
+   */
+  unsigned int ui32_ElementSize;
+  unsigned long long ui64_BrickBytes;
+
+  /**
+   * The bricks of each timepoint, or NULL for bricks that are all zero. The
+   * table of a timepoint is only allocated when it is first written to, so
+   * a 4D mask on which a single timepoint is drawn costs little more than a
+   * 3D one.
+   */
+  unsigned char ***pppu8_Bricks;
+  unsigned long long ui64_AllocatedBricks;
+
+  /**
+   * The bricks as they were at the last checkpoint, per timepoint in the
+   * same way.
+   */
+  unsigned char ***pppu8_Checkpoint;
+
+  /**
+   * For each brick, whether it may differ from the last checkpoint and
+   * whether it changed since the Serie was in sync with its file, and the
+   * list of bricks that may differ from the last checkpoint. A checkpoint
+   * only compares the bricks in the list.
+   */
+  unsigned char *pu8_Changed;
+  unsigned long long *pui64_Changed;
+  unsigned long long ui64_Changed;
+  unsigned long long ui64_ChangedCapacity;
+
+  /**
+   * The planes of the slices that are taken of the volume.
+   */
+  SparsePlane *ps_Planes;
+
+  /**
+   * Where the memory of the bricks and planes is counted.
+   */
+  Accounting *ps_Accounting;
+
+  /**
+   * The Serie stored in this volume, whose dirty slabs cover the bricks
+   * that changed since it was in sync with its file.
+   */
+  Serie *ps_Serie;
+} SparseMask;
+
+
+/**
+ * This structure describes the bricks that changed between two checkpoints
+ * of a sparse volume.
+ */
+typedef struct s_SparseDelta
+{
+  /**
+   * The volume the checkpoints were taken of.
+   */
+  SparseMask *ps_Mask;
+
+  /**
+   * The number of bricks that changed, and the number of bytes of the
+   * delta. The structure is followed by a record for each brick: its index,
+   * and the exclusive or of its contents at both checkpoints.
+   */
+  unsigned long long ui64_Bricks;
+  unsigned long long ui64_Size;
+} SparseDelta;
+
+
+/**
+ * This function creates an empty sparse volume of the size of a Serie.
+ *
+ * @param serie  The Serie to take the matrix, timepoints and data type from.
+ *
+ * @return A newly allocated sparse volume, with all voxels zero.
+ */
+SparseMask *memory_sparse_new (Serie *serie);
+
+
+/**
+ * This function frees a sparse volume. Planes that are still in use are
+ * left to their slices.
+ *
+ * @param ps_Mask  The sparse volume to free.
+ */
+void memory_sparse_destroy (SparseMask *ps_Mask);
+
+
+/**
+ * This function finds a voxel in a sparse volume.
+ *
+ * @param ps_Mask     The sparse volume.
+ * @param i16_X       The x-coordinate of the voxel.
+ * @param i16_Y       The y-coordinate of the voxel.
+ * @param i16_Z       The z-coordinate of the voxel.
+ * @param u16_T       The timepoint of the voxel.
+ * @param b_Allocate  1 to allocate the brick of the voxel when needed.
+ *
+ * @return A pointer to the voxel, or NULL when it is outside the volume or
+ *         its brick is not allocated (and b_Allocate is 0).
+ */
+void *memory_sparse_get_voxel (SparseMask *ps_Mask, short int i16_X, short int i16_Y,
+                               short int i16_Z, unsigned short int u16_T, short int b_Allocate);
+
+
+/**
+ * This function creates a plane for a slice of a sparse volume.
+ *
+ * @param ps_Mask        The sparse volume.
+ * @param ui32_Pixels    The number of pixels of the slice.
+ * @param u16_TimePoint  The timepoint of the slice.
+ *
+ * @return A newly allocated plane.
+ */
+SparsePlane *memory_sparse_plane_new (SparseMask *ps_Mask, unsigned int ui32_Pixels,
+                                      unsigned short int u16_TimePoint);
+
+
+/**
+ * This function lets a pixel of a slice point into its plane, for a voxel
+ * in a brick that is not allocated.
+ *
+ * @param ps_Plane    The plane of the slice.
+ * @param ui32_Pixel  The index of the pixel in the slice.
+ * @param i16_X       The x-coordinate of the voxel.
+ * @param i16_Y       The y-coordinate of the voxel.
+ * @param i16_Z       The z-coordinate of the voxel.
+ *
+ * @return A pointer to the value of the pixel, which is zero.
+ */
+void *memory_sparse_plane_add (SparsePlane *ps_Plane, unsigned int ui32_Pixel,
+                               short int i16_X, short int i16_Y, short int i16_Z);
+
+
+/**
+ * This function lets a pixel of a slice point to a voxel: into its brick
+ * when that is allocated, and into the plane otherwise.
+ *
+ * @param ps_Plane    The plane of the slice.
+ * @param ui32_Pixel  The index of the pixel in the slice.
+ * @param i16_X       The x-coordinate of the voxel.
+ * @param i16_Y       The y-coordinate of the voxel.
+ * @param i16_Z       The z-coordinate of the voxel.
+ *
+ * @return A pointer to the value of the pixel.
+ */
+void *memory_sparse_plane_get_voxel (SparsePlane *ps_Plane, unsigned int ui32_Pixel,
+                                     short int i16_X, short int i16_Y, short int i16_Z);
+
+
+/**
+ * This function moves what was written to a plane into its volume, and
+ * frees the plane.
+ *
+ * @param ps_Plane  The plane to free, or NULL.
+ */
+void memory_sparse_plane_destroy (SparsePlane *ps_Plane);
+
+
+/**
+ * This function moves what was written to the planes of all slices of a
+ * sparse volume into the volume.
+ *
+ * @param ps_Mask  The sparse volume.
+ */
+void memory_sparse_flush (SparseMask *ps_Mask);
+
+
+/**
+ * This function copies the first voxels of a sparse volume to a linear
+ * buffer, in x-fastest order.
+ *
+ * @param ps_Mask      The sparse volume.
+ * @param pv_Data      The buffer to copy to.
+ * @param ui64_Voxels  The number of voxels to copy.
+ */
+void memory_sparse_copy_to_linear (SparseMask *ps_Mask, void *pv_Data, unsigned long long ui64_Voxels);
+
+
+/**
+ * This function replaces the first voxels of a sparse volume with the
+ * contents of a linear buffer. Bricks that become all zero are freed, when
+ * no slice is taken of the volume.
+ *
+ * @param ps_Mask      The sparse volume.
+ * @param pv_Data      The buffer to copy from, in x-fastest order.
+ * @param ui64_Voxels  The number of voxels to copy.
+ */
+void memory_sparse_copy_from_linear (SparseMask *ps_Mask, const void *pv_Data, unsigned long long ui64_Voxels);
+
+
+/**
+ * This function forgets which bricks changed since the volume was in sync
+ * with a file. It is called when the dirty slabs of the Serie are cleared.
+ *
+ * @param ps_Mask  The sparse volume.
+ */
+void memory_sparse_mark_synced (SparseMask *ps_Mask);
+
+
+/**
+ * This function takes a checkpoint of a sparse volume. Only the bricks that
+ * were written to since the previous checkpoint are compared, and only
+ * those that differ are stored, so this is suited for undo steps.
+ *
+ * @param ps_Mask  The sparse volume.
+ *
+ * @return The changes since the previous checkpoint (or since the volume was
+ *         empty, for the first one), or NULL when nothing changed. It is a
+ *         single block of ui64_Size bytes, to be freed with free().
+ */
+SparseDelta *memory_sparse_checkpoint (SparseMask *ps_Mask);
+
+
+/**
+ * This function applies a delta to the volume it was taken of. Applying the
+ * delta of the last checkpoint returns to the checkpoint before it, and
+ * applying it again returns to the last checkpoint.
+ *
+ * @param pv_Delta  The SparseDelta to apply.
+ * @param pv_Mask   The SparseMask to apply it to.
+ *
+ * @return 1 on success, 0 when the delta belongs to another volume.
+ */
+short int memory_sparse_delta_apply (void *pv_Delta, void *pv_Mask);
+
+
+/**
+ * This function returns the number of bytes the bricks of a sparse volume
+ * take.
+ *
+ * @param ps_Mask  The sparse volume.
+ *
+ * @return The number of bytes in allocated bricks.
+ */
+unsigned long long memory_sparse_get_allocated_bytes (SparseMask *ps_Mask);
+
+
+/**
+ *   @}
+ * @}
+ */
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif//MEMORY_SPARSE_H
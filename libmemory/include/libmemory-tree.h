@@ -53,6 +53,10 @@ extern "C" {
  *   - ts_Tree of Study
  *     - ts_Tree of Serie
  *       - ts_List of Slice
+ *
+ * Patients, studies and series are found by their id and by their UID
+ * through hash indexes, which are kept in sync with the trees by
+ * memory_tree_register() and memory_tree_unregister().
  */
 
 
@@ -124,6 +128,61 @@ Tree* memory_tree_get_study_by_id (Tree* tree, unsigned long long id);
 Tree*
 memory_tree_get_serie_by_id (Tree* tree, unsigned long long id);
 
+
+/**
+ * This function returns the patient tree element with a specific patient
+ * ID, in the same tree as a given patient.
+ *
+ * @param tree  A patient tree element of the tree to search in.
+ * @param uid   The patient ID to look for.
+ *
+ * @return A pointer to the patient tree element, or NULL.
+ */
+Tree* memory_tree_get_patient_by_uid (Tree* tree, const char *uid);
+
+
+/**
+ * This function returns the study tree element of a patient with a
+ * specific study instance UID.
+ *
+ * @param tree  The patient tree element to search in.
+ * @param uid   The study instance UID to look for.
+ *
+ * @return A pointer to the study tree element, or NULL.
+ */
+Tree* memory_tree_get_study_by_uid (Tree* tree, const char *uid);
+
+
+/**
+ * This function returns the serie tree element of a study with a specific
+ * serie instance UID.
+ *
+ * @param tree  The study tree element to search in.
+ * @param uid   The serie instance UID to look for.
+ *
+ * @return A pointer to the serie tree element, or NULL.
+ */
+Tree* memory_tree_get_serie_by_uid (Tree* tree, const char *uid);
+
+
+/**
+ * This function adds a tree element, and everything below it, to the
+ * registry the lookups by id and UID use. Elements are registered when
+ * they are merged into a memory tree.
+ *
+ * @param tree  The patient, study or serie tree element to register.
+ */
+void memory_tree_register (Tree* tree);
+
+
+/**
+ * This function removes a tree element, and everything below it, from the
+ * registry. It must be called before the element or its data is freed.
+ *
+ * @param tree  The patient, study or serie tree element to unregister.
+ */
+void memory_tree_unregister (Tree* tree);
+
 /**
  * This function returns the serie at the nth position. When a patient
  * or a study tree is given, it will use the tree's child to search for
@@ -0,0 +1,932 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libmemory-brick.h"
+#include "libmemory-serie.h"
+#include "libcommon-debug.h"
+#include "libcommon-iohint.h"
+#include "libcommon-thread.h"
+#include "libcommon-unused.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#define BRICK_FILE_MAGIC         "CLMVBRK\0"
+#define BRICK_FILE_VERSION       1
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* LOCAL FUNCTIONS                                                                                    */
+/*                                                                                                    */
+/*                                                                                                    */
+
+/**
+ * The header of a brick file. It is followed by the offsets and lengths of
+ * all bricks, and then by the bricks themselves. Like the index of dicom
+ * directories, it is written as it is in memory.
+ */
+typedef struct s_BrickFileHeader
+{
+  char                          ac_Magic[8];
+  unsigned int                  ui32_Version;
+  unsigned int                  ui32_BrickSize;
+  unsigned int                  ui32_ElementSize;
+  unsigned long long            ui64_NumberOfBricks;
+
+  ts_Coordinate3DInt            ts_Matrix;
+  unsigned short int            u16_NumberOfTimeSeries;
+  Coordinate3D                  ts_PixelDimension;
+  float                         f_Slope;
+  float                         f_Offset;
+  short int                     i16_RawDataType;
+  MemoryDataType                e_DataType;
+  te_ImageIOFiletype            e_InputType;
+  unsigned char                 u8_AxisUnits;
+  int                           i32_MinimumValue;
+  int                           i32_MaximumValue;
+
+  double                        d_Qfac;
+  short int                     i16_QuaternionCode;
+  ts_Quaternion                 ts_Quaternion;
+  ts_Quaternion                 ts_QuaternationOffset;
+  ts_Matrix4x4                  t_ScannerSpaceIJKtoXYZ;
+  ts_Matrix4x4                  t_ScannerSpaceXYZtoIJK;
+  short int                     i16_StandardSpaceCode;
+  ts_Matrix4x4                  t_StandardSpaceIJKtoXYZ;
+  ts_Matrix4x4                  t_StandardSpaceXYZtoIJK;
+  short int                     b_UsesStandardSpace;
+
+} ts_BrickFileHeader;
+
+
+typedef struct
+{
+  Serie                         *ps_Serie;
+  unsigned int                  ui32_BrickSize;
+  unsigned int                  ui32_ElementSize;
+  unsigned int                  ui32_BricksX;
+  unsigned int                  ui32_BricksY;
+  unsigned int                  ui32_BricksZ;
+  unsigned long long            ui64_BrickBytes;
+  unsigned long long            ui64_FirstBrick;
+  unsigned int                  ui32_Depth;
+  const unsigned char           *pu8_Slab;
+  short int                     b_Compress;
+  unsigned char                 **ppu8_Bricks;
+  unsigned long                 *pul_Lengths;
+  short int                     b_Failed;
+  unsigned long long            *pui64_BytesWritten;
+} ts_BrickWriteJob;
+
+
+short int
+b_memory_brick_write_all (int i32_File, const void *pv_Data, unsigned long long ui64_Length, off_t t_Offset)
+{
+  ssize_t s_Written;
+
+  while (ui64_Length > 0)
+  {
+    s_Written = pwrite (i32_File, pv_Data, ui64_Length, t_Offset);
+    if (s_Written < 0 && errno == EINTR)
+      continue;
+
+    if (s_Written <= 0)
+      return 0;
+
+    pv_Data = (const char *)pv_Data + s_Written;
+    ui64_Length -= s_Written;
+    t_Offset += s_Written;
+  }
+
+  return 1;
+}
+
+
+short int
+b_memory_brick_read_all (int i32_File, void *pv_Data, unsigned long long ui64_Length, off_t t_Offset)
+{
+  ssize_t s_Read;
+
+  while (ui64_Length > 0)
+  {
+    s_Read = pread (i32_File, pv_Data, ui64_Length, t_Offset);
+    if (s_Read < 0 && errno == EINTR)
+      continue;
+
+    if (s_Read <= 0)
+      return 0;
+
+    pv_Data = (char *)pv_Data + s_Read;
+    ui64_Length -= s_Read;
+    t_Offset += s_Read;
+  }
+
+  return 1;
+}
+
+
+// Cuts the bricks [ui64_Start, ui64_End) of a slab out of the linear data of
+// that slab. A slab is one row of bricks along z, for a single timepoint.
+void
+v_memory_brick_write_range (unsigned long long ui64_Start, unsigned long long ui64_End,
+                            UNUSED unsigned int ui32_Worker, void *pv_Job)
+{
+  ts_BrickWriteJob *ps_Job = pv_Job;
+  Serie *serie = ps_Job->ps_Serie;
+  unsigned int ui32_Size = ps_Job->ui32_BrickSize;
+  unsigned int ui32_ElementSize = ps_Job->ui32_ElementSize;
+  unsigned long long ui64_Brick, ui64_Source, ui64_Row;
+  unsigned int ui32_X, ui32_Y, ui32_Width, ui32_Height, ui32_Cnt, ui32_Row;
+  unsigned char *pu8_Brick, *pu8_Compressed;
+  unsigned long ul_Length;
+
+  for (ui64_Brick = ui64_Start; ui64_Brick < ui64_End; ui64_Brick++)
+  {
+    // Brick numbers run along x first, then y.
+    ui32_X = (ui64_Brick % ps_Job->ui32_BricksX) * ui32_Size;
+    ui32_Y = (ui64_Brick / ps_Job->ui32_BricksX) * ui32_Size;
+
+    // Bricks at the edges of the volume are padded with zeros.
+    ui32_Width = ((unsigned int)serie->matrix.i16_x - ui32_X < ui32_Size) ? serie->matrix.i16_x - ui32_X : ui32_Size;
+    ui32_Height = ((unsigned int)serie->matrix.i16_y - ui32_Y < ui32_Size) ? serie->matrix.i16_y - ui32_Y : ui32_Size;
+
+    pu8_Brick = calloc (1, ps_Job->ui64_BrickBytes);
+    if (pu8_Brick == NULL)
+    {
+      __atomic_store_n (&ps_Job->b_Failed, 1, __ATOMIC_RELAXED);
+      continue;
+    }
+
+    for (ui32_Cnt = 0; ui32_Cnt < ps_Job->ui32_Depth; ui32_Cnt++)
+    {
+      for (ui32_Row = 0; ui32_Row < ui32_Height; ui32_Row++)
+      {
+        ui64_Source = (((unsigned long long)ui32_Cnt * serie->matrix.i16_y + ui32_Y + ui32_Row)
+                       * serie->matrix.i16_x + ui32_X) * ui32_ElementSize;
+        ui64_Row = ((unsigned long long)ui32_Cnt * ui32_Size + ui32_Row) * ui32_Size * ui32_ElementSize;
+
+        memcpy (pu8_Brick + ui64_Row, ps_Job->pu8_Slab + ui64_Source, ui32_Width * ui32_ElementSize);
+      }
+    }
+
+    ul_Length = ps_Job->ui64_BrickBytes;
+
+    // Keep the compressed brick only when it is actually smaller.
+    if (ps_Job->b_Compress)
+    {
+      unsigned long ul_Bound = compressBound (ps_Job->ui64_BrickBytes);
+      pu8_Compressed = malloc (ul_Bound);
+
+      if (pu8_Compressed != NULL
+          && compress2 (pu8_Compressed, &ul_Bound, pu8_Brick, ps_Job->ui64_BrickBytes, Z_BEST_SPEED) == Z_OK
+          && ul_Bound < ps_Job->ui64_BrickBytes)
+      {
+        free (pu8_Brick);
+        pu8_Brick = pu8_Compressed;
+        ul_Length = ul_Bound;
+      }
+      else
+        free (pu8_Compressed);
+    }
+
+    ps_Job->ppu8_Bricks[ui64_Brick] = pu8_Brick;
+    ps_Job->pul_Lengths[ui64_Brick] = ul_Length;
+
+    if (ps_Job->pui64_BytesWritten != NULL)
+      __atomic_add_fetch (ps_Job->pui64_BytesWritten,
+                          (unsigned long long)ui32_Width * ui32_Height * ps_Job->ui32_Depth * ui32_ElementSize,
+                          __ATOMIC_RELAXED);
+  }
+}
+
+
+void
+v_memory_brick_unlink (BrickCache *ps_Cache, CachedBrick *ps_Brick)
+{
+  if (ps_Brick->ps_Previous != NULL)
+    ps_Brick->ps_Previous->ps_Next = ps_Brick->ps_Next;
+  else
+    ps_Cache->ps_MostRecent = ps_Brick->ps_Next;
+
+  if (ps_Brick->ps_Next != NULL)
+    ps_Brick->ps_Next->ps_Previous = ps_Brick->ps_Previous;
+  else
+    ps_Cache->ps_LeastRecent = ps_Brick->ps_Previous;
+
+  ps_Brick->ps_Previous = NULL;
+  ps_Brick->ps_Next = NULL;
+}
+
+
+void
+v_memory_brick_push_front (BrickCache *ps_Cache, CachedBrick *ps_Brick)
+{
+  ps_Brick->ps_Previous = NULL;
+  ps_Brick->ps_Next = ps_Cache->ps_MostRecent;
+
+  if (ps_Cache->ps_MostRecent != NULL)
+    ps_Cache->ps_MostRecent->ps_Previous = ps_Brick;
+
+  ps_Cache->ps_MostRecent = ps_Brick;
+
+  if (ps_Cache->ps_LeastRecent == NULL)
+    ps_Cache->ps_LeastRecent = ps_Brick;
+}
+
+
+void
+v_memory_brick_prefetch_neighbours (BrickCache *ps_Cache, unsigned long long ui64_Brick)
+{
+  unsigned long long ui64_Plane = (unsigned long long)ps_Cache->ui32_BricksX * ps_Cache->ui32_BricksY;
+  unsigned long long ui64_Volume = ui64_Plane * ps_Cache->ui32_BricksZ;
+  unsigned long long ui64_InVolume = ui64_Brick % ui64_Volume;
+  unsigned long long pui64_Neighbours[6];
+  unsigned int ui32_Neighbours = 0;
+  unsigned int ui32_Cnt;
+
+  // Bricks that are read ahead would only push others out.
+  if (common_accounting_under_pressure ()) return;
+
+  unsigned int ui32_X = ui64_InVolume % ps_Cache->ui32_BricksX;
+  unsigned int ui32_Y = (ui64_InVolume / ps_Cache->ui32_BricksX) % ps_Cache->ui32_BricksY;
+  unsigned int ui32_Z = ui64_InVolume / ui64_Plane;
+
+  // A slice that needs this brick, or the next slice the viewer scrolls
+  // to, needs the bricks around it as well. Let the kernel read those
+  // while this brick is being decoded.
+  if (ui32_X > 0) pui64_Neighbours[ui32_Neighbours++] = ui64_Brick - 1;
+  if (ui32_X + 1 < ps_Cache->ui32_BricksX) pui64_Neighbours[ui32_Neighbours++] = ui64_Brick + 1;
+  if (ui32_Y > 0) pui64_Neighbours[ui32_Neighbours++] = ui64_Brick - ps_Cache->ui32_BricksX;
+  if (ui32_Y + 1 < ps_Cache->ui32_BricksY) pui64_Neighbours[ui32_Neighbours++] = ui64_Brick + ps_Cache->ui32_BricksX;
+  if (ui32_Z > 0) pui64_Neighbours[ui32_Neighbours++] = ui64_Brick - ui64_Plane;
+  if (ui32_Z + 1 < ps_Cache->ui32_BricksZ) pui64_Neighbours[ui32_Neighbours++] = ui64_Brick + ui64_Plane;
+
+  for (ui32_Cnt = 0; ui32_Cnt < ui32_Neighbours; ui32_Cnt++)
+  {
+    if (ps_Cache->pps_Resident[pui64_Neighbours[ui32_Cnt]] != NULL) continue;
+
+    common_iohint_willneed (ps_Cache->i32_File, ps_Cache->pui64_Offsets[pui64_Neighbours[ui32_Cnt]],
+                            ps_Cache->pui32_Lengths[pui64_Neighbours[ui32_Cnt]]);
+  }
+}
+
+
+CachedBrick*
+ps_memory_brick_fault (BrickCache *ps_Cache, unsigned long long ui64_Brick)
+{
+  CachedBrick *ps_Brick;
+  unsigned char *pu8_Compressed;
+  unsigned long ul_Length;
+  short int b_Success;
+
+  ps_Brick = malloc (sizeof (CachedBrick) + ps_Cache->ui64_BrickBytes);
+  if (ps_Brick == NULL) return NULL;
+
+  ps_Brick->ui64_Brick = ui64_Brick;
+
+  v_memory_brick_prefetch_neighbours (ps_Cache, ui64_Brick);
+
+  if (ps_Cache->pui32_Lengths[ui64_Brick] == ps_Cache->ui64_BrickBytes)
+  {
+    b_Success = b_memory_brick_read_all (ps_Cache->i32_File, ps_Brick->pu8_Data, ps_Cache->ui64_BrickBytes,
+                                         ps_Cache->pui64_Offsets[ui64_Brick]);
+  }
+  else
+  {
+    pu8_Compressed = malloc (ps_Cache->pui32_Lengths[ui64_Brick]);
+    ul_Length = ps_Cache->ui64_BrickBytes;
+
+    b_Success = (pu8_Compressed != NULL
+                 && b_memory_brick_read_all (ps_Cache->i32_File, pu8_Compressed, ps_Cache->pui32_Lengths[ui64_Brick],
+                                             ps_Cache->pui64_Offsets[ui64_Brick])
+                 && uncompress (ps_Brick->pu8_Data, &ul_Length, pu8_Compressed, ps_Cache->pui32_Lengths[ui64_Brick]) == Z_OK
+                 && ul_Length == ps_Cache->ui64_BrickBytes);
+
+    free (pu8_Compressed);
+  }
+
+  if (!b_Success)
+  {
+    debug_error ("Could not read brick %llu.", ui64_Brick);
+    free (ps_Brick);
+    return NULL;
+  }
+
+  ps_Cache->pps_Resident[ui64_Brick] = ps_Brick;
+  v_memory_brick_push_front (ps_Cache, ps_Brick);
+  ps_Cache->ui64_MemoryInUse += ps_Cache->ui64_BrickBytes;
+  common_accounting_add (ps_Cache->ps_Accounting, ACCOUNTING_CACHE, ps_Cache->ui64_BrickBytes);
+
+  // Make room by dropping the bricks that have not been used for the
+  // longest time. The brick we just read is never dropped. When the
+  // program as a whole takes too much, the cache shrinks below its own
+  // budget.
+  while ((ps_Cache->ui64_MemoryInUse > ps_Cache->ui64_MemoryBudget
+          || common_accounting_under_pressure ())
+         && ps_Cache->ps_LeastRecent != ps_Brick)
+  {
+    CachedBrick *ps_Victim = ps_Cache->ps_LeastRecent;
+
+    v_memory_brick_unlink (ps_Cache, ps_Victim);
+    ps_Cache->pps_Resident[ps_Victim->ui64_Brick] = NULL;
+    ps_Cache->ui64_MemoryInUse -= ps_Cache->ui64_BrickBytes;
+    common_accounting_remove (ps_Cache->ps_Accounting, ACCOUNTING_CACHE, ps_Cache->ui64_BrickBytes);
+    free (ps_Victim);
+  }
+
+  return ps_Brick;
+}
+
+
+unsigned long long
+ui64_memory_brick_index (BrickCache *ps_Cache, unsigned int ui32_X, unsigned int ui32_Y,
+                         unsigned int ui32_Z, unsigned int ui32_T)
+{
+  unsigned int ui32_Size = ps_Cache->ui32_BrickSize;
+
+  return (((unsigned long long)ui32_T * ps_Cache->ui32_BricksZ + ui32_Z / ui32_Size)
+          * ps_Cache->ui32_BricksY + ui32_Y / ui32_Size)
+         * ps_Cache->ui32_BricksX + ui32_X / ui32_Size;
+}
+
+
+unsigned long long
+ui64_memory_brick_offset (BrickCache *ps_Cache, unsigned int ui32_X, unsigned int ui32_Y, unsigned int ui32_Z)
+{
+  unsigned int ui32_Size = ps_Cache->ui32_BrickSize;
+
+  return (((unsigned long long)(ui32_Z % ui32_Size) * ui32_Size + ui32_Y % ui32_Size)
+          * ui32_Size + ui32_X % ui32_Size) * ps_Cache->ui32_ElementSize;
+}
+
+
+/**
+ * Returns a brick, reading it when it is not in memory. The lock of the
+ * cache must be held.
+ */
+CachedBrick*
+ps_memory_brick_get (BrickCache *ps_Cache, unsigned long long ui64_Brick)
+{
+  CachedBrick *ps_Brick = ps_Cache->pps_Resident[ui64_Brick];
+
+  if (ps_Brick == NULL)
+  {
+    ps_Cache->ui64_Misses++;
+    return ps_memory_brick_fault (ps_Cache, ui64_Brick);
+  }
+
+  ps_Cache->ui64_Hits++;
+  if (ps_Brick != ps_Cache->ps_MostRecent)
+  {
+    v_memory_brick_unlink (ps_Cache, ps_Brick);
+    v_memory_brick_push_front (ps_Cache, ps_Brick);
+  }
+
+  return ps_Brick;
+}
+
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* GLOBAL FUNCTIONS                                                                                   */
+/*                                                                                                    */
+/*                                                                                                    */
+
+short int
+memory_brick_write (Serie *serie, const char *pc_Path, short int b_Compress,
+                    unsigned long long *pui64_BytesWritten)
+{
+  debug_functions ();
+
+  ts_BrickFileHeader ts_Header;
+  ts_BrickWriteJob ts_Job;
+  unsigned long long *pui64_Offsets, ui64_SlabBricks, ui64_Slab, ui64_Slabs, ui64_Brick;
+  unsigned long long ui64_SlabSize, ui64_SlabOffset;
+  unsigned int *pui32_Lengths, ui32_Z;
+  unsigned char *pu8_SlabBuffer = NULL;
+  off_t t_Position;
+  char *pc_TemporaryName;
+  int i32_File;
+  short int b_Success = 1;
+
+  if (serie == NULL || pc_Path == NULL) return 1;
+
+  memset (&ts_Header, 0, sizeof (ts_BrickFileHeader));
+  memcpy (ts_Header.ac_Magic, BRICK_FILE_MAGIC, sizeof (ts_Header.ac_Magic));
+  ts_Header.ui32_Version = BRICK_FILE_VERSION;
+  ts_Header.ui32_BrickSize = BRICK_DEFAULT_SIZE;
+  ts_Header.ui32_ElementSize = memory_serie_get_memory_space (serie);
+
+  ts_Header.ts_Matrix = serie->matrix;
+  ts_Header.u16_NumberOfTimeSeries = serie->num_time_series;
+  ts_Header.ts_PixelDimension = serie->pixel_dimension;
+  ts_Header.f_Slope = serie->slope;
+  ts_Header.f_Offset = serie->offset;
+  ts_Header.i16_RawDataType = serie->raw_data_type;
+  ts_Header.e_DataType = serie->data_type;
+  ts_Header.e_InputType = serie->input_type;
+  ts_Header.u8_AxisUnits = serie->u8_AxisUnits;
+
+  ts_Header.d_Qfac = serie->d_Qfac;
+  ts_Header.i16_QuaternionCode = serie->i16_QuaternionCode;
+  if (serie->ps_Quaternion != NULL)
+    ts_Header.ts_Quaternion = *serie->ps_Quaternion;
+  if (serie->ps_QuaternationOffset != NULL)
+    ts_Header.ts_QuaternationOffset = *serie->ps_QuaternationOffset;
+  ts_Header.t_ScannerSpaceIJKtoXYZ = serie->t_ScannerSpaceIJKtoXYZ;
+  ts_Header.t_ScannerSpaceXYZtoIJK = serie->t_ScannerSpaceXYZtoIJK;
+  ts_Header.i16_StandardSpaceCode = serie->i16_StandardSpaceCode;
+  ts_Header.t_StandardSpaceIJKtoXYZ = serie->t_StandardSpaceIJKtoXYZ;
+  ts_Header.t_StandardSpaceXYZtoIJK = serie->t_StandardSpaceXYZtoIJK;
+  ts_Header.b_UsesStandardSpace = (serie->pt_RotationMatrix == &serie->t_StandardSpaceIJKtoXYZ);
+
+  memset (&ts_Job, 0, sizeof (ts_BrickWriteJob));
+  ts_Job.ps_Serie = serie;
+  ts_Job.ui32_BrickSize = ts_Header.ui32_BrickSize;
+  ts_Job.ui32_ElementSize = ts_Header.ui32_ElementSize;
+  ts_Job.ui32_BricksX = (serie->matrix.i16_x + ts_Job.ui32_BrickSize - 1) / ts_Job.ui32_BrickSize;
+  ts_Job.ui32_BricksY = (serie->matrix.i16_y + ts_Job.ui32_BrickSize - 1) / ts_Job.ui32_BrickSize;
+  ts_Job.ui32_BricksZ = (serie->matrix.i16_z + ts_Job.ui32_BrickSize - 1) / ts_Job.ui32_BrickSize;
+  ts_Job.ui64_BrickBytes = (unsigned long long)ts_Job.ui32_BrickSize * ts_Job.ui32_BrickSize *
+                           ts_Job.ui32_BrickSize * ts_Job.ui32_ElementSize;
+  ts_Job.b_Compress = b_Compress;
+  ts_Job.pui64_BytesWritten = pui64_BytesWritten;
+
+  ts_Header.ui64_NumberOfBricks = (unsigned long long)ts_Job.ui32_BricksX * ts_Job.ui32_BricksY *
+                                  ts_Job.ui32_BricksZ * serie->num_time_series;
+
+  // The volume is converted one slab of bricks at a time. A Serie that does
+  // not have all of its data in memory in linear order is read into a
+  // buffer of a single slab.
+  ui64_SlabBricks = (unsigned long long)ts_Job.ui32_BricksX * ts_Job.ui32_BricksY;
+  ui64_Slabs = (unsigned long long)ts_Job.ui32_BricksZ * serie->num_time_series;
+  ui64_SlabSize = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y *
+                  ts_Job.ui32_BrickSize * ts_Job.ui32_ElementSize;
+
+  pui64_Offsets = calloc (ts_Header.ui64_NumberOfBricks, sizeof (unsigned long long));
+  pui32_Lengths = calloc (ts_Header.ui64_NumberOfBricks, sizeof (unsigned int));
+  ts_Job.ppu8_Bricks = calloc (ui64_SlabBricks, sizeof (unsigned char *));
+  ts_Job.pul_Lengths = calloc (ui64_SlabBricks, sizeof (unsigned long));
+  if (!memory_serie_has_linear_data (serie))
+    pu8_SlabBuffer = malloc (ui64_SlabSize);
+
+  if (pui64_Offsets == NULL || pui32_Lengths == NULL || ts_Job.ppu8_Bricks == NULL || ts_Job.pul_Lengths == NULL
+      || (pu8_SlabBuffer == NULL && !memory_serie_has_linear_data (serie)))
+  {
+    debug_error ("Not enough memory to write '%s'.", pc_Path);
+    free (pui64_Offsets);
+    free (pui32_Lengths);
+    free (ts_Job.ppu8_Bricks);
+    free (ts_Job.pul_Lengths);
+    free (pu8_SlabBuffer);
+    return 1;
+  }
+
+  // Write into a temporary file that replaces the destination when done.
+  pc_TemporaryName = calloc (1, strlen (pc_Path) + 8);
+  assert (pc_TemporaryName != NULL);
+  sprintf (pc_TemporaryName, "%s.XXXXXX", pc_Path);
+
+  i32_File = mkstemp (pc_TemporaryName);
+  if (i32_File < 0)
+  {
+    debug_error ("Could not open the file '%s'.", pc_Path);
+    free (pc_TemporaryName);
+    free (pui64_Offsets);
+    free (pui32_Lengths);
+    free (ts_Job.ppu8_Bricks);
+    free (ts_Job.pul_Lengths);
+    free (pu8_SlabBuffer);
+    return 1;
+  }
+
+  fchmod (i32_File, 0644);
+
+  // The bricks follow the header and the index, which is written last.
+  t_Position = sizeof (ts_BrickFileHeader) +
+               ts_Header.ui64_NumberOfBricks * (sizeof (unsigned long long) + sizeof (unsigned int));
+
+  for (ui64_Slab = 0; b_Success && ui64_Slab < ui64_Slabs; ui64_Slab++)
+  {
+    // Slabs run along z first, then time, like the bricks in them.
+    ui32_Z = (ui64_Slab % ts_Job.ui32_BricksZ) * ts_Job.ui32_BrickSize;
+    ts_Job.ui32_Depth = ((unsigned int)serie->matrix.i16_z - ui32_Z < ts_Job.ui32_BrickSize)
+                        ? serie->matrix.i16_z - ui32_Z : ts_Job.ui32_BrickSize;
+    ts_Job.ui64_FirstBrick = ui64_Slab * ui64_SlabBricks;
+
+    ui64_SlabOffset = ((ui64_Slab / ts_Job.ui32_BricksZ) * serie->matrix.i16_z + ui32_Z) *
+                      serie->matrix.i16_x * serie->matrix.i16_y * ts_Job.ui32_ElementSize;
+
+    if (pu8_SlabBuffer == NULL)
+      ts_Job.pu8_Slab = (unsigned char *)serie->data + ui64_SlabOffset;
+
+    else if (memory_serie_read_linear (serie, ui64_SlabOffset,
+                                       ui64_SlabSize / ts_Job.ui32_BrickSize * ts_Job.ui32_Depth,
+                                       pu8_SlabBuffer) == 0)
+      ts_Job.pu8_Slab = pu8_SlabBuffer;
+
+    else
+    {
+      b_Success = 0;
+      break;
+    }
+
+    common_thread_parallel_for (ui64_SlabBricks, 1, 0, v_memory_brick_write_range, &ts_Job);
+    if (ts_Job.b_Failed)
+      b_Success = 0;
+
+    for (ui64_Brick = 0; ui64_Brick < ui64_SlabBricks; ui64_Brick++)
+    {
+      if (b_Success)
+      {
+        pui64_Offsets[ts_Job.ui64_FirstBrick + ui64_Brick] = t_Position;
+        pui32_Lengths[ts_Job.ui64_FirstBrick + ui64_Brick] = ts_Job.pul_Lengths[ui64_Brick];
+
+        b_Success = b_memory_brick_write_all (i32_File, ts_Job.ppu8_Bricks[ui64_Brick],
+                                              ts_Job.pul_Lengths[ui64_Brick], t_Position);
+        t_Position += ts_Job.pul_Lengths[ui64_Brick];
+      }
+
+      free (ts_Job.ppu8_Bricks[ui64_Brick]), ts_Job.ppu8_Bricks[ui64_Brick] = NULL;
+    }
+  }
+
+  // The range of a Serie that is streamed is only known once all of it has
+  // been read.
+  ts_Header.i32_MinimumValue = serie->i32_MinimumValue;
+  ts_Header.i32_MaximumValue = serie->i32_MaximumValue;
+
+  t_Position = 0;
+  b_Success = b_Success
+    && b_memory_brick_write_all (i32_File, &ts_Header, sizeof (ts_BrickFileHeader), t_Position)
+    && b_memory_brick_write_all (i32_File, pui64_Offsets, ts_Header.ui64_NumberOfBricks * sizeof (unsigned long long),
+                                 t_Position + sizeof (ts_BrickFileHeader))
+    && b_memory_brick_write_all (i32_File, pui32_Lengths, ts_Header.ui64_NumberOfBricks * sizeof (unsigned int),
+                                 t_Position + sizeof (ts_BrickFileHeader) + ts_Header.ui64_NumberOfBricks * sizeof (unsigned long long))
+    && fsync (i32_File) == 0;
+
+  if (close (i32_File) != 0)
+    b_Success = 0;
+
+  if (b_Success && rename (pc_TemporaryName, pc_Path) != 0)
+    b_Success = 0;
+
+  if (!b_Success)
+  {
+    debug_error ("Error while writing the file '%s'.", pc_Path);
+    unlink (pc_TemporaryName);
+  }
+
+  free (pc_TemporaryName);
+  free (pui64_Offsets);
+  free (pui32_Lengths);
+  free (ts_Job.ppu8_Bricks);
+  free (ts_Job.pul_Lengths);
+  free (pu8_SlabBuffer);
+
+  return (b_Success) ? 0 : 1;
+}
+
+
+BrickCache*
+memory_brick_open (Serie *serie, const char *pc_Path, unsigned long long ui64_MemoryBudget)
+{
+  debug_functions ();
+
+  ts_BrickFileHeader ts_Header;
+  BrickCache *ps_Cache;
+  struct stat ts_Stat;
+  unsigned long long ui64_Brick;
+  int i32_File;
+
+  if (serie == NULL || pc_Path == NULL) return NULL;
+
+  i32_File = open (pc_Path, O_RDONLY);
+  if (i32_File < 0) return NULL;
+
+  if (!b_memory_brick_read_all (i32_File, &ts_Header, sizeof (ts_BrickFileHeader), 0)
+      || memcmp (ts_Header.ac_Magic, BRICK_FILE_MAGIC, sizeof (ts_Header.ac_Magic)) != 0
+      || ts_Header.ui32_Version != BRICK_FILE_VERSION
+      || ts_Header.ui32_BrickSize == 0
+      || ts_Header.ui32_ElementSize == 0
+      || ts_Header.ui32_ElementSize != (unsigned int)memory_serie_get_type_space (ts_Header.e_DataType))
+  {
+    debug_error ("'%s' is not a brick file.", pc_Path);
+    close (i32_File);
+    return NULL;
+  }
+
+  ps_Cache = calloc (1, sizeof (BrickCache));
+  assert (ps_Cache != NULL);
+
+  ps_Cache->i32_File = i32_File;
+  ps_Cache->ui32_BrickSize = ts_Header.ui32_BrickSize;
+  ps_Cache->ts_Matrix = ts_Header.ts_Matrix;
+  ps_Cache->u16_NumberOfTimeSeries = ts_Header.u16_NumberOfTimeSeries;
+  ps_Cache->ui32_BricksX = (ts_Header.ts_Matrix.i16_x + ts_Header.ui32_BrickSize - 1) / ts_Header.ui32_BrickSize;
+  ps_Cache->ui32_BricksY = (ts_Header.ts_Matrix.i16_y + ts_Header.ui32_BrickSize - 1) / ts_Header.ui32_BrickSize;
+  ps_Cache->ui32_BricksZ = (ts_Header.ts_Matrix.i16_z + ts_Header.ui32_BrickSize - 1) / ts_Header.ui32_BrickSize;
+  ps_Cache->ui64_NumberOfBricks = ts_Header.ui64_NumberOfBricks;
+  ps_Cache->ui32_ElementSize = ts_Header.ui32_ElementSize;
+  ps_Cache->ui64_BrickBytes = (unsigned long long)ts_Header.ui32_BrickSize * ts_Header.ui32_BrickSize *
+                              ts_Header.ui32_BrickSize * ts_Header.ui32_ElementSize;
+  ps_Cache->ui64_MemoryBudget = ui64_MemoryBudget;
+  ps_Cache->ps_Accounting = &serie->ts_Accounting;
+
+  ps_Cache->pui64_Offsets = calloc (ps_Cache->ui64_NumberOfBricks, sizeof (unsigned long long));
+  ps_Cache->pui32_Lengths = calloc (ps_Cache->ui64_NumberOfBricks, sizeof (unsigned int));
+  ps_Cache->pps_Resident = calloc (ps_Cache->ui64_NumberOfBricks, sizeof (CachedBrick *));
+  pthread_mutex_init (&ps_Cache->t_Lock, NULL);
+
+  if (ps_Cache->ui64_NumberOfBricks != (unsigned long long)ps_Cache->ui32_BricksX * ps_Cache->ui32_BricksY *
+                                       ps_Cache->ui32_BricksZ * ps_Cache->u16_NumberOfTimeSeries
+      || ps_Cache->pui64_Offsets == NULL || ps_Cache->pui32_Lengths == NULL || ps_Cache->pps_Resident == NULL
+      || !b_memory_brick_read_all (i32_File, ps_Cache->pui64_Offsets,
+                                   ps_Cache->ui64_NumberOfBricks * sizeof (unsigned long long),
+                                   sizeof (ts_BrickFileHeader))
+      || !b_memory_brick_read_all (i32_File, ps_Cache->pui32_Lengths,
+                                   ps_Cache->ui64_NumberOfBricks * sizeof (unsigned int),
+                                   sizeof (ts_BrickFileHeader) + ps_Cache->ui64_NumberOfBricks * sizeof (unsigned long long)))
+  {
+    debug_error ("The index of '%s' is damaged.", pc_Path);
+    memory_brick_close (ps_Cache);
+    return NULL;
+  }
+
+  // A brick is read straight into a buffer of ui64_BrickBytes, so an index
+  // entry that points past the end of the file, or that is larger than the
+  // brick it holds, is as damaged as a short index.
+  if (fstat (i32_File, &ts_Stat) != 0)
+  {
+    debug_error ("Could not stat '%s'.", pc_Path);
+    memory_brick_close (ps_Cache);
+    return NULL;
+  }
+
+  for (ui64_Brick = 0; ui64_Brick < ps_Cache->ui64_NumberOfBricks; ui64_Brick++)
+  {
+    if (ps_Cache->pui32_Lengths[ui64_Brick] == 0
+        || ps_Cache->pui32_Lengths[ui64_Brick] > ps_Cache->ui64_BrickBytes
+        || ps_Cache->pui64_Offsets[ui64_Brick] > (unsigned long long)ts_Stat.st_size
+        || ps_Cache->pui32_Lengths[ui64_Brick] > (unsigned long long)ts_Stat.st_size - ps_Cache->pui64_Offsets[ui64_Brick])
+    {
+      debug_error ("Brick %llu of '%s' lies outside the file.", ui64_Brick, pc_Path);
+      memory_brick_close (ps_Cache);
+      return NULL;
+    }
+  }
+
+  /*--------------------------------------------------------------------------.
+   | FILL IN THE SERIE                                                        |
+   '--------------------------------------------------------------------------*/
+
+  serie->matrix = ts_Header.ts_Matrix;
+  serie->num_time_series = ts_Header.u16_NumberOfTimeSeries;
+  serie->pixel_dimension = ts_Header.ts_PixelDimension;
+  serie->slope = ts_Header.f_Slope;
+  serie->offset = ts_Header.f_Offset;
+  serie->raw_data_type = ts_Header.i16_RawDataType;
+  serie->data_type = ts_Header.e_DataType;
+  serie->input_type = ts_Header.e_InputType;
+  serie->u8_AxisUnits = ts_Header.u8_AxisUnits;
+  serie->i32_MinimumValue = ts_Header.i32_MinimumValue;
+  serie->i32_MaximumValue = ts_Header.i32_MaximumValue;
+
+  serie->d_Qfac = ts_Header.d_Qfac;
+  serie->i16_QuaternionCode = ts_Header.i16_QuaternionCode;
+
+  if (serie->ps_Quaternion == NULL)
+    serie->ps_Quaternion = calloc (1, sizeof (ts_Quaternion));
+  if (serie->ps_QuaternationOffset == NULL)
+    serie->ps_QuaternationOffset = calloc (1, sizeof (ts_Quaternion));
+
+  assert (serie->ps_Quaternion != NULL && serie->ps_QuaternationOffset != NULL);
+  *serie->ps_Quaternion = ts_Header.ts_Quaternion;
+  *serie->ps_QuaternationOffset = ts_Header.ts_QuaternationOffset;
+
+  serie->t_ScannerSpaceIJKtoXYZ = ts_Header.t_ScannerSpaceIJKtoXYZ;
+  serie->t_ScannerSpaceXYZtoIJK = ts_Header.t_ScannerSpaceXYZtoIJK;
+  serie->i16_StandardSpaceCode = ts_Header.i16_StandardSpaceCode;
+  serie->t_StandardSpaceIJKtoXYZ = ts_Header.t_StandardSpaceIJKtoXYZ;
+  serie->t_StandardSpaceXYZtoIJK = ts_Header.t_StandardSpaceXYZtoIJK;
+
+  if (ts_Header.b_UsesStandardSpace)
+  {
+    serie->pt_RotationMatrix = &serie->t_StandardSpaceIJKtoXYZ;
+    serie->pt_InverseMatrix = &serie->t_StandardSpaceXYZtoIJK;
+  }
+  else
+  {
+    serie->pt_RotationMatrix = &serie->t_ScannerSpaceIJKtoXYZ;
+    serie->pt_InverseMatrix = &serie->t_ScannerSpaceXYZtoIJK;
+  }
+
+  if (serie->pv_OutOfBlobValue == NULL)
+    serie->pv_OutOfBlobValue = calloc (1, ps_Cache->ui32_ElementSize);
+
+  serie->ps_BrickCache = ps_Cache;
+
+  return ps_Cache;
+}
+
+
+BrickCache*
+memory_brick_reopen (BrickCache *ps_Cache, Serie *serie)
+{
+  debug_functions ();
+
+  BrickCache *ps_Copy;
+  int i32_File;
+
+  if (ps_Cache == NULL || serie == NULL) return NULL;
+
+  // The open file is shared rather than its path, so a file that has been
+  // replaced since is still the one that is read.
+  i32_File = dup (ps_Cache->i32_File);
+  if (i32_File < 0) return NULL;
+
+  ps_Copy = calloc (1, sizeof (BrickCache));
+  assert (ps_Copy != NULL);
+
+  ps_Copy->i32_File = i32_File;
+  ps_Copy->ui32_BrickSize = ps_Cache->ui32_BrickSize;
+  ps_Copy->ts_Matrix = ps_Cache->ts_Matrix;
+  ps_Copy->u16_NumberOfTimeSeries = ps_Cache->u16_NumberOfTimeSeries;
+  ps_Copy->ui32_BricksX = ps_Cache->ui32_BricksX;
+  ps_Copy->ui32_BricksY = ps_Cache->ui32_BricksY;
+  ps_Copy->ui32_BricksZ = ps_Cache->ui32_BricksZ;
+  ps_Copy->ui64_NumberOfBricks = ps_Cache->ui64_NumberOfBricks;
+  ps_Copy->ui32_ElementSize = ps_Cache->ui32_ElementSize;
+  ps_Copy->ui64_BrickBytes = ps_Cache->ui64_BrickBytes;
+  ps_Copy->ui64_MemoryBudget = ps_Cache->ui64_MemoryBudget;
+  ps_Copy->ps_Accounting = &serie->ts_Accounting;
+
+  ps_Copy->pui64_Offsets = calloc (ps_Copy->ui64_NumberOfBricks, sizeof (unsigned long long));
+  ps_Copy->pui32_Lengths = calloc (ps_Copy->ui64_NumberOfBricks, sizeof (unsigned int));
+  ps_Copy->pps_Resident = calloc (ps_Copy->ui64_NumberOfBricks, sizeof (CachedBrick *));
+  pthread_mutex_init (&ps_Copy->t_Lock, NULL);
+
+  if (ps_Copy->pui64_Offsets == NULL || ps_Copy->pui32_Lengths == NULL || ps_Copy->pps_Resident == NULL)
+  {
+    memory_brick_close (ps_Copy);
+    return NULL;
+  }
+
+  memcpy (ps_Copy->pui64_Offsets, ps_Cache->pui64_Offsets, ps_Copy->ui64_NumberOfBricks * sizeof (unsigned long long));
+  memcpy (ps_Copy->pui32_Lengths, ps_Cache->pui32_Lengths, ps_Copy->ui64_NumberOfBricks * sizeof (unsigned int));
+
+  return ps_Copy;
+}
+
+
+short int
+memory_brick_read_voxel (BrickCache *ps_Cache, short int i16_X, short int i16_Y,
+                         short int i16_Z, unsigned short int u16_T, void *pv_Value)
+{
+  return (memory_brick_read_row (ps_Cache, i16_X, i16_Y, i16_Z, u16_T, 1, pv_Value) == 1);
+}
+
+
+unsigned int
+memory_brick_read_row (BrickCache *ps_Cache, short int i16_X, short int i16_Y,
+                       short int i16_Z, unsigned short int u16_T,
+                       unsigned int ui32_Voxels, void *pv_Values)
+{
+  unsigned char *pu8_Values = pv_Values;
+  unsigned int ui32_Size, ui32_Run, ui32_Read = 0;
+  CachedBrick *ps_Brick;
+
+  if (ps_Cache == NULL
+      || i16_X < 0 || i16_X >= ps_Cache->ts_Matrix.i16_x
+      || i16_Y < 0 || i16_Y >= ps_Cache->ts_Matrix.i16_y
+      || i16_Z < 0 || i16_Z >= ps_Cache->ts_Matrix.i16_z
+      || u16_T >= ps_Cache->u16_NumberOfTimeSeries)
+    return 0;
+
+  if (ui32_Voxels > (unsigned int)(ps_Cache->ts_Matrix.i16_x - i16_X))
+    ui32_Voxels = ps_Cache->ts_Matrix.i16_x - i16_X;
+
+  ui32_Size = ps_Cache->ui32_BrickSize;
+
+  // A run along x is contiguous within each brick, so it takes a lookup
+  // and a copy per brick, all under a single lock.
+  pthread_mutex_lock (&ps_Cache->t_Lock);
+
+  while (ui32_Read < ui32_Voxels)
+  {
+    unsigned int ui32_X = i16_X + ui32_Read;
+
+    ps_Brick = ps_memory_brick_get (ps_Cache, ui64_memory_brick_index (ps_Cache, ui32_X, i16_Y, i16_Z, u16_T));
+    if (ps_Brick == NULL) break;
+
+    ui32_Run = ui32_Size - ui32_X % ui32_Size;
+    if (ui32_Run > ui32_Voxels - ui32_Read)
+      ui32_Run = ui32_Voxels - ui32_Read;
+
+    memcpy (pu8_Values + (unsigned long long)ui32_Read * ps_Cache->ui32_ElementSize,
+            ps_Brick->pu8_Data + ui64_memory_brick_offset (ps_Cache, ui32_X, i16_Y, i16_Z),
+            (unsigned long long)ui32_Run * ps_Cache->ui32_ElementSize);
+
+    ui32_Read += ui32_Run;
+  }
+
+  pthread_mutex_unlock (&ps_Cache->t_Lock);
+
+  return ui32_Read;
+}
+
+
+unsigned int
+memory_brick_read_voxels (BrickCache *ps_Cache, unsigned short int u16_T,
+                          BrickVoxel *ps_Voxels, unsigned int ui32_Voxels)
+{
+  unsigned long long ui64_Brick, ui64_LastBrick = 0;
+  unsigned int ui32_Cnt, ui32_Read = 0;
+  CachedBrick *ps_Brick = NULL;
+  BrickVoxel *ps_Voxel;
+
+  if (ps_Cache == NULL || u16_T >= ps_Cache->u16_NumberOfTimeSeries) return 0;
+
+  // Neighbouring voxels of a slice mostly fall in the same brick, which is
+  // then only looked up once.
+  pthread_mutex_lock (&ps_Cache->t_Lock);
+
+  for (ui32_Cnt = 0; ui32_Cnt < ui32_Voxels; ui32_Cnt++)
+  {
+    ps_Voxel = &ps_Voxels[ui32_Cnt];
+
+    if (ps_Voxel->i16_X < 0 || ps_Voxel->i16_X >= ps_Cache->ts_Matrix.i16_x
+        || ps_Voxel->i16_Y < 0 || ps_Voxel->i16_Y >= ps_Cache->ts_Matrix.i16_y
+        || ps_Voxel->i16_Z < 0 || ps_Voxel->i16_Z >= ps_Cache->ts_Matrix.i16_z)
+      continue;
+
+    ui64_Brick = ui64_memory_brick_index (ps_Cache, ps_Voxel->i16_X, ps_Voxel->i16_Y, ps_Voxel->i16_Z, u16_T);
+    if (ps_Brick == NULL || ui64_Brick != ui64_LastBrick)
+    {
+      ps_Brick = ps_memory_brick_get (ps_Cache, ui64_Brick);
+      ui64_LastBrick = ui64_Brick;
+      if (ps_Brick == NULL) continue;
+    }
+
+    memcpy (ps_Voxel->pv_Value,
+            ps_Brick->pu8_Data + ui64_memory_brick_offset (ps_Cache, ps_Voxel->i16_X, ps_Voxel->i16_Y, ps_Voxel->i16_Z),
+            ps_Cache->ui32_ElementSize);
+    ui32_Read++;
+  }
+
+  pthread_mutex_unlock (&ps_Cache->t_Lock);
+
+  return ui32_Read;
+}
+
+
+void
+memory_brick_close (BrickCache *ps_Cache)
+{
+  debug_functions ();
+
+  if (ps_Cache == NULL) return;
+
+  CachedBrick *ps_Brick = ps_Cache->ps_MostRecent;
+  while (ps_Brick != NULL)
+  {
+    CachedBrick *ps_Next = ps_Brick->ps_Next;
+    free (ps_Brick);
+    ps_Brick = ps_Next;
+  }
+
+  common_accounting_remove (ps_Cache->ps_Accounting, ACCOUNTING_CACHE, ps_Cache->ui64_MemoryInUse);
+
+  debug_extra ("Brick cache: %llu hits, %llu misses.", ps_Cache->ui64_Hits, ps_Cache->ui64_Misses);
+
+  close (ps_Cache->i32_File);
+  pthread_mutex_destroy (&ps_Cache->t_Lock);
+
+  free (ps_Cache->pui64_Offsets), ps_Cache->pui64_Offsets = NULL;
+  free (ps_Cache->pui32_Lengths), ps_Cache->pui32_Lengths = NULL;
+  free (ps_Cache->pps_Resident), ps_Cache->pps_Resident = NULL;
+  free (ps_Cache), ps_Cache = NULL;
+}
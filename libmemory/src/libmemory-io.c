@@ -23,15 +23,24 @@
 #include "libmemory-patient.h"
 #include "libmemory-study.h"
 #include "libmemory-serie.h"
+#include "libmemory-brick.h"
+#include "libmemory-sparse.h"
 #include "libcommon-debug.h"
+#include "libcommon-iohint.h"
+#include "libcommon-thread.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <dirent.h>
 #include <libgen.h>
 
 #include <string.h>
+#include <strings.h>
 
 // On Microsoft Windows we should search for backslashes instead of forward
 // slashes.
@@ -41,6 +50,31 @@
 #define PATH_SEPARATOR '/'
 #endif
 
+// The index of a parsed dicom directory is stored next to the files.
+#define DICOM_INDEX_FILENAME ".clmedview-index"
+#define DICOM_INDEX_MAGIC    "CLMVIDX\0"
+#define DICOM_INDEX_VERSION  2
+
+// The number of dicom files to read ahead while loading slices.
+#define DICOM_READAHEAD_FILES 8
+
+// The number of dicom files each thread reads at least when the pixel
+// data of a serie is read in parallel.
+#define DICOM_PARALLEL_MIN_FILES 4
+
+static int i32_CompressionLevel = -1;
+static unsigned long long ui64_BrickMemoryBudget = BRICK_DEFAULT_BUDGET;
+
+// Files loaded by load jobs share a single limit on how many of them are
+// read at the same time, no matter how many jobs are running.
+static unsigned int ui32_LoadConcurrency = MEMORY_IO_DEFAULT_LOAD_CONCURRENCY;
+static unsigned int ui32_ActiveLoads = 0;
+static pthread_mutex_t t_LoadMutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t t_LoadCondition = PTHREAD_COND_INITIALIZER;
+
+// When set, the pixel data of dicom series is read when it is first viewed.
+static short int b_LazyDicom = 0;
+
 
 /*                                                                                                    */
 /*                                                                                                    */
@@ -55,6 +89,16 @@ short int i16_memory_io_isDirectory(const char *path);
 short int i16_memory_io_isFile(const char *path);
 short int i16_memory_io_load_file_nifti (Tree **patient_tree, char *path);
 short int i16_memory_io_load_file_dicom (Tree **patient_tree, char *path);
+short int i16_memory_io_save_file (Serie *serie, const char *path, unsigned long long *pui64_BytesWritten);
+Tree *pt_memory_io_load_file_any (char *pc_path);
+Tree *pt_memory_io_merge_serie (Tree **ppt_study, Tree *pt_new_serie);
+void v_memory_io_copy_id (char *pc_Id, size_t s_IdLen, const char *pc_Name);
+Tree *pt_memory_io_unknown_tree (Serie *ps_serie);
+void v_memory_io_destroy_tree (Tree *pt_serie);
+Tree *pt_memory_io_load_nifti (char *pc_path, short int b_Lazy, short int b_Streaming);
+Tree *pt_memory_io_load_dicom (char *pc_path, short int b_Lazy, short int b_Streaming);
+short int i16_memory_io_dicom_index_load (const char *pc_dirName, unsigned int ui32_Entries, unsigned long long ui64_Fingerprint, char **ppc_Names, Patient *ps_patient, Study *ps_study, Serie *ps_serie, List **ppll_dicomFiles);
+short int i16_memory_io_dicom_index_save (const char *pc_dirName, unsigned int ui32_Entries, unsigned long long ui64_Fingerprint, Patient *ps_patient, Study *ps_study, Serie *ps_serie, List *pll_dicomFiles);
 
 
 typedef struct s_dicom_FileProperties
@@ -70,9 +114,140 @@ typedef struct s_dicom_FileProperties
 
   te_DCM_ComplexImageComponent  e_DCM_CIC;
 
+  long                          l_PixelDataOffset;
+  long                          l_PixelDataLength;
+
+  int                           i32_Slice;
+  short int                     b_Loaded;
+
 } ts_dicom_FileProperties;
 
 
+int i32_memory_io_dicom_compare_load_order (const void *pv_First, const void *pv_Second)
+{
+  const ts_dicom_FileProperties *ps_First = *(ts_dicom_FileProperties * const *)pv_First;
+  const ts_dicom_FileProperties *ps_Second = *(ts_dicom_FileProperties * const *)pv_Second;
+
+  if (ps_First->i16_TemporalPositionIdentifier != ps_Second->i16_TemporalPositionIdentifier)
+    return ps_First->i16_TemporalPositionIdentifier - ps_Second->i16_TemporalPositionIdentifier;
+
+  return ps_First->i16_relativeOrderNumber - ps_Second->i16_relativeOrderNumber;
+}
+
+
+void v_memory_io_dicom_prefetch (ts_dicom_FileProperties **pps_Files, int i32_Files, int i32_File)
+{
+  if (pps_Files == NULL || i32_File < 0 || i32_File >= i32_Files) return;
+
+  // Without a known pixel data offset, the whole file is read.
+  if (pps_Files[i32_File]->l_PixelDataOffset >= 0)
+    common_iohint_prefetch_file (pps_Files[i32_File]->pc_Filename,
+                                 pps_Files[i32_File]->l_PixelDataOffset,
+                                 pps_Files[i32_File]->l_PixelDataLength);
+  else
+    common_iohint_prefetch_file (pps_Files[i32_File]->pc_Filename, 0, 0);
+}
+
+
+typedef struct
+{
+  Serie *ps_Serie;
+  ts_dicom_FileProperties **pps_Files;
+  long l_SliceSize;
+} ts_dicom_SliceReadJob;
+
+
+void v_memory_io_dicom_read_slices (unsigned long long start, unsigned long long end,
+                                    unsigned int worker, void *user_data)
+{
+  ts_dicom_SliceReadJob *ps_Job = (ts_dicom_SliceReadJob *)user_data;
+  ts_dicom_FileProperties *ps_File;
+  unsigned long long ui64_Cnt;
+  (void)worker;
+
+  for (ui64_Cnt = start; ui64_Cnt < end; ui64_Cnt++)
+  {
+    ps_File = ps_Job->pps_Files[ui64_Cnt];
+    if (ps_File->i32_Slice < 0 || ps_File->l_PixelDataOffset < 0 || ps_File->l_PixelDataLength < ps_Job->l_SliceSize)
+    {
+      continue;
+    }
+
+    ps_File->b_Loaded = i16_memory_io_dicom_readPixelData (ps_File->pc_Filename,
+                                                           (char *)ps_Job->ps_Serie->data + ps_File->i32_Slice * ps_Job->l_SliceSize,
+                                                           ps_File->l_PixelDataOffset, ps_Job->l_SliceSize);
+  }
+}
+
+
+void v_memory_io_dicom_load_slices (Serie *ps_serie, ts_dicom_FileProperties **pps_Files, int i32_Files)
+{
+  ts_dicom_SliceReadJob ts_Job;
+  int i32_Cnt;
+
+  ts_Job.ps_Serie = ps_serie;
+  ts_Job.pps_Files = pps_Files;
+  ts_Job.l_SliceSize = (long)ps_serie->matrix.i16_x * ps_serie->matrix.i16_y * 2;
+
+  if (ps_serie->data == NULL)
+  {
+    ps_serie->data = calloc ((size_t)ps_serie->matrix.i16_z * ps_serie->num_time_series, ts_Job.l_SliceSize);
+    ps_serie->pv_OutOfBlobValue = calloc (1, 2);
+    assert (ps_serie->data != NULL && ps_serie->pv_OutOfBlobValue != NULL);
+  }
+
+  // Each file holds one slice at a known offset, so the files are read
+  // straight into their slices by several threads at once.
+  common_thread_parallel_for (i32_Files, DICOM_PARALLEL_MIN_FILES, 0, v_memory_io_dicom_read_slices, &ts_Job);
+
+  // Files without a usable offset, or that could not be read directly,
+  // are parsed one at a time.
+  for (i32_Cnt = 0; i32_Cnt < i32_Files; i32_Cnt++)
+  {
+    if (pps_Files[i32_Cnt]->i32_Slice >= 0 && !pps_Files[i32_Cnt]->b_Loaded)
+    {
+      i16_memory_io_dicom_loadSingleSlice (ps_serie, pps_Files[i32_Cnt]->pc_Filename,
+                                           pps_Files[i32_Cnt]->i32_Slice % ps_serie->matrix.i16_z,
+                                           pps_Files[i32_Cnt]->i32_Slice / ps_serie->matrix.i16_z, -1, 0);
+    }
+  }
+}
+
+
+/**
+ * This structure tells where the pixel data of a slice of a lazy dicom
+ * serie can be found.
+ */
+typedef struct
+{
+  char *pc_Filename;
+  long l_PixelDataOffset;
+  long l_PixelDataLength;
+} ts_dicom_SliceSource;
+
+
+short int i16_memory_io_dicom_load_lazy_slice (Serie *ps_serie, short int i16_Slice, unsigned short int u16_TimePoint, void *pv_Source)
+{
+  ts_dicom_SliceSource *ps_Source = (ts_dicom_SliceSource *)pv_Source;
+
+  common_iohint_prefetch_file (ps_Source->pc_Filename,
+                               (ps_Source->l_PixelDataOffset >= 0) ? ps_Source->l_PixelDataOffset : 0,
+                               (ps_Source->l_PixelDataOffset >= 0) ? ps_Source->l_PixelDataLength : 0);
+
+  return i16_memory_io_dicom_loadSingleSlice (ps_serie, ps_Source->pc_Filename, i16_Slice, u16_TimePoint,
+                                              ps_Source->l_PixelDataOffset, ps_Source->l_PixelDataLength);
+}
+
+
+void v_memory_io_dicom_slice_source_destroy (void *pv_Source)
+{
+  ts_dicom_SliceSource *ps_Source = (ts_dicom_SliceSource *)pv_Source;
+
+  free (ps_Source->pc_Filename), ps_Source->pc_Filename = NULL;
+  free (ps_Source), ps_Source = NULL;
+}
+
+
 void v_print_Matrix(ts_Matrix4x4 *pt_Matrix)
 {
   printf("%10.4f, %10.4f, %10.4f, %10.4f \n", pt_Matrix->af_Matrix[0][0], pt_Matrix->af_Matrix[1][0], pt_Matrix->af_Matrix[2][0], pt_Matrix->af_Matrix[3][0]);
@@ -112,240 +287,980 @@ i16_memory_io_isFile(const char *path)
   return S_ISREG(statbuf.st_mode);
 }
 
-Tree *pt_memory_io_load_file_nifti (char *pc_path)
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* DICOM DIRECTORY INDEX                                                                              */
+/*                                                                                                    */
+/*                                                                                                    */
+
+/**
+ * The index is a flat binary file: one header, followed by one entry for
+ * each dicom file of the serie. It is only ever read back on the machine
+ * that wrote it, so the structures are written as they are in memory.
+ *
+ * The header holds a fingerprint of the directory listing, made from the
+ * name, inode, modification time and size of every entry. Any file that
+ * is added, removed, replaced or written to changes the fingerprint, and
+ * with it invalidates the index.
+ */
+typedef struct s_dicom_IndexHeader
 {
-  char *pc_filename=NULL;
+  char                          ac_Magic[8];
+  unsigned int                  ui32_Version;
+  unsigned int                  ui32_NumberOfFiles;
+  unsigned int                  ui32_NumberOfDirectoryEntries;
+  unsigned long long            ui64_DirectoryFingerprint;
+
+  char                          c_patientID[64];
+  char                          c_patientName[100];
+  char                          c_studyInstanceUID[64];
+  char                          c_studyName[100];
+  char                          c_serieInstanceUID[64];
+  char                          c_serieName[100];
+
+  ts_Coordinate3DInt            ts_Matrix;
+  Coordinate3D                  ts_PixelDimension;
+  float                         f_Slope;
+  float                         f_Offset;
+  MemoryDataType                e_DataType;
+  short unsigned int            u16_NumberOfTimeSeries;
+  short int                     i16_QuaternionCode;
+  ts_Matrix4x4                  t_ScannerSpaceIJKtoXYZ;
+
+} ts_dicom_IndexHeader;
+
+
+typedef struct s_dicom_IndexEntry
+{
+  char                          c_Filename[256];
 
-  Tree *pt_patient=NULL;
-  Tree *pt_study=NULL;
-  Tree *pt_serie=NULL;
+  Coordinate3D                  ts_ZPosition;
+  Vector3D                      ts_XVector;
+  Vector3D                      ts_YVector;
 
-  Patient *ps_patient = NULL;
-  Study   *ps_study = NULL;
-  Serie   *ps_serie = NULL;
+  short int                     i16_TemporalPositionIdentifier;
+  short int                     i16_StackPositionIdentifier;
+  te_DCM_ComplexImageComponent  e_DCM_CIC;
 
-  pc_filename = basename(pc_path);
+  long long                     i64_PixelDataOffset;
+  long long                     i64_PixelDataLength;
 
-	ps_patient=memory_patient_new("unknown");
-	strncpy(ps_patient->c_patientID,ps_patient->name,sizeof(ps_patient->c_patientID));
-	pt_patient=tree_append(NULL,ps_patient,TREE_TYPE_PATIENT);
+} ts_dicom_IndexEntry;
 
-	ps_study=memory_study_new ("unknown");
-	strncpy(ps_study->c_studyInstanceUID, ps_study->name, sizeof(ps_study->c_studyInstanceUID));
-  pt_study=tree_append_child(pt_patient, ps_study, TREE_TYPE_STUDY);
 
-  ps_serie = memory_serie_new (pc_filename, pc_path);
-  strncpy(ps_serie->c_serieInstanceUID, ps_serie->name, sizeof(ps_serie->c_serieInstanceUID));
-  pt_serie = tree_append_child (pt_study, ps_serie, TREE_TYPE_SERIE);
+void
+v_memory_io_dicom_file_properties_destroy (void *data)
+{
+  ts_dicom_FileProperties *ps_dicomFile = (ts_dicom_FileProperties*)data;
+  if (ps_dicomFile == NULL) return;
 
-  switch (memory_io_niftii_file_type (pc_path))
+  free (ps_dicomFile->pc_Filename), ps_dicomFile->pc_Filename = NULL;
+  free (ps_dicomFile), ps_dicomFile = NULL;
+}
+
+
+short int
+i16_memory_io_dicom_index_path (const char *pc_dirName, short int b_UserCache, char *pc_Output, size_t s_OutputLen)
+{
+  char c_RealPath[PATH_MAX];
+  const char *pc_CacheHome;
+  unsigned long ui64_Hash = 5381;
+  int i32_Cnt;
+
+  if (!b_UserCache)
   {
-    case MUMC_FILETYPE_NIFTII_SF: return (memory_io_niftii_load (ps_serie, pc_path, NULL) == 1) ? pt_serie : NULL; break;
-    case MUMC_FILETYPE_NIFTII_TF:
-      {
-        //Check weather the hdr or img file is passed
-        char* pc_Extension = strrchr (pc_path, '.');
+    return (snprintf (pc_Output, s_OutputLen, "%s%c%s", pc_dirName, PATH_SEPARATOR, DICOM_INDEX_FILENAME) < (int)s_OutputLen);
+  }
 
-        char c_ImageFile[1024];
-        char c_HeaderFile[1024];
+  // Directories we cannot write to (read-only media, shared storage) get
+  // their index in the user's cache directory, named by a hash of the
+  // directory's absolute path.
+  if (realpath (pc_dirName, c_RealPath) == NULL)
+  {
+    return 0;
+  }
 
-        strcpy(&c_ImageFile[0],pc_path);
-        strcpy(&c_HeaderFile[0],pc_path);
+  for (i32_Cnt = 0; c_RealPath[i32_Cnt] != '\0'; i32_Cnt++)
+  {
+    ui64_Hash = ((ui64_Hash << 5) + ui64_Hash) + (unsigned char)c_RealPath[i32_Cnt];
+  }
 
-        if (pc_Extension == NULL)
-        {
-          pc_Extension = strrchr (&c_ImageFile[0], '.');
-          strcat(pc_Extension, ".img");
+  pc_CacheHome = getenv ("XDG_CACHE_HOME");
+  if (pc_CacheHome != NULL && pc_CacheHome[0] != '\0')
+  {
+    mkdir (pc_CacheHome, 0700);
+    i32_Cnt = snprintf (pc_Output, s_OutputLen, "%s%cclmedview", pc_CacheHome, PATH_SEPARATOR);
+  }
+  else
+  {
+    pc_CacheHome = getenv ("HOME");
+    if (pc_CacheHome == NULL || pc_CacheHome[0] == '\0')
+    {
+      return 0;
+    }
 
-          pc_Extension = strrchr (&c_HeaderFile[0], '.');
-          strcat(pc_Extension, ".hdr");
-        }
-        else
-        {
-          pc_Extension = strrchr (&c_ImageFile[0], '.');
-          strcpy(pc_Extension, ".img");
-          pc_Extension = strrchr (&c_HeaderFile[0], '.');
-          strcpy(pc_Extension, ".hdr");
-        }
+    snprintf (pc_Output, s_OutputLen, "%s%c.cache", pc_CacheHome, PATH_SEPARATOR);
+    mkdir (pc_Output, 0700);
+    i32_Cnt = snprintf (pc_Output, s_OutputLen, "%s%c.cache%cclmedview", pc_CacheHome, PATH_SEPARATOR, PATH_SEPARATOR);
+  }
 
-        return (memory_io_niftii_load (ps_serie, c_ImageFile, c_HeaderFile) == 1) ? pt_serie : NULL; break;
-      }
-      break;
-    case MUMC_FILETYPE_ANALYZE75:
-    case MUMC_FILETYPE_DICOM:
-    case MUMC_FILETYPE_NOT_KNOWN:
-    default:
-      return NULL;
+  if (i32_Cnt >= (int)s_OutputLen)
+  {
+    return 0;
   }
 
+  mkdir (pc_Output, 0700);
+
+  return (snprintf (&pc_Output[i32_Cnt], s_OutputLen - i32_Cnt, "%c%016lx.idx", PATH_SEPARATOR, ui64_Hash) < (int)(s_OutputLen - i32_Cnt));
 }
 
-Tree *pt_memory_io_load_file_dicom (char *pc_path)
+
+unsigned long long
+ui64_memory_io_dicom_index_hash (unsigned long long ui64_Hash, const void *pv_Data, size_t s_Length)
 {
-  Patient *ps_patient = NULL;
-  Study   *ps_study = NULL;
-  Serie   *ps_serie=NULL;
+  const unsigned char *pu8_Data = (const unsigned char *)pv_Data;
+  size_t s_Cnt;
 
-  Tree *pt_patient=NULL;
-  Tree *pt_study=NULL;
-  Tree *pt_serie=NULL;
+  // FNV-1a
+  for (s_Cnt = 0; s_Cnt < s_Length; s_Cnt++)
+  {
+    ui64_Hash = (ui64_Hash ^ pu8_Data[s_Cnt]) * 0x100000001b3ULL;
+  }
 
-  DIR *p_dicomDirectory;
-  struct dirent *p_dirEntry;
+  return ui64_Hash;
+}
 
-  char *pc_dirName = NULL;
-  char *pc_fullPath = NULL;
 
-  ts_dicom_FileProperties *ps_ReferenceFileProps = NULL;
-  ts_dicom_FileProperties *ps_dicomFile;
+int
+i32_memory_io_dicom_index_compare_names (const void *pv_Left, const void *pv_Right)
+{
+  return strcmp (*(char * const *)pv_Left, *(char * const *)pv_Right);
+}
 
-  List *pll_dicomFiles = NULL;
-  List *pll_dicomFilesIter = NULL;
 
-  short int i16_NumberOfSlices=0;
-  short int i16_MinimumReferenceOrderValue=0;
-  short int i16_MaximumReferenceOrderValue=0;
-  short int i16_TemporalPositionIdentifier=0;
-  short int i16_StackPositionIdentifier=0;
-  short int i16_NumberOfReconstructions=0;
+void
+v_memory_io_dicom_index_free_names (char **ppc_Names, unsigned int ui32_Names)
+{
+  unsigned int ui32_Cnt;
 
-  short int i16_Cnt=0;
-  short int i16_timeFrameCnt=0;
+  if (ppc_Names == NULL) return;
 
-  Coordinate3D ts_slicePosition;
-  Vector3D     ts_XVector;
-  Vector3D     ts_YVector;
-  Vector3D     ts_ZVector;
+  for (ui32_Cnt = 0; ui32_Cnt < ui32_Names; ui32_Cnt++)
+  {
+    free (ppc_Names[ui32_Cnt]);
+  }
 
-  te_DCM_ComplexImageComponent e_DCM_CIC;
+  free (ppc_Names);
+}
 
-  // Build list of all files
-  // Check weather path is a path or a directory
-  pc_dirName = (i16_memory_io_isFile(pc_path)) ? dirname(pc_path) : pc_path;
-  p_dicomDirectory = opendir (pc_dirName);
 
-  if (p_dicomDirectory == NULL)
+short int
+i16_memory_io_dicom_index_fingerprint (const char *pc_dirName, unsigned int *pui32_Entries, unsigned long long *pui64_Fingerprint,
+                                       char ***pppc_Names)
+{
+  DIR *p_Directory;
+  struct dirent *p_dirEntry;
+  struct stat statbuf;
+  char c_Path[PATH_MAX];
+  char **ppc_Names = NULL;
+  unsigned int ui32_Allocated = 0;
+  unsigned long long ui64_Hash;
+  long long ai64_Properties[4];
+
+  *pui32_Entries = 0;
+  *pui64_Fingerprint = 0;
+  *pppc_Names = NULL;
+
+  p_Directory = opendir (pc_dirName);
+  if (p_Directory == NULL)
   {
     return 0;
   }
 
-  ps_patient = memory_patient_new ("unknown");
-  ps_study = memory_study_new("unknown");
-  ps_serie = memory_serie_new("unknown",NULL);
-
-  p_dirEntry = readdir (p_dicomDirectory);
-  pll_dicomFilesIter = pll_dicomFiles;
-
-  while (p_dirEntry!=NULL)
+  while ((p_dirEntry = readdir (p_Directory)) != NULL)
   {
-    // create Full path name
-    pc_fullPath = calloc(1, strlen(pc_path)+2+strlen(p_dirEntry->d_name));
-    strcpy(pc_fullPath,pc_dirName);
-    strcpy(&pc_fullPath[strlen(pc_fullPath)],"/");
-    strcpy(&pc_fullPath[strlen(pc_fullPath)],p_dirEntry->d_name);
-
-
-
-    if (i16_memory_io_dicom_loadMetaData(ps_patient,ps_study,ps_serie, &ts_slicePosition, &ts_XVector, &ts_YVector, &i16_TemporalPositionIdentifier, &i16_StackPositionIdentifier, &e_DCM_CIC,  pc_fullPath))
+    if (!strcmp (p_dirEntry->d_name, ".") || !strcmp (p_dirEntry->d_name, "..") ||
+        !strncmp (p_dirEntry->d_name, DICOM_INDEX_FILENAME, strlen (DICOM_INDEX_FILENAME)))
     {
-      ts_dicom_FileProperties *ps_dicomFile=calloc(1,sizeof(ts_dicom_FileProperties));
-
-      if ( ps_ReferenceFileProps == NULL)
-      {
-        //first time passing this loop, refer to first read file
-        pt_patient = tree_append (pt_patient, ps_patient, TREE_TYPE_PATIENT);
-        pt_study = tree_append_child (pt_patient, ps_study, TREE_TYPE_STUDY);
-        pt_serie=tree_append_child (pt_study, ps_serie, TREE_TYPE_SERIE);
+      continue;
+    }
 
-        ps_ReferenceFileProps = ps_dicomFile;
-      }
+    // An entry that cannot be looked at still counts with its name, so
+    // that it changes the fingerprint when it comes or goes.
+    memset (ai64_Properties, 0, sizeof (ai64_Properties));
+    if (snprintf (c_Path, sizeof (c_Path), "%s%c%s", pc_dirName, PATH_SEPARATOR, p_dirEntry->d_name) < (int)sizeof (c_Path) &&
+        stat (c_Path, &statbuf) == 0)
+    {
+      ai64_Properties[0] = statbuf.st_ino;
+      ai64_Properties[1] = statbuf.st_mtim.tv_sec;
+      ai64_Properties[2] = statbuf.st_mtim.tv_nsec;
+      ai64_Properties[3] = statbuf.st_size;
+    }
 
-      ps_dicomFile->pc_Filename = pc_fullPath;
-      ps_dicomFile->ts_ZPosition = ts_slicePosition;
-      ps_dicomFile->ts_XVector = s_algebra_vector_normalize(&ts_XVector);
-      ps_dicomFile->ts_YVector = s_algebra_vector_normalize(&ts_YVector);
-      ts_ZVector = s_algebra_vector_crossproduct(&ps_dicomFile->ts_XVector,&ps_dicomFile->ts_YVector);
+    ui64_Hash = ui64_memory_io_dicom_index_hash (0xcbf29ce484222325ULL, p_dirEntry->d_name, strlen (p_dirEntry->d_name) + 1);
+    ui64_Hash = ui64_memory_io_dicom_index_hash (ui64_Hash, ai64_Properties, sizeof (ai64_Properties));
 
-      ps_dicomFile->i16_relativeOrderNumber = i16_memory_io_dicom_relativePosition(&ps_ReferenceFileProps->ts_ZPosition,
-                                                                                   &ps_dicomFile->ts_ZPosition,
-                                                                                   &ts_ZVector,
-                                                                                   &ps_serie->pixel_dimension);
+    // The order of readdir is not fixed, so the entries are summed.
+    *pui64_Fingerprint += ui64_Hash;
 
-      ps_dicomFile->i16_TemporalPositionIdentifier = (i16_TemporalPositionIdentifier==0)?1:i16_TemporalPositionIdentifier;
-      ps_dicomFile->i16_StackPositionIdentifier = i16_StackPositionIdentifier;
-      ps_dicomFile->e_DCM_CIC = e_DCM_CIC;
+    // The names are kept so that an index can only refer to files that
+    // were part of this fingerprint.
+    if (*pui32_Entries == ui32_Allocated)
+    {
+      ui32_Allocated = (ui32_Allocated == 0) ? 64 : ui32_Allocated * 2;
+      ppc_Names = realloc (ppc_Names, ui32_Allocated * sizeof (char *));
+      assert (ppc_Names != NULL);
+    }
 
-      if (ps_dicomFile->i16_relativeOrderNumber < i16_MinimumReferenceOrderValue)
-      {
-        i16_MinimumReferenceOrderValue = ps_dicomFile->i16_relativeOrderNumber;
-      }
+    ppc_Names[*pui32_Entries] = strdup (p_dirEntry->d_name);
+    assert (ppc_Names[*pui32_Entries] != NULL);
+    (*pui32_Entries)++;
+  }
 
-      if (ps_dicomFile->i16_relativeOrderNumber > i16_MaximumReferenceOrderValue)
-      {
-        i16_MaximumReferenceOrderValue = ps_dicomFile->i16_relativeOrderNumber;
-      }
- 
-      i16_NumberOfSlices++;
+  closedir (p_Directory);
 
-      pll_dicomFilesIter = list_append(pll_dicomFilesIter, ps_dicomFile);
-    }
-    p_dirEntry = readdir (p_dicomDirectory);
+  if (ppc_Names != NULL)
+  {
+    qsort (ppc_Names, *pui32_Entries, sizeof (char *), i32_memory_io_dicom_index_compare_names);
   }
 
-  closedir (p_dicomDirectory);
+  *pppc_Names = ppc_Names;
+  return 1;
+}
+
 
+short int
+i16_memory_io_dicom_index_read (const char *pc_IndexPath, const char *pc_dirName, unsigned int ui32_Entries,
+                                unsigned long long ui64_Fingerprint, char **ppc_Names,
+                                Patient *ps_patient, Study *ps_study, Serie *ps_serie, List **ppll_dicomFiles)
+{
+  debug_functions ();
 
-  ps_serie->matrix.i16_z=(ps_serie->matrix.i16_z==0) ? i16_NumberOfSlices/ps_serie->num_time_series : 1;
-  i16_NumberOfReconstructions=(short int)(ps_serie->matrix.i16_z)/(i16_MaximumReferenceOrderValue - i16_MinimumReferenceOrderValue + 1);
+  char *pc_fullPath;
+  char *pc_Name;
+  FILE *pf_Index;
+  ts_dicom_IndexHeader ts_Header;
+  ts_dicom_IndexEntry ts_Entry;
+  ts_dicom_FileProperties *ps_dicomFile;
+  List *pll_dicomFiles = NULL;
+  unsigned int ui32_Cnt;
 
-  if (i16_NumberOfReconstructions <= 1)
+  pf_Index = fopen (pc_IndexPath, "rb");
+  if (pf_Index == NULL)
   {
-    i16_NumberOfReconstructions =1;
-    e_DCM_CIC = DCM_CIC_REAL;
+    return 0;
   }
-  else
+
+  if (fread (&ts_Header, sizeof (ts_dicom_IndexHeader), 1, pf_Index) != 1 ||
+      memcmp (ts_Header.ac_Magic, DICOM_INDEX_MAGIC, sizeof (ts_Header.ac_Magic)) != 0 ||
+      ts_Header.ui32_Version != DICOM_INDEX_VERSION ||
+      ts_Header.ui32_NumberOfFiles == 0 ||
+      ts_Header.ui32_NumberOfFiles > ui32_Entries ||
+      ts_Header.ui32_NumberOfDirectoryEntries != ui32_Entries ||
+      ts_Header.ui64_DirectoryFingerprint != ui64_Fingerprint)
   {
-    ps_serie->matrix.i16_z= ps_serie->matrix.i16_z/i16_NumberOfReconstructions;
-    ps_serie->num_time_series*=i16_NumberOfReconstructions;
+    fclose (pf_Index);
+    return 0;
   }
 
-  pll_dicomFiles = list_nth(pll_dicomFilesIter,1);
-
-  short int i16_RecoCnt;
-  short int b_RecoDoesntMatter=0;
-  for (i16_RecoCnt=0; i16_RecoCnt<i16_NumberOfReconstructions; i16_RecoCnt++)
+  for (ui32_Cnt = 0; ui32_Cnt < ts_Header.ui32_NumberOfFiles; ui32_Cnt++)
   {
-    if (i16_NumberOfReconstructions > 1)
+    if (fread (&ts_Entry, sizeof (ts_dicom_IndexEntry), 1, pf_Index) != 1)
     {
-      switch (i16_RecoCnt)
-      {
-        case 0: e_DCM_CIC = DCM_CIC_MAGNITUDE; break;
-        case 1: e_DCM_CIC = DCM_CIC_PHASE; break;
-      }
+      break;
     }
-    else
+
+    ts_Entry.c_Filename[sizeof (ts_Entry.c_Filename) - 1] = '\0';
+
+    // The index may come from a shared cache directory, so its names are
+    // only trusted when they are plain files of the fingerprinted listing.
+    pc_Name = ts_Entry.c_Filename;
+    if (pc_Name[0] == '\0' || strchr (pc_Name, '/') != NULL || strchr (pc_Name, PATH_SEPARATOR) != NULL ||
+        strstr (pc_Name, "..") != NULL ||
+        bsearch (&pc_Name, ppc_Names, ui32_Entries, sizeof (char *), i32_memory_io_dicom_index_compare_names) == NULL)
     {
-      b_RecoDoesntMatter=1;
+      debug_extra ("The index %s refers to a file outside %s.", pc_IndexPath, pc_dirName);
+      break;
     }
 
+    pc_fullPath = calloc (1, strlen (pc_dirName) + 2 + strlen (ts_Entry.c_Filename));
+    assert (pc_fullPath != NULL);
+    sprintf (pc_fullPath, "%s%c%s", pc_dirName, PATH_SEPARATOR, ts_Entry.c_Filename);
 
-    for (i16_timeFrameCnt=1; i16_timeFrameCnt<=ps_serie->num_time_series/i16_NumberOfReconstructions; i16_timeFrameCnt++)
-    {
-      i16_NumberOfSlices=0;
-      for (i16_Cnt=i16_MinimumReferenceOrderValue; i16_Cnt<=i16_MaximumReferenceOrderValue; i16_Cnt++ )
-      {
-        pll_dicomFilesIter = pll_dicomFiles;
-        while (pll_dicomFilesIter != NULL)
-        {
-          ps_dicomFile=(ts_dicom_FileProperties*)(pll_dicomFilesIter->data);
+    ps_dicomFile = calloc (1, sizeof (ts_dicom_FileProperties));
+    assert (ps_dicomFile != NULL);
 
+    ps_dicomFile->pc_Filename = pc_fullPath;
+    ps_dicomFile->ts_ZPosition = ts_Entry.ts_ZPosition;
+    ps_dicomFile->ts_XVector = ts_Entry.ts_XVector;
+    ps_dicomFile->ts_YVector = ts_Entry.ts_YVector;
+    ps_dicomFile->i16_TemporalPositionIdentifier = ts_Entry.i16_TemporalPositionIdentifier;
+    ps_dicomFile->i16_StackPositionIdentifier = ts_Entry.i16_StackPositionIdentifier;
+    ps_dicomFile->e_DCM_CIC = ts_Entry.e_DCM_CIC;
+    ps_dicomFile->l_PixelDataOffset = ts_Entry.i64_PixelDataOffset;
+    ps_dicomFile->l_PixelDataLength = ts_Entry.i64_PixelDataLength;
 
+    pll_dicomFiles = list_append (pll_dicomFiles, ps_dicomFile);
+  }
 
-          if ((ps_dicomFile->i16_relativeOrderNumber == i16_Cnt) &&
-              (ps_dicomFile->i16_TemporalPositionIdentifier == i16_timeFrameCnt) &&
+  fclose (pf_Index);
+
+  if (ui32_Cnt < ts_Header.ui32_NumberOfFiles)
+  {
+    debug_extra ("The index %s of %s is incomplete.", pc_IndexPath, pc_dirName);
+
+    list_free_all (pll_dicomFiles, v_memory_io_dicom_file_properties_destroy);
+    return 0;
+  }
+
+  memcpy (ps_patient->c_patientID, ts_Header.c_patientID, sizeof (ps_patient->c_patientID));
+  memcpy (ps_patient->name, ts_Header.c_patientName, sizeof (ps_patient->name));
+  memcpy (ps_study->c_studyInstanceUID, ts_Header.c_studyInstanceUID, sizeof (ps_study->c_studyInstanceUID));
+  memcpy (ps_study->name, ts_Header.c_studyName, sizeof (ps_study->name));
+  memcpy (ps_serie->c_serieInstanceUID, ts_Header.c_serieInstanceUID, sizeof (ps_serie->c_serieInstanceUID));
+  memcpy (ps_serie->name, ts_Header.c_serieName, sizeof (ps_serie->name));
+
+  ps_serie->matrix = ts_Header.ts_Matrix;
+  ps_serie->pixel_dimension = ts_Header.ts_PixelDimension;
+  ps_serie->slope = ts_Header.f_Slope;
+  ps_serie->offset = ts_Header.f_Offset;
+  ps_serie->data_type = ts_Header.e_DataType;
+  ps_serie->num_time_series = ts_Header.u16_NumberOfTimeSeries;
+  ps_serie->i16_QuaternionCode = ts_Header.i16_QuaternionCode;
+  ps_serie->t_ScannerSpaceIJKtoXYZ = ts_Header.t_ScannerSpaceIJKtoXYZ;
+  ps_serie->input_type = MUMC_FILETYPE_DICOM;
+
+  ps_dicomFile = (ts_dicom_FileProperties*)(list_last (pll_dicomFiles)->data);
+  free (ps_serie->pc_filename);
+  ps_serie->pc_filename = calloc (1, strlen (ps_dicomFile->pc_Filename) + 1);
+  strcpy (ps_serie->pc_filename, ps_dicomFile->pc_Filename);
+
+  *ppll_dicomFiles = pll_dicomFiles;
+  return 1;
+}
+
+
+
+
+short int
+i16_memory_io_dicom_index_load (const char *pc_dirName, unsigned int ui32_Entries, unsigned long long ui64_Fingerprint,
+                                char **ppc_Names, Patient *ps_patient, Study *ps_study, Serie *ps_serie, List **ppll_dicomFiles)
+{
+  debug_functions ();
+
+  char c_IndexPath[PATH_MAX];
+  short int b_UserCache;
+
+  if (ppc_Names == NULL)
+  {
+    return 0;
+  }
+
+  // An index that does not match the directory does not hide the one in
+  // the cache directory.
+  for (b_UserCache = 0; b_UserCache <= 1; b_UserCache++)
+  {
+    if (i16_memory_io_dicom_index_path (pc_dirName, b_UserCache, c_IndexPath, sizeof (c_IndexPath)) &&
+        i16_memory_io_dicom_index_read (c_IndexPath, pc_dirName, ui32_Entries, ui64_Fingerprint, ppc_Names,
+                                        ps_patient, ps_study, ps_serie, ppll_dicomFiles))
+    {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+short int
+i16_memory_io_dicom_index_save (const char *pc_dirName, unsigned int ui32_Entries, unsigned long long ui64_Fingerprint,
+                                Patient *ps_patient, Study *ps_study, Serie *ps_serie, List *pll_dicomFiles)
+{
+  debug_functions ();
+
+  char c_IndexPath[PATH_MAX];
+  char c_TemporaryPath[PATH_MAX];
+  char *pc_Basename;
+  FILE *pf_Index = NULL;
+  ts_dicom_IndexHeader ts_Header;
+  ts_dicom_IndexEntry ts_Entry;
+  ts_dicom_FileProperties *ps_dicomFile;
+  List *pll_Iter;
+  short int b_UserCache;
+  short int b_Failed;
+
+  memset (&ts_Header, 0, sizeof (ts_dicom_IndexHeader));
+  memcpy (ts_Header.ac_Magic, DICOM_INDEX_MAGIC, sizeof (ts_Header.ac_Magic));
+  ts_Header.ui32_Version = DICOM_INDEX_VERSION;
+  ts_Header.ui32_NumberOfFiles = list_length (pll_dicomFiles);
+  ts_Header.ui32_NumberOfDirectoryEntries = ui32_Entries;
+  ts_Header.ui64_DirectoryFingerprint = ui64_Fingerprint;
+
+  memcpy (ts_Header.c_patientID, ps_patient->c_patientID, sizeof (ts_Header.c_patientID));
+  memcpy (ts_Header.c_patientName, ps_patient->name, sizeof (ts_Header.c_patientName));
+  memcpy (ts_Header.c_studyInstanceUID, ps_study->c_studyInstanceUID, sizeof (ts_Header.c_studyInstanceUID));
+  memcpy (ts_Header.c_studyName, ps_study->name, sizeof (ts_Header.c_studyName));
+  memcpy (ts_Header.c_serieInstanceUID, ps_serie->c_serieInstanceUID, sizeof (ts_Header.c_serieInstanceUID));
+  memcpy (ts_Header.c_serieName, ps_serie->name, sizeof (ts_Header.c_serieName));
+
+  ts_Header.ts_Matrix = ps_serie->matrix;
+  ts_Header.ts_PixelDimension = ps_serie->pixel_dimension;
+  ts_Header.f_Slope = ps_serie->slope;
+  ts_Header.f_Offset = ps_serie->offset;
+  ts_Header.e_DataType = ps_serie->data_type;
+  ts_Header.u16_NumberOfTimeSeries = ps_serie->num_time_series;
+  ts_Header.i16_QuaternionCode = ps_serie->i16_QuaternionCode;
+  ts_Header.t_ScannerSpaceIJKtoXYZ = ps_serie->t_ScannerSpaceIJKtoXYZ;
+
+  for (b_UserCache = 0; b_UserCache <= 1; b_UserCache++)
+  {
+    if (!i16_memory_io_dicom_index_path (pc_dirName, b_UserCache, c_IndexPath, sizeof (c_IndexPath)) ||
+        snprintf (c_TemporaryPath, sizeof (c_TemporaryPath), "%s.tmp", c_IndexPath) >= (int)sizeof (c_TemporaryPath))
+    {
+      continue;
+    }
+
+    pf_Index = fopen (c_TemporaryPath, "wb");
+    if (pf_Index == NULL)
+    {
+      continue;
+    }
+
+    b_Failed = (fwrite (&ts_Header, sizeof (ts_dicom_IndexHeader), 1, pf_Index) != 1);
+
+    pll_Iter = list_nth (pll_dicomFiles, 1);
+    while (pll_Iter != NULL && !b_Failed)
+    {
+      ps_dicomFile = (ts_dicom_FileProperties*)(pll_Iter->data);
+      memset (&ts_Entry, 0, sizeof (ts_dicom_IndexEntry));
+
+      pc_Basename = strrchr (ps_dicomFile->pc_Filename, PATH_SEPARATOR);
+      pc_Basename = (pc_Basename == NULL) ? ps_dicomFile->pc_Filename : pc_Basename + 1;
+
+      if (strlen (pc_Basename) >= sizeof (ts_Entry.c_Filename))
+      {
+        b_Failed = 1;
+        break;
+      }
+
+      strcpy (ts_Entry.c_Filename, pc_Basename);
+      ts_Entry.ts_ZPosition = ps_dicomFile->ts_ZPosition;
+      ts_Entry.ts_XVector = ps_dicomFile->ts_XVector;
+      ts_Entry.ts_YVector = ps_dicomFile->ts_YVector;
+      ts_Entry.i16_TemporalPositionIdentifier = ps_dicomFile->i16_TemporalPositionIdentifier;
+      ts_Entry.i16_StackPositionIdentifier = ps_dicomFile->i16_StackPositionIdentifier;
+      ts_Entry.e_DCM_CIC = ps_dicomFile->e_DCM_CIC;
+      ts_Entry.i64_PixelDataOffset = ps_dicomFile->l_PixelDataOffset;
+      ts_Entry.i64_PixelDataLength = ps_dicomFile->l_PixelDataLength;
+
+      b_Failed = (fwrite (&ts_Entry, sizeof (ts_dicom_IndexEntry), 1, pf_Index) != 1);
+      pll_Iter = list_next (pll_Iter);
+    }
+
+    b_Failed |= (fclose (pf_Index) != 0);
+
+    // Only replace the index once it has been written completely.
+    if (!b_Failed && rename (c_TemporaryPath, c_IndexPath) == 0)
+    {
+      return 1;
+    }
+
+    unlink (c_TemporaryPath);
+  }
+
+  debug_warning ("Could not write an index for %s.", pc_dirName);
+  return 0;
+}
+
+/**
+ * Copies a name into an identifier field, cutting it off when it does not
+ * fit. The identifier is always terminated.
+ */
+void v_memory_io_copy_id (char *pc_Id, size_t s_IdLen, const char *pc_Name)
+{
+  size_t s_Length = strnlen (pc_Name, s_IdLen - 1);
+
+  memcpy (pc_Id, pc_Name, s_Length);
+  pc_Id[s_Length] = '\0';
+}
+
+/**
+ * Places a serie that was read from a file without patient and study
+ * information under a patient and study that are both named "unknown".
+ * Each of the three is identified by its name.
+ */
+Tree *pt_memory_io_unknown_tree (Serie *ps_serie)
+{
+  Patient *ps_patient = memory_patient_new ("unknown");
+  Study *ps_study = memory_study_new ("unknown");
+
+  v_memory_io_copy_id (ps_patient->c_patientID, sizeof (ps_patient->c_patientID), ps_patient->name);
+  v_memory_io_copy_id (ps_study->c_studyInstanceUID, sizeof (ps_study->c_studyInstanceUID), ps_study->name);
+  v_memory_io_copy_id (ps_serie->c_serieInstanceUID, sizeof (ps_serie->c_serieInstanceUID), ps_serie->name);
+
+  Tree *pt_patient = tree_append (NULL, ps_patient, TREE_TYPE_PATIENT);
+  Tree *pt_study = tree_append_child (pt_patient, ps_study, TREE_TYPE_STUDY);
+
+  return tree_append_child (pt_study, ps_serie, TREE_TYPE_SERIE);
+}
+
+/**
+ * This function destroys a serie that was loaded into a tree of its own,
+ * together with its patient and study.
+ */
+void v_memory_io_destroy_tree (Tree *pt_serie)
+{
+  Tree *pt_study = pt_serie->parent;
+  Tree *pt_patient = pt_study->parent;
+
+  memory_serie_destroy (pt_serie->data);
+  tree_remove (pt_serie);
+  memory_study_destroy (pt_study->data);
+  tree_remove (pt_study);
+  memory_patient_destroy (pt_patient->data);
+  tree_remove (pt_patient);
+}
+
+Tree *pt_memory_io_load_file_nifti (char *pc_path)
+{
+  return pt_memory_io_load_nifti (pc_path, 0, 0);
+}
+
+/**
+ * This function loads a niftii file. A lazy serie reads its slices from the
+ * file when they are needed. A streaming serie does so every time, without
+ * keeping them.
+ */
+Tree *pt_memory_io_load_nifti (char *pc_path, short int b_Lazy, short int b_Streaming)
+{
+  char *pc_filename=NULL;
+
+  Tree *pt_serie=NULL;
+  Serie *ps_serie = NULL;
+
+  pc_filename = basename(pc_path);
+
+  ps_serie = memory_serie_new (pc_filename, pc_path);
+  pt_serie = pt_memory_io_unknown_tree (ps_serie);
+
+  switch (memory_io_niftii_file_type (pc_path))
+  {
+    case MUMC_FILETYPE_NIFTII_SF:
+      if (((b_Streaming) ? memory_io_niftii_load_streaming (ps_serie, pc_path, NULL)
+           : (b_Lazy) ? memory_io_niftii_load_lazy (ps_serie, pc_path, NULL)
+                      : memory_io_niftii_load (ps_serie, pc_path, NULL)) != 1) return NULL;
+      memory_serie_set_synced_file (ps_serie, pc_path);
+      return pt_serie;
+      break;
+    case MUMC_FILETYPE_NIFTII_TF:
+      {
+        //Check weather the hdr or img file is passed
+        char* pc_Extension = strrchr (pc_path, '.');
+
+        char c_ImageFile[1024];
+        char c_HeaderFile[1024];
+
+        strcpy(&c_ImageFile[0],pc_path);
+        strcpy(&c_HeaderFile[0],pc_path);
+
+        if (pc_Extension == NULL)
+        {
+          pc_Extension = strrchr (&c_ImageFile[0], '.');
+          strcat(pc_Extension, ".img");
+
+          pc_Extension = strrchr (&c_HeaderFile[0], '.');
+          strcat(pc_Extension, ".hdr");
+        }
+        else
+        {
+          pc_Extension = strrchr (&c_ImageFile[0], '.');
+          strcpy(pc_Extension, ".img");
+          pc_Extension = strrchr (&c_HeaderFile[0], '.');
+          strcpy(pc_Extension, ".hdr");
+        }
+
+        return (((b_Streaming) ? memory_io_niftii_load_streaming (ps_serie, c_HeaderFile, c_ImageFile)
+                 : (b_Lazy) ? memory_io_niftii_load_lazy (ps_serie, c_HeaderFile, c_ImageFile)
+                            : memory_io_niftii_load (ps_serie, c_HeaderFile, c_ImageFile)) == 1) ? pt_serie : NULL; break;
+      }
+      break;
+    case MUMC_FILETYPE_ANALYZE75:
+    case MUMC_FILETYPE_DICOM:
+    case MUMC_FILETYPE_NOT_KNOWN:
+    default:
+      return NULL;
+  }
+
+}
+
+Tree *pt_memory_io_load_file_bricks (char *pc_path)
+{
+  debug_functions ();
+
+  Serie *ps_serie = NULL;
+
+  ps_serie = memory_serie_new (basename (pc_path), pc_path);
+  if (memory_brick_open (ps_serie, pc_path, ui64_BrickMemoryBudget) == NULL)
+  {
+    memory_serie_destroy (ps_serie);
+    return NULL;
+  }
+
+  ps_serie->e_SerieType = SERIE_ORIGINAL;
+
+  return pt_memory_io_unknown_tree (ps_serie);
+}
+
+Tree *pt_memory_io_load_file_dicom (char *pc_path)
+{
+  return pt_memory_io_load_dicom (pc_path, b_LazyDicom, 0);
+}
+
+/**
+ * This function loads a dicom file or directory. A lazy serie reads its
+ * slices from the files when they are needed. A streaming serie does so
+ * every time, without keeping them.
+ */
+Tree *pt_memory_io_load_dicom (char *pc_path, short int b_Lazy, short int b_Streaming)
+{
+  Patient *ps_patient = NULL;
+  Study   *ps_study = NULL;
+  Serie   *ps_serie=NULL;
+
+  Tree *pt_patient=NULL;
+  Tree *pt_study=NULL;
+  Tree *pt_serie=NULL;
+
+  DIR *p_dicomDirectory;
+  struct dirent *p_dirEntry;
+
+  char *pc_dirName = NULL;
+  char *pc_fullPath = NULL;
+
+  ts_dicom_FileProperties *ps_ReferenceFileProps = NULL;
+  ts_dicom_FileProperties *ps_dicomFile;
+
+  List *pll_dicomFiles = NULL;
+  List *pll_dicomFilesIter = NULL;
+
+  short int i16_NumberOfSlices=0;
+  short int i16_MinimumReferenceOrderValue=0;
+  short int i16_MaximumReferenceOrderValue=0;
+  short int i16_TemporalPositionIdentifier=0;
+  short int i16_StackPositionIdentifier=0;
+  short int i16_NumberOfReconstructions=0;
+
+  short int i16_Cnt=0;
+  short int i16_timeFrameCnt=0;
+
+  Coordinate3D ts_slicePosition;
+  Vector3D     ts_XVector;
+  Vector3D     ts_YVector;
+  Vector3D     ts_ZVector;
+
+  te_DCM_ComplexImageComponent e_DCM_CIC;
+
+  long l_PixelDataOffset = -1;
+  long l_PixelDataLength = 0;
+
+  unsigned int ui32_DirectoryEntries = 0;
+  unsigned long long ui64_DirectoryFingerprint = 0;
+  char **ppc_DirectoryNames = NULL;
+
+  // Build list of all files
+  // Check weather path is a path or a directory
+  pc_dirName = (i16_memory_io_isFile(pc_path)) ? dirname(pc_path) : pc_path;
+
+  ps_patient = memory_patient_new ("unknown");
+  ps_study = memory_study_new("unknown");
+  ps_serie = memory_serie_new("unknown",NULL);
+
+  // When the directory has been parsed before, the index contains all
+  // header information we need. Otherwise, parse the headers and write
+  // an index for the next time.
+  // The listing is fingerprinted before the headers are parsed, so that
+  // files that change while parsing invalidate the index written below.
+  i16_memory_io_dicom_index_fingerprint (pc_dirName, &ui32_DirectoryEntries, &ui64_DirectoryFingerprint, &ppc_DirectoryNames);
+
+  if (!i16_memory_io_dicom_index_load (pc_dirName, ui32_DirectoryEntries, ui64_DirectoryFingerprint, ppc_DirectoryNames,
+                                       ps_patient, ps_study, ps_serie, &pll_dicomFilesIter))
+  {
+    p_dicomDirectory = opendir (pc_dirName);
+    if (p_dicomDirectory == NULL)
+    {
+      v_memory_io_dicom_index_free_names (ppc_DirectoryNames, ui32_DirectoryEntries);
+      memory_serie_destroy (ps_serie);
+      memory_study_destroy (ps_study);
+      memory_patient_destroy (ps_patient);
+      return 0;
+    }
+
+    p_dirEntry = readdir (p_dicomDirectory);
+
+    while (p_dirEntry!=NULL)
+    {
+      // create Full path name
+      pc_fullPath = calloc(1, strlen(pc_dirName)+2+strlen(p_dirEntry->d_name));
+      strcpy(pc_fullPath,pc_dirName);
+      strcpy(&pc_fullPath[strlen(pc_fullPath)],"/");
+      strcpy(&pc_fullPath[strlen(pc_fullPath)],p_dirEntry->d_name);
+
+      // Skip directories and anything without a dicom preamble before
+      // handing the file to the (more expensive) header parser.
+      if (!i16_memory_io_isFile(pc_fullPath) || !i16_memory_io_dicom_isDicomFile(pc_fullPath))
+      {
+        free(pc_fullPath), pc_fullPath = NULL;
+        p_dirEntry = readdir (p_dicomDirectory);
+        continue;
+      }
+
+      i16_TemporalPositionIdentifier = 0;
+      i16_StackPositionIdentifier = 0;
+
+      if (i16_memory_io_dicom_loadMetaData(ps_patient,ps_study,ps_serie, &ts_slicePosition, &ts_XVector, &ts_YVector, &i16_TemporalPositionIdentifier, &i16_StackPositionIdentifier, &e_DCM_CIC, &l_PixelDataOffset, &l_PixelDataLength, pc_fullPath))
+      {
+        ps_dicomFile=calloc(1,sizeof(ts_dicom_FileProperties));
+        assert (ps_dicomFile != NULL);
+
+        ps_dicomFile->pc_Filename = pc_fullPath;
+        ps_dicomFile->ts_ZPosition = ts_slicePosition;
+        ps_dicomFile->ts_XVector = s_algebra_vector_normalize(&ts_XVector);
+        ps_dicomFile->ts_YVector = s_algebra_vector_normalize(&ts_YVector);
+        ps_dicomFile->i16_TemporalPositionIdentifier = (i16_TemporalPositionIdentifier==0)?1:i16_TemporalPositionIdentifier;
+        ps_dicomFile->i16_StackPositionIdentifier = i16_StackPositionIdentifier;
+        ps_dicomFile->e_DCM_CIC = e_DCM_CIC;
+        ps_dicomFile->l_PixelDataOffset = l_PixelDataOffset;
+        ps_dicomFile->l_PixelDataLength = l_PixelDataLength;
+
+        pll_dicomFilesIter = list_append(pll_dicomFilesIter, ps_dicomFile);
+      }
+      else
+      {
+        free(pc_fullPath), pc_fullPath = NULL;
+      }
+      p_dirEntry = readdir (p_dicomDirectory);
+    }
+
+    closedir (p_dicomDirectory);
+
+    if (pll_dicomFilesIter != NULL)
+    {
+      i16_memory_io_dicom_index_save (pc_dirName, ui32_DirectoryEntries, ui64_DirectoryFingerprint,
+                                      ps_patient, ps_study, ps_serie, list_nth (pll_dicomFilesIter, 1));
+    }
+  }
+
+  v_memory_io_dicom_index_free_names (ppc_DirectoryNames, ui32_DirectoryEntries);
+
+  if (pll_dicomFilesIter == NULL)
+  {
+    memory_serie_destroy (ps_serie);
+    memory_study_destroy (ps_study);
+    memory_patient_destroy (ps_patient);
+    return NULL;
+  }
+
+  pt_patient = tree_append (pt_patient, ps_patient, TREE_TYPE_PATIENT);
+  pt_study = tree_append_child (pt_patient, ps_study, TREE_TYPE_STUDY);
+  pt_serie = tree_append_child (pt_study, ps_serie, TREE_TYPE_SERIE);
+
+  // Order the slices relative to the first file.
+  pll_dicomFiles = list_nth (pll_dicomFilesIter, 1);
+  pll_dicomFilesIter = pll_dicomFiles;
+  ps_ReferenceFileProps = (ts_dicom_FileProperties*)(pll_dicomFiles->data);
+
+  while (pll_dicomFilesIter != NULL)
+  {
+    ps_dicomFile=(ts_dicom_FileProperties*)(pll_dicomFilesIter->data);
+
+    ts_ZVector = s_algebra_vector_crossproduct(&ps_dicomFile->ts_XVector,&ps_dicomFile->ts_YVector);
+
+    ps_dicomFile->i16_relativeOrderNumber = i16_memory_io_dicom_relativePosition(&ps_ReferenceFileProps->ts_ZPosition,
+                                                                                 &ps_dicomFile->ts_ZPosition,
+                                                                                 &ts_ZVector,
+                                                                                 &ps_serie->pixel_dimension);
+
+    if (ps_dicomFile->i16_relativeOrderNumber < i16_MinimumReferenceOrderValue)
+    {
+      i16_MinimumReferenceOrderValue = ps_dicomFile->i16_relativeOrderNumber;
+    }
+
+    if (ps_dicomFile->i16_relativeOrderNumber > i16_MaximumReferenceOrderValue)
+    {
+      i16_MaximumReferenceOrderValue = ps_dicomFile->i16_relativeOrderNumber;
+    }
+
+    i16_NumberOfSlices++;
+
+    pll_dicomFilesIter = list_next(pll_dicomFilesIter);
+  }
+
+  // A single file with several frames is an enhanced (multi-frame)
+  // object, which holds all slices of all timepoints.
+  short int b_MultiFrame = (i16_NumberOfSlices == 1 && ps_serie->matrix.i16_z > 1);
+  if (b_MultiFrame)
+  {
+    if (ps_serie->num_time_series == 0 || ps_serie->matrix.i16_z % ps_serie->num_time_series != 0)
+    {
+      ps_serie->num_time_series = 1;
+    }
+
+    ps_serie->matrix.i16_z = ps_serie->matrix.i16_z / ps_serie->num_time_series;
+    i16_NumberOfReconstructions = 1;
+  }
+  else
+  {
+    ps_serie->matrix.i16_z=(ps_serie->matrix.i16_z==0) ? i16_NumberOfSlices/ps_serie->num_time_series : 1;
+    i16_NumberOfReconstructions=(short int)(ps_serie->matrix.i16_z)/(i16_MaximumReferenceOrderValue - i16_MinimumReferenceOrderValue + 1);
+  }
+
+  if (i16_NumberOfReconstructions <= 1)
+  {
+    i16_NumberOfReconstructions =1;
+    e_DCM_CIC = DCM_CIC_REAL;
+  }
+  else
+  {
+    ps_serie->matrix.i16_z= ps_serie->matrix.i16_z/i16_NumberOfReconstructions;
+    ps_serie->num_time_series*=i16_NumberOfReconstructions;
+  }
+
+  // A lazy serie only remembers where each slice is. The slices are read
+  // when they are first viewed, or by the background reader of the serie.
+  // A streaming serie reads them every time, and never holds the volume.
+  void **ppv_LazySources = NULL;
+  if (b_Lazy || b_Streaming)
+  {
+    ppv_LazySources = calloc ((size_t)ps_serie->matrix.i16_z * ps_serie->num_time_series, sizeof (void *));
+    assert (ppv_LazySources != NULL);
+
+    if (!b_Streaming)
+    {
+      ps_serie->data = calloc ((size_t)ps_serie->matrix.i16_x * ps_serie->matrix.i16_y *
+                               ps_serie->matrix.i16_z * ps_serie->num_time_series, 2);
+      assert (ps_serie->data != NULL);
+    }
+
+    ps_serie->pv_OutOfBlobValue = calloc (1, 2);
+    assert (ps_serie->pv_OutOfBlobValue != NULL);
+  }
+
+  // The slices are first given their place in the serie, and then read
+  // together, in parallel, from the pixel data offsets of the headers or
+  // the index. Let the kernel start on the first few files meanwhile.
+  int i32_Files = 0;
+  ts_dicom_FileProperties **pps_LoadOrder = NULL;
+
+  pll_dicomFilesIter = pll_dicomFiles;
+  while (pll_dicomFilesIter != NULL)
+  {
+    i32_Files++;
+    pll_dicomFilesIter = list_next(pll_dicomFilesIter);
+  }
+
+  pps_LoadOrder = calloc (i32_Files, sizeof (ts_dicom_FileProperties *));
+  if (pps_LoadOrder != NULL)
+  {
+    i32_Files = 0;
+    pll_dicomFilesIter = pll_dicomFiles;
+    while (pll_dicomFilesIter != NULL)
+    {
+      pps_LoadOrder[i32_Files] = pll_dicomFilesIter->data;
+      pps_LoadOrder[i32_Files]->i32_Slice = -1;
+      pps_LoadOrder[i32_Files]->b_Loaded = 0;
+      i32_Files++;
+      pll_dicomFilesIter = list_next(pll_dicomFilesIter);
+    }
+
+    qsort (pps_LoadOrder, i32_Files, sizeof (ts_dicom_FileProperties *), i32_memory_io_dicom_compare_load_order);
+
+    for (i16_Cnt = 0; i16_Cnt < DICOM_READAHEAD_FILES && i16_Cnt < i32_Files && ppv_LazySources == NULL; i16_Cnt++)
+      v_memory_io_dicom_prefetch (pps_LoadOrder, i32_Files, i16_Cnt);
+  }
+
+  short int i16_RecoCnt;
+  short int b_RecoDoesntMatter=0;
+  for (i16_RecoCnt=0; i16_RecoCnt<i16_NumberOfReconstructions; i16_RecoCnt++)
+  {
+    if (i16_NumberOfReconstructions > 1)
+    {
+      switch (i16_RecoCnt)
+      {
+        case 0: e_DCM_CIC = DCM_CIC_MAGNITUDE; break;
+        case 1: e_DCM_CIC = DCM_CIC_PHASE; break;
+      }
+    }
+    else
+    {
+      b_RecoDoesntMatter=1;
+    }
+
+
+    for (i16_timeFrameCnt=1; i16_timeFrameCnt<=ps_serie->num_time_series/i16_NumberOfReconstructions; i16_timeFrameCnt++)
+    {
+      i16_NumberOfSlices=0;
+      for (i16_Cnt=i16_MinimumReferenceOrderValue; i16_Cnt<=i16_MaximumReferenceOrderValue; i16_Cnt++ )
+      {
+        pll_dicomFilesIter = pll_dicomFiles;
+        while (pll_dicomFilesIter != NULL)
+        {
+          ps_dicomFile=(ts_dicom_FileProperties*)(pll_dicomFilesIter->data);
+
+
+
+          if ((ps_dicomFile->i16_relativeOrderNumber == i16_Cnt) &&
+              (ps_dicomFile->i16_TemporalPositionIdentifier == i16_timeFrameCnt) &&
               ((ps_dicomFile->e_DCM_CIC == e_DCM_CIC) || b_RecoDoesntMatter))
           {
-            i16_memory_io_dicom_loadSingleSlice(ps_serie, ps_dicomFile->pc_Filename, i16_NumberOfSlices, i16_timeFrameCnt-1 + i16_RecoCnt * ps_serie->num_time_series/i16_NumberOfReconstructions);
+            short int i16_TimePoint = i16_timeFrameCnt-1 + i16_RecoCnt * ps_serie->num_time_series/i16_NumberOfReconstructions;
+            int i32_Slice = i16_TimePoint * ps_serie->matrix.i16_z + i16_NumberOfSlices;
+
+            if (b_MultiFrame && ppv_LazySources != NULL && ps_dicomFile->l_PixelDataOffset >= 0)
+            {
+              // Each frame of the file is a slice source of its own.
+              long l_FrameSize = (long)ps_serie->matrix.i16_x * ps_serie->matrix.i16_y * 2;
+
+              for (i32_Slice = 0; i32_Slice < ps_serie->matrix.i16_z * ps_serie->num_time_series; i32_Slice++)
+              {
+                if ((i32_Slice + 1) * l_FrameSize > ps_dicomFile->l_PixelDataLength) break;
+
+                ts_dicom_SliceSource *ps_Source = calloc (1, sizeof (ts_dicom_SliceSource));
+                assert (ps_Source != NULL);
+
+                ps_Source->pc_Filename = strdup (ps_dicomFile->pc_Filename);
+                ps_Source->l_PixelDataOffset = ps_dicomFile->l_PixelDataOffset + i32_Slice * l_FrameSize;
+                ps_Source->l_PixelDataLength = l_FrameSize;
+                ppv_LazySources[i32_Slice] = ps_Source;
+              }
+            }
+            else if (b_MultiFrame)
+            {
+              i16_memory_io_dicom_loadMultiFrame (ps_serie, ps_dicomFile->pc_Filename,
+                                                  ps_dicomFile->l_PixelDataOffset, ps_dicomFile->l_PixelDataLength);
+            }
+            else if (ppv_LazySources != NULL)
+            {
+              if (i16_NumberOfSlices < ps_serie->matrix.i16_z && ppv_LazySources[i32_Slice] == NULL)
+              {
+                ts_dicom_SliceSource *ps_Source = calloc (1, sizeof (ts_dicom_SliceSource));
+                assert (ps_Source != NULL);
+
+                ps_Source->pc_Filename = strdup (ps_dicomFile->pc_Filename);
+                ps_Source->l_PixelDataOffset = ps_dicomFile->l_PixelDataOffset;
+                ps_Source->l_PixelDataLength = ps_dicomFile->l_PixelDataLength;
+                ppv_LazySources[i32_Slice] = ps_Source;
+              }
+            }
+            else if (pps_LoadOrder != NULL)
+            {
+              ps_dicomFile->i32_Slice = i32_Slice;
+            }
+            else
+            {
+              i16_memory_io_dicom_loadSingleSlice(ps_serie, ps_dicomFile->pc_Filename, i16_NumberOfSlices, i16_TimePoint,
+                                                  ps_dicomFile->l_PixelDataOffset, ps_dicomFile->l_PixelDataLength);
+            }
 
             if (i16_Cnt==i16_MinimumReferenceOrderValue)
             {
@@ -370,272 +1285,825 @@ Tree *pt_memory_io_load_file_dicom (char *pc_path)
               ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][2] = ts_ZVector.z;
               ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[2][3] = 0;
 
-              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][0] = ps_dicomFile->ts_ZPosition.x;
-              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][1] = ps_dicomFile->ts_ZPosition.y;
-              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][2] = ps_dicomFile->ts_ZPosition.z;
-              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][3] = 1;
+              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][0] = ps_dicomFile->ts_ZPosition.x;
+              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][1] = ps_dicomFile->ts_ZPosition.y;
+              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][2] = ps_dicomFile->ts_ZPosition.z;
+              ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][3] = 1;
+
+              // Convert Left handiness to Right handiness
+              ts_Matrix4x4 ts_LPS_RAS;
+              LOAD_MAT44(ts_LPS_RAS, -1, 0, 0, 0,  0, -1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1);
+
+              ps_serie->t_ScannerSpaceIJKtoXYZ = tda_algebra_matrix_4x4_multiply(&ts_LPS_RAS,&ps_serie->t_ScannerSpaceIJKtoXYZ);
+            }
+
+            i16_NumberOfSlices++;
+
+            if (pll_dicomFilesIter != pll_dicomFiles)
+            {
+              pll_dicomFilesIter=list_remove(pll_dicomFilesIter);
+              break;
+            }
+
+          }
+          pll_dicomFilesIter = list_next(pll_dicomFilesIter);
+        }
+      }
+    }
+  }
+
+  if (pps_LoadOrder != NULL && ppv_LazySources == NULL && !b_MultiFrame)
+  {
+    v_memory_io_dicom_load_slices (ps_serie, pps_LoadOrder, i32_Files);
+  }
+
+  // clear everything
+  free (pps_LoadOrder), pps_LoadOrder = NULL;
+  list_free_all(pll_dicomFiles, v_memory_io_dicom_file_properties_destroy);
+
+  ps_serie->i16_QuaternionCode=1; //NIFTI_XFORM_SCANNER_ANAT
+  ps_serie->t_ScannerSpaceXYZtoIJK = tda_algebra_matrix_4x4_inverse(&ps_serie->t_ScannerSpaceIJKtoXYZ);
+
+  ps_serie->pt_RotationMatrix = &ps_serie->t_ScannerSpaceIJKtoXYZ;
+  ps_serie->pt_InverseMatrix = &ps_serie->t_ScannerSpaceXYZtoIJK;
+
+  ps_serie->i16_StandardSpaceCode=0;
+  ps_serie->raw_data_type=DT_UINT16;
+  ps_serie->u8_AxisUnits=0;
+
+  ps_serie->ps_Quaternion = calloc (1, sizeof (ts_Quaternion));
+  *ps_serie->ps_Quaternion = ts_algebra_quaternion_MatrixToQuaternion(&ps_serie->t_ScannerSpaceIJKtoXYZ, &ps_serie->d_Qfac);
+
+  ps_serie->ps_QuaternationOffset = calloc (1, sizeof (ts_Quaternion));
+
+  ps_serie->ps_QuaternationOffset->I = ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][0];
+  ps_serie->ps_QuaternationOffset->J = ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][1];
+  ps_serie->ps_QuaternationOffset->K = ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][2];
+
+  if (ppv_LazySources == NULL)
+  {
+    memory_serie_set_upper_and_lower_borders_from_data(ps_serie);
+  }
+  else if (memory_serie_set_lazy (ps_serie, i16_memory_io_dicom_load_lazy_slice, ppv_LazySources,
+                                  v_memory_io_dicom_slice_source_destroy) == 0)
+  {
+    // The middle slice gives the window a sensible range to start with.
+    memory_serie_ensure_slice (ps_serie, ps_serie->matrix.i16_z / 2, 0);
+  }
+  else
+  {
+    int i32_Slice;
+
+    debug_warning ("Could not load '%s' lazily, loading it at once.", pc_dirName);
+    for (i32_Slice = 0; i32_Slice < ps_serie->matrix.i16_z * ps_serie->num_time_series; i32_Slice++)
+    {
+      if (ppv_LazySources[i32_Slice] == NULL) continue;
+
+      i16_memory_io_dicom_load_lazy_slice (ps_serie, i32_Slice % ps_serie->matrix.i16_z,
+                                           i32_Slice / ps_serie->matrix.i16_z, ppv_LazySources[i32_Slice]);
+      v_memory_io_dicom_slice_source_destroy (ppv_LazySources[i32_Slice]);
+    }
+    free (ppv_LazySources), ppv_LazySources = NULL;
+
+    memory_serie_set_upper_and_lower_borders_from_data(ps_serie);
+  }
+
+  return pt_serie;
+}
+
+/**
+ * This function loads a file into a tree of its own, which holds a single
+ * patient, study and serie. It does not touch any other tree, so several
+ * files can be loaded at the same time.
+ */
+Tree *pt_memory_io_load_file_any (char *pc_path)
+{
+  Tree *pt_new_serie = NULL;
+
+  if (pc_path == NULL)
+  {
+    return NULL;
+  }
+
+  char *pc_Extension = strrchr (pc_path, '.');
+
+  // Volumes kept in a brick file are read from disk when they are viewed.
+  if (pc_Extension != NULL && !strcasecmp (pc_Extension, BRICK_FILE_EXTENSION))
+  {
+    pt_new_serie = pt_memory_io_load_file_bricks(pc_path);
+  }
+  // check wheater it is a niftii
+  else if (memory_io_niftii_file_type(pc_path) != MUMC_FILETYPE_NOT_KNOWN)
+  {
+    pt_new_serie = pt_memory_io_load_file_nifti(pc_path);
+  }
+  else
+  {
+    // maybe a dicom?
+    pt_new_serie = pt_memory_io_load_file_dicom(pc_path);
+  }
+
+  if (pt_new_serie != NULL)
+    memory_serie_account_data (pt_new_serie->data);
+
+  return pt_new_serie;
+}
+
+/**
+ * This function moves a serie that was loaded on its own into the tree of
+ * 'ppt_study'. The patient and study of the serie are merged with those
+ * that exist already. When the serie itself exists already, the loaded
+ * copy is destroyed and NULL is returned.
+ */
+Tree *pt_memory_io_merge_serie (Tree **ppt_study, Tree *pt_new_serie)
+{
+  Patient *ps_new_patient = NULL;
+  Study   *ps_new_study = NULL;
+  Serie   *ps_new_serie = NULL;
+
+  Tree *pt_new_patient=NULL;
+  Tree *pt_new_study=NULL;
+
+  Tree *pt_patientIter=NULL;
+  Tree *pt_studyIter=NULL;
+  Tree *pt_serieIter=NULL;
+
+  unsigned char b_PatientExists = 0;
+  unsigned char b_StudyExists = 0;
+  unsigned char b_SerieExists = 0;
+
+  if (pt_new_serie == NULL)
+  {
+    return NULL;
+  }
+
+  pt_new_study = pt_new_serie->parent;
+  pt_new_patient = pt_new_study->parent;
+
+  ps_new_patient = (Patient *)(pt_new_patient->data);
+  ps_new_study = (Study *)(pt_new_study->data);
+  ps_new_serie = (Serie *)(pt_new_serie->data);
+
+
+  // Check wheather patient, study and serie exists. If so,
+  pt_patientIter = (*ppt_study != NULL) ? (*ppt_study)->parent : NULL;
+
+
+
+
+  //Check if patient exists. The registry finds it without walking the tree.
+  pt_patientIter = memory_tree_get_patient_by_uid (pt_patientIter, ps_new_patient->c_patientID);
+  if (pt_patientIter != NULL)
+  {
+    b_PatientExists=1;
+
+    memory_patient_destroy(ps_new_patient);
+    tree_remove(pt_new_patient);
+
+    pt_new_patient = pt_patientIter;
+    ps_new_patient = (Patient *)(pt_new_patient->data);
+  }
+
+  if (!b_PatientExists)
+  {
+    tree_remove(pt_new_patient);
+    pt_patientIter = (*ppt_study != NULL) ? (*ppt_study)->parent : NULL;
+    pt_new_patient = tree_append (pt_patientIter, ps_new_patient, TREE_TYPE_PATIENT);
+    memory_tree_register (pt_new_patient);
+  }
+
+  //Check if Study exists
+  pt_studyIter = memory_tree_get_study_by_uid (pt_new_patient, ps_new_study->c_studyInstanceUID);
+  if (pt_studyIter != NULL)
+  {
+    b_StudyExists=1;
+    memory_study_destroy(ps_new_study);
+    tree_remove(pt_new_study);
+
+    pt_new_study = pt_studyIter;
+    ps_new_study = (Study*)(pt_new_study->data);
+  }
+
+  if (!b_StudyExists)
+  {
+    tree_remove(pt_new_study);
+    pt_new_study = tree_append_child (pt_new_patient, ps_new_study, TREE_TYPE_STUDY);
+    memory_tree_register (pt_new_study);
+  }
+
+  pt_serieIter = memory_tree_get_serie_by_uid (pt_new_study, ps_new_serie->c_serieInstanceUID);
+  if (pt_serieIter != NULL)
+  {
+    b_SerieExists=1;
+    memory_serie_destroy(ps_new_serie);
+    tree_remove(pt_new_serie);
+
+    pt_new_serie = pt_serieIter;
+    ps_new_serie = (Serie *)(pt_new_serie->data);
+  }
+
+  if (!b_SerieExists)
+  {
+    tree_remove(pt_new_serie);
+    pt_new_serie=tree_append_child (pt_new_study, ps_new_serie, TREE_TYPE_SERIE);
+    memory_tree_register (pt_new_serie);
+  }
+  else
+  {
+    pt_new_serie= NULL;
+  }
+
+  return pt_new_serie;
+}
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* GLOBAL FUNCTIONS                                                                                   */
+/*                                                                                                    */
+/*                                                                                                    */
+Tree *pt_memory_io_load_file (Tree **ppt_study, char *pc_path)
+{
+  debug_functions ();
+
+  if (ppt_study == NULL) return NULL;
+
+  return pt_memory_io_merge_serie (ppt_study, pt_memory_io_load_file_any (pc_path));
+}
+
+void memory_io_set_compression_level (int i32_Level)
+{
+  i32_CompressionLevel = (i32_Level < -1 || i32_Level > 9) ? -1 : i32_Level;
+}
+
+
+int memory_io_get_compression_level ()
+{
+  return i32_CompressionLevel;
+}
+
+
+void memory_io_set_brick_memory_budget (unsigned long long ui64_Bytes)
+{
+  ui64_BrickMemoryBudget = ui64_Bytes;
+}
+
 
-              // Convert Left handiness to Right handiness
-              ts_Matrix4x4 ts_LPS_RAS;
-              LOAD_MAT44(ts_LPS_RAS, -1, 0, 0, 0,  0, -1, 0, 0,  0, 0, 1, 0,  0, 0, 0, 1);
+short int memory_io_save_file (Serie *serie, const char *path)
+{
+  return i16_memory_io_save_file (serie, path, NULL);
+}
 
-              ps_serie->t_ScannerSpaceIJKtoXYZ = tda_algebra_matrix_4x4_multiply(&ts_LPS_RAS,&ps_serie->t_ScannerSpaceIJKtoXYZ);
-            }
+short int i16_memory_io_save_file (Serie *serie, const char *path, unsigned long long *pui64_BytesWritten)
+{
+  debug_functions ();
 
-            i16_NumberOfSlices++;
+  short int i16_Result = 0;
 
-            if (pll_dicomFilesIter != pll_dicomFiles)
-            {
-              pll_dicomFilesIter=list_remove(pll_dicomFilesIter);
-              break;
-            }
+  char *pc_Path = calloc (1, strlen (path) + 5);
+  strcpy (pc_Path, path);
 
-          }
-          pll_dicomFilesIter = list_next(pll_dicomFilesIter);
-        }
-      }
+  // The writers read the data in linear order with memory_serie_read_linear(),
+  // whatever keeps it. Values painted into a sparse Serie are moved into its
+  // bricks first.
+  if (serie->ps_Sparse != NULL)
+    memory_sparse_flush (serie->ps_Sparse);
+
+  // The extension of the path picks the format. A path without one is
+  // written in the format the serie was loaded from.
+  char* pc_Extension = strrchr (pc_Path, '.');
+  if (pc_Extension != NULL && strchr (pc_Extension, PATH_SEPARATOR) != NULL)
+    pc_Extension = NULL;
+
+  if (pc_Extension == NULL)
+  {
+    switch (serie->input_type)
+    {
+      case MUMC_FILETYPE_DICOM:
+      case MUMC_FILETYPE_NIFTII_SF:
+        strcat (pc_Path, ".nii");
+        break;
+      case MUMC_FILETYPE_ANALYZE75:
+      case MUMC_FILETYPE_NIFTII_TF:
+        strcat (pc_Path, ".hdr");
+        break;
+      case MUMC_FILETYPE_NOT_KNOWN:
+      default:
+        break;
     }
+
+    pc_Extension = strrchr (pc_Path, '.');
+    if (pc_Extension != NULL && strchr (pc_Extension, PATH_SEPARATOR) != NULL)
+      pc_Extension = NULL;
   }
 
-  // clear everything
-  pll_dicomFilesIter = list_nth(pll_dicomFiles,1);
-  while (pll_dicomFilesIter->next != NULL)
+  // Converting to a brick file keeps the volume in its own format.
+  if (pc_Extension != NULL && !strcasecmp (pc_Extension, BRICK_FILE_EXTENSION))
   {
-    ps_dicomFile=(ts_dicom_FileProperties*)(pll_dicomFilesIter->data);
+    i16_Result = memory_brick_write (serie, pc_Path, (i32_CompressionLevel != 0), pui64_BytesWritten);
+  }
+  else if (pc_Extension == NULL || serie->input_type == MUMC_FILETYPE_NOT_KNOWN)
+  {
+    i16_Result = 1;
+  }
+  else if (!strcasecmp (pc_Extension, ".gz"))
+  {
+    // A .gz extension asks for a compressed single-file niftii.
+    i16_Result = memory_io_niftii_save_compressed (serie, pc_Path, i32_CompressionLevel, pui64_BytesWritten);
+  }
+  else if (!strcasecmp (pc_Extension, ".nii"))
+  {
+    // When the file still holds what we loaded or saved before, only
+    // the regions that changed since then have to be written.
+    if (serie->pc_SyncedFile != NULL && !strcmp (serie->pc_SyncedFile, pc_Path)
+        && memory_io_niftii_update (serie, pc_Path, pui64_BytesWritten) == 0)
+      i16_Result = 0;
+    else
+      i16_Result = memory_io_niftii_save_with_progress (serie, pc_Path, NULL, pui64_BytesWritten);
 
-    free(ps_dicomFile->pc_Filename), ps_dicomFile->pc_Filename = NULL;
-    free(ps_dicomFile), ps_dicomFile = NULL;
-    pll_dicomFilesIter = list_next(pll_dicomFilesIter);
+    if (i16_Result == 0)
+      memory_serie_set_synced_file (serie, pc_Path);
   }
-  list_free(pll_dicomFiles);
+  else if (!strcasecmp (pc_Extension, ".hdr") || !strcasecmp (pc_Extension, ".img"))
+  {
+    // A niftii pair is written to a .hdr and an .img file next to each
+    // other, whichever of the two was asked for.
+    char *pc_ImageFile = calloc (1, strlen (pc_Path) + 1);
+    char *pc_HeaderFile = calloc (1, strlen (pc_Path) + 1);
+    assert (pc_ImageFile != NULL && pc_HeaderFile != NULL);
 
-  ps_serie->i16_QuaternionCode=1; //NIFTI_XFORM_SCANNER_ANAT
-  ps_serie->t_ScannerSpaceXYZtoIJK = tda_algebra_matrix_4x4_inverse(&ps_serie->t_ScannerSpaceIJKtoXYZ);
+    strcpy (pc_ImageFile, pc_Path);
+    strcpy (pc_HeaderFile, pc_Path);
+    strcpy (pc_ImageFile + (pc_Extension - pc_Path), ".img");
+    strcpy (pc_HeaderFile + (pc_Extension - pc_Path), ".hdr");
 
-  ps_serie->pt_RotationMatrix = &ps_serie->t_ScannerSpaceIJKtoXYZ;
-  ps_serie->pt_InverseMatrix = &ps_serie->t_ScannerSpaceXYZtoIJK;
+    i16_Result = memory_io_niftii_save_with_progress (serie, pc_HeaderFile, pc_ImageFile, pui64_BytesWritten);
 
-  ps_serie->i16_StandardSpaceCode=0;
-  ps_serie->raw_data_type=MEMORY_TYPE_UINT16;
-  ps_serie->u8_AxisUnits=0;
+    free (pc_ImageFile), pc_ImageFile = NULL;
+    free (pc_HeaderFile), pc_HeaderFile = NULL;
+  }
+  else
+  {
+    debug_warning ("Cannot save '%s': '%s' is not a known format.", pc_Path, pc_Extension);
+    i16_Result = 1;
+  }
 
-  ps_serie->ps_Quaternion = calloc (1, sizeof (ts_Quaternion));
-  *ps_serie->ps_Quaternion = ts_algebra_quaternion_MatrixToQuaternion(&ps_serie->t_ScannerSpaceIJKtoXYZ, &ps_serie->d_Qfac);
+  free (pc_Path);
+  pc_Path = NULL;
+  return i16_Result;
+}
 
-  ps_serie->ps_QuaternationOffset = calloc (1, sizeof (ts_Quaternion));
 
-  ps_serie->ps_QuaternationOffset->I = ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][0];
-  ps_serie->ps_QuaternationOffset->J = ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][1];
-  ps_serie->ps_QuaternationOffset->K = ps_serie->t_ScannerSpaceIJKtoXYZ.af_Matrix[3][2];
+void*
+pv_memory_io_save_job_run (void *data)
+{
+  SaveJob *ps_Job = (SaveJob *)data;
 
-  memory_serie_set_upper_and_lower_borders_from_data(ps_serie);
+  common_thread_set_thread_workers (ps_Job->ui32_Workers);
+  ps_Job->i16_Result = i16_memory_io_save_file (ps_Job->ps_Snapshot, ps_Job->pc_Path, &ps_Job->ui64_BytesWritten);
+  __atomic_store_n (&ps_Job->b_Finished, 1, __ATOMIC_RELEASE);
 
-  return pt_serie;
+  return NULL;
 }
 
-/*                                                                                                    */
-/*                                                                                                    */
-/* GLOBAL FUNCTIONS                                                                                   */
-/*                                                                                                    */
-/*                                                                                                    */
-Tree *pt_memory_io_load_file (Tree **ppt_study, char *pc_path)
+
+SaveJob *memory_io_save_file_async (Serie *serie, const char *path)
 {
   debug_functions ();
 
-  if (ppt_study == NULL) return NULL;
-
-  Patient *ps_new_patient = NULL;
-  Study   *ps_new_study = NULL;
-  Serie   *ps_new_serie = NULL;
-
-  Patient *ps_tmp_patient = NULL;
-  Study   *ps_tmp_study = NULL;
-  Serie   *ps_tmp_serie = NULL;
-
-  Tree *pt_new_patient=NULL;
-  Tree *pt_new_study=NULL;
-  Tree *pt_new_serie=NULL;
+  if (serie == NULL || path == NULL) return NULL;
+  if (serie->data == NULL && serie->ps_Sparse == NULL && serie->ps_BrickCache == NULL) return NULL;
+  if (memory_serie_load_all (serie) != 0) return NULL;
+
+  SaveJob *ps_Job = calloc (1, sizeof (SaveJob));
+  assert (ps_Job != NULL);
+
+  unsigned long long ui64_DataSize = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y *
+                                     serie->matrix.i16_z * serie->num_time_series *
+                                     memory_serie_get_memory_space (serie);
+
+  // Take a copy of everything the writer needs, so the serie can be
+  // changed (or painted on) while the snapshot is being written.
+  Serie *ps_Snapshot = calloc (1, sizeof (Serie));
+  assert (ps_Snapshot != NULL);
+
+  *ps_Snapshot = *serie;
+  ps_Snapshot->pc_filename = NULL;
+  ps_Snapshot->pv_OutOfBlobValue = NULL;
+  ps_Snapshot->pc_SyncedFile = NULL;
+  ps_Snapshot->pu8_DirtySlabs = NULL;
+  ps_Snapshot->pll_History = NULL;
+  ps_Snapshot->ps_BrickCache = NULL;
+  ps_Snapshot->ps_Sparse = NULL;
+  memset (&ps_Snapshot->ts_Accounting, 0, sizeof (Accounting));
+
+  // The orientation matrices point into the serie, so point the snapshot
+  // at its own copies of them.
+  if (serie->pt_RotationMatrix == &serie->t_StandardSpaceIJKtoXYZ)
+  {
+    ps_Snapshot->pt_RotationMatrix = &ps_Snapshot->t_StandardSpaceIJKtoXYZ;
+    ps_Snapshot->pt_InverseMatrix = &ps_Snapshot->t_StandardSpaceXYZtoIJK;
+  }
+  else if (serie->pt_RotationMatrix == &serie->t_ScannerSpaceIJKtoXYZ)
+  {
+    ps_Snapshot->pt_RotationMatrix = &ps_Snapshot->t_ScannerSpaceIJKtoXYZ;
+    ps_Snapshot->pt_InverseMatrix = &ps_Snapshot->t_ScannerSpaceXYZtoIJK;
+  }
+  else
+  {
+    ps_Snapshot->pt_RotationMatrix = NULL;
+    ps_Snapshot->pt_InverseMatrix = NULL;
+  }
 
-  Tree *pt_patientIter=NULL;
-  Tree *pt_studyIter=NULL;
-  Tree *pt_serieIter=NULL;
+  // The data of the serie is shared with the snapshot rather than copied,
+  // when the serie is not written to in place. A brick file is read through
+  // a cache of its own. Anything else is copied in linear order.
+  ps_Snapshot->data = NULL;
+  ps_Snapshot->ps_Buffer = NULL;
+  if (serie->ps_BrickCache != NULL)
+    ps_Snapshot->ps_BrickCache = memory_brick_reopen (serie->ps_BrickCache, ps_Snapshot);
 
-  unsigned char b_PatientExists = 0;
-  unsigned char b_StudyExists = 0;
-  unsigned char b_SerieExists = 0;
+  else if (memory_serie_share_data (serie, ps_Snapshot) != 0)
+  {
+    ps_Snapshot->data = memory_serie_copy_linear_data (serie);
+    ps_Snapshot->e_Layout = SERIE_LAYOUT_LINEAR;
+  }
 
-  if (pc_path == NULL)
+  ps_Snapshot->ps_Quaternion = calloc (1, sizeof (ts_Quaternion));
+  ps_Snapshot->ps_QuaternationOffset = calloc (1, sizeof (ts_Quaternion));
+  if ((ps_Snapshot->data == NULL && ps_Snapshot->ps_BrickCache == NULL)
+      || ps_Snapshot->ps_Quaternion == NULL || ps_Snapshot->ps_QuaternationOffset == NULL)
   {
+    debug_error ("Not enough memory to save '%s'.", path);
+    memory_serie_destroy (ps_Snapshot);
+    memory_serie_reclaim_data (serie);
+    free (ps_Job);
     return NULL;
   }
 
-  // check wheater it is a niftii
-  if (memory_io_niftii_file_type(pc_path) != MUMC_FILETYPE_NOT_KNOWN)
+  memory_serie_account_data (ps_Snapshot);
+
+  if (serie->ps_Quaternion != NULL)
+    *ps_Snapshot->ps_Quaternion = *serie->ps_Quaternion;
+  if (serie->ps_QuaternationOffset != NULL)
+    *ps_Snapshot->ps_QuaternationOffset = *serie->ps_QuaternationOffset;
+
+  // The snapshot takes over the dirty slabs. The serie starts over with a
+  // clean set, to keep track of what changes while the snapshot is written.
+  ps_Snapshot->pc_SyncedFile = serie->pc_SyncedFile;
+  ps_Snapshot->pu8_DirtySlabs = serie->pu8_DirtySlabs;
+  serie->pc_SyncedFile = NULL;
+  serie->pu8_DirtySlabs = NULL;
+  if (serie->e_Layout == SERIE_LAYOUT_LINEAR)
+    memory_serie_set_synced_file (serie, path);
+
+  ps_Job->ps_Serie = serie;
+  ps_Job->ps_Snapshot = ps_Snapshot;
+  ps_Job->pc_Path = calloc (1, strlen (path) + 1);
+  assert (ps_Job->pc_Path != NULL);
+  strcpy (ps_Job->pc_Path, path);
+
+  ps_Job->ui64_BytesTotal = ui64_DataSize;
+  ps_Job->ui32_Workers = common_thread_number_of_workers ();
+
+  if (pthread_create (&ps_Job->t_Thread, NULL, pv_memory_io_save_job_run, ps_Job) != 0)
   {
-    pt_new_serie = pt_memory_io_load_file_nifti(pc_path);
+    // Without a thread, write it right away.
+    pv_memory_io_save_job_run (ps_Job);
+    ps_Job->b_Joined = 1;
   }
+
+  return ps_Job;
+}
+
+
+void*
+pv_memory_io_convert_job_run (void *data)
+{
+  SaveJob *ps_Job = (SaveJob *)data;
+  Tree *pt_Serie;
+  Serie *ps_Serie;
+
+  common_thread_set_thread_workers (ps_Job->ui32_Workers);
+
+  char *pc_Extension = strrchr (ps_Job->pc_Source, '.');
+
+  // The source is opened lazily, and streamed into the bricks a slab at a
+  // time.
+  if (pc_Extension != NULL && !strcasecmp (pc_Extension, BRICK_FILE_EXTENSION))
+    pt_Serie = pt_memory_io_load_file_bricks (ps_Job->pc_Source);
+  else if (memory_io_niftii_file_type (ps_Job->pc_Source) != MUMC_FILETYPE_NOT_KNOWN)
+    pt_Serie = pt_memory_io_load_nifti (ps_Job->pc_Source, 1, 1);
   else
+    pt_Serie = pt_memory_io_load_dicom (ps_Job->pc_Source, 1, 1);
+
+  ps_Job->i16_Result = 1;
+  if (pt_Serie != NULL)
   {
-    // maybe a dicom?
-    pt_new_serie = pt_memory_io_load_file_dicom(pc_path);
+    ps_Serie = (Serie *)pt_Serie->data;
+
+    // A source that could not be opened lazily was read in full already.
+    memory_serie_set_streaming (ps_Serie);
+    __atomic_store_n (&ps_Job->ui64_BytesTotal, memory_serie_get_data_size (ps_Serie), __ATOMIC_RELAXED);
+
+    ps_Job->i16_Result = memory_brick_write (ps_Serie, ps_Job->pc_Path, (i32_CompressionLevel != 0),
+                                             &ps_Job->ui64_BytesWritten);
+    v_memory_io_destroy_tree (pt_Serie);
   }
 
-  if (pt_new_serie == NULL)
+  __atomic_store_n (&ps_Job->b_Finished, 1, __ATOMIC_RELEASE);
+
+  return NULL;
+}
+
+
+SaveJob *memory_io_convert_file_async (const char *pc_Source, const char *pc_Destination)
+{
+  debug_functions ();
+
+  if (pc_Source == NULL || pc_Destination == NULL) return NULL;
+
+  SaveJob *ps_Job = calloc (1, sizeof (SaveJob));
+  assert (ps_Job != NULL);
+
+  ps_Job->pc_Source = calloc (1, strlen (pc_Source) + 1);
+  ps_Job->pc_Path = calloc (1, strlen (pc_Destination) + 1);
+  assert (ps_Job->pc_Source != NULL && ps_Job->pc_Path != NULL);
+  strcpy (ps_Job->pc_Source, pc_Source);
+  strcpy (ps_Job->pc_Path, pc_Destination);
+  ps_Job->ui32_Workers = common_thread_number_of_workers ();
+
+  if (pthread_create (&ps_Job->t_Thread, NULL, pv_memory_io_convert_job_run, ps_Job) != 0)
   {
-    return NULL;
+    // Without a thread, convert it right away.
+    pv_memory_io_convert_job_run (ps_Job);
+    ps_Job->b_Joined = 1;
   }
 
-  pt_new_study = pt_new_serie->parent;
-  pt_new_patient = pt_new_study->parent;
+  return ps_Job;
+}
 
-  ps_new_patient = (Patient *)(pt_new_patient->data);
-  ps_new_study = (Study *)(pt_new_study->data);
-  ps_new_serie = (Serie *)(pt_new_serie->data);
 
+float memory_io_save_job_get_progress (SaveJob *ps_Job)
+{
+  if (ps_Job == NULL) return 1.0;
+  if (memory_io_save_job_is_finished (ps_Job)) return 1.0;
+  // The size of a conversion is only known once its source is opened.
+  unsigned long long ui64_BytesTotal = __atomic_load_n (&ps_Job->ui64_BytesTotal, __ATOMIC_RELAXED);
+  if (ui64_BytesTotal == 0) return 0.0;
 
-  // Check wheather patient, study and serie exists. If so,
-  pt_patientIter = (*ppt_study != NULL) ? (*ppt_study)->parent : NULL;
+  return (float)__atomic_load_n (&ps_Job->ui64_BytesWritten, __ATOMIC_RELAXED) / ui64_BytesTotal;
+}
 
 
+short int memory_io_save_job_is_finished (SaveJob *ps_Job)
+{
+  if (ps_Job == NULL) return 1;
+  return __atomic_load_n (&ps_Job->b_Finished, __ATOMIC_ACQUIRE);
+}
 
 
-  //Check if patient exists
-  pt_patientIter=tree_nth(pt_patientIter,1);
-  while (pt_patientIter != NULL)
-  {
-    ps_tmp_patient=(Patient *)(pt_patientIter->data);
+short int memory_io_save_job_finish (SaveJob *ps_Job)
+{
+  debug_functions ();
 
-    if (strcmp(ps_tmp_patient->c_patientID,ps_new_patient->c_patientID) == 0)
-    {
-      b_PatientExists=1;
+  short int i16_Result;
 
-      memory_patient_destroy(ps_new_patient);
-      tree_remove(pt_new_patient);
+  if (ps_Job == NULL) return 1;
 
-      pt_new_patient = pt_patientIter;
-      ps_new_patient = (Patient *)(pt_new_patient->data);
-      // Patient exists
-      break;
-    }
-    pt_patientIter=tree_next(pt_patientIter);
-  }
+  if (!ps_Job->b_Joined)
+    pthread_join (ps_Job->t_Thread, NULL);
 
-  if (!b_PatientExists)
+  i16_Result = ps_Job->i16_Result;
+
+  // A conversion has no serie to hand anything back to.
+  if (ps_Job->ps_Serie == NULL)
   {
-    tree_remove(pt_new_patient);
-    pt_patientIter = (*ppt_study != NULL) ? (*ppt_study)->parent : NULL;
-    pt_new_patient = tree_append (pt_patientIter, ps_new_patient, TREE_TYPE_PATIENT);
+    free (ps_Job->pc_Source), ps_Job->pc_Source = NULL;
+    free (ps_Job->pc_Path), ps_Job->pc_Path = NULL;
+    free (ps_Job), ps_Job = NULL;
+    return i16_Result;
   }
 
-  //Check if Study exists
-  pt_studyIter=tree_nth(pt_new_patient->child,1);
-  while (pt_studyIter != NULL)
-  {
-    ps_tmp_study=(Study * )(pt_studyIter->data);
+  // Hand the file that the snapshot is in sync with back to the serie. When
+  // the save did not write to that file, whatever was dirty still is.
+  Serie *ps_Serie = ps_Job->ps_Serie;
+  Serie *ps_Snapshot = ps_Job->ps_Snapshot;
 
-    if (strcmp(ps_tmp_study->c_studyInstanceUID,ps_new_study->c_studyInstanceUID) == 0)
-    {
-      b_StudyExists=1;
-      memory_study_destroy(ps_new_study);
-      tree_remove(pt_new_study);
+  free (ps_Serie->pc_SyncedFile);
+  ps_Serie->pc_SyncedFile = ps_Snapshot->pc_SyncedFile;
+  ps_Snapshot->pc_SyncedFile = NULL;
 
-      pt_new_study = pt_studyIter;
-      ps_new_study = (Study*)(pt_new_study->data);
-      break;
-    }
-    pt_studyIter=tree_next(pt_studyIter);
-  }
+  // Dirty slabs are only kept for the linear layout.
+  if (ps_Serie->pc_SyncedFile == NULL || ps_Serie->e_Layout != SERIE_LAYOUT_LINEAR)
+    memory_serie_set_synced_file (ps_Serie, NULL);
 
-  if (!b_StudyExists)
+  else if (ps_Snapshot->pu8_DirtySlabs != NULL && ps_Serie->pu8_DirtySlabs != NULL)
   {
-    tree_remove(pt_new_study);
-    pt_new_study = tree_append_child (pt_new_patient, ps_new_study, TREE_TYPE_STUDY);
+    unsigned long long ui64_Slab;
+    unsigned long long ui64_Slabs = (ps_Job->ui64_BytesTotal + SERIE_DIRTY_SLAB_SIZE - 1) / SERIE_DIRTY_SLAB_SIZE;
+
+    for (ui64_Slab = 0; ui64_Slab < ui64_Slabs; ui64_Slab++)
+      ps_Serie->pu8_DirtySlabs[ui64_Slab] |= ps_Snapshot->pu8_DirtySlabs[ui64_Slab];
   }
 
-  pt_serieIter=tree_nth(pt_new_study->child,1);
-  while (pt_serieIter != NULL)
-  {
-    ps_tmp_serie=(Serie *)(pt_studyIter->data);
+  // Data shared with the snapshot belongs to the serie alone again.
+  memory_serie_destroy (ps_Job->ps_Snapshot);
+  memory_serie_reclaim_data (ps_Serie);
 
-    if (strcmp(ps_tmp_serie->c_serieInstanceUID,ps_new_serie->c_serieInstanceUID) == 0)
-    {
-      b_SerieExists=1;
-      memory_serie_destroy(ps_new_serie);
-      tree_remove(pt_new_serie);
+  free (ps_Job->pc_Path), ps_Job->pc_Path = NULL;
+  free (ps_Job), ps_Job = NULL;
 
-      pt_new_serie = pt_serieIter;
-      ps_new_serie = (Serie *)(pt_new_serie->data);
-      break;
+  return i16_Result;
+}
+
+
+
+
+void memory_io_set_lazy_dicom (short int b_Lazy)
+{
+  b_LazyDicom = b_Lazy;
+}
+
+
+void memory_io_set_load_concurrency (unsigned int ui32_Loads)
+{
+  pthread_mutex_lock (&t_LoadMutex);
+  ui32_LoadConcurrency = (ui32_Loads == 0) ? MEMORY_IO_DEFAULT_LOAD_CONCURRENCY : ui32_Loads;
+  pthread_cond_broadcast (&t_LoadCondition);
+  pthread_mutex_unlock (&t_LoadMutex);
+}
+
+
+void*
+pv_memory_io_load_job_run (void *data)
+{
+  LoadJob *ps_Job = (LoadJob *)data;
+  unsigned int ui32_Path;
+  Tree *pt_Serie;
+
+  while ((ui32_Path = __atomic_fetch_add (&ps_Job->ui32_NextPath, 1, __ATOMIC_RELAXED)) < ps_Job->ui32_Paths)
+  {
+    // Wait for a free slot, so that the disk isn't asked for more files at
+    // once than it can serve.
+    pthread_mutex_lock (&t_LoadMutex);
+    while (ui32_ActiveLoads >= ui32_LoadConcurrency)
+      pthread_cond_wait (&t_LoadCondition, &t_LoadMutex);
+    ui32_ActiveLoads++;
+    pthread_mutex_unlock (&t_LoadMutex);
+
+    pt_Serie = pt_memory_io_load_file_any (ps_Job->ppc_Paths[ui32_Path]);
+
+    pthread_mutex_lock (&t_LoadMutex);
+    ui32_ActiveLoads--;
+    pthread_cond_signal (&t_LoadCondition);
+    pthread_mutex_unlock (&t_LoadMutex);
+
+    if (pt_Serie == NULL)
+    {
+      debug_warning ("Could not load '%s'.", ps_Job->ppc_Paths[ui32_Path]);
+      __atomic_add_fetch (&ps_Job->ui32_Failed, 1, __ATOMIC_RELAXED);
     }
-    pt_serieIter=tree_next(pt_serieIter);
+
+    // Publish the serie before telling it is there.
+    ps_Job->ppt_Series[ui32_Path] = pt_Serie;
+    __atomic_store_n (&ps_Job->pu8_Loaded[ui32_Path], 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch (&ps_Job->ui32_Done, 1, __ATOMIC_RELEASE);
   }
 
-  if (!b_SerieExists)
+  return NULL;
+}
+
+
+LoadJob *memory_io_load_files_async (char **ppc_Paths, unsigned int ui32_Paths)
+{
+  debug_functions ();
+
+  unsigned int ui32_Path;
+  unsigned int ui32_Thread;
+
+  if (ppc_Paths == NULL || ui32_Paths == 0) return NULL;
+
+  LoadJob *ps_Job = calloc (1, sizeof (LoadJob));
+  assert (ps_Job != NULL);
+
+  ps_Job->ui32_Paths = ui32_Paths;
+  ps_Job->ppc_Paths = calloc (ui32_Paths, sizeof (char *));
+  ps_Job->ppt_Series = calloc (ui32_Paths, sizeof (Tree *));
+  ps_Job->pu8_Loaded = calloc (ui32_Paths, sizeof (unsigned char));
+  assert (ps_Job->ppc_Paths != NULL && ps_Job->ppt_Series != NULL && ps_Job->pu8_Loaded != NULL);
+
+  // The loaders may change the path they are given (dirname), so they
+  // work on copies.
+  for (ui32_Path = 0; ui32_Path < ui32_Paths; ui32_Path++)
   {
-    tree_remove(pt_new_serie);
-    pt_new_serie=tree_append_child (pt_new_study, ps_new_serie, TREE_TYPE_SERIE);
+    ps_Job->ppc_Paths[ui32_Path] = calloc (1, strlen (ppc_Paths[ui32_Path]) + 1);
+    assert (ps_Job->ppc_Paths[ui32_Path] != NULL);
+    strcpy (ps_Job->ppc_Paths[ui32_Path], ppc_Paths[ui32_Path]);
   }
-  else
+
+  // Every thread waits for a slot before reading, so starting more threads
+  // than the concurrency limit would only leave them waiting.
+  ps_Job->ui32_Threads = __atomic_load_n (&ui32_LoadConcurrency, __ATOMIC_RELAXED);
+  if (ps_Job->ui32_Threads > ui32_Paths)
+    ps_Job->ui32_Threads = ui32_Paths;
+
+  ps_Job->pt_Threads = calloc (ps_Job->ui32_Threads, sizeof (pthread_t));
+  assert (ps_Job->pt_Threads != NULL);
+
+  for (ui32_Thread = 0; ui32_Thread < ps_Job->ui32_Threads; ui32_Thread++)
   {
-    pt_new_serie= NULL;
+    if (pthread_create (&ps_Job->pt_Threads[ui32_Thread], NULL, pv_memory_io_load_job_run, ps_Job) != 0)
+      break;
   }
 
-  return pt_new_serie;
+  ps_Job->ui32_Threads = ui32_Thread;
+
+  // Without any thread, load everything right away.
+  if (ps_Job->ui32_Threads == 0)
+    pv_memory_io_load_job_run (ps_Job);
+
+  return ps_Job;
 }
 
-short int memory_io_save_file (Serie *serie, const char *path)
+
+Tree *memory_io_load_job_merge_next (LoadJob *ps_Job, Tree **ppt_study)
 {
   debug_functions ();
 
-  char *pc_Path = calloc (1, strlen (path) + 4);
-  strcpy (pc_Path, path);
+  unsigned int ui32_Path;
+  Tree *pt_Serie;
 
-  char* pc_Extension = strrchr (pc_Path, '.');
+  if (ps_Job == NULL || ppt_study == NULL) return NULL;
 
-  switch (serie->input_type)
+  for (ui32_Path = 0; ui32_Path < ps_Job->ui32_Paths; ui32_Path++)
   {
-    case MUMC_FILETYPE_ANALYZE75:
-      break;
-    case MUMC_FILETYPE_DICOM:
-    case MUMC_FILETYPE_NIFTII_SF:
-      if (pc_Extension == NULL)
-      {
-        strcat (pc_Path, ".nii");
-      }
-
-      memory_io_niftii_save (serie, pc_Path, NULL);
+    if (__atomic_load_n (&ps_Job->pu8_Loaded[ui32_Path], __ATOMIC_ACQUIRE) != 1)
+      continue;
 
-      break;
-    case MUMC_FILETYPE_NIFTII_TF:
-      {
-        char c_ImageFile[1024];
-        char c_HeaderFile[1024];
+    // Loaded series are merged only once.
+    ps_Job->pu8_Loaded[ui32_Path] = 2;
 
-        strcpy(&c_ImageFile[0],path);
-        strcpy(&c_HeaderFile[0],path);
+    pt_Serie = pt_memory_io_merge_serie (ppt_study, ps_Job->ppt_Series[ui32_Path]);
+    ps_Job->ppt_Series[ui32_Path] = NULL;
 
-        if (pc_Extension == NULL)
-        {
-          strcat(&c_ImageFile[0], ".img");
-          strcat(&c_HeaderFile[0], ".hdr");
-        }
+    // Duplicates are dropped by the merge. Move on to the next serie.
+    if (pt_Serie == NULL) continue;
 
-        memory_io_niftii_save(serie,&c_HeaderFile[0],&c_ImageFile[0]);
+    // Let the next series join the same tree.
+    if (*ppt_study == NULL)
+      *ppt_study = tree_parent (pt_Serie);
 
-      }
-      break;
-    case MUMC_FILETYPE_NOT_KNOWN :
-    default:
-      {
-        free (pc_Path);
-        pc_Path = NULL;
-        return 1;
-      }
+    return pt_Serie;
   }
 
-  free (pc_Path);
-  pc_Path = NULL;
-  return 0;
+  return NULL;
+}
+
+
+float memory_io_load_job_get_progress (LoadJob *ps_Job)
+{
+  if (ps_Job == NULL) return 1.0;
+
+  return (float)__atomic_load_n (&ps_Job->ui32_Done, __ATOMIC_RELAXED) / ps_Job->ui32_Paths;
+}
+
+
+short int memory_io_load_job_is_finished (LoadJob *ps_Job)
+{
+  if (ps_Job == NULL) return 1;
+  return (__atomic_load_n (&ps_Job->ui32_Done, __ATOMIC_ACQUIRE) == ps_Job->ui32_Paths);
 }
 
 
+unsigned int memory_io_load_job_finish (LoadJob *ps_Job)
+{
+  debug_functions ();
+
+  unsigned int ui32_Path;
+  unsigned int ui32_Thread;
+  unsigned int ui32_Failed;
+
+  if (ps_Job == NULL) return 0;
+
+  for (ui32_Thread = 0; ui32_Thread < ps_Job->ui32_Threads; ui32_Thread++)
+    pthread_join (ps_Job->pt_Threads[ui32_Thread], NULL);
+
+  ui32_Failed = ps_Job->ui32_Failed;
+
+  // Series that have not been merged are of no use to anyone anymore.
+  for (ui32_Path = 0; ui32_Path < ps_Job->ui32_Paths; ui32_Path++)
+  {
+    if (ps_Job->ppt_Series[ui32_Path] != NULL)
+      memory_tree_destroy (ps_Job->ppt_Series[ui32_Path]);
+
+    free (ps_Job->ppc_Paths[ui32_Path]);
+  }
+
+  free (ps_Job->ppc_Paths), ps_Job->ppc_Paths = NULL;
+  free (ps_Job->ppt_Series), ps_Job->ppt_Series = NULL;
+  free (ps_Job->pu8_Loaded), ps_Job->pu8_Loaded = NULL;
+  free (ps_Job->pt_Threads), ps_Job->pt_Threads = NULL;
+  free (ps_Job), ps_Job = NULL;
+
+  return ui32_Failed;
+}
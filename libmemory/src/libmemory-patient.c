@@ -30,9 +30,9 @@ memory_patient_next_id ()
 {
   debug_functions ();
 
+  // Files can be loaded on several threads at once.
   static unsigned long long id = 0;
-  id++;
-  return id;
+  return __atomic_add_fetch (&id, 1, __ATOMIC_RELAXED);
 }
 
 Patient*
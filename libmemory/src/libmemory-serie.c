@@ -22,7 +22,12 @@
 #include "libmemory-slice.h"
 #include "libmemory-tree.h"
 #include "libmemory-io.h"
+#include "libmemory-brick.h"
+#include "libmemory-sparse.h"
 #include "libcommon-debug.h"
+#include "libcommon-thread.h"
+#include "libcommon-history.h"
+#include "libcommon-unused.h"
 
 
 #include <stdio.h>
@@ -32,6 +37,9 @@
 #include <limits.h>
 #include <math.h>
 #include <libgen.h>
+#include <byteswap.h>
+#include <unistd.h>
+#include <pthread.h>
 
 /*                                                                                                    */
 /*                                                                                                    */
@@ -39,6 +47,557 @@
 /*                                                                                                    */
 /*                                                                                                    */
 
+// Volumes smaller than this number of voxels per thread are not worth
+// splitting over threads.
+#define SERIE_INGEST_MIN_CHUNK 262144
+
+// The time the background reader of a lazy serie steps aside when a slice
+// is needed right away.
+#define SERIE_LAZY_YIELD_USEC  1000
+
+/**
+ * The state of a lazy serie. Slice z of timepoint t is slice t * Z + z.
+ */
+typedef struct s_SerieLazyData
+{
+  SerieSliceLoader pf_LoadSlice;
+  void (*pf_DestroySource) (void *);
+  void **ppv_Sources;
+
+  /**
+   * One flag per slice, set when the slice is in memory.
+   */
+  unsigned char *pu8_Loaded;
+  unsigned int ui32_Slices;
+  unsigned int ui32_Remaining;
+
+  /**
+   * The slice that was needed last. The background reader continues from
+   * there, so the neighbours of the slices in view are read first.
+   */
+  unsigned int ui32_Focus;
+
+  /**
+   * The number of threads that are waiting for a slice right now. The
+   * background reader only reads when nobody is waiting.
+   */
+  unsigned int ui32_Waiting;
+  short int b_Stop;
+
+  /**
+   * Set when slices that are not in memory are read for the caller only.
+   * See memory_serie_set_streaming().
+   */
+  short int b_Streaming;
+
+  pthread_mutex_t t_Lock;
+  pthread_t t_Reader;
+  short int b_HasReader;
+} SerieLazyData;
+
+typedef struct
+{
+  Serie *serie;
+  short int b_SwapBytes;
+  int *pi32_Minimum;
+  int *pi32_Maximum;
+} ts_SerieIngestJob;
+
+// The range of values of a serie is kept as integers. A float range is
+// rounded, and a range that does not fit is clamped. This is only done for
+// the minimum and maximum, not for every voxel.
+static int
+i32_memory_serie_range_to_int (double f64_Value)
+{
+  f64_Value = round (f64_Value);
+
+  if (f64_Value <= INT_MIN) return INT_MIN;
+  if (f64_Value >= INT_MAX) return INT_MAX;
+
+  return (int)f64_Value;
+}
+
+// Walks the voxels [start, end) as 'type' and keeps track of the minimum and
+// maximum in that type.
+#define SERIE_INGEST_LOOP(type)                                                 \
+  {                                                                             \
+    type *pt_Data = (type *)(serie->data) + start;                              \
+    type *pt_End = (type *)(serie->data) + end;                                 \
+    type t_Minimum = *pt_Data;                                                  \
+    type t_Maximum = *pt_Data;                                                  \
+    for (; pt_Data < pt_End; pt_Data++)                                         \
+    {                                                                           \
+      t_Minimum = (*pt_Data < t_Minimum) ? *pt_Data : t_Minimum;                \
+      t_Maximum = (*pt_Data > t_Maximum) ? *pt_Data : t_Maximum;                \
+    }                                                                           \
+    i32_minimum = i32_memory_serie_range_to_int (t_Minimum);                    \
+    i32_maximum = i32_memory_serie_range_to_int (t_Maximum);                    \
+  }
+
+// The same, for data in the opposite byte order. Every voxel is swapped in
+// place in the same pass, through an integer of the same size.
+#define SERIE_INGEST_SWAP_LOOP(type, swaptype, swap)                            \
+  {                                                                             \
+    swaptype *pt_Data = (swaptype *)(serie->data) + start;                      \
+    swaptype *pt_End = (swaptype *)(serie->data) + end;                         \
+    union { swaptype u; type t; } u_Value;                                      \
+    u_Value.u = swap (*pt_Data);                                                \
+    type t_Minimum = u_Value.t;                                                 \
+    type t_Maximum = u_Value.t;                                                 \
+    for (; pt_Data < pt_End; pt_Data++)                                         \
+    {                                                                           \
+      u_Value.u = swap (*pt_Data);                                              \
+      *pt_Data = u_Value.u;                                                     \
+      t_Minimum = (u_Value.t < t_Minimum) ? u_Value.t : t_Minimum;              \
+      t_Maximum = (u_Value.t > t_Maximum) ? u_Value.t : t_Maximum;              \
+    }                                                                           \
+    i32_minimum = i32_memory_serie_range_to_int (t_Minimum);                    \
+    i32_maximum = i32_memory_serie_range_to_int (t_Maximum);                    \
+  }
+
+void
+v_memory_serie_ingest_range (unsigned long long start, unsigned long long end,
+                             unsigned int worker, void *user_data)
+{
+  ts_SerieIngestJob *ps_Job = (ts_SerieIngestJob *)user_data;
+  Serie *serie = ps_Job->serie;
+
+  int i32_minimum = INT_MAX;
+  int i32_maximum = INT_MIN;
+
+  // Single bytes have no byte order.
+  short int b_SwapBytes = ps_Job->b_SwapBytes && memory_serie_get_memory_space (serie) > 1;
+
+  if (start < end && b_SwapBytes)
+  {
+    switch (serie->data_type)
+    {
+      case MEMORY_TYPE_INT16   : SERIE_INGEST_SWAP_LOOP (signed short int, unsigned short int, __bswap_16); break;
+      case MEMORY_TYPE_INT32   : SERIE_INGEST_SWAP_LOOP (signed int, unsigned int, __bswap_32); break;
+      case MEMORY_TYPE_INT64   : SERIE_INGEST_SWAP_LOOP (signed long long, unsigned long long, __bswap_64); break;
+      case MEMORY_TYPE_UINT16  : SERIE_INGEST_SWAP_LOOP (unsigned short int, unsigned short int, __bswap_16); break;
+      case MEMORY_TYPE_UINT32  : SERIE_INGEST_SWAP_LOOP (unsigned int, unsigned int, __bswap_32); break;
+      case MEMORY_TYPE_UINT64  : SERIE_INGEST_SWAP_LOOP (unsigned long long, unsigned long long, __bswap_64); break;
+      case MEMORY_TYPE_FLOAT32 : SERIE_INGEST_SWAP_LOOP (float, unsigned int, __bswap_32); break;
+      case MEMORY_TYPE_FLOAT64 : SERIE_INGEST_SWAP_LOOP (double, unsigned long long, __bswap_64); break;
+      default : break;
+    }
+  }
+
+  else if (start < end)
+  {
+    switch (serie->data_type)
+    {
+      case MEMORY_TYPE_INT8    : SERIE_INGEST_LOOP (signed char); break;
+      case MEMORY_TYPE_INT16   : SERIE_INGEST_LOOP (signed short int); break;
+      case MEMORY_TYPE_INT32   : SERIE_INGEST_LOOP (signed int); break;
+      case MEMORY_TYPE_INT64   : SERIE_INGEST_LOOP (signed long long); break;
+      case MEMORY_TYPE_UINT8   : SERIE_INGEST_LOOP (unsigned char); break;
+      case MEMORY_TYPE_UINT16  : SERIE_INGEST_LOOP (unsigned short int); break;
+      case MEMORY_TYPE_UINT32  : SERIE_INGEST_LOOP (unsigned int); break;
+      case MEMORY_TYPE_UINT64  : SERIE_INGEST_LOOP (unsigned long long); break;
+      case MEMORY_TYPE_FLOAT32 : SERIE_INGEST_LOOP (float); break;
+      case MEMORY_TYPE_FLOAT64 : SERIE_INGEST_LOOP (double); break;
+      default : break;
+    }
+  }
+
+  ps_Job->pi32_Minimum[worker] = i32_minimum;
+  ps_Job->pi32_Maximum[worker] = i32_maximum;
+}
+
+
+// Rows of voxels are copied between layouts in parallel. Small volumes are
+// not worth the threads.
+#define SERIE_REORDER_MIN_CHUNK 1024
+
+typedef struct
+{
+  Serie *serie;
+  te_SerieLayout e_From;
+  te_SerieLayout e_To;
+  unsigned char *pu8_From;
+  unsigned char *pu8_To;
+} ts_SerieReorderJob;
+
+unsigned long long
+ui64_memory_serie_voxel_index (ts_Coordinate3DInt *ps_Matrix, te_SerieLayout e_Layout,
+                               unsigned long long x, unsigned long long y,
+                               unsigned long long z, unsigned long long t)
+{
+  if (e_Layout == SERIE_LAYOUT_BRICKED)
+  {
+    unsigned long long ui64_Mask = SERIE_BRICK_SIZE - 1;
+    unsigned long long ui64_BricksX = (ps_Matrix->i16_x + ui64_Mask) >> SERIE_BRICK_SHIFT;
+    unsigned long long ui64_BricksY = (ps_Matrix->i16_y + ui64_Mask) >> SERIE_BRICK_SHIFT;
+    unsigned long long ui64_BricksZ = (ps_Matrix->i16_z + ui64_Mask) >> SERIE_BRICK_SHIFT;
+
+    unsigned long long ui64_Brick = ((t * ui64_BricksZ + (z >> SERIE_BRICK_SHIFT)) * ui64_BricksY
+                                     + (y >> SERIE_BRICK_SHIFT)) * ui64_BricksX
+                                     + (x >> SERIE_BRICK_SHIFT);
+
+    return (ui64_Brick << (3 * SERIE_BRICK_SHIFT))
+           + ((((z & ui64_Mask) << SERIE_BRICK_SHIFT) + (y & ui64_Mask)) << SERIE_BRICK_SHIFT)
+           + (x & ui64_Mask);
+  }
+
+  return ((t * ps_Matrix->i16_z + z) * ps_Matrix->i16_y + y) * ps_Matrix->i16_x + x;
+}
+
+// Copies the rows [start, end) of the volume, where a row is all x for one
+// (y, z, t). A run of SERIE_BRICK_SIZE voxels along x is contiguous in both
+// layouts, so each run is a single memcpy.
+void
+v_memory_serie_reorder_range (unsigned long long start, unsigned long long end,
+                              UNUSED unsigned int worker, void *user_data)
+{
+  ts_SerieReorderJob *ps_Job = (ts_SerieReorderJob *)user_data;
+  Serie *serie = ps_Job->serie;
+  ts_Coordinate3DInt *ps_Matrix = &serie->matrix;
+
+  unsigned long long ui64_ElementSize = memory_serie_get_memory_space (serie);
+  unsigned long long ui64_Row, x, y, z, t, ui64_Run;
+
+  for (ui64_Row = start; ui64_Row < end; ui64_Row++)
+  {
+    y = ui64_Row % ps_Matrix->i16_y;
+    z = (ui64_Row / ps_Matrix->i16_y) % ps_Matrix->i16_z;
+    t = ui64_Row / ps_Matrix->i16_y / ps_Matrix->i16_z;
+
+    for (x = 0; x < (unsigned long long)ps_Matrix->i16_x; x += SERIE_BRICK_SIZE)
+    {
+      ui64_Run = ps_Matrix->i16_x - x;
+      if (ui64_Run > SERIE_BRICK_SIZE)
+        ui64_Run = SERIE_BRICK_SIZE;
+
+      memcpy (ps_Job->pu8_To + ui64_memory_serie_voxel_index (ps_Matrix, ps_Job->e_To, x, y, z, t) * ui64_ElementSize,
+              ps_Job->pu8_From + ui64_memory_serie_voxel_index (ps_Matrix, ps_Job->e_From, x, y, z, t) * ui64_ElementSize,
+              ui64_Run * ui64_ElementSize);
+    }
+  }
+}
+
+unsigned long long
+ui64_memory_serie_data_size_for_layout (Serie *serie, te_SerieLayout e_Layout)
+{
+  unsigned long long ui64_Voxels;
+
+  if (e_Layout == SERIE_LAYOUT_BRICKED)
+  {
+    unsigned long long ui64_Mask = SERIE_BRICK_SIZE - 1;
+    ui64_Voxels = ((serie->matrix.i16_x + ui64_Mask) & ~ui64_Mask) *
+                  ((serie->matrix.i16_y + ui64_Mask) & ~ui64_Mask) *
+                  ((serie->matrix.i16_z + ui64_Mask) & ~ui64_Mask);
+  }
+  else
+    ui64_Voxels = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y * serie->matrix.i16_z;
+
+  return ui64_Voxels * serie->num_time_series * memory_serie_get_memory_space (serie);
+}
+
+// Returns a new buffer with the data of a Serie in another layout. The
+// padding of a bricked layout is zeroed.
+void *
+pv_memory_serie_reorder (Serie *serie, te_SerieLayout e_To)
+{
+  unsigned long long ui64_Size = ui64_memory_serie_data_size_for_layout (serie, e_To);
+
+  void *pv_Data = (e_To == SERIE_LAYOUT_LINEAR) ? malloc (ui64_Size) : calloc (1, ui64_Size);
+  if (pv_Data == NULL) return NULL;
+
+  ts_SerieReorderJob ts_Job;
+  ts_Job.serie = serie;
+  ts_Job.e_From = serie->e_Layout;
+  ts_Job.e_To = e_To;
+  ts_Job.pu8_From = serie->data;
+  ts_Job.pu8_To = pv_Data;
+
+  common_thread_parallel_for ((unsigned long long)serie->matrix.i16_y * serie->matrix.i16_z * serie->num_time_series,
+                              SERIE_REORDER_MIN_CHUNK, 0, v_memory_serie_reorder_range, &ts_Job);
+
+  return pv_Data;
+}
+
+
+/**
+ * Reads a single slice of a lazy serie, and widens the range of values of
+ * the serie with it. The lock of the lazy data must be held.
+ */
+short int
+i16_memory_serie_lazy_read_slice (Serie *serie, unsigned int ui32_Slice)
+{
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+  unsigned long long ui64_PixelsInSlice = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y;
+  int i32_Minimum = INT_MAX;
+  int i32_Maximum = INT_MIN;
+  ts_SerieIngestJob ts_Job;
+
+  if (ps_Lazy->pu8_Loaded[ui32_Slice]) return 1;
+
+  if (ps_Lazy->ppv_Sources[ui32_Slice] != NULL
+      && !ps_Lazy->pf_LoadSlice (serie, ui32_Slice % serie->matrix.i16_z,
+                                 ui32_Slice / serie->matrix.i16_z,
+                                 ps_Lazy->ppv_Sources[ui32_Slice]))
+  {
+    debug_warning ("Could not read slice %u of '%s'.", ui32_Slice, serie->name);
+  }
+
+  // A slice without a source, or one that could not be read, stays empty.
+  // It is not tried again.
+  ts_Job.serie = serie;
+  ts_Job.b_SwapBytes = 0;
+  ts_Job.pi32_Minimum = &i32_Minimum;
+  ts_Job.pi32_Maximum = &i32_Maximum;
+  v_memory_serie_ingest_range (ui32_Slice * ui64_PixelsInSlice, (ui32_Slice + 1) * ui64_PixelsInSlice, 0, &ts_Job);
+
+  // The range is read by the viewer while it grows.
+  if (i32_Minimum < serie->i32_MinimumValue)
+    __atomic_store_n (&serie->i32_MinimumValue, i32_Minimum, __ATOMIC_RELAXED);
+
+  if (i32_Maximum > serie->i32_MaximumValue)
+    __atomic_store_n (&serie->i32_MaximumValue, i32_Maximum, __ATOMIC_RELAXED);
+
+  __atomic_store_n (&ps_Lazy->pu8_Loaded[ui32_Slice], 1, __ATOMIC_RELEASE);
+  ps_Lazy->ui32_Remaining--;
+
+  return 1;
+}
+
+
+/**
+ * Reads a slice of a streaming lazy serie into pv_Slice, without keeping it
+ * in the data of the serie. The range of values of the serie is widened
+ * with it, like for slices that are kept.
+ */
+short int
+i16_memory_serie_lazy_stream_slice (Serie *serie, unsigned int ui32_Slice, void *pv_Slice)
+{
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+  unsigned long long ui64_PixelsInSlice = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y;
+  unsigned long long ui64_SliceSize = ui64_PixelsInSlice * memory_serie_get_memory_space (serie);
+  int i32_Minimum = INT_MAX;
+  int i32_Maximum = INT_MIN;
+  ts_SerieIngestJob ts_Job;
+  Serie ts_Window;
+
+  pthread_mutex_lock (&ps_Lazy->t_Lock);
+
+  // A slice that was read before the serie started streaming is kept.
+  if (ps_Lazy->pu8_Loaded[ui32_Slice])
+  {
+    memcpy (pv_Slice, (unsigned char *)serie->data + ui32_Slice * ui64_SliceSize, ui64_SliceSize);
+    pthread_mutex_unlock (&ps_Lazy->t_Lock);
+    return 1;
+  }
+
+  // Slice loaders read into the data of a serie, so they are handed a serie
+  // of a single slice whose data is pv_Slice.
+  ts_Window = *serie;
+  ts_Window.data = pv_Slice;
+  ts_Window.matrix.i16_z = 1;
+  ts_Window.num_time_series = 1;
+  memset (pv_Slice, 0, ui64_SliceSize);
+
+  if (ps_Lazy->ppv_Sources[ui32_Slice] != NULL
+      && !ps_Lazy->pf_LoadSlice (&ts_Window, 0, 0, ps_Lazy->ppv_Sources[ui32_Slice]))
+  {
+    debug_warning ("Could not read slice %u of '%s'.", ui32_Slice, serie->name);
+  }
+
+  ts_Job.serie = &ts_Window;
+  ts_Job.b_SwapBytes = 0;
+  ts_Job.pi32_Minimum = &i32_Minimum;
+  ts_Job.pi32_Maximum = &i32_Maximum;
+  v_memory_serie_ingest_range (0, ui64_PixelsInSlice, 0, &ts_Job);
+
+  if (i32_Minimum < serie->i32_MinimumValue)
+    __atomic_store_n (&serie->i32_MinimumValue, i32_Minimum, __ATOMIC_RELAXED);
+
+  if (i32_Maximum > serie->i32_MaximumValue)
+    __atomic_store_n (&serie->i32_MaximumValue, i32_Maximum, __ATOMIC_RELAXED);
+
+  pthread_mutex_unlock (&ps_Lazy->t_Lock);
+
+  return 1;
+}
+
+
+/**
+ * Reads a range of the linear data of a lazy serie. Slices that are not in
+ * memory yet are read first, or streamed past when the serie is streaming.
+ */
+short int
+i16_memory_serie_lazy_read_linear (Serie *serie, unsigned long long ui64_Offset,
+                                   unsigned long long ui64_Length, unsigned char *pu8_Buffer)
+{
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+  unsigned long long ui64_SliceSize = (unsigned long long)serie->matrix.i16_x * serie->matrix.i16_y *
+                                      memory_serie_get_memory_space (serie);
+  unsigned long long ui64_End = ui64_Offset + ui64_Length;
+  unsigned long long ui64_Start, ui64_Run;
+  unsigned int ui32_Slice;
+  unsigned char *pu8_Slice = NULL;
+
+  for (ui32_Slice = ui64_Offset / ui64_SliceSize; ui64_Offset < ui64_End; ui32_Slice++)
+  {
+    ui64_Start = ui64_Offset - ui32_Slice * ui64_SliceSize;
+    ui64_Run = ui64_SliceSize - ui64_Start;
+    if (ui64_Run > ui64_End - ui64_Offset)
+      ui64_Run = ui64_End - ui64_Offset;
+
+    if (!ps_Lazy->b_Streaming)
+    {
+      memory_serie_ensure_slice (serie, ui32_Slice % serie->matrix.i16_z, ui32_Slice / serie->matrix.i16_z);
+      memcpy (pu8_Buffer, (unsigned char *)serie->data + ui64_Offset, ui64_Run);
+    }
+
+    else if (ui64_Run == ui64_SliceSize)
+      i16_memory_serie_lazy_stream_slice (serie, ui32_Slice, pu8_Buffer);
+
+    // Part of a slice goes through a buffer of its own.
+    else
+    {
+      if (pu8_Slice == NULL)
+        pu8_Slice = malloc (ui64_SliceSize);
+
+      if (pu8_Slice == NULL) return 1;
+
+      i16_memory_serie_lazy_stream_slice (serie, ui32_Slice, pu8_Slice);
+      memcpy (pu8_Buffer, pu8_Slice + ui64_Start, ui64_Run);
+    }
+
+    pu8_Buffer += ui64_Run;
+    ui64_Offset += ui64_Run;
+  }
+
+  free (pu8_Slice), pu8_Slice = NULL;
+  return 0;
+}
+
+
+void*
+pv_memory_serie_lazy_reader (void *data)
+{
+  Serie *serie = (Serie *)data;
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+  unsigned int ui32_Distance, ui32_Slice;
+
+  pthread_mutex_lock (&ps_Lazy->t_Lock);
+  while (!ps_Lazy->b_Stop && ps_Lazy->ui32_Remaining > 0)
+  {
+    // Step aside while the slice engine waits for a slice.
+    if (__atomic_load_n (&ps_Lazy->ui32_Waiting, __ATOMIC_RELAXED) > 0)
+    {
+      pthread_mutex_unlock (&ps_Lazy->t_Lock);
+      usleep (SERIE_LAZY_YIELD_USEC);
+      pthread_mutex_lock (&ps_Lazy->t_Lock);
+      continue;
+    }
+
+    // Read the missing slice closest to the one that was needed last.
+    for (ui32_Distance = 0; ui32_Distance < ps_Lazy->ui32_Slices; ui32_Distance++)
+    {
+      ui32_Slice = ps_Lazy->ui32_Focus + ui32_Distance;
+      if (ui32_Slice < ps_Lazy->ui32_Slices && !ps_Lazy->pu8_Loaded[ui32_Slice])
+        break;
+
+      ui32_Slice = ps_Lazy->ui32_Focus - ui32_Distance;
+      if (ui32_Distance <= ps_Lazy->ui32_Focus && !ps_Lazy->pu8_Loaded[ui32_Slice])
+        break;
+    }
+
+    if (ui32_Distance == ps_Lazy->ui32_Slices) break;
+
+    i16_memory_serie_lazy_read_slice (serie, ui32_Slice);
+    ps_Lazy->ui32_Focus = ui32_Slice;
+
+    // Give waiting threads a chance to take the lock.
+    pthread_mutex_unlock (&ps_Lazy->t_Lock);
+    pthread_mutex_lock (&ps_Lazy->t_Lock);
+  }
+  pthread_mutex_unlock (&ps_Lazy->t_Lock);
+
+  return NULL;
+}
+
+
+void
+v_memory_serie_lazy_destroy (Serie *serie)
+{
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+  unsigned int ui32_Slice;
+
+  if (ps_Lazy == NULL) return;
+
+  if (ps_Lazy->b_HasReader)
+  {
+    pthread_mutex_lock (&ps_Lazy->t_Lock);
+    ps_Lazy->b_Stop = 1;
+    pthread_mutex_unlock (&ps_Lazy->t_Lock);
+    pthread_join (ps_Lazy->t_Reader, NULL);
+  }
+
+  for (ui32_Slice = 0; ui32_Slice < ps_Lazy->ui32_Slices; ui32_Slice++)
+  {
+    if (ps_Lazy->pf_DestroySource != NULL && ps_Lazy->ppv_Sources[ui32_Slice] != NULL)
+      ps_Lazy->pf_DestroySource (ps_Lazy->ppv_Sources[ui32_Slice]);
+  }
+
+  pthread_mutex_destroy (&ps_Lazy->t_Lock);
+  free (ps_Lazy->ppv_Sources), ps_Lazy->ppv_Sources = NULL;
+  free (ps_Lazy->pu8_Loaded), ps_Lazy->pu8_Loaded = NULL;
+  free (ps_Lazy), ps_Lazy = NULL;
+
+  serie->ps_Lazy = NULL;
+}
+
+
+/**
+ * Lets go of the data of a serie. Shared data is freed by the last serie
+ * that refers to it.
+ */
+void
+v_memory_serie_release_data (Serie *serie)
+{
+  SerieBuffer *ps_Buffer = serie->ps_Buffer;
+
+  if (ps_Buffer == NULL)
+    free (serie->data);
+
+  else if (__atomic_sub_fetch (&ps_Buffer->ui32_References, 1, __ATOMIC_ACQ_REL) == 0)
+  {
+    // Shared data is counted for the program as a whole, not for any of the
+    // series that refer to it.
+    common_accounting_remove (NULL, ACCOUNTING_VOLUME, ps_Buffer->ui64_Size);
+    free (ps_Buffer->pv_Data), ps_Buffer->pv_Data = NULL;
+    free (ps_Buffer), ps_Buffer = NULL;
+  }
+
+  serie->data = NULL;
+  serie->ps_Buffer = NULL;
+}
+
+
+/**
+ * Makes shared data that no other serie refers to anymore the data of the
+ * serie alone, so that it is counted for it again.
+ */
+short int
+b_memory_serie_take_over_data (Serie *serie)
+{
+  SerieBuffer *ps_Buffer = serie->ps_Buffer;
+
+  if (ps_Buffer == NULL || __atomic_load_n (&ps_Buffer->ui32_References, __ATOMIC_ACQUIRE) != 1)
+    return 0;
+
+  common_accounting_remove (NULL, ACCOUNTING_VOLUME, ps_Buffer->ui64_Size);
+  serie->ps_Buffer = NULL;
+  free (ps_Buffer), ps_Buffer = NULL;
+  memory_serie_account_data (serie);
+
+  return 1;
+}
+
 
 /*                                                                                                    */
 /*                                                                                                    */
@@ -50,9 +609,9 @@ memory_serie_next_id ()
 {
   debug_functions ();
 
+  // Files can be loaded on several threads at once.
   static unsigned long long id = 0;
-  id++;
-  return id;
+  return __atomic_add_fetch (&id, 1, __ATOMIC_RELAXED);
 }
 
 Serie*
@@ -89,14 +648,82 @@ memory_serie_destroy (void *data)
   if (data == NULL) return;
   Serie *serie = (Serie *)data;
 
+  v_memory_serie_lazy_destroy (serie);
+
   free (serie->pc_filename), serie->pc_filename=NULL;
-  free (serie->data), serie->data = NULL;
+  v_memory_serie_release_data (serie);
   free (serie->pv_OutOfBlobValue), serie->pv_OutOfBlobValue = NULL;
   free (serie->ps_Quaternion), serie->ps_Quaternion = NULL;
   free (serie->ps_QuaternationOffset), serie->ps_QuaternationOffset = NULL;
+  free (serie->pc_SyncedFile), serie->pc_SyncedFile = NULL;
+  free (serie->pu8_DirtySlabs), serie->pu8_DirtySlabs = NULL;
+  memory_brick_close (serie->ps_BrickCache), serie->ps_BrickCache = NULL;
+  memory_sparse_destroy (serie->ps_Sparse), serie->ps_Sparse = NULL;
+  list_free_all (serie->pll_History, common_history_destroy_element), serie->pll_History = NULL;
+  common_accounting_release (&serie->ts_Accounting);
   free (serie), serie = NULL;
 }
 
+
+unsigned long long
+ui64_memory_serie_dirty_slab_count (Serie *serie)
+{
+  unsigned long long ui64_DataSize = (unsigned long long)serie->matrix.i16_x *
+                                     serie->matrix.i16_y * serie->matrix.i16_z *
+                                     serie->num_time_series *
+                                     memory_serie_get_memory_space (serie);
+
+  return (ui64_DataSize + SERIE_DIRTY_SLAB_SIZE - 1) / SERIE_DIRTY_SLAB_SIZE;
+}
+
+
+void
+memory_serie_mark_dirty (Serie *serie, unsigned long long ui64_Offset, unsigned long long ui64_Length)
+{
+  if (serie == NULL || ui64_Length == 0) return;
+
+  // Without a file to be in sync with, everything has to be written anyway.
+  if (serie->pu8_DirtySlabs == NULL) return;
+
+  unsigned long long ui64_Slabs = ui64_memory_serie_dirty_slab_count (serie);
+  unsigned long long ui64_First = ui64_Offset / SERIE_DIRTY_SLAB_SIZE;
+  unsigned long long ui64_Last = (ui64_Offset + ui64_Length - 1) / SERIE_DIRTY_SLAB_SIZE;
+
+  if (ui64_Last >= ui64_Slabs)
+    ui64_Last = ui64_Slabs - 1;
+
+  if (ui64_First <= ui64_Last)
+    memset (serie->pu8_DirtySlabs + ui64_First, 1, ui64_Last - ui64_First + 1);
+}
+
+
+void
+memory_serie_set_synced_file (Serie *serie, const char *pc_Path)
+{
+  debug_functions ();
+
+  if (serie == NULL) return;
+
+  free (serie->pc_SyncedFile), serie->pc_SyncedFile = NULL;
+  free (serie->pu8_DirtySlabs), serie->pu8_DirtySlabs = NULL;
+
+  // Changes to a Serie without data of its own cannot be tracked, so it is
+  // always written as a whole. A sparse Serie marks the slabs its bricks
+  // cover when they change. Dirty slabs are byte ranges of the linear
+  // layout.
+  if (pc_Path == NULL || (serie->data == NULL && serie->ps_Sparse == NULL)
+      || serie->e_Layout != SERIE_LAYOUT_LINEAR) return;
+
+  serie->pc_SyncedFile = calloc (1, strlen (pc_Path) + 1);
+  assert (serie->pc_SyncedFile != NULL);
+  strcpy (serie->pc_SyncedFile, pc_Path);
+
+  serie->pu8_DirtySlabs = calloc (1, ui64_memory_serie_dirty_slab_count (serie) + 1);
+  assert (serie->pu8_DirtySlabs != NULL);
+
+  memory_sparse_mark_synced (serie->ps_Sparse);
+}
+
 MemoryDataType
 memory_serie_get_memory_type (Serie *serie)
 {
@@ -113,8 +740,15 @@ memory_serie_get_memory_space (Serie *serie)
 
   if (serie == NULL) return 0;
 
+  return memory_serie_get_type_space (serie->data_type);
+}
+
+
+short int
+memory_serie_get_type_space (MemoryDataType e_Type)
+{
   short int num_bytes = 0;
-  switch (serie->data_type)
+  switch (e_Type)
   {
     case MEMORY_TYPE_INT8       : num_bytes = 1; break;
     case MEMORY_TYPE_INT16      : num_bytes = 2; break;
@@ -142,117 +776,479 @@ memory_serie_get_memory_space (Serie *serie)
   return num_bytes;
 }
 
+unsigned long long
+memory_serie_get_data_size (Serie *serie)
+{
+  if (serie == NULL) return 0;
+  return ui64_memory_serie_data_size_for_layout (serie, serie->e_Layout);
+}
+
+
+void
+memory_serie_account_data (Serie *serie)
+{
+  if (serie == NULL) return;
+
+  AccountingCategory e_Category = (serie->e_SerieType == SERIE_MASK) ? ACCOUNTING_MASK : ACCOUNTING_VOLUME;
+  AccountingUsage ts_Usage = common_accounting_get_usage (&serie->ts_Accounting, e_Category);
+
+  // The bricks of a sparse mask are counted as they are allocated.
+  if (serie->ps_Sparse != NULL) return;
+
+  // Shared data is counted for the program as a whole.
+  common_accounting_resize (&serie->ts_Accounting, e_Category, ts_Usage.current,
+                            (serie->data != NULL && serie->ps_Buffer == NULL)
+                            ? memory_serie_get_data_size (serie) : 0);
+}
+
+
+unsigned long long
+memory_serie_get_voxel_offset (Serie *serie, short int i16_X, short int i16_Y,
+                               short int i16_Z, unsigned short int u16_T)
+{
+  return ui64_memory_serie_voxel_index (&serie->matrix, serie->e_Layout, i16_X, i16_Y, i16_Z, u16_T)
+         * memory_serie_get_memory_space (serie);
+}
+
+
+short int
+memory_serie_set_layout (Serie *serie, te_SerieLayout e_Layout)
+{
+  debug_functions ();
+
+  if (serie == NULL) return 1;
+  if (serie->e_Layout == e_Layout) return 0;
+
+  // A Serie that is kept in a brick file has no data to reorder.
+  if (serie->data == NULL) return 1;
+
+  // A lazy Serie is read slice by slice, which needs the linear layout.
+  if (serie->ps_Lazy != NULL) return 1;
+
+  // The data is reordered into a new buffer, so shared data is only read
+  // here, and the Serie lets go of it afterwards.
+  void *pv_Data = pv_memory_serie_reorder (serie, e_Layout);
+  if (pv_Data == NULL)
+  {
+    debug_error ("Not enough memory to change the layout of '%s'.", serie->name);
+    return 1;
+  }
+
+  v_memory_serie_release_data (serie);
+  serie->data = pv_Data;
+  serie->e_Layout = e_Layout;
+  memory_serie_account_data (serie);
+
+  // The dirty slabs refer to byte ranges of the old layout.
+  memory_serie_set_synced_file (serie, NULL);
+
+  return 0;
+}
+
+
+void *
+memory_serie_copy_linear_data (Serie *serie)
+{
+  debug_functions ();
+
+  if (serie == NULL) return NULL;
+
+  unsigned long long ui64_Size = memory_serie_get_data_size (serie);
+
+  // A sparse Serie is only made dense for code that needs it to be.
+  if (serie->ps_Sparse != NULL)
+  {
+    void *pv_Dense = malloc (ui64_Size);
+    if (pv_Dense != NULL)
+      memory_sparse_copy_to_linear (serie->ps_Sparse, pv_Dense, ui64_Size / memory_serie_get_memory_space (serie));
+
+    return pv_Dense;
+  }
+
+  if (serie->data == NULL) return NULL;
+  if (memory_serie_load_all (serie) != 0) return NULL;
+
+  if (serie->e_Layout != SERIE_LAYOUT_LINEAR)
+    return pv_memory_serie_reorder (serie, SERIE_LAYOUT_LINEAR);
+
+  void *pv_Data = malloc (ui64_Size);
+  if (pv_Data != NULL)
+    memcpy (pv_Data, serie->data, ui64_Size);
+
+  return pv_Data;
+}
+
+
+short int
+memory_serie_has_linear_data (Serie *serie)
+{
+  return (serie != NULL && serie->data != NULL && serie->e_Layout == SERIE_LAYOUT_LINEAR
+          && serie->ps_Sparse == NULL && serie->ps_Lazy == NULL);
+}
+
+
+short int
+memory_serie_read_linear (Serie *serie, unsigned long long ui64_Offset,
+                          unsigned long long ui64_Length, void *pv_Buffer)
+{
+  if (serie == NULL || pv_Buffer == NULL) return 1;
+
+  ts_Coordinate3DInt *ps_Matrix = &serie->matrix;
+  unsigned long long ui64_ElementSize = memory_serie_get_memory_space (serie);
+  unsigned long long ui64_Voxel, ui64_End, ui64_Run, x, y, z, t;
+  unsigned char *pu8_Buffer = pv_Buffer;
+
+  if (ui64_ElementSize == 0
+      || ui64_Offset + ui64_Length > ui64_memory_serie_data_size_for_layout (serie, SERIE_LAYOUT_LINEAR))
+    return 1;
+
+  if (memory_serie_has_linear_data (serie))
+  {
+    memcpy (pu8_Buffer, (unsigned char *)serie->data + ui64_Offset, ui64_Length);
+    return 0;
+  }
+
+  // A range that starts or ends inside a voxel reads that voxel as a whole.
+  if (ui64_Offset % ui64_ElementSize != 0 || ui64_Length % ui64_ElementSize != 0)
+  {
+    unsigned char au8_Voxel[32];
+    unsigned long long ui64_Head = ui64_Offset % ui64_ElementSize;
+    unsigned long long ui64_Part = ui64_ElementSize - ui64_Head;
+
+    if (ui64_Head == 0)
+      ui64_Part = ui64_Length % ui64_ElementSize;
+    if (ui64_Part > ui64_Length)
+      ui64_Part = ui64_Length;
+
+    if (ui64_ElementSize > sizeof (au8_Voxel)) return 1;
+
+    // Either the partial voxel at the start, or the one at the end.
+    if (ui64_Head != 0)
+    {
+      if (memory_serie_read_linear (serie, ui64_Offset - ui64_Head, ui64_ElementSize, au8_Voxel) != 0) return 1;
+
+      memcpy (pu8_Buffer, au8_Voxel + ui64_Head, ui64_Part);
+      return memory_serie_read_linear (serie, ui64_Offset + ui64_Part, ui64_Length - ui64_Part, pu8_Buffer + ui64_Part);
+    }
+
+    if (memory_serie_read_linear (serie, ui64_Offset + ui64_Length - ui64_Part, ui64_ElementSize, au8_Voxel) != 0)
+      return 1;
+
+    memcpy (pu8_Buffer + ui64_Length - ui64_Part, au8_Voxel, ui64_Part);
+    return memory_serie_read_linear (serie, ui64_Offset, ui64_Length - ui64_Part, pu8_Buffer);
+  }
+
+  if (serie->ps_Lazy != NULL)
+    return i16_memory_serie_lazy_read_linear (serie, ui64_Offset, ui64_Length, pu8_Buffer);
+
+  // Walk the range in runs along x that are contiguous in whatever keeps
+  // the data.
+  ui64_Voxel = ui64_Offset / ui64_ElementSize;
+  ui64_End = ui64_Voxel + ui64_Length / ui64_ElementSize;
+
+  while (ui64_Voxel < ui64_End)
+  {
+    x = ui64_Voxel % ps_Matrix->i16_x;
+    y = (ui64_Voxel / ps_Matrix->i16_x) % ps_Matrix->i16_y;
+    z = (ui64_Voxel / ps_Matrix->i16_x / ps_Matrix->i16_y) % ps_Matrix->i16_z;
+    t = ui64_Voxel / ps_Matrix->i16_x / ps_Matrix->i16_y / ps_Matrix->i16_z;
+
+    ui64_Run = ps_Matrix->i16_x - x;
+    if (ui64_Run > ui64_End - ui64_Voxel)
+      ui64_Run = ui64_End - ui64_Voxel;
+
+    if (serie->ps_Sparse != NULL)
+    {
+      if (ui64_Run > SPARSE_BRICK_SIZE - x % SPARSE_BRICK_SIZE)
+        ui64_Run = SPARSE_BRICK_SIZE - x % SPARSE_BRICK_SIZE;
+
+      void *pv_Voxel = memory_sparse_get_voxel (serie->ps_Sparse, x, y, z, t, 0);
+      if (pv_Voxel != NULL)
+        memcpy (pu8_Buffer, pv_Voxel, ui64_Run * ui64_ElementSize);
+      else
+        memset (pu8_Buffer, 0, ui64_Run * ui64_ElementSize);
+    }
+
+    else if (serie->data != NULL)
+    {
+      if (ui64_Run > SERIE_BRICK_SIZE - x % SERIE_BRICK_SIZE)
+        ui64_Run = SERIE_BRICK_SIZE - x % SERIE_BRICK_SIZE;
+
+      memcpy (pu8_Buffer, (unsigned char *)serie->data
+              + ui64_memory_serie_voxel_index (ps_Matrix, serie->e_Layout, x, y, z, t) * ui64_ElementSize,
+              ui64_Run * ui64_ElementSize);
+    }
+
+    else if (serie->ps_BrickCache != NULL)
+    {
+      if (memory_brick_read_row (serie->ps_BrickCache, x, y, z, t, ui64_Run, pu8_Buffer) != ui64_Run)
+        return 1;
+    }
+
+    else
+      return 1;
+
+    pu8_Buffer += ui64_Run * ui64_ElementSize;
+    ui64_Voxel += ui64_Run;
+  }
+
+  return 0;
+}
+
+
+short int
+memory_serie_share_data (Serie *ps_Source, Serie *ps_Target)
+{
+  debug_functions ();
+
+  if (ps_Source == NULL || ps_Target == NULL || ps_Source == ps_Target) return 1;
+  if (ps_Source->data == NULL || ps_Source->ps_Sparse != NULL) return 1;
+  if (ps_Source->e_SerieType == SERIE_MASK || ps_Source->e_SerieType == SERIE_OVERLAY) return 1;
+  if (memory_serie_load_all (ps_Source) != 0) return 1;
+
+  if (ps_Source->ps_Buffer == NULL)
+  {
+    SerieBuffer *ps_Buffer = calloc (1, sizeof (SerieBuffer));
+    assert (ps_Buffer != NULL);
+
+    ps_Buffer->pv_Data = ps_Source->data;
+    ps_Buffer->ui64_Size = memory_serie_get_data_size (ps_Source);
+    ps_Buffer->ui32_References = 1;
+    ps_Source->ps_Buffer = ps_Buffer;
+
+    common_accounting_add (NULL, ACCOUNTING_VOLUME, ps_Buffer->ui64_Size);
+    memory_serie_account_data (ps_Source);
+  }
+
+  __atomic_add_fetch (&ps_Source->ps_Buffer->ui32_References, 1, __ATOMIC_RELAXED);
+
+  v_memory_serie_release_data (ps_Target);
+  ps_Target->data = ps_Source->data;
+  ps_Target->ps_Buffer = ps_Source->ps_Buffer;
+  ps_Target->e_Layout = ps_Source->e_Layout;
+  memory_serie_account_data (ps_Target);
+
+  return 0;
+}
+
+
+short int
+memory_serie_make_writable (Serie *serie)
+{
+  if (serie == NULL || serie->ps_Buffer == NULL) return 0;
+
+  SerieBuffer *ps_Buffer = serie->ps_Buffer;
+
+  // The last serie that refers to the data can take it over.
+  if (b_memory_serie_take_over_data (serie))
+    return 0;
+
+  void *pv_Data = malloc (ps_Buffer->ui64_Size);
+  if (pv_Data == NULL)
+  {
+    debug_error ("Not enough memory to copy the data of '%s'.", serie->name);
+    return 1;
+  }
+
+  memcpy (pv_Data, ps_Buffer->pv_Data, ps_Buffer->ui64_Size);
+  v_memory_serie_release_data (serie);
+  serie->data = pv_Data;
+  memory_serie_account_data (serie);
+
+  return 0;
+}
+
+
+void
+memory_serie_reclaim_data (Serie *serie)
+{
+  if (serie == NULL) return;
+  b_memory_serie_take_over_data (serie);
+}
+
+
+short int
+memory_serie_set_lazy (Serie *serie, SerieSliceLoader pf_LoadSlice, void **ppv_Sources,
+                       void (*pf_DestroySource) (void *))
+{
+  debug_functions ();
+
+  if (serie == NULL || pf_LoadSlice == NULL || ppv_Sources == NULL
+      || serie->e_Layout != SERIE_LAYOUT_LINEAR || serie->ps_Lazy != NULL)
+    return 1;
+
+  // The slices are read into 'data'.
+  if (serie->data != NULL && memory_serie_make_writable (serie) != 0) return 1;
+
+  SerieLazyData *ps_Lazy = calloc (1, sizeof (SerieLazyData));
+  assert (ps_Lazy != NULL);
+
+  ps_Lazy->pf_LoadSlice = pf_LoadSlice;
+  ps_Lazy->pf_DestroySource = pf_DestroySource;
+  ps_Lazy->ppv_Sources = ppv_Sources;
+  ps_Lazy->ui32_Slices = (unsigned int)serie->matrix.i16_z * serie->num_time_series;
+  ps_Lazy->ui32_Remaining = ps_Lazy->ui32_Slices;
+  ps_Lazy->pu8_Loaded = calloc (ps_Lazy->ui32_Slices, sizeof (unsigned char));
+  assert (ps_Lazy->pu8_Loaded != NULL);
+
+  pthread_mutex_init (&ps_Lazy->t_Lock, NULL);
+
+  // The range grows with every slice that is read.
+  serie->i32_MinimumValue = INT_MAX;
+  serie->i32_MaximumValue = INT_MIN;
+  serie->ps_Lazy = ps_Lazy;
+
+  // Without data to keep the slices in, the serie streams right away.
+  if (serie->data == NULL)
+  {
+    ps_Lazy->b_Streaming = 1;
+    return 0;
+  }
+
+  ps_Lazy->b_HasReader = (pthread_create (&ps_Lazy->t_Reader, NULL, pv_memory_serie_lazy_reader, serie) == 0);
+
+  return 0;
+}
+
+
+short int
+memory_serie_ensure_slice (Serie *serie, short int i16_Slice, unsigned short int u16_TimePoint)
+{
+  if (serie == NULL || serie->ps_Lazy == NULL) return 1;
+  if (i16_Slice < 0 || i16_Slice >= serie->matrix.i16_z || u16_TimePoint >= serie->num_time_series) return 0;
+
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+  unsigned int ui32_Slice = (unsigned int)u16_TimePoint * serie->matrix.i16_z + i16_Slice;
+
+  // A serie that streams without data cannot keep the slice.
+  if (serie->data == NULL) return 0;
+
+  if (__atomic_load_n (&ps_Lazy->pu8_Loaded[ui32_Slice], __ATOMIC_ACQUIRE))
+    return 1;
+
+  __atomic_add_fetch (&ps_Lazy->ui32_Waiting, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock (&ps_Lazy->t_Lock);
+  __atomic_sub_fetch (&ps_Lazy->ui32_Waiting, 1, __ATOMIC_RELAXED);
+
+  i16_memory_serie_lazy_read_slice (serie, ui32_Slice);
+  ps_Lazy->ui32_Focus = ui32_Slice;
+
+  pthread_mutex_unlock (&ps_Lazy->t_Lock);
+
+  return 1;
+}
+
+
+short int
+memory_serie_load_all (Serie *serie)
+{
+  debug_functions ();
+
+  unsigned int ui32_Slice;
+
+  if (serie == NULL || serie->ps_Lazy == NULL) return 0;
+
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+
+  // A serie that was opened for streaming gets its data now.
+  if (serie->data == NULL)
+  {
+    serie->data = calloc (1, memory_serie_get_data_size (serie));
+    if (serie->data == NULL) return 1;
+
+    memory_serie_account_data (serie);
+  }
+
+  __atomic_add_fetch (&ps_Lazy->ui32_Waiting, 1, __ATOMIC_RELAXED);
+  pthread_mutex_lock (&ps_Lazy->t_Lock);
+  __atomic_sub_fetch (&ps_Lazy->ui32_Waiting, 1, __ATOMIC_RELAXED);
+
+  for (ui32_Slice = 0; ui32_Slice < ps_Lazy->ui32_Slices; ui32_Slice++)
+    i16_memory_serie_lazy_read_slice (serie, ui32_Slice);
+
+  pthread_mutex_unlock (&ps_Lazy->t_Lock);
+
+  v_memory_serie_lazy_destroy (serie);
+  return 0;
+}
+
+
+short int
+memory_serie_set_streaming (Serie *serie)
+{
+  debug_functions ();
+
+  if (serie == NULL || serie->ps_Lazy == NULL) return 1;
+
+  SerieLazyData *ps_Lazy = serie->ps_Lazy;
+
+  if (ps_Lazy->b_HasReader)
+  {
+    pthread_mutex_lock (&ps_Lazy->t_Lock);
+    ps_Lazy->b_Stop = 1;
+    pthread_mutex_unlock (&ps_Lazy->t_Lock);
+    pthread_join (ps_Lazy->t_Reader, NULL);
+    ps_Lazy->b_HasReader = 0;
+  }
+
+  ps_Lazy->b_Streaming = 1;
+  return 0;
+}
+
+
 void
 memory_serie_set_upper_and_lower_borders_from_data (Serie *serie)
 {
-  short int num_bytes = memory_serie_get_memory_space(serie);
+  memory_serie_ingest_data (serie, 0);
+}
+
+
+void
+memory_serie_ingest_data (Serie *serie, short int b_SwapBytes)
+{
+  debug_functions ();
 
-  unsigned int i32_memory_size = serie->matrix.i16_x * serie->matrix.i16_y * serie->matrix.i16_z * serie->num_time_series;
-  unsigned int i32_blobCnt;
+  if (serie == NULL || serie->data == NULL) return;
 
-  int i32_Value = 0, i32_minimum, i32_maximum;
+  // Swapping the bytes writes to 'data'. Finding the range only reads it.
+  if (b_SwapBytes && memory_serie_make_writable (serie) != 0) return;
 
-  void *pv_Data = serie->data;
+  unsigned long long ui64_memory_size = (unsigned long long)serie->matrix.i16_x *
+                                        serie->matrix.i16_y * serie->matrix.i16_z *
+                                        serie->num_time_series;
 
-  i32_minimum = INT_MAX;
-  i32_maximum = INT_MIN;
-  switch (serie->data_type)
+  unsigned int ui32_Workers = common_thread_number_of_workers ();
+  unsigned int ui32_Cnt;
+
+  ts_SerieIngestJob ts_Job;
+  ts_Job.serie = serie;
+  ts_Job.b_SwapBytes = b_SwapBytes;
+  ts_Job.pi32_Minimum = calloc (ui32_Workers, sizeof (int));
+  ts_Job.pi32_Maximum = calloc (ui32_Workers, sizeof (int));
+  assert (ts_Job.pi32_Minimum != NULL && ts_Job.pi32_Maximum != NULL);
+
+  for (ui32_Cnt = 0; ui32_Cnt < ui32_Workers; ui32_Cnt++)
   {
-    case MEMORY_TYPE_INT8    :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(signed char*)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_INT16   :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(signed short int *)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_INT32   :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(signed int *)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_INT64   :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(signed long long *)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_UINT8   :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(unsigned char*)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_UINT16  :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(unsigned short int *)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_UINT32  :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(unsigned int*)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_UINT64  :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)(*(unsigned long long*)(pv_Data));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_FLOAT32 :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)roundf((*(float*)(pv_Data)));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    case MEMORY_TYPE_FLOAT64 :
-      for (i32_blobCnt=0; i32_blobCnt<i32_memory_size; i32_blobCnt++)
-      {
-        i32_Value = (signed int)roundf((*(double*)(pv_Data)));
-        i32_minimum = (i32_Value < i32_minimum) ? i32_Value : i32_minimum;
-        i32_maximum = (i32_Value > i32_maximum) ? i32_Value : i32_maximum;
-        pv_Data+=num_bytes;
-      }
-      break;
-    default : break;
+    ts_Job.pi32_Minimum[ui32_Cnt] = INT_MAX;
+    ts_Job.pi32_Maximum[ui32_Cnt] = INT_MIN;
   }
 
-  serie->i32_MaximumValue = i32_maximum;
-  serie->i32_MinimumValue = i32_minimum;
+  common_thread_parallel_for (ui64_memory_size, SERIE_INGEST_MIN_CHUNK, ui32_Workers,
+                              v_memory_serie_ingest_range, &ts_Job);
+
+  serie->i32_MinimumValue = INT_MAX;
+  serie->i32_MaximumValue = INT_MIN;
+  for (ui32_Cnt = 0; ui32_Cnt < ui32_Workers; ui32_Cnt++)
+  {
+    if (ts_Job.pi32_Minimum[ui32_Cnt] < serie->i32_MinimumValue)
+      serie->i32_MinimumValue = ts_Job.pi32_Minimum[ui32_Cnt];
+
+    if (ts_Job.pi32_Maximum[ui32_Cnt] > serie->i32_MaximumValue)
+      serie->i32_MaximumValue = ts_Job.pi32_Maximum[ui32_Cnt];
+  }
+
+  free (ts_Job.pi32_Minimum), ts_Job.pi32_Minimum = NULL;
+  free (ts_Job.pi32_Maximum), ts_Job.pi32_Maximum = NULL;
 }
 
 Serie *
@@ -268,21 +1264,19 @@ memory_serie_create_mask_from_serie (Serie *serie)
   mask->pixel_dimension = serie->pixel_dimension;
   mask->slope = serie->slope;
   mask->offset = serie->offset;
-  mask->raw_data_type = 4;
-  mask->data_type = MEMORY_TYPE_INT16;
-  mask->input_type = serie->input_type;
-  mask->num_time_series = serie->num_time_series;
 
-  double data_size =
-    mask->matrix.i16_x * mask->matrix.i16_y * mask->matrix.i16_z *
-    memory_serie_get_memory_space (mask) * mask->num_time_series;
+  // Labels run from 1 to 255, so a byte per voxel is enough.
+  mask->raw_data_type = 2;
+  mask->data_type = MEMORY_TYPE_UINT8;
 
-  debug_extra ("About to allocate: ~ %.2f megabytes.", data_size / 1000000.0);
-
-  mask->data = calloc (1, data_size);
-  assert (mask->data != NULL);
+  mask->input_type = serie->input_type;
+  mask->u8_NiftiVersion = serie->u8_NiftiVersion;
+  mask->num_time_series = serie->num_time_series;
 
-//  memset (mask->data, 0, data_size);
+  // Masks are mostly empty, so only the bricks that are painted on take
+  // memory.
+  mask->ps_Sparse = memory_sparse_new (mask);
+  assert (mask->ps_Sparse != NULL);
 
   mask->pv_OutOfBlobValue = calloc (1, memory_serie_get_memory_space (mask));
 
@@ -19,6 +19,8 @@
 
 #include "libmemory-slice.h"
 #include "libmemory-serie.h"
+#include "libmemory-brick.h"
+#include "libmemory-sparse.h"
 #include "libcommon-debug.h"
 #include "libcommon-algebra.h"
 
@@ -298,10 +300,50 @@ memory_slice_get_data (Slice *slice)
 
   ppv_CntData = ppv_Data;
 
+  // A serie that lives in a brick file has no data to point into. Its
+  // voxels are copied into a buffer that belongs to the slice instead.
+  // The voxels of a row are read at once, so the cache is locked once per
+  // row instead of once per voxel.
+  unsigned char *pu8_BrickValues = NULL;
+  BrickVoxel *ps_BrickVoxels = NULL;
+  unsigned int ui32_BrickVoxels = 0;
+  unsigned int ui32_RowLength = abs (p_ViewportProps->i16_StopWidth - p_ViewportProps->i16_StartWidth);
+  if (serie->ps_BrickCache != NULL)
+  {
+    free (slice->pv_BrickValues);
+    slice->pv_BrickValues = calloc (slice->matrix.i16_x * slice->matrix.i16_y, i16_BytesToRead);
+    assert (slice->pv_BrickValues != NULL);
+
+    ps_BrickVoxels = calloc (ui32_RowLength + 1, sizeof (BrickVoxel));
+    assert (ps_BrickVoxels != NULL);
+
+    pu8_BrickValues = slice->pv_BrickValues;
+  }
+
+  unsigned long long ui64_SliceBytes = i32_MemoryPerSlice;
+  if (pu8_BrickValues != NULL)
+    ui64_SliceBytes += slice->matrix.i16_x * slice->matrix.i16_y * i16_BytesToRead;
+
+  common_accounting_resize (&serie->ts_Accounting, ACCOUNTING_SLICE, slice->ui64_AccountedBytes, ui64_SliceBytes);
+  slice->ui64_AccountedBytes = ui64_SliceBytes;
+
+  // A sparse serie has no data for the bricks that are all zero. The
+  // slice points into a plane of its own for those voxels, whose values
+  // are moved into the serie when they are painted on.
+  SparsePlane *ps_SparsePlane = NULL;
+  memory_sparse_plane_destroy (slice->ps_SparsePlane), slice->ps_SparsePlane = NULL;
+  if (serie->ps_Sparse != NULL)
+  {
+    slice->ps_SparsePlane = memory_sparse_plane_new (serie->ps_Sparse, slice->matrix.i16_x * slice->matrix.i16_y,
+                                                     slice->u16_timePoint);
+    ps_SparsePlane = slice->ps_SparsePlane;
+  }
+
 
   short int i16_positionX;
   short int i16_positionY;
   short int i16_positionZ;
+  short int i16_LazyZ = -1;
 
   /*
 
@@ -351,19 +393,76 @@ memory_slice_get_data (Slice *slice)
           i16_positionX = serie->matrix.i16_x - i16_positionX;
         }
 
-        i32_MemoryOffset  = ((int)(i16_positionZ * serie->matrix.i16_x * serie->matrix.i16_y) +
-                             (int)(i16_positionY * serie->matrix.i16_x) +
-                             (int)(i16_positionX)) * i16_BytesToRead;
-
-        if ((i32_MemoryOffset < 0 ) || (i32_MemoryOffset >= i32_MemoryInBlob))
+        if (pu8_BrickValues != NULL)
+        {
+          // The value is read with the rest of the row. A voxel that cannot
+          // be read stays zero, like the value outside the volume.
+          pv_OrigData = pu8_BrickValues + (ppv_CntData - ppv_Data) * i16_BytesToRead;
+          if (ui32_BrickVoxels <= ui32_RowLength)
+          {
+            ps_BrickVoxels[ui32_BrickVoxels].i16_X = i16_positionX;
+            ps_BrickVoxels[ui32_BrickVoxels].i16_Y = i16_positionY;
+            ps_BrickVoxels[ui32_BrickVoxels].i16_Z = i16_positionZ;
+            ps_BrickVoxels[ui32_BrickVoxels].pv_Value = pv_OrigData;
+            ui32_BrickVoxels++;
+          }
+        }
+        else if (ps_SparsePlane != NULL)
+        {
+          if ((i16_positionX >= serie->matrix.i16_x) ||
+              (i16_positionY >= serie->matrix.i16_y) ||
+              (i16_positionZ >= serie->matrix.i16_z))
+          {
+            pv_OrigData = serie->pv_OutOfBlobValue;
+          }
+          else
+          {
+            pv_OrigData = memory_sparse_plane_get_voxel (ps_SparsePlane, ppv_CntData - ppv_Data,
+                                                         i16_positionX, i16_positionY, i16_positionZ);
+          }
+        }
+        else if (serie->e_Layout == SERIE_LAYOUT_BRICKED)
         {
-          pv_OrigData = serie->pv_OutOfBlobValue;
+          // Consecutive voxels of a sagittal, coronal or oblique slice
+          // mostly fall in the same brick, so this walks memory about as
+          // well as an axial slice does in the linear layout.
+          if ((i16_positionX >= serie->matrix.i16_x) ||
+              (i16_positionY >= serie->matrix.i16_y) ||
+              (i16_positionZ >= serie->matrix.i16_z))
+          {
+            pv_OrigData = serie->pv_OutOfBlobValue;
+          }
+          else
+          {
+            pv_OrigData = serie->data;
+            pv_OrigData += memory_serie_get_voxel_offset (serie, i16_positionX, i16_positionY,
+                                                          i16_positionZ, slice->u16_timePoint);
+          }
         }
         else
         {
-          pv_OrigData = serie->data;
-          pv_OrigData += i32_MemoryOffset;
-          pv_OrigData += i32_MemoryTimeSerieOffset;
+          // A lazy serie reads its slices on first use. The background
+          // reader continues with the slices around the last one asked for.
+          if (serie->ps_Lazy != NULL && i16_positionZ != i16_LazyZ)
+          {
+            memory_serie_ensure_slice (serie, i16_positionZ, slice->u16_timePoint);
+            i16_LazyZ = i16_positionZ;
+          }
+
+          i32_MemoryOffset  = ((int)(i16_positionZ * serie->matrix.i16_x * serie->matrix.i16_y) +
+                               (int)(i16_positionY * serie->matrix.i16_x) +
+                               (int)(i16_positionX)) * i16_BytesToRead;
+
+          if ((i32_MemoryOffset < 0 ) || (i32_MemoryOffset >= i32_MemoryInBlob))
+          {
+            pv_OrigData = serie->pv_OutOfBlobValue;
+          }
+          else
+          {
+            pv_OrigData = serie->data;
+            pv_OrigData += i32_MemoryOffset;
+            pv_OrigData += i32_MemoryTimeSerieOffset;
+          }
         }
       }
 
@@ -387,9 +486,18 @@ memory_slice_get_data (Slice *slice)
 
       i16_widthCnt += i16_strideX;//p_ViewportProps->i16_StrideWidth;
     }
+
+    if (ui32_BrickVoxels > 0)
+    {
+      memory_brick_read_voxels (serie->ps_BrickCache, slice->u16_timePoint, ps_BrickVoxels, ui32_BrickVoxels);
+      ui32_BrickVoxels = 0;
+    }
+
     i16_heightCnt += i16_strideY;//p_ViewportProps->i16_StrideHeight;
   }
 
+  free (ps_BrickVoxels);
+
 
   /*
   end = clock();
@@ -424,11 +532,21 @@ memory_slice_destroy (void *data)
   if (data == NULL) return;
 
   Slice *slice = (Slice *)data;
+
+  if (slice->serie != NULL)
+    common_accounting_remove (&slice->serie->ts_Accounting, ACCOUNTING_SLICE, slice->ui64_AccountedBytes);
+
   slice->serie = NULL;
 
   free (slice->data);
   slice->data = NULL;
 
+  free (slice->pv_BrickValues);
+  slice->pv_BrickValues = NULL;
+
+  memory_sparse_plane_destroy (slice->ps_SparsePlane);
+  slice->ps_SparsePlane = NULL;
+
   free (slice);
 }
 
@@ -0,0 +1,836 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libmemory-sparse.h"
+#include "libmemory-serie.h"
+#include "libcommon-debug.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#define SPARSE_BRICK_MASK        (SPARSE_BRICK_SIZE - 1)
+
+#define SPARSE_CHANGED_CHECKPOINT  1    /*! The brick may differ from the last checkpoint. */
+#define SPARSE_CHANGED_FILE        2    /*! The brick changed since the Serie was in sync with its file. */
+
+#define SPARSE_PLANE_IN_BRICK      (1ULL << 63)  /*! The pixel points into an allocated brick. */
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* LOCAL FUNCTIONS                                                                                    */
+/*                                                                                                    */
+/*                                                                                                    */
+
+unsigned long long
+ui64_memory_sparse_brick_index (SparseMask *ps_Mask, short int i16_X, short int i16_Y,
+                                short int i16_Z, unsigned short int u16_T)
+{
+  return u16_T * ps_Mask->ui64_BricksPerTimePoint
+    + ((unsigned long long)(i16_Z >> SPARSE_BRICK_SHIFT) * ps_Mask->ui32_BricksY
+       + (i16_Y >> SPARSE_BRICK_SHIFT)) * ps_Mask->ui32_BricksX
+    + (i16_X >> SPARSE_BRICK_SHIFT);
+}
+
+
+unsigned long long
+ui64_memory_sparse_voxel_offset (SparseMask *ps_Mask, short int i16_X, short int i16_Y, short int i16_Z)
+{
+  return (((i16_Z & SPARSE_BRICK_MASK) << (2 * SPARSE_BRICK_SHIFT))
+          | ((i16_Y & SPARSE_BRICK_MASK) << SPARSE_BRICK_SHIFT)
+          | (i16_X & SPARSE_BRICK_MASK)) * ps_Mask->ui32_ElementSize;
+}
+
+
+// Returns where the pointer to a brick is kept in a table of bricks per
+// timepoint, or NULL when its timepoint has none yet and b_Allocate is 0.
+unsigned char **
+ppu8_memory_sparse_brick_slot (SparseMask *ps_Mask, unsigned char ***pppu8_Table,
+                               unsigned long long ui64_Brick, short int b_Allocate)
+{
+  unsigned long long ui64_TimePoint = ui64_Brick / ps_Mask->ui64_BricksPerTimePoint;
+
+  if (pppu8_Table[ui64_TimePoint] == NULL)
+  {
+    if (!b_Allocate) return NULL;
+
+    pppu8_Table[ui64_TimePoint] = calloc (ps_Mask->ui64_BricksPerTimePoint, sizeof (unsigned char *));
+    assert (pppu8_Table[ui64_TimePoint] != NULL);
+  }
+
+  return pppu8_Table[ui64_TimePoint] + ui64_Brick % ps_Mask->ui64_BricksPerTimePoint;
+}
+
+
+unsigned char *
+pu8_memory_sparse_brick (SparseMask *ps_Mask, unsigned char ***pppu8_Table, unsigned long long ui64_Brick)
+{
+  unsigned char **ppu8_Slot = ppu8_memory_sparse_brick_slot (ps_Mask, pppu8_Table, ui64_Brick, 0);
+  return (ppu8_Slot != NULL) ? *ppu8_Slot : NULL;
+}
+
+
+void
+v_memory_sparse_account (SparseMask *ps_Mask, AccountingCategory e_Category, short int i16_Bricks)
+{
+  if (i16_Bricks > 0)
+    common_accounting_add (ps_Mask->ps_Accounting, e_Category, i16_Bricks * ps_Mask->ui64_BrickBytes);
+  else
+    common_accounting_remove (ps_Mask->ps_Accounting, e_Category, -i16_Bricks * ps_Mask->ui64_BrickBytes);
+}
+
+
+short int
+b_memory_sparse_is_zero (const unsigned char *pu8_Data, unsigned long long ui64_Length)
+{
+  unsigned long long ui64_Cnt;
+
+  for (ui64_Cnt = 0; ui64_Cnt < ui64_Length; ui64_Cnt++)
+    if (pu8_Data[ui64_Cnt] != 0) return 0;
+
+  return 1;
+}
+
+
+// Marks the parts of the linear data that a brick covers as dirty: a run
+// of voxels in each of its rows.
+void
+v_memory_sparse_mark_dirty (SparseMask *ps_Mask, unsigned long long ui64_Brick)
+{
+  ts_Coordinate3DInt *ps_Matrix = &ps_Mask->ts_Matrix;
+  unsigned long long ui64_TimePoint = ui64_Brick / ps_Mask->ui64_BricksPerTimePoint;
+  unsigned long long ui64_InTimePoint = ui64_Brick % ps_Mask->ui64_BricksPerTimePoint;
+  short int i16_X = (ui64_InTimePoint % ps_Mask->ui32_BricksX) << SPARSE_BRICK_SHIFT;
+  short int i16_Y = ((ui64_InTimePoint / ps_Mask->ui32_BricksX) % ps_Mask->ui32_BricksY) << SPARSE_BRICK_SHIFT;
+  short int i16_Z = (ui64_InTimePoint / ps_Mask->ui32_BricksX / ps_Mask->ui32_BricksY) << SPARSE_BRICK_SHIFT;
+  short int i16_Run = ps_Matrix->i16_x - i16_X;
+  short int i16_Row, i16_Slice;
+
+  if (i16_Run > SPARSE_BRICK_SIZE)
+    i16_Run = SPARSE_BRICK_SIZE;
+
+  for (i16_Slice = i16_Z; i16_Slice < i16_Z + SPARSE_BRICK_SIZE && i16_Slice < ps_Matrix->i16_z; i16_Slice++)
+    for (i16_Row = i16_Y; i16_Row < i16_Y + SPARSE_BRICK_SIZE && i16_Row < ps_Matrix->i16_y; i16_Row++)
+    {
+      unsigned long long ui64_Voxel = ((ui64_TimePoint * ps_Matrix->i16_z + i16_Slice)
+                                       * ps_Matrix->i16_y + i16_Row) * ps_Matrix->i16_x + i16_X;
+
+      memory_serie_mark_dirty (ps_Mask->ps_Serie, ui64_Voxel * ps_Mask->ui32_ElementSize,
+                               i16_Run * ps_Mask->ui32_ElementSize);
+    }
+}
+
+
+void
+v_memory_sparse_mark_changed (SparseMask *ps_Mask, unsigned long long ui64_Brick)
+{
+  // The Serie only keeps dirty slabs while it is in sync with a file.
+  if (!(ps_Mask->pu8_Changed[ui64_Brick] & SPARSE_CHANGED_FILE) && ps_Mask->ps_Serie->pu8_DirtySlabs != NULL)
+  {
+    ps_Mask->pu8_Changed[ui64_Brick] |= SPARSE_CHANGED_FILE;
+    v_memory_sparse_mark_dirty (ps_Mask, ui64_Brick);
+  }
+
+  if (ps_Mask->pu8_Changed[ui64_Brick] & SPARSE_CHANGED_CHECKPOINT) return;
+
+  if (ps_Mask->ui64_Changed == ps_Mask->ui64_ChangedCapacity)
+  {
+    ps_Mask->ui64_ChangedCapacity = (ps_Mask->ui64_ChangedCapacity == 0) ? 64 : ps_Mask->ui64_ChangedCapacity * 2;
+    ps_Mask->pui64_Changed = realloc (ps_Mask->pui64_Changed,
+                                      ps_Mask->ui64_ChangedCapacity * sizeof (unsigned long long));
+    assert (ps_Mask->pui64_Changed != NULL);
+  }
+
+  ps_Mask->pu8_Changed[ui64_Brick] |= SPARSE_CHANGED_CHECKPOINT;
+  ps_Mask->pui64_Changed[ps_Mask->ui64_Changed++] = ui64_Brick;
+}
+
+
+// Returns the voxel of a pixel of a plane, from the index it keeps for it.
+void *
+pv_memory_sparse_plane_voxel (SparsePlane *ps_Plane, unsigned int ui32_Pixel, short int b_Allocate)
+{
+  SparseMask *ps_Mask = ps_Plane->ps_Mask;
+  unsigned long long ui64_Voxel = (ps_Plane->pui64_Voxels[ui32_Pixel] & ~SPARSE_PLANE_IN_BRICK) - 1;
+
+  return memory_sparse_get_voxel (ps_Mask,
+                                  ui64_Voxel % ps_Mask->ts_Matrix.i16_x,
+                                  (ui64_Voxel / ps_Mask->ts_Matrix.i16_x) % ps_Mask->ts_Matrix.i16_y,
+                                  ui64_Voxel / ((unsigned long long)ps_Mask->ts_Matrix.i16_x * ps_Mask->ts_Matrix.i16_y),
+                                  ps_Plane->u16_TimePoint, b_Allocate);
+}
+
+
+void
+v_memory_sparse_plane_commit (SparsePlane *ps_Plane)
+{
+  SparseMask *ps_Mask = ps_Plane->ps_Mask;
+  unsigned int ui32_Pixel;
+  unsigned int ui32_ElementSize;
+  unsigned char *pu8_Value;
+  unsigned char *pu8_Committed;
+  void *pv_Voxel;
+
+  if (ps_Mask == NULL) return;
+
+  ui32_ElementSize = ps_Mask->ui32_ElementSize;
+
+  // Only the values that were written since the last time are moved, so
+  // planes of other slices that show the same voxel do not undo them.
+  // Pixels in a brick have been written to the brick already, which then
+  // only counts as changed.
+  for (ui32_Pixel = 0; ui32_Pixel < ps_Plane->ui32_Pixels; ui32_Pixel++)
+  {
+    if (ps_Plane->pui64_Voxels[ui32_Pixel] == 0) continue;
+
+    pu8_Committed = ps_Plane->pu8_Committed + ui32_Pixel * ui32_ElementSize;
+
+    if (ps_Plane->pui64_Voxels[ui32_Pixel] & SPARSE_PLANE_IN_BRICK)
+    {
+      pv_Voxel = pv_memory_sparse_plane_voxel (ps_Plane, ui32_Pixel, 0);
+      if (pv_Voxel == NULL || !memcmp (pv_Voxel, pu8_Committed, ui32_ElementSize)) continue;
+
+      pv_memory_sparse_plane_voxel (ps_Plane, ui32_Pixel, 1);
+      memcpy (pu8_Committed, pv_Voxel, ui32_ElementSize);
+      continue;
+    }
+
+    pu8_Value = ps_Plane->pu8_Values + ui32_Pixel * ui32_ElementSize;
+    if (!memcmp (pu8_Value, pu8_Committed, ui32_ElementSize)) continue;
+
+    pv_Voxel = pv_memory_sparse_plane_voxel (ps_Plane, ui32_Pixel, 1);
+    memcpy (pv_Voxel, pu8_Value, ui32_ElementSize);
+    memcpy (pu8_Committed, pu8_Value, ui32_ElementSize);
+  }
+}
+
+
+void
+v_memory_sparse_plane_unlink (SparsePlane *ps_Plane)
+{
+  if (ps_Plane->ps_Previous != NULL)
+    ps_Plane->ps_Previous->ps_Next = ps_Plane->ps_Next;
+  else if (ps_Plane->ps_Mask != NULL)
+    ps_Plane->ps_Mask->ps_Planes = ps_Plane->ps_Next;
+
+  if (ps_Plane->ps_Next != NULL)
+    ps_Plane->ps_Next->ps_Previous = ps_Plane->ps_Previous;
+
+  ps_Plane->ps_Previous = NULL;
+  ps_Plane->ps_Next = NULL;
+}
+
+
+void
+v_memory_sparse_planes_reload (SparseMask *ps_Mask)
+{
+  SparsePlane *ps_Plane;
+  unsigned int ui32_Pixel;
+  unsigned int ui32_ElementSize = ps_Mask->ui32_ElementSize;
+
+  for (ps_Plane = ps_Mask->ps_Planes; ps_Plane != NULL; ps_Plane = ps_Plane->ps_Next)
+  {
+    for (ui32_Pixel = 0; ui32_Pixel < ps_Plane->ui32_Pixels; ui32_Pixel++)
+    {
+      if (ps_Plane->pui64_Voxels[ui32_Pixel] == 0) continue;
+
+      void *pv_Voxel = pv_memory_sparse_plane_voxel (ps_Plane, ui32_Pixel, 0);
+      unsigned char *pu8_Committed = ps_Plane->pu8_Committed + ui32_Pixel * ui32_ElementSize;
+
+      // The slice reads pixels in a brick from the brick itself.
+      if (ps_Plane->pui64_Voxels[ui32_Pixel] & SPARSE_PLANE_IN_BRICK)
+      {
+        if (pv_Voxel != NULL)
+          memcpy (pu8_Committed, pv_Voxel, ui32_ElementSize);
+        continue;
+      }
+
+      unsigned char *pu8_Value = ps_Plane->pu8_Values + ui32_Pixel * ui32_ElementSize;
+      if (pv_Voxel != NULL)
+        memcpy (pu8_Value, pv_Voxel, ui32_ElementSize);
+      else
+        memset (pu8_Value, 0, ui32_ElementSize);
+
+      memcpy (pu8_Committed, pu8_Value, ui32_ElementSize);
+    }
+  }
+}
+
+
+// Bricks are a multiple of eight bytes long, and allocated on their own,
+// so they can be combined a word at a time.
+void
+v_memory_sparse_xor (unsigned char *pu8_Output, const unsigned char *pu8_First,
+                     const unsigned char *pu8_Second, unsigned long long ui64_Length)
+{
+  unsigned long long *pui64_Output = (unsigned long long *)pu8_Output;
+  const unsigned long long *pui64_First = (const unsigned long long *)pu8_First;
+  const unsigned long long *pui64_Second = (const unsigned long long *)pu8_Second;
+  unsigned long long ui64_Cnt;
+
+  for (ui64_Cnt = 0; ui64_Cnt < ui64_Length / sizeof (unsigned long long); ui64_Cnt++)
+    pui64_Output[ui64_Cnt] = pui64_First[ui64_Cnt] ^ pui64_Second[ui64_Cnt];
+}
+
+
+short int
+b_memory_sparse_brick_changed (SparseMask *ps_Mask, unsigned long long ui64_Brick)
+{
+  unsigned char *pu8_Brick = pu8_memory_sparse_brick (ps_Mask, ps_Mask->pppu8_Bricks, ui64_Brick);
+  unsigned char *pu8_Checkpoint = pu8_memory_sparse_brick (ps_Mask, ps_Mask->pppu8_Checkpoint, ui64_Brick);
+
+  if (pu8_Brick == NULL && pu8_Checkpoint == NULL) return 0;
+  if (pu8_Brick == NULL) return !b_memory_sparse_is_zero (pu8_Checkpoint, ps_Mask->ui64_BrickBytes);
+  if (pu8_Checkpoint == NULL) return !b_memory_sparse_is_zero (pu8_Brick, ps_Mask->ui64_BrickBytes);
+
+  return memcmp (pu8_Brick, pu8_Checkpoint, ps_Mask->ui64_BrickBytes) != 0;
+}
+
+
+/*                                                                                                    */
+/*                                                                                                    */
+/* GLOBAL FUNCTIONS                                                                                   */
+/*                                                                                                    */
+/*                                                                                                    */
+
+SparseMask *
+memory_sparse_new (Serie *serie)
+{
+  debug_functions ();
+
+  assert (serie != NULL);
+
+  SparseMask *ps_Mask = calloc (1, sizeof (SparseMask));
+  assert (ps_Mask != NULL);
+
+  ps_Mask->ts_Matrix = serie->matrix;
+  ps_Mask->u16_NumberOfTimeSeries = (serie->num_time_series > 0) ? serie->num_time_series : 1;
+  ps_Mask->ui32_BricksX = (serie->matrix.i16_x + SPARSE_BRICK_MASK) >> SPARSE_BRICK_SHIFT;
+  ps_Mask->ui32_BricksY = (serie->matrix.i16_y + SPARSE_BRICK_MASK) >> SPARSE_BRICK_SHIFT;
+  ps_Mask->ui32_BricksZ = (serie->matrix.i16_z + SPARSE_BRICK_MASK) >> SPARSE_BRICK_SHIFT;
+  ps_Mask->ui64_BricksPerTimePoint = (unsigned long long)ps_Mask->ui32_BricksX *
+                                     ps_Mask->ui32_BricksY * ps_Mask->ui32_BricksZ;
+
+  ps_Mask->ui32_ElementSize = memory_serie_get_memory_space (serie);
+  ps_Mask->ui64_BrickBytes = (unsigned long long)SPARSE_BRICK_SIZE * SPARSE_BRICK_SIZE *
+                             SPARSE_BRICK_SIZE * ps_Mask->ui32_ElementSize;
+
+  ps_Mask->pppu8_Bricks = calloc (ps_Mask->u16_NumberOfTimeSeries, sizeof (unsigned char **));
+  ps_Mask->pppu8_Checkpoint = calloc (ps_Mask->u16_NumberOfTimeSeries, sizeof (unsigned char **));
+  ps_Mask->pu8_Changed = calloc (ps_Mask->ui64_BricksPerTimePoint * ps_Mask->u16_NumberOfTimeSeries, 1);
+  assert (ps_Mask->pppu8_Bricks != NULL && ps_Mask->pppu8_Checkpoint != NULL && ps_Mask->pu8_Changed != NULL);
+
+  ps_Mask->ps_Accounting = &serie->ts_Accounting;
+  ps_Mask->ps_Serie = serie;
+
+  return ps_Mask;
+}
+
+
+void
+memory_sparse_destroy (SparseMask *ps_Mask)
+{
+  debug_functions ();
+
+  unsigned long long ui64_Brick;
+  unsigned short int u16_T;
+
+  if (ps_Mask == NULL) return;
+
+  // The slices free their own planes.
+  while (ps_Mask->ps_Planes != NULL)
+  {
+    SparsePlane *ps_Plane = ps_Mask->ps_Planes;
+    v_memory_sparse_plane_unlink (ps_Plane);
+    ps_Plane->ps_Mask = NULL;
+  }
+
+  for (u16_T = 0; u16_T < ps_Mask->u16_NumberOfTimeSeries; u16_T++)
+  {
+    for (ui64_Brick = 0; ps_Mask->pppu8_Bricks[u16_T] != NULL && ui64_Brick < ps_Mask->ui64_BricksPerTimePoint; ui64_Brick++)
+      free (ps_Mask->pppu8_Bricks[u16_T][ui64_Brick]);
+
+    for (ui64_Brick = 0; ps_Mask->pppu8_Checkpoint[u16_T] != NULL && ui64_Brick < ps_Mask->ui64_BricksPerTimePoint; ui64_Brick++)
+    {
+      if (ps_Mask->pppu8_Checkpoint[u16_T][ui64_Brick] == NULL) continue;
+
+      free (ps_Mask->pppu8_Checkpoint[u16_T][ui64_Brick]);
+      v_memory_sparse_account (ps_Mask, ACCOUNTING_HISTORY, -1);
+    }
+
+    free (ps_Mask->pppu8_Bricks[u16_T]), ps_Mask->pppu8_Bricks[u16_T] = NULL;
+    free (ps_Mask->pppu8_Checkpoint[u16_T]), ps_Mask->pppu8_Checkpoint[u16_T] = NULL;
+  }
+
+  common_accounting_remove (ps_Mask->ps_Accounting, ACCOUNTING_MASK,
+                            ps_Mask->ui64_AllocatedBricks * ps_Mask->ui64_BrickBytes);
+
+  free (ps_Mask->pppu8_Bricks), ps_Mask->pppu8_Bricks = NULL;
+  free (ps_Mask->pppu8_Checkpoint), ps_Mask->pppu8_Checkpoint = NULL;
+  free (ps_Mask->pu8_Changed), ps_Mask->pu8_Changed = NULL;
+  free (ps_Mask->pui64_Changed), ps_Mask->pui64_Changed = NULL;
+  free (ps_Mask), ps_Mask = NULL;
+}
+
+
+void *
+memory_sparse_get_voxel (SparseMask *ps_Mask, short int i16_X, short int i16_Y,
+                         short int i16_Z, unsigned short int u16_T, short int b_Allocate)
+{
+  unsigned char **ppu8_Brick;
+  unsigned long long ui64_Brick;
+
+  if (i16_X < 0 || i16_Y < 0 || i16_Z < 0 ||
+      i16_X >= ps_Mask->ts_Matrix.i16_x ||
+      i16_Y >= ps_Mask->ts_Matrix.i16_y ||
+      i16_Z >= ps_Mask->ts_Matrix.i16_z ||
+      u16_T >= ps_Mask->u16_NumberOfTimeSeries)
+    return NULL;
+
+  ui64_Brick = ui64_memory_sparse_brick_index (ps_Mask, i16_X, i16_Y, i16_Z, u16_T);
+  ppu8_Brick = ppu8_memory_sparse_brick_slot (ps_Mask, ps_Mask->pppu8_Bricks, ui64_Brick, b_Allocate);
+  if (ppu8_Brick == NULL) return NULL;
+
+  // A voxel that is asked for to be written to changes its brick.
+  if (b_Allocate)
+    v_memory_sparse_mark_changed (ps_Mask, ui64_Brick);
+
+  if (*ppu8_Brick == NULL)
+  {
+    if (!b_Allocate) return NULL;
+
+    *ppu8_Brick = calloc (1, ps_Mask->ui64_BrickBytes);
+    assert (*ppu8_Brick != NULL);
+
+    ps_Mask->ui64_AllocatedBricks++;
+    v_memory_sparse_account (ps_Mask, ACCOUNTING_MASK, 1);
+  }
+
+  return *ppu8_Brick + ui64_memory_sparse_voxel_offset (ps_Mask, i16_X, i16_Y, i16_Z);
+}
+
+
+SparsePlane *
+memory_sparse_plane_new (SparseMask *ps_Mask, unsigned int ui32_Pixels, unsigned short int u16_TimePoint)
+{
+  assert (ps_Mask != NULL);
+
+  SparsePlane *ps_Plane = calloc (1, sizeof (SparsePlane));
+  assert (ps_Plane != NULL);
+
+  ps_Plane->ps_Mask = ps_Mask;
+  ps_Plane->u16_TimePoint = u16_TimePoint;
+  ps_Plane->ui32_Pixels = ui32_Pixels;
+  ps_Plane->pui64_Voxels = calloc (ui32_Pixels, sizeof (unsigned long long));
+  ps_Plane->pu8_Values = calloc (ui32_Pixels, ps_Mask->ui32_ElementSize);
+  ps_Plane->pu8_Committed = calloc (ui32_Pixels, ps_Mask->ui32_ElementSize);
+  assert (ps_Plane->pui64_Voxels != NULL && ps_Plane->pu8_Values != NULL && ps_Plane->pu8_Committed != NULL);
+
+  common_accounting_add (ps_Mask->ps_Accounting, ACCOUNTING_SLICE,
+                         ui32_Pixels * (sizeof (unsigned long long) + 2 * ps_Mask->ui32_ElementSize));
+
+  ps_Plane->ps_Next = ps_Mask->ps_Planes;
+  if (ps_Mask->ps_Planes != NULL)
+    ps_Mask->ps_Planes->ps_Previous = ps_Plane;
+
+  ps_Mask->ps_Planes = ps_Plane;
+
+  return ps_Plane;
+}
+
+
+void *
+memory_sparse_plane_add (SparsePlane *ps_Plane, unsigned int ui32_Pixel,
+                         short int i16_X, short int i16_Y, short int i16_Z)
+{
+  SparseMask *ps_Mask = ps_Plane->ps_Mask;
+
+  ps_Plane->pui64_Voxels[ui32_Pixel] = ((unsigned long long)i16_Z * ps_Mask->ts_Matrix.i16_y + i16_Y)
+                                       * ps_Mask->ts_Matrix.i16_x + i16_X + 1;
+
+  return ps_Plane->pu8_Values + ui32_Pixel * ps_Mask->ui32_ElementSize;
+}
+
+
+void *
+memory_sparse_plane_get_voxel (SparsePlane *ps_Plane, unsigned int ui32_Pixel,
+                               short int i16_X, short int i16_Y, short int i16_Z)
+{
+  SparseMask *ps_Mask = ps_Plane->ps_Mask;
+  void *pv_Voxel = memory_sparse_get_voxel (ps_Mask, i16_X, i16_Y, i16_Z, ps_Plane->u16_TimePoint, 0);
+
+  if (pv_Voxel == NULL)
+    return memory_sparse_plane_add (ps_Plane, ui32_Pixel, i16_X, i16_Y, i16_Z);
+
+  // The value is kept to tell whether the brick is painted on through the
+  // slice by the time the plane is committed.
+  memory_sparse_plane_add (ps_Plane, ui32_Pixel, i16_X, i16_Y, i16_Z);
+  ps_Plane->pui64_Voxels[ui32_Pixel] |= SPARSE_PLANE_IN_BRICK;
+  memcpy (ps_Plane->pu8_Committed + ui32_Pixel * ps_Mask->ui32_ElementSize, pv_Voxel, ps_Mask->ui32_ElementSize);
+
+  return pv_Voxel;
+}
+
+
+void
+memory_sparse_plane_destroy (SparsePlane *ps_Plane)
+{
+  if (ps_Plane == NULL) return;
+
+  // A plane that outlived its volume was counted for it, and has been
+  // given back with it.
+  if (ps_Plane->ps_Mask != NULL)
+    common_accounting_remove (ps_Plane->ps_Mask->ps_Accounting, ACCOUNTING_SLICE,
+                              ps_Plane->ui32_Pixels * (sizeof (unsigned long long)
+                                                       + 2 * ps_Plane->ps_Mask->ui32_ElementSize));
+
+  v_memory_sparse_plane_commit (ps_Plane);
+  v_memory_sparse_plane_unlink (ps_Plane);
+
+  free (ps_Plane->pui64_Voxels), ps_Plane->pui64_Voxels = NULL;
+  free (ps_Plane->pu8_Values), ps_Plane->pu8_Values = NULL;
+  free (ps_Plane->pu8_Committed), ps_Plane->pu8_Committed = NULL;
+  free (ps_Plane), ps_Plane = NULL;
+}
+
+
+void
+memory_sparse_flush (SparseMask *ps_Mask)
+{
+  SparsePlane *ps_Plane;
+
+  if (ps_Mask == NULL) return;
+
+  for (ps_Plane = ps_Mask->ps_Planes; ps_Plane != NULL; ps_Plane = ps_Plane->ps_Next)
+    v_memory_sparse_plane_commit (ps_Plane);
+}
+
+
+void
+memory_sparse_copy_to_linear (SparseMask *ps_Mask, void *pv_Data, unsigned long long ui64_Voxels)
+{
+  debug_functions ();
+
+  unsigned char *pu8_Data = pv_Data;
+  unsigned long long ui64_Voxel = 0;
+  unsigned long long ui64_TimePointVoxels = (unsigned long long)ps_Mask->ts_Matrix.i16_x *
+                                            ps_Mask->ts_Matrix.i16_y * ps_Mask->ts_Matrix.i16_z;
+  unsigned int ui32_ElementSize = ps_Mask->ui32_ElementSize;
+  short int i16_X, i16_Y, i16_Z, i16_Run;
+  unsigned short int u16_T;
+
+  memory_sparse_flush (ps_Mask);
+
+  // Walk the rows, and copy each row in runs that lie in a single brick.
+  for (u16_T = 0; u16_T < ps_Mask->u16_NumberOfTimeSeries; u16_T++)
+  {
+    // A timepoint that was never written to is zero throughout.
+    if (ps_Mask->pppu8_Bricks[u16_T] == NULL)
+    {
+      unsigned long long ui64_Run = ui64_TimePointVoxels;
+      if (ui64_Run > ui64_Voxels - ui64_Voxel)
+        ui64_Run = ui64_Voxels - ui64_Voxel;
+
+      memset (pu8_Data + ui64_Voxel * ui32_ElementSize, 0, ui64_Run * ui32_ElementSize);
+      ui64_Voxel += ui64_Run;
+      continue;
+    }
+
+    for (i16_Z = 0; i16_Z < ps_Mask->ts_Matrix.i16_z; i16_Z++)
+      for (i16_Y = 0; i16_Y < ps_Mask->ts_Matrix.i16_y; i16_Y++)
+        for (i16_X = 0; i16_X < ps_Mask->ts_Matrix.i16_x; i16_X += i16_Run)
+        {
+          if (ui64_Voxel >= ui64_Voxels) return;
+
+          i16_Run = SPARSE_BRICK_SIZE - (i16_X & SPARSE_BRICK_MASK);
+          if (i16_Run > ps_Mask->ts_Matrix.i16_x - i16_X)
+            i16_Run = ps_Mask->ts_Matrix.i16_x - i16_X;
+          if ((unsigned long long)i16_Run > ui64_Voxels - ui64_Voxel)
+            i16_Run = ui64_Voxels - ui64_Voxel;
+
+          void *pv_Voxel = memory_sparse_get_voxel (ps_Mask, i16_X, i16_Y, i16_Z, u16_T, 0);
+          if (pv_Voxel != NULL)
+            memcpy (pu8_Data + ui64_Voxel * ui32_ElementSize, pv_Voxel, i16_Run * ui32_ElementSize);
+          else
+            memset (pu8_Data + ui64_Voxel * ui32_ElementSize, 0, i16_Run * ui32_ElementSize);
+
+          ui64_Voxel += i16_Run;
+        }
+  }
+}
+
+
+void
+memory_sparse_copy_from_linear (SparseMask *ps_Mask, const void *pv_Data, unsigned long long ui64_Voxels)
+{
+  debug_functions ();
+
+  const unsigned char *pu8_Data = pv_Data;
+  unsigned long long ui64_Voxel = 0;
+  unsigned long long ui64_Brick;
+  unsigned long long ui64_Left;
+  unsigned int ui32_ElementSize = ps_Mask->ui32_ElementSize;
+  short int i16_X, i16_Y, i16_Z, i16_Run;
+  unsigned short int u16_T;
+
+  // Whatever was painted before is overwritten.
+  memory_sparse_flush (ps_Mask);
+
+  for (u16_T = 0; u16_T < ps_Mask->u16_NumberOfTimeSeries && ui64_Voxel < ui64_Voxels; u16_T++)
+    for (i16_Z = 0; i16_Z < ps_Mask->ts_Matrix.i16_z && ui64_Voxel < ui64_Voxels; i16_Z++)
+      for (i16_Y = 0; i16_Y < ps_Mask->ts_Matrix.i16_y && ui64_Voxel < ui64_Voxels; i16_Y++)
+        for (i16_X = 0; i16_X < ps_Mask->ts_Matrix.i16_x && ui64_Voxel < ui64_Voxels; i16_X += i16_Run)
+        {
+          i16_Run = SPARSE_BRICK_SIZE - (i16_X & SPARSE_BRICK_MASK);
+          if (i16_Run > ps_Mask->ts_Matrix.i16_x - i16_X)
+            i16_Run = ps_Mask->ts_Matrix.i16_x - i16_X;
+          if ((unsigned long long)i16_Run > ui64_Voxels - ui64_Voxel)
+            i16_Run = ui64_Voxels - ui64_Voxel;
+
+          const unsigned char *pu8_Run = pu8_Data + ui64_Voxel * ui32_ElementSize;
+          short int b_Zero = b_memory_sparse_is_zero (pu8_Run, i16_Run * ui32_ElementSize);
+
+          void *pv_Voxel = memory_sparse_get_voxel (ps_Mask, i16_X, i16_Y, i16_Z, u16_T, !b_Zero);
+          if (pv_Voxel != NULL)
+          {
+            v_memory_sparse_mark_changed (ps_Mask, ui64_memory_sparse_brick_index (ps_Mask, i16_X, i16_Y, i16_Z, u16_T));
+            memcpy (pv_Voxel, pu8_Run, i16_Run * ui32_ElementSize);
+          }
+
+          ui64_Voxel += i16_Run;
+        }
+
+  // Give back the bricks that were cleared, and the tables of timepoints
+  // that are empty again. Slices may point into any brick, so this can
+  // only be done when no slice is taken of the volume.
+  for (u16_T = 0; ps_Mask->ps_Planes == NULL && u16_T < ps_Mask->u16_NumberOfTimeSeries; u16_T++)
+  {
+    unsigned char **ppu8_Bricks = ps_Mask->pppu8_Bricks[u16_T];
+    if (ppu8_Bricks == NULL) continue;
+
+    for (ui64_Brick = 0, ui64_Left = 0; ui64_Brick < ps_Mask->ui64_BricksPerTimePoint; ui64_Brick++)
+    {
+      if (ppu8_Bricks[ui64_Brick] == NULL) continue;
+
+      if (!b_memory_sparse_is_zero (ppu8_Bricks[ui64_Brick], ps_Mask->ui64_BrickBytes))
+      {
+        ui64_Left++;
+        continue;
+      }
+
+      free (ppu8_Bricks[ui64_Brick]), ppu8_Bricks[ui64_Brick] = NULL;
+      ps_Mask->ui64_AllocatedBricks--;
+      v_memory_sparse_account (ps_Mask, ACCOUNTING_MASK, -1);
+    }
+
+    if (ui64_Left == 0)
+      free (ps_Mask->pppu8_Bricks[u16_T]), ps_Mask->pppu8_Bricks[u16_T] = NULL;
+  }
+
+  // The slices show the new values from now on.
+  v_memory_sparse_planes_reload (ps_Mask);
+}
+
+
+void
+memory_sparse_mark_synced (SparseMask *ps_Mask)
+{
+  unsigned long long ui64_Bricks, ui64_Brick;
+
+  if (ps_Mask == NULL) return;
+
+  ui64_Bricks = ps_Mask->ui64_BricksPerTimePoint * ps_Mask->u16_NumberOfTimeSeries;
+  for (ui64_Brick = 0; ui64_Brick < ui64_Bricks; ui64_Brick++)
+    ps_Mask->pu8_Changed[ui64_Brick] &= ~SPARSE_CHANGED_FILE;
+}
+
+
+SparseDelta *
+memory_sparse_checkpoint (SparseMask *ps_Mask)
+{
+  debug_functions ();
+
+  unsigned long long ui64_Cnt;
+  unsigned long long ui64_Brick;
+  unsigned long long ui64_Capacity = 0;
+  unsigned long long ui64_RecordSize = sizeof (unsigned long long) + ps_Mask->ui64_BrickBytes;
+  SparseDelta *ps_Delta = NULL;
+
+  memory_sparse_flush (ps_Mask);
+
+  // Only the bricks that were written to since the previous checkpoint can
+  // differ from it.
+  for (ui64_Cnt = 0; ui64_Cnt < ps_Mask->ui64_Changed; ui64_Cnt++)
+  {
+    ui64_Brick = ps_Mask->pui64_Changed[ui64_Cnt];
+    ps_Mask->pu8_Changed[ui64_Brick] &= ~SPARSE_CHANGED_CHECKPOINT;
+
+    if (!b_memory_sparse_brick_changed (ps_Mask, ui64_Brick)) continue;
+
+    // The delta is kept in a single block, so the history can move it to
+    // disk as it is.
+    if (ps_Delta == NULL || ps_Delta->ui64_Bricks == ui64_Capacity)
+    {
+      ui64_Capacity = (ui64_Capacity == 0) ? 16 : ui64_Capacity * 2;
+      ps_Delta = realloc (ps_Delta, sizeof (SparseDelta) + ui64_Capacity * ui64_RecordSize);
+      assert (ps_Delta != NULL);
+
+      if (ui64_Capacity == 16)
+      {
+        ps_Delta->ps_Mask = ps_Mask;
+        ps_Delta->ui64_Bricks = 0;
+      }
+    }
+
+    unsigned char *pu8_Record = (unsigned char *)(ps_Delta + 1) + ps_Delta->ui64_Bricks * ui64_RecordSize;
+    unsigned char *pu8_Brick = pu8_memory_sparse_brick (ps_Mask, ps_Mask->pppu8_Bricks, ui64_Brick);
+    unsigned char **ppu8_Checkpoint = ppu8_memory_sparse_brick_slot (ps_Mask, ps_Mask->pppu8_Checkpoint, ui64_Brick, 1);
+    unsigned char *pu8_Checkpoint = *ppu8_Checkpoint;
+    unsigned char *pu8_Xor = pu8_Record + sizeof (unsigned long long);
+
+    if (pu8_Brick == NULL)
+      memcpy (pu8_Xor, pu8_Checkpoint, ps_Mask->ui64_BrickBytes);
+    else if (pu8_Checkpoint == NULL)
+      memcpy (pu8_Xor, pu8_Brick, ps_Mask->ui64_BrickBytes);
+    else
+      v_memory_sparse_xor (pu8_Xor, pu8_Brick, pu8_Checkpoint, ps_Mask->ui64_BrickBytes);
+
+    *(unsigned long long *)pu8_Record = ui64_Brick;
+    ps_Delta->ui64_Bricks++;
+
+    // The checkpoint follows the volume.
+    if (pu8_Brick == NULL || b_memory_sparse_is_zero (pu8_Brick, ps_Mask->ui64_BrickBytes))
+    {
+      if (pu8_Checkpoint != NULL)
+      {
+        free (pu8_Checkpoint), *ppu8_Checkpoint = NULL;
+        v_memory_sparse_account (ps_Mask, ACCOUNTING_HISTORY, -1);
+      }
+      continue;
+    }
+
+    if (pu8_Checkpoint == NULL)
+    {
+      pu8_Checkpoint = malloc (ps_Mask->ui64_BrickBytes);
+      assert (pu8_Checkpoint != NULL);
+      *ppu8_Checkpoint = pu8_Checkpoint;
+      v_memory_sparse_account (ps_Mask, ACCOUNTING_HISTORY, 1);
+    }
+
+    memcpy (pu8_Checkpoint, pu8_Brick, ps_Mask->ui64_BrickBytes);
+  }
+
+  ps_Mask->ui64_Changed = 0;
+
+  if (ps_Delta != NULL)
+    ps_Delta->ui64_Size = sizeof (SparseDelta) + ps_Delta->ui64_Bricks * ui64_RecordSize;
+
+  return ps_Delta;
+}
+
+
+short int
+memory_sparse_delta_apply (void *pv_Delta, void *pv_Mask)
+{
+  debug_functions ();
+
+  SparseDelta *ps_Delta = pv_Delta;
+  SparseMask *ps_Mask = pv_Mask;
+  unsigned long long ui64_Cnt;
+
+  if (ps_Delta == NULL || ps_Mask == NULL || ps_Delta->ps_Mask != ps_Mask) return 0;
+
+  unsigned long long ui64_RecordSize = sizeof (unsigned long long) + ps_Mask->ui64_BrickBytes;
+
+  memory_sparse_flush (ps_Mask);
+
+  for (ui64_Cnt = 0; ui64_Cnt < ps_Delta->ui64_Bricks; ui64_Cnt++)
+  {
+    unsigned char *pu8_Record = (unsigned char *)(ps_Delta + 1) + ui64_Cnt * ui64_RecordSize;
+    unsigned long long ui64_Brick = *(unsigned long long *)pu8_Record;
+    unsigned char *pu8_Xor = pu8_Record + sizeof (unsigned long long);
+    unsigned char **ppu8_Checkpoint = ppu8_memory_sparse_brick_slot (ps_Mask, ps_Mask->pppu8_Checkpoint, ui64_Brick, 1);
+    unsigned char *pu8_Checkpoint = *ppu8_Checkpoint;
+    unsigned char **ppu8_Brick;
+
+    // The brick is compared again at the next checkpoint.
+    v_memory_sparse_mark_changed (ps_Mask, ui64_Brick);
+
+    // Both undo and redo turn the checkpoint into the other state by
+    // flipping the bits that differ between them.
+    if (pu8_Checkpoint == NULL)
+    {
+      pu8_Checkpoint = calloc (1, ps_Mask->ui64_BrickBytes);
+      assert (pu8_Checkpoint != NULL);
+      *ppu8_Checkpoint = pu8_Checkpoint;
+      v_memory_sparse_account (ps_Mask, ACCOUNTING_HISTORY, 1);
+    }
+
+    v_memory_sparse_xor (pu8_Checkpoint, pu8_Checkpoint, pu8_Xor, ps_Mask->ui64_BrickBytes);
+
+    if (b_memory_sparse_is_zero (pu8_Checkpoint, ps_Mask->ui64_BrickBytes))
+    {
+      free (pu8_Checkpoint), pu8_Checkpoint = *ppu8_Checkpoint = NULL;
+      v_memory_sparse_account (ps_Mask, ACCOUNTING_HISTORY, -1);
+    }
+
+    // Slices may point into the brick, so it is only freed when no slice
+    // is taken of the volume.
+    if (pu8_Checkpoint == NULL)
+    {
+      ppu8_Brick = ppu8_memory_sparse_brick_slot (ps_Mask, ps_Mask->pppu8_Bricks, ui64_Brick, 0);
+      if (ppu8_Brick == NULL || *ppu8_Brick == NULL) continue;
+
+      if (ps_Mask->ps_Planes == NULL)
+      {
+        free (*ppu8_Brick), *ppu8_Brick = NULL;
+        ps_Mask->ui64_AllocatedBricks--;
+        v_memory_sparse_account (ps_Mask, ACCOUNTING_MASK, -1);
+      }
+      else
+        memset (*ppu8_Brick, 0, ps_Mask->ui64_BrickBytes);
+
+      continue;
+    }
+
+    ppu8_Brick = ppu8_memory_sparse_brick_slot (ps_Mask, ps_Mask->pppu8_Bricks, ui64_Brick, 1);
+    if (*ppu8_Brick == NULL)
+    {
+      *ppu8_Brick = malloc (ps_Mask->ui64_BrickBytes);
+      assert (*ppu8_Brick != NULL);
+      ps_Mask->ui64_AllocatedBricks++;
+      v_memory_sparse_account (ps_Mask, ACCOUNTING_MASK, 1);
+    }
+
+    memcpy (*ppu8_Brick, pu8_Checkpoint, ps_Mask->ui64_BrickBytes);
+  }
+
+  v_memory_sparse_planes_reload (ps_Mask);
+
+  return 1;
+}
+
+
+unsigned long long
+memory_sparse_get_allocated_bytes (SparseMask *ps_Mask)
+{
+  if (ps_Mask == NULL) return 0;
+  return ps_Mask->ui64_AllocatedBricks * ps_Mask->ui64_BrickBytes;
+}
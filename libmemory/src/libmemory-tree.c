@@ -24,13 +24,338 @@
 
 #include <string.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
+
+// The number of buckets the registry starts with. It doubles whenever it
+// holds more entries than buckets.
+#define TREE_REGISTRY_MIN_BUCKETS 256
+
+// The length of the UID fields of a Patient, Study and Serie.
+#define TREE_REGISTRY_UID_LENGTH  64
 
 
 static Tree* ts_ActiveTree;
 
 
+/**
+ * The indexes of the registry. Each element of a memory tree is found by
+ * its id, and by its UID within its parent.
+ */
+typedef enum
+{
+  TREE_INDEX_PATIENT_ID,
+  TREE_INDEX_STUDY_ID,
+  TREE_INDEX_SERIE_ID,
+  TREE_INDEX_PATIENT_UID,
+  TREE_INDEX_STUDY_UID,
+  TREE_INDEX_SERIE_UID
+} te_TreeIndex;
+
+
+typedef struct s_TreeRegistryEntry
+{
+  te_TreeIndex e_Index;
+  unsigned long long ui64_Key;
+  Tree *pt_Scope;
+  Tree *pt_Node;
+  unsigned long long ui64_Tree;
+  struct s_TreeRegistryEntry *ps_Next;
+} TreeRegistryEntry;
+
+
+/**
+ * Patients, studies and series of all memory trees, hashed on their id and
+ * on their UID. Elements are registered when they are merged into a tree,
+ * and unregistered before they are taken out of it.
+ *
+ * Each entry carries a number for the tree it is in, so that lookups that
+ * are limited to one tree compare that number instead of walking the tree.
+ * The patients of a tree share the number of the first one registered.
+ */
+static struct
+{
+  TreeRegistryEntry **pps_Buckets;
+  unsigned long long ui64_Buckets;
+  unsigned long long ui64_Entries;
+  unsigned long long ui64_LastTree;
+  pthread_mutex_t t_Lock;
+} ts_Registry = { NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER };
+
+
+// Returns 0 for a patient, 1 for a study and 2 for a serie, or -1.
+static short int
+i16_memory_tree_level (Tree *tree)
+{
+  switch (tree->type)
+  {
+    case TREE_TYPE_PATIENT      : return 0;
+    case TREE_TYPE_STUDY        : return 1;
+    case TREE_TYPE_SERIE        :
+    case TREE_TYPE_SERIE_MASK   :
+    case TREE_TYPE_SERIE_OVERLAY: return 2;
+    default                     : return -1;
+  }
+}
+
+
+static unsigned long long
+ui64_memory_tree_id (Tree *tree, short int i16_Level)
+{
+  switch (i16_Level)
+  {
+    case 0 : return ((Patient *)tree->data)->id;
+    case 1 : return ((Study *)tree->data)->id;
+    default: return ((Serie *)tree->data)->id;
+  }
+}
+
+
+static const char *
+pc_memory_tree_uid (Tree *tree, short int i16_Level)
+{
+  switch (i16_Level)
+  {
+    case 0 : return ((Patient *)tree->data)->c_patientID;
+    case 1 : return ((Study *)tree->data)->c_studyInstanceUID;
+    default: return ((Serie *)tree->data)->c_serieInstanceUID;
+  }
+}
+
+
+// FNV-1a. UIDs are not always terminated within their field.
+static unsigned long long
+ui64_memory_tree_uid_hash (const char *pc_UID)
+{
+  unsigned long long ui64_Hash = 0xcbf29ce484222325ULL;
+  unsigned int ui32_Cnt;
+
+  for (ui32_Cnt = 0; ui32_Cnt < TREE_REGISTRY_UID_LENGTH && pc_UID[ui32_Cnt] != '\0'; ui32_Cnt++)
+  {
+    ui64_Hash ^= (unsigned char)pc_UID[ui32_Cnt];
+    ui64_Hash *= 0x100000001b3ULL;
+  }
+
+  return ui64_Hash;
+}
+
+
+static unsigned long long
+ui64_memory_tree_bucket (te_TreeIndex e_Index, unsigned long long ui64_Key, Tree *pt_Scope,
+                         unsigned long long ui64_Buckets)
+{
+  unsigned long long ui64_Hash = (ui64_Key ^ (unsigned long long)(uintptr_t)pt_Scope
+                                  ^ ((unsigned long long)e_Index << 56)) * 0x9e3779b97f4a7c15ULL;
+
+  return (ui64_Hash >> 32) & (ui64_Buckets - 1);
+}
+
+
+static void
+v_memory_tree_registry_insert (te_TreeIndex e_Index, unsigned long long ui64_Key, Tree *pt_Scope, Tree *pt_Node,
+                               unsigned long long ui64_Tree)
+{
+  unsigned long long ui64_Bucket;
+
+  if (ts_Registry.ui64_Entries >= ts_Registry.ui64_Buckets)
+  {
+    unsigned long long ui64_Buckets = (ts_Registry.ui64_Buckets == 0)
+                                      ? TREE_REGISTRY_MIN_BUCKETS : ts_Registry.ui64_Buckets * 2;
+
+    TreeRegistryEntry **pps_Buckets = calloc (ui64_Buckets, sizeof (TreeRegistryEntry *));
+    assert (pps_Buckets != NULL);
+
+    for (ui64_Bucket = 0; ui64_Bucket < ts_Registry.ui64_Buckets; ui64_Bucket++)
+    {
+      while (ts_Registry.pps_Buckets[ui64_Bucket] != NULL)
+      {
+        TreeRegistryEntry *ps_Entry = ts_Registry.pps_Buckets[ui64_Bucket];
+        ts_Registry.pps_Buckets[ui64_Bucket] = ps_Entry->ps_Next;
+
+        unsigned long long ui64_New = ui64_memory_tree_bucket (ps_Entry->e_Index, ps_Entry->ui64_Key,
+                                                               ps_Entry->pt_Scope, ui64_Buckets);
+        ps_Entry->ps_Next = pps_Buckets[ui64_New];
+        pps_Buckets[ui64_New] = ps_Entry;
+      }
+    }
+
+    free (ts_Registry.pps_Buckets);
+    ts_Registry.pps_Buckets = pps_Buckets;
+    ts_Registry.ui64_Buckets = ui64_Buckets;
+  }
+
+  TreeRegistryEntry *ps_Entry = calloc (1, sizeof (TreeRegistryEntry));
+  assert (ps_Entry != NULL);
+
+  ps_Entry->e_Index = e_Index;
+  ps_Entry->ui64_Key = ui64_Key;
+  ps_Entry->pt_Scope = pt_Scope;
+  ps_Entry->pt_Node = pt_Node;
+  ps_Entry->ui64_Tree = ui64_Tree;
+
+  ui64_Bucket = ui64_memory_tree_bucket (e_Index, ui64_Key, pt_Scope, ts_Registry.ui64_Buckets);
+  ps_Entry->ps_Next = ts_Registry.pps_Buckets[ui64_Bucket];
+  ts_Registry.pps_Buckets[ui64_Bucket] = ps_Entry;
+  ts_Registry.ui64_Entries++;
+}
+
+
+static void
+v_memory_tree_registry_remove (te_TreeIndex e_Index, unsigned long long ui64_Key, Tree *pt_Scope, Tree *pt_Node)
+{
+  if (ts_Registry.ui64_Buckets == 0) return;
+
+  TreeRegistryEntry **pps_Entry = &ts_Registry.pps_Buckets[ui64_memory_tree_bucket (e_Index, ui64_Key, pt_Scope,
+                                                                                    ts_Registry.ui64_Buckets)];
+  while (*pps_Entry != NULL)
+  {
+    TreeRegistryEntry *ps_Entry = *pps_Entry;
+    if (ps_Entry->pt_Node == pt_Node && ps_Entry->e_Index == e_Index)
+    {
+      *pps_Entry = ps_Entry->ps_Next;
+      free (ps_Entry), ps_Entry = NULL;
+      ts_Registry.ui64_Entries--;
+      return;
+    }
+
+    pps_Entry = &ps_Entry->ps_Next;
+  }
+}
+
+
+// Finds an element by its id, or by its UID when pc_UID is given, in the
+// tree with the given number, or in any tree for 0. The lock of the registry
+// must be held.
+static Tree *
+pt_memory_tree_registry_find (te_TreeIndex e_Index, unsigned long long ui64_Key, Tree *pt_Scope,
+                              unsigned long long ui64_Tree, const char *pc_UID)
+{
+  TreeRegistryEntry *ps_Entry;
+
+  if (ts_Registry.ui64_Buckets == 0) return NULL;
+
+  ps_Entry = ts_Registry.pps_Buckets[ui64_memory_tree_bucket (e_Index, ui64_Key, pt_Scope, ts_Registry.ui64_Buckets)];
+  for (; ps_Entry != NULL; ps_Entry = ps_Entry->ps_Next)
+  {
+    if (ps_Entry->e_Index != e_Index || ps_Entry->ui64_Key != ui64_Key || ps_Entry->pt_Scope != pt_Scope)
+      continue;
+
+    Tree *pt_Node = ps_Entry->pt_Node;
+    if (pc_UID != NULL && strncmp (pc_memory_tree_uid (pt_Node, i16_memory_tree_level (pt_Node)),
+                                   pc_UID, TREE_REGISTRY_UID_LENGTH) != 0)
+      continue;
+
+    // Several trees can be loaded at once, for example by the batch mode.
+    if (ui64_Tree != 0 && ps_Entry->ui64_Tree != ui64_Tree)
+      continue;
+
+    return pt_Node;
+  }
+
+  return NULL;
+}
+
+
+// Returns the number of the tree a registered patient is in, or 0. The lock
+// of the registry must be held.
+static unsigned long long
+ui64_memory_tree_registered_tree (Tree *pt_Patient)
+{
+  TreeRegistryEntry *ps_Entry;
+  unsigned long long ui64_Id;
+
+  if (ts_Registry.ui64_Buckets == 0 || pt_Patient->data == NULL) return 0;
+
+  ui64_Id = ((Patient *)pt_Patient->data)->id;
+  ps_Entry = ts_Registry.pps_Buckets[ui64_memory_tree_bucket (TREE_INDEX_PATIENT_ID, ui64_Id, NULL,
+                                                               ts_Registry.ui64_Buckets)];
+  for (; ps_Entry != NULL; ps_Entry = ps_Entry->ps_Next)
+  {
+    if (ps_Entry->e_Index == TREE_INDEX_PATIENT_ID && ps_Entry->pt_Node == pt_Patient)
+      return ps_Entry->ui64_Tree;
+  }
+
+  return 0;
+}
+
+
+// Returns the number of the tree a patient is in: its own, or that of the
+// nearest of its registered neighbours. The lock of the registry must be
+// held.
+static unsigned long long
+ui64_memory_tree_number (Tree *pt_Patient)
+{
+  unsigned long long ui64_Tree = ui64_memory_tree_registered_tree (pt_Patient);
+  Tree *pt_Previous = pt_Patient->previous;
+  Tree *pt_Next = pt_Patient->next;
+
+  while (ui64_Tree == 0 && (pt_Previous != NULL || pt_Next != NULL))
+  {
+    if (pt_Previous != NULL)
+    {
+      ui64_Tree = ui64_memory_tree_registered_tree (pt_Previous);
+      pt_Previous = pt_Previous->previous;
+    }
+
+    if (ui64_Tree == 0 && pt_Next != NULL)
+    {
+      ui64_Tree = ui64_memory_tree_registered_tree (pt_Next);
+      pt_Next = pt_Next->next;
+    }
+  }
+
+  return ui64_Tree;
+}
+
+
+static void
+v_memory_tree_register_node (Tree *tree, short int b_Register)
+{
+  short int i16_Level = i16_memory_tree_level (tree);
+  if (i16_Level < 0 || tree->data == NULL) return;
+
+  // Patients are found by their UID in the whole tree. Studies and series
+  // by their UID within their patient or study.
+  Tree *pt_Scope = (i16_Level == 0) ? NULL : tree->parent;
+  unsigned long long ui64_Id = ui64_memory_tree_id (tree, i16_Level);
+  unsigned long long ui64_Hash = ui64_memory_tree_uid_hash (pc_memory_tree_uid (tree, i16_Level));
+
+  if (b_Register)
+  {
+    // A patient that is the first of its tree starts a new one. Studies
+    // and series are in the tree of their patient.
+    Tree *pt_Patient = tree;
+    while (pt_Patient->parent != NULL)
+      pt_Patient = pt_Patient->parent;
+
+    unsigned long long ui64_Tree = ui64_memory_tree_number (pt_Patient);
+    if (ui64_Tree == 0)
+      ui64_Tree = ++ts_Registry.ui64_LastTree;
+
+    v_memory_tree_registry_insert (TREE_INDEX_PATIENT_ID + i16_Level, ui64_Id, NULL, tree, ui64_Tree);
+    v_memory_tree_registry_insert (TREE_INDEX_PATIENT_UID + i16_Level, ui64_Hash, pt_Scope, tree, ui64_Tree);
+  }
+  else
+  {
+    v_memory_tree_registry_remove (TREE_INDEX_PATIENT_ID + i16_Level, ui64_Id, NULL, tree);
+    v_memory_tree_registry_remove (TREE_INDEX_PATIENT_UID + i16_Level, ui64_Hash, pt_Scope, tree);
+  }
+}
+
+
+static void
+v_memory_tree_register_all (Tree *tree, short int b_Register)
+{
+  v_memory_tree_register_node (tree, b_Register);
+
+  Tree *pt_Child;
+  for (pt_Child = tree->child; pt_Child != NULL && i16_memory_tree_level (tree) < 2; pt_Child = pt_Child->next)
+    v_memory_tree_register_all (pt_Child, b_Register);
+}
+
+
 void
 memory_tree_set_active (Tree* tree)
 {
@@ -65,29 +390,12 @@ memory_tree_get_study_by_id (Tree* tree, unsigned long long id)
   if (tree == NULL) return NULL;
   if (tree->type != TREE_TYPE_PATIENT) return NULL;
 
-  Tree *root = tree_nth (tree, 1);
-  while (root != NULL)
-  {
-    Tree *studies = tree_child (root);
-    while (studies != NULL)
-    {
-      Study *study = studies->data;
-      if (study == NULL)
-      {
-        studies = tree_next (studies);
-        continue;
-      }
-
-      if (study->id == id)
-        return studies;
-
-      studies = tree_next (studies);
-    }
-
-    root = tree_next (root);
-  }
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  unsigned long long ui64_Tree = ui64_memory_tree_number (tree);
+  Tree *study = (ui64_Tree == 0) ? NULL : pt_memory_tree_registry_find (TREE_INDEX_STUDY_ID, id, NULL, ui64_Tree, NULL);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
 
-  return 0;
+  return study;
 }
 
 Tree*
@@ -100,37 +408,88 @@ memory_tree_get_serie_by_id (Tree* tree, unsigned long long id)
   if (tree->type == TREE_TYPE_STUDY) return NULL;
   if (tree->type == TREE_TYPE_SERIE) return NULL;
 
-  Tree *root = tree_nth (tree, 1);
-  while (root != NULL)
-  {
-    Tree *studies = tree_child (root);
-    while (studies != NULL)
-    {
-      Tree *pll_Serie = tree_child(studies);
-      while (pll_Serie != NULL)
-      {
-        Serie *ps_Serie = pll_Serie->data;
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  unsigned long long ui64_Tree = ui64_memory_tree_number (tree);
+  Tree *serie = (ui64_Tree == 0) ? NULL : pt_memory_tree_registry_find (TREE_INDEX_SERIE_ID, id, NULL, ui64_Tree, NULL);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
+
+  return serie;
+}
 
-        if (ps_Serie == NULL)
-        {
-          pll_Serie = tree_next(pll_Serie);
-          continue;
-        }
 
-        if (ps_Serie->id == id)
-        {
-          return pll_Serie;
-        }
+Tree*
+memory_tree_get_patient_by_uid (Tree* tree, const char *uid)
+{
+  debug_functions ();
 
-        pll_Serie = tree_next(pll_Serie);
-      }
-      studies = tree_next (studies);
-    }
+  if (tree == NULL || uid == NULL || tree->type != TREE_TYPE_PATIENT) return NULL;
 
-    root = tree_next (root);
-  }
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  unsigned long long ui64_Tree = ui64_memory_tree_number (tree);
+  Tree *patient = (ui64_Tree == 0) ? NULL : pt_memory_tree_registry_find (TREE_INDEX_PATIENT_UID,
+                                                                          ui64_memory_tree_uid_hash (uid),
+                                                                          NULL, ui64_Tree, uid);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
 
-  return 0;
+  return patient;
+}
+
+
+Tree*
+memory_tree_get_study_by_uid (Tree* tree, const char *uid)
+{
+  debug_functions ();
+
+  if (tree == NULL || uid == NULL || tree->type != TREE_TYPE_PATIENT) return NULL;
+
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  Tree *study = pt_memory_tree_registry_find (TREE_INDEX_STUDY_UID, ui64_memory_tree_uid_hash (uid),
+                                              tree, 0, uid);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
+
+  return study;
+}
+
+
+Tree*
+memory_tree_get_serie_by_uid (Tree* tree, const char *uid)
+{
+  debug_functions ();
+
+  if (tree == NULL || uid == NULL || tree->type != TREE_TYPE_STUDY) return NULL;
+
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  Tree *serie = pt_memory_tree_registry_find (TREE_INDEX_SERIE_UID, ui64_memory_tree_uid_hash (uid),
+                                              tree, 0, uid);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
+
+  return serie;
+}
+
+
+void
+memory_tree_register (Tree* tree)
+{
+  debug_functions ();
+
+  if (tree == NULL) return;
+
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  v_memory_tree_register_all (tree, 1);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
+}
+
+
+void
+memory_tree_unregister (Tree* tree)
+{
+  debug_functions ();
+
+  if (tree == NULL) return;
+
+  pthread_mutex_lock (&ts_Registry.t_Lock);
+  v_memory_tree_register_all (tree, 0);
+  pthread_mutex_unlock (&ts_Registry.t_Lock);
 }
 
 Tree*
@@ -195,6 +554,7 @@ memory_tree_add_mask_for_serie (Tree* tree)
   assert (mask != NULL);
 
   tree = tree_append (tree, mask, TREE_TYPE_SERIE_MASK);
+  memory_tree_register (tree);
 
   return tree;
 }
@@ -214,6 +574,7 @@ memory_tree_add_overlay_for_serie (Tree* tree)
   assert (overlay != NULL);
 
   tree = tree_append (tree, overlay, TREE_TYPE_SERIE_OVERLAY);
+  memory_tree_register (tree);
 
   return tree;
 }
@@ -235,6 +596,8 @@ memory_tree_destroy (Tree* tree)
 
   while (pll_Patients != NULL)
   {
+    memory_tree_unregister (pll_Patients);
+
     Tree *pll_Studies = tree_child (pll_Patients);
     assert (pll_Studies->type == TREE_TYPE_STUDY);
 
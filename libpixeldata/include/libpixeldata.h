@@ -99,6 +99,7 @@ typedef struct
 
   unsigned int display_lookup_table_len; /*< The allocated size of the
                                              display LUT. */
+  unsigned int rgb_len; /*< The allocated number of bytes for 'rgb'. */
 
   unsigned char alpha; /*< The alpha channel value. */
 
@@ -337,6 +338,19 @@ short int pixeldata_lookup_table_load_from_file (const char *filename);
 short int pixeldata_lookup_table_load_from_directory (const char *filename);
 
 
+/**
+ * This function tells whether a pixel lies within a selection.
+ *
+ * @param selection                 The selection mask, or NULL to select
+ *                                  everything.
+ * @param ppv_SelectionDataCounter  The pixel in the slice data of the
+ *                                  selection.
+ *
+ * @return 1 when the pixel is selected, 0 otherwise.
+ */
+short int pixeldata_is_selected (PixelData *selection, void **ppv_SelectionDataCounter);
+
+
 /**
  * For the sake of abstracting the complexities of changing the value of a
  * voxel this function should be used to perform this task.
@@ -0,0 +1,47 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "libpixeldata.h"
+
+#include <stddef.h>
+
+/*
+ * This function is kept in a file of its own, because the plugins build it
+ * into themselves: a plugin cannot call into the program that loaded it.
+ */
+
+short int
+pixeldata_is_selected (PixelData *selection, void **ppv_SelectionDataCounter)
+{
+  if (selection == NULL) return 1;
+
+  // A selection may be of another voxel type than the mask it restricts, so
+  // it is read in its own type.
+  switch (selection->serie->data_type)
+  {
+    case MEMORY_TYPE_UINT8   : return *(unsigned char *)*ppv_SelectionDataCounter != 0;
+    case MEMORY_TYPE_INT16   : return *(short int *)*ppv_SelectionDataCounter != 0;
+    case MEMORY_TYPE_INT32   : return *(int *)*ppv_SelectionDataCounter != 0;
+    case MEMORY_TYPE_UINT16  : return *(short unsigned int *)*ppv_SelectionDataCounter != 0;
+    case MEMORY_TYPE_UINT32  : return *(unsigned int *)*ppv_SelectionDataCounter != 0;
+    case MEMORY_TYPE_FLOAT32 : return *(float *)*ppv_SelectionDataCounter != 0;
+    case MEMORY_TYPE_FLOAT64 : return *(double *)*ppv_SelectionDataCounter != 0;
+    default                  : return 0;
+  }
+}
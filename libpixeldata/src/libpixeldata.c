@@ -21,6 +21,7 @@
 #include "libmemory-slice.h"
 #include "libmemory-serie.h"
 #include "libcommon-debug.h"
+#include "libcommon-accounting.h"
 
 
 #include <stdio.h>
@@ -41,6 +42,17 @@
 
 List *pl_lookup_tables=NULL;
 
+/* --------------------------------------------------------------------------
+ * LOCAL FUNCTIONS
+ * -------------------------------------------------------------------------- */
+
+static Accounting *
+pixeldata_accounting (PixelData *pixeldata)
+{
+  // The buffers are counted for the serie they show, when there is one.
+  return (pixeldata->serie != NULL) ? &pixeldata->serie->ts_Accounting : NULL;
+}
+
 /* --------------------------------------------------------------------------
  * PUBLIC FUNCTIONS
  * -------------------------------------------------------------------------- */
@@ -86,6 +98,9 @@ pixeldata_new_with_lookup_table (PixelDataLookupTable *lut,
       pixeldata->display_lookup_table = calloc (1, lut->table_len);
       assert (pixeldata->display_lookup_table != NULL);
 
+      pixeldata->display_lookup_table_len = lut->table_len;
+      common_accounting_add (pixeldata_accounting (pixeldata), ACCOUNTING_LUT, lut->table_len);
+
       // Make a copy of the color lookup table.
       memcpy (pixeldata->display_lookup_table,
               pixeldata->color_lookup_table,
@@ -118,10 +133,13 @@ pixeldata_destroy (void *data)
   // Clean up the Display LUT.
   free (pixeldata->display_lookup_table);
   pixeldata->display_lookup_table = NULL;
+  common_accounting_remove (pixeldata_accounting (pixeldata), ACCOUNTING_LUT,
+                            pixeldata->display_lookup_table_len);
 
   // Clean up the RGB buffer.
   free (pixeldata->rgb);
   pixeldata->rgb = NULL;
+  common_accounting_remove (pixeldata_accounting (pixeldata), ACCOUNTING_PIXBUF, pixeldata->rgb_len);
 
   // Clean up the slice.
   memory_slice_destroy (pixeldata->slice);
@@ -248,6 +266,10 @@ pixeldata_apply_lookup_table (PixelData *pixeldata)
 
   assert (pixeldata->display_lookup_table != NULL);
 
+  common_accounting_resize (pixeldata_accounting (pixeldata), ACCOUNTING_LUT,
+                            pixeldata->display_lookup_table_len, sizeof (unsigned int) * (range + 1));
+  pixeldata->display_lookup_table_len = sizeof (unsigned int) * (range + 1);
+
   float f_Slope = 255.0 / (float)(pixeldata->ts_WWWL.i32_windowWidth);
   float f_Offset = 128.0 - ((float)(pixeldata->ts_WWWL.i32_windowLevel)*f_Slope);
 
@@ -370,6 +392,10 @@ pixeldata_create_rgb_pixbuf (PixelData *pixeldata)
 
   pixeldata->rgb = realloc (pixeldata->rgb, sizeof (unsigned int) * slice->matrix.i16_x * slice->matrix.i16_y);
 
+  common_accounting_resize (pixeldata_accounting (pixeldata), ACCOUNTING_PIXBUF, pixeldata->rgb_len,
+                            sizeof (unsigned int) * slice->matrix.i16_x * slice->matrix.i16_y);
+  pixeldata->rgb_len = sizeof (unsigned int) * slice->matrix.i16_x * slice->matrix.i16_y;
+
   unsigned int *rgb = pixeldata->rgb;
   unsigned int *display_lookup_table = pixeldata->display_lookup_table;
 
@@ -571,6 +597,7 @@ pixeldata_lookup_table_load_from_file (const char *filename)
 
   list_item->table = lookup_table;
   list_item->table_len = (lookup_table_len + 1) * sizeof (unsigned int);
+  common_accounting_add (NULL, ACCOUNTING_LUT, list_item->table_len);
 
   pl_lookup_tables = list_append (pl_lookup_tables, list_item);
 
@@ -647,6 +674,7 @@ pixeldata_lookup_table_destroy_item (void *data)
 
   free (item->table);
   item->table = NULL;
+  common_accounting_remove (NULL, ACCOUNTING_LUT, item->table_len);
 
   free (item);
 }
@@ -695,22 +723,40 @@ pixeldata_set_voxel (PixelData *mask, PixelData *selection,
   void **ppv_ImageDataCounter = PIXELDATA_ACTIVE_SLICE_DATA (mask);
   ppv_ImageDataCounter += (unsigned int)(point.y * mask_slice->matrix.i16_x + point.x);
 
+  short int b_Selected = pixeldata_is_selected (selection, ppv_SelectionDataCounter);
+
   switch (mask->serie->data_type)
   {
+  case MEMORY_TYPE_UINT8:
+    {
+      if (action == ACTION_ERASE)
+      {
+        if (*(unsigned char *)*ppv_ImageDataCounter == (unsigned char)value && b_Selected)
+        {
+          *(unsigned char *)*ppv_ImageDataCounter = 0;
+        }
+      }
+      else
+      {
+        if (*(unsigned char *)*ppv_ImageDataCounter == 0 && b_Selected)
+        {
+          *(unsigned char *)*ppv_ImageDataCounter = (unsigned char)value;
+        }
+      }
+    }
+    break;
   case MEMORY_TYPE_INT16:
     {
       if (action == ACTION_ERASE)
       {
-        if (*(short int *)*ppv_ImageDataCounter == (short int)value
-            && (selection == NULL || (*((short int *)*ppv_SelectionDataCounter))))
+        if (*(short int *)*ppv_ImageDataCounter == (short int)value && b_Selected)
         {
           *(short int *)*ppv_ImageDataCounter = 0;
         }
       }
       else
       {
-        if (*(short int *)*ppv_ImageDataCounter == 0
-            && (selection == NULL || (*((short int *)*ppv_SelectionDataCounter))))
+        if (*(short int *)*ppv_ImageDataCounter == 0 && b_Selected)
         {
           *(short int *)*ppv_ImageDataCounter = (short int)value;
         }
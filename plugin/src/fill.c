@@ -4,6 +4,39 @@
 #include <stdlib.h>
 #include <string.h>
 
+// Masks may be of any voxel type, so the value of a pixel is read in the
+// type of its mask and only tested against zero.
+static bool
+fill_get_voxel_is_set (PixelData *mask, Coordinate point, bool *b_IsSet)
+{
+  union
+  {
+    unsigned char u8;
+    short int i16;
+    int i32;
+    short unsigned int u16;
+    unsigned int u32;
+    float f32;
+    double f64;
+  } u_Value;
+
+  if (!plugin_get_voxel_at_point (mask, point, &u_Value)) return false;
+
+  switch (mask->serie->data_type)
+  {
+    case MEMORY_TYPE_UINT8   : *b_IsSet = (u_Value.u8 != 0); break;
+    case MEMORY_TYPE_INT16   : *b_IsSet = (u_Value.i16 != 0); break;
+    case MEMORY_TYPE_INT32   : *b_IsSet = (u_Value.i32 != 0); break;
+    case MEMORY_TYPE_UINT16  : *b_IsSet = (u_Value.u16 != 0); break;
+    case MEMORY_TYPE_UINT32  : *b_IsSet = (u_Value.u32 != 0); break;
+    case MEMORY_TYPE_FLOAT32 : *b_IsSet = (u_Value.f32 != 0); break;
+    case MEMORY_TYPE_FLOAT64 : *b_IsSet = (u_Value.f64 != 0); break;
+    default                  : return false;
+  }
+
+  return true;
+}
+
 void
 plugin_get_metadata (PluginMetaData **metadata)
 {
@@ -48,7 +81,7 @@ plugin_apply (PluginMetaData *metadata, PixelData *original,
   int i32_CntArray;
   int i32_CntKernel;
 
-  short int i16_Value;
+  bool b_IsSet;
 
   int i32_lengthArrayToRead = 1;
 
@@ -89,14 +122,22 @@ plugin_apply (PluginMetaData *metadata, PixelData *original,
       if ((ts_PixelPoint.x >= 0) && (ts_PixelPoint.x < PIXELDATA_ACTIVE_SLICE (mask)->matrix.i16_x) &&
           (ts_PixelPoint.y >= 0) && (ts_PixelPoint.y < PIXELDATA_ACTIVE_SLICE (mask)->matrix.i16_y))
       {
-        if (plugin_get_voxel_at_point (mask, ts_PixelPoint, &i16_Value))
+        if (fill_get_voxel_is_set (mask, ts_PixelPoint, &b_IsSet))
         {
-	  if ((properties->action == ACTION_SET && i16_Value == 0) ||
-	      (properties->action == ACTION_ERASE && i16_Value) != 0)
+	  if ((properties->action == ACTION_SET && !b_IsSet) ||
+	      (properties->action == ACTION_ERASE && b_IsSet))
 	  {
 	    plugin_set_voxel_at_point (mask, selection, ts_PixelPoint , properties->value, properties->action);
-	    p_ArrayToReadFrom[i32_lengthArrayToRead] = ts_PixelPoint;
-	    i32_lengthArrayToRead++;
+
+	    // Only continue from pixels that actually changed. Pixels outside
+	    // the selection, or with another label than the one erased, would
+	    // otherwise be visited again and again.
+	    bool b_WasSet = b_IsSet;
+	    if (fill_get_voxel_is_set (mask, ts_PixelPoint, &b_IsSet) && b_IsSet != b_WasSet)
+	    {
+	      p_ArrayToReadFrom[i32_lengthArrayToRead] = ts_PixelPoint;
+	      i32_lengthArrayToRead++;
+	    }
 	  }
         }
       }
@@ -26,57 +26,95 @@ plugin_set_voxel_at_point (PixelData *mask,
   void **ppv_ImageDataCounter = PIXELDATA_ACTIVE_SLICE_DATA (mask);
   ppv_ImageDataCounter += (unsigned int)(point.y * mask_slice->matrix.i16_x + point.x);
 
+  bool b_Selected = pixeldata_is_selected (selection, ppv_SelectionDataCounter);
+
+  bool b_Changed = false;
+
   switch (mask->serie->data_type)
   {
+  case MEMORY_TYPE_UINT8:
+    {
+      if (action == ACTION_ERASE)
+      {
+        if (*(unsigned char *)*ppv_ImageDataCounter == (unsigned char)value && b_Selected)
+        {
+          *(unsigned char *)*ppv_ImageDataCounter = 0;
+          b_Changed = true;
+        }
+      }
+      else
+      {
+        if (*(unsigned char *)*ppv_ImageDataCounter == 0 && b_Selected)
+        {
+          *(unsigned char *)*ppv_ImageDataCounter = (unsigned char)value;
+          b_Changed = true;
+        }
+      }
+    }
+    break;
   case MEMORY_TYPE_INT16:
     {
       if (action == ACTION_ERASE)
       {
-        if (*(short int *)*ppv_ImageDataCounter == (short int)value
-            && (selection == NULL || (*((short int *)*ppv_SelectionDataCounter))))
+        if (*(short int *)*ppv_ImageDataCounter == (short int)value && b_Selected)
+        {
           *(short int *)*ppv_ImageDataCounter = 0;
+          b_Changed = true;
+        }
       }
       else
       {
-        if (*(short int *)*ppv_ImageDataCounter == 0
-            && (selection == NULL || (*((short int *)*ppv_SelectionDataCounter))))
+        if (*(short int *)*ppv_ImageDataCounter == 0 && b_Selected)
+        {
           *(short int *)*ppv_ImageDataCounter = (short int)value;
+          b_Changed = true;
+        }
       }
     }
     break;
   case MEMORY_TYPE_INT32:
     {
-      if (*(int *)*ppv_ImageDataCounter == 0
-          && (selection == NULL || (*((int *)*ppv_SelectionDataCounter))))
+      if (*(int *)*ppv_ImageDataCounter == 0 && b_Selected)
+      {
         *(int *)*ppv_ImageDataCounter = (int)value;
+        b_Changed = true;
+      }
     }
     break;
   case MEMORY_TYPE_UINT16 :
     {
-      if (*(short unsigned int *)*ppv_ImageDataCounter == 0
-          && (selection == NULL || (*((short unsigned int *)*ppv_SelectionDataCounter))))
+      if (*(short unsigned int *)*ppv_ImageDataCounter == 0 && b_Selected)
+      {
         *(short unsigned int *)*ppv_ImageDataCounter = (short unsigned int)value;
+        b_Changed = true;
+      }
     }
     break;
   case MEMORY_TYPE_UINT32:
     {
-      if (*(unsigned int *)*ppv_ImageDataCounter == 0
-          && (selection == NULL || (*((unsigned int *)*ppv_SelectionDataCounter))))
+      if (*(unsigned int *)*ppv_ImageDataCounter == 0 && b_Selected)
+      {
         *(unsigned int *)*ppv_ImageDataCounter = value;
+        b_Changed = true;
+      }
     }
     break;
   case MEMORY_TYPE_FLOAT32:
     {
-      if (*(float *)*ppv_ImageDataCounter == 0
-          && (selection == NULL || (*((float *)*ppv_SelectionDataCounter))))
+      if (*(float *)*ppv_ImageDataCounter == 0 && b_Selected)
+      {
         *(float *)*ppv_ImageDataCounter = value;
+        b_Changed = true;
+      }
     }
     break;
   case MEMORY_TYPE_FLOAT64:
     {
-      if (*(double *)*ppv_ImageDataCounter == 0
-          && (selection == NULL || (*((double *)*ppv_SelectionDataCounter))))
+      if (*(double *)*ppv_ImageDataCounter == 0 && b_Selected)
+      {
         *(double *)*ppv_ImageDataCounter = value;
+        b_Changed = true;
+      }
     }
     break;
   default:
@@ -84,6 +122,14 @@ plugin_set_voxel_at_point (PixelData *mask,
     break;
   }
 
+  // Let the serie know which part of its data changed, so an incremental
+  // save only has to write that part. The flags are set directly, because
+  // a plugin cannot call into the program that loaded it. A sparse serie
+  // keeps track of its changed bricks itself.
+  Serie *ps_Serie = mask->serie;
+  if (b_Changed && ps_Serie->pu8_DirtySlabs != NULL && ps_Serie->data != NULL)
+    ps_Serie->pu8_DirtySlabs[((char *)*ppv_ImageDataCounter - (char *)ps_Serie->data) / SERIE_DIRTY_SLAB_SIZE] = 1;
+
   return 1;
 }
 
@@ -0,0 +1,488 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "batch.h"
+#include "libmemory-serie.h"
+#include "libmemory-tree.h"
+#include "libmemory-brick.h"
+#include "libpixeldata.h"
+#include "libhistogram.h"
+#include "libcommon-debug.h"
+#include "libcommon-iohint.h"
+#include "libcommon-thread.h"
+#include "libcommon-unused.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+
+#ifdef WIN32
+#define PATH_SEPARATOR        '\\'
+#define LOOKUP_TABLES_PATH    "luts\\"
+#else
+#define PATH_SEPARATOR        '/'
+#define LOOKUP_TABLES_PATH    "luts/"
+#endif
+
+// Label statistics are only gathered for volumes with at most this many
+// distinct values, which covers every mask.
+#define BATCH_MAXIMUM_LABELS  65536
+
+
+/******************************************************************************
+ * OBJECT INTERNAL TYPES
+ ******************************************************************************/
+
+
+typedef struct
+{
+  BatchOptions *ps_Options;
+  char **ppc_Inputs;
+  int i32_Inputs;
+
+  PixelDataLookupTable *ps_LookupTable;
+
+  int i32_NextInput;
+  int i32_Failures;
+
+  // The workers each input may use for itself.
+  unsigned int ui32_WorkersPerInput;
+
+  // Keeps the output of one input together on stdout.
+  pthread_mutex_t t_OutputLock;
+} BatchRun;
+
+
+/******************************************************************************
+ * HELPER FUNCTIONS
+ ******************************************************************************/
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_OUTPUT_NAME                                                          |
+ | Returns the name of an input without its directory and known extensions,  |
+ | to base the names of output files on.                                      |
+ '----------------------------------------------------------------------------*/
+static char*
+batch_output_name (const char *pc_Input)
+{
+  static const char *ppc_Extensions[] = { ".nii.gz", ".gz", ".nii", ".hdr", ".img",
+                                          BRICK_FILE_EXTENSION, NULL };
+
+  char *pc_Name = calloc (1, strlen (pc_Input) + 1);
+  assert (pc_Name != NULL);
+  strcpy (pc_Name, pc_Input);
+
+  // A DICOM directory may be given with a trailing separator.
+  size_t i32_Length = strlen (pc_Name);
+  while (i32_Length > 1 && pc_Name[i32_Length - 1] == PATH_SEPARATOR)
+    pc_Name[--i32_Length] = '\0';
+
+  char *pc_Base = strrchr (pc_Name, PATH_SEPARATOR);
+  pc_Base = (pc_Base != NULL) ? pc_Base + 1 : pc_Name;
+  memmove (pc_Name, pc_Base, strlen (pc_Base) + 1);
+
+  int i32_Cnt;
+  for (i32_Cnt = 0; ppc_Extensions[i32_Cnt] != NULL; i32_Cnt++)
+  {
+    size_t i32_NameLength = strlen (pc_Name);
+    size_t i32_ExtensionLength = strlen (ppc_Extensions[i32_Cnt]);
+
+    if (i32_NameLength > i32_ExtensionLength
+        && !strcasecmp (pc_Name + i32_NameLength - i32_ExtensionLength, ppc_Extensions[i32_Cnt]))
+    {
+      pc_Name[i32_NameLength - i32_ExtensionLength] = '\0';
+      break;
+    }
+  }
+
+  return pc_Name;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_OUTPUT_PATH                                                          |
+ | Returns '<output directory>/<name>.<extension>'.                           |
+ '----------------------------------------------------------------------------*/
+static char*
+batch_output_path (BatchOptions *ps_Options, const char *pc_Name, const char *pc_Extension)
+{
+  const char *pc_Directory = (ps_Options->pc_OutputDirectory != NULL) ? ps_Options->pc_OutputDirectory : ".";
+
+  char *pc_Path = calloc (1, strlen (pc_Directory) + strlen (pc_Name) + strlen (pc_Extension) + 3);
+  assert (pc_Path != NULL);
+
+  sprintf (pc_Path, "%s%c%s.%s", pc_Directory, PATH_SEPARATOR, pc_Name, pc_Extension);
+  return pc_Path;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_VOXEL_VALUE                                                          |
+ | Reads a voxel as an integer, from memory or from a brick file.             |
+ '----------------------------------------------------------------------------*/
+static short int
+batch_voxel_value (Serie *ps_Serie, short int x, short int y, short int z, int *pi32_Value)
+{
+  unsigned char pu8_Value[32];
+  void *pv_Value = pu8_Value;
+
+  if (ps_Serie->ps_BrickCache != NULL)
+  {
+    if (!memory_brick_read_voxel (ps_Serie->ps_BrickCache, x, y, z, 0, pv_Value))
+      return 0;
+  }
+  else
+  {
+    memory_serie_ensure_slice (ps_Serie, z, 0);
+    pv_Value = (char *)ps_Serie->data + memory_serie_get_voxel_offset (ps_Serie, x, y, z, 0);
+  }
+
+  switch (ps_Serie->data_type)
+  {
+    case MEMORY_TYPE_INT8    : *pi32_Value = *(signed char *)pv_Value; break;
+    case MEMORY_TYPE_INT16   : *pi32_Value = *(short int *)pv_Value; break;
+    case MEMORY_TYPE_INT32   : *pi32_Value = *(int *)pv_Value; break;
+    case MEMORY_TYPE_INT64   : *pi32_Value = *(long long *)pv_Value; break;
+    case MEMORY_TYPE_UINT8   : *pi32_Value = *(unsigned char *)pv_Value; break;
+    case MEMORY_TYPE_UINT16  : *pi32_Value = *(unsigned short int *)pv_Value; break;
+    case MEMORY_TYPE_UINT32  : *pi32_Value = *(unsigned int *)pv_Value; break;
+    case MEMORY_TYPE_UINT64  : *pi32_Value = *(unsigned long long *)pv_Value; break;
+    case MEMORY_TYPE_FLOAT32 : *pi32_Value = roundf (*(float *)pv_Value); break;
+    case MEMORY_TYPE_FLOAT64 : *pi32_Value = round (*(double *)pv_Value); break;
+    default : return 0;
+  }
+
+  return 1;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_STATISTICS                                                           |
+ | Prints the number of voxels and the volume of each non-zero label in the   |
+ | first timepoint of a Serie.                                                |
+ '----------------------------------------------------------------------------*/
+static short int
+batch_statistics (BatchRun *ps_Run, const char *pc_Input, Serie *ps_Serie)
+{
+  debug_functions ();
+
+  long long i64_Range = (long long)ps_Serie->i32_MaximumValue - ps_Serie->i32_MinimumValue + 1;
+  if (i64_Range < 1 || i64_Range > BATCH_MAXIMUM_LABELS)
+  {
+    fprintf (stderr, "%s: too many distinct values for label statistics.\n", pc_Input);
+    return 0;
+  }
+
+  // A bin per label, counted on all threads.
+  Histogram *ps_Histogram = histogram_new ();
+  assert (ps_Histogram != NULL);
+
+  histogram_set_time_point (ps_Histogram, 0);
+  histogram_set_serie (ps_Histogram, ps_Serie);
+
+  double d_VoxelVolume = fabs (ps_Serie->pixel_dimension.x * ps_Serie->pixel_dimension.y *
+                               ps_Serie->pixel_dimension.z);
+
+  pthread_mutex_lock (&ps_Run->t_OutputLock);
+
+  long long i64_Cnt;
+  for (i64_Cnt = 0; i64_Cnt < (long long)ps_Histogram->data_len; i64_Cnt++)
+  {
+    long long i64_Label = i64_Cnt + ps_Histogram->first_value;
+    if (i64_Label == 0 || ps_Histogram->data[i64_Cnt] == 0) continue;
+
+    printf ("%s\t%lld\t%d\t%.3f\n", pc_Input, i64_Label, ps_Histogram->data[i64_Cnt],
+            ps_Histogram->data[i64_Cnt] * d_VoxelVolume);
+  }
+
+  fflush (stdout);
+  pthread_mutex_unlock (&ps_Run->t_OutputLock);
+
+  histogram_destroy (ps_Histogram), ps_Histogram = NULL;
+  return 1;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_RENDER                                                               |
+ | Writes the middle axial slice of a Serie through a lookup table to a      |
+ | binary PPM image. The window spans the full range of the Serie.            |
+ '----------------------------------------------------------------------------*/
+static short int
+batch_render (BatchRun *ps_Run, Serie *ps_Serie, const char *pc_Path)
+{
+  debug_functions ();
+
+  PixelDataLookupTable *ps_Table = ps_Run->ps_LookupTable;
+  unsigned int ui32_Colors = ps_Table->table_len / sizeof (unsigned int);
+
+  short int i16_Width = ps_Serie->matrix.i16_x;
+  short int i16_Height = ps_Serie->matrix.i16_y;
+  short int i16_Slice = ps_Serie->matrix.i16_z / 2;
+
+  long long i64_Range = (long long)ps_Serie->i32_MaximumValue - ps_Serie->i32_MinimumValue;
+  if (i64_Range < 1) i64_Range = 1;
+
+  unsigned char *pu8_Image = calloc ((size_t)i16_Width * i16_Height, 3);
+  assert (pu8_Image != NULL);
+
+  // Rows are written from the top, which is the highest y in the volume,
+  // to match the orientation of the viewer.
+  unsigned char *pu8_Pixel = pu8_Image;
+  short int x, y;
+  int i32_Value;
+  for (y = i16_Height - 1; y >= 0; y--)
+    for (x = 0; x < i16_Width; x++, pu8_Pixel += 3)
+    {
+      if (!batch_voxel_value (ps_Serie, x, y, i16_Slice, &i32_Value)) continue;
+
+      long long i64_Index = ((long long)i32_Value - ps_Serie->i32_MinimumValue) * (ui32_Colors - 1) / i64_Range;
+      if (i64_Index < 0) i64_Index = 0;
+      if (i64_Index >= ui32_Colors) i64_Index = ui32_Colors - 1;
+
+      unsigned int ui32_Color = ps_Table->table[i64_Index];
+      pu8_Pixel[0] = ui32_Color & 0xff;
+      pu8_Pixel[1] = (ui32_Color >> 8) & 0xff;
+      pu8_Pixel[2] = (ui32_Color >> 16) & 0xff;
+    }
+
+  short int b_Success = 0;
+  FILE *ps_File = fopen (pc_Path, "wb");
+  if (ps_File != NULL)
+  {
+    fprintf (ps_File, "P6\n%d %d\n255\n", i16_Width, i16_Height);
+    b_Success = (fwrite (pu8_Image, 3, (size_t)i16_Width * i16_Height, ps_File) == (size_t)i16_Width * i16_Height);
+    b_Success = (fclose (ps_File) == 0) && b_Success;
+  }
+
+  free (pu8_Image), pu8_Image = NULL;
+  return b_Success;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_PROCESS                                                              |
+ | Loads one input and does everything that was asked for with it.           |
+ '----------------------------------------------------------------------------*/
+static short int
+batch_process (BatchRun *ps_Run, const char *pc_Input)
+{
+  debug_functions ();
+
+  BatchOptions *ps_Options = ps_Run->ps_Options;
+  short int b_Success = 1;
+
+  // When converting to a brick file is all there is to do, the input is
+  // streamed into bricks, so it does not have to fit in memory.
+  if (ps_Options->pc_ConvertExtension != NULL && !ps_Options->b_Statistics && ps_Run->ps_LookupTable == NULL
+      && !strcasecmp (ps_Options->pc_ConvertExtension, BRICK_FILE_EXTENSION + 1))
+  {
+    char *pc_Name = batch_output_name (pc_Input);
+    char *pc_Output = batch_output_path (ps_Options, pc_Name, ps_Options->pc_ConvertExtension);
+
+    if (memory_io_save_job_finish (memory_io_convert_file_async (pc_Input, pc_Output)) != 0)
+    {
+      fprintf (stderr, "%s: cannot be written to '%s'.\n", pc_Input, pc_Output);
+      b_Success = 0;
+    }
+
+    free (pc_Output), pc_Output = NULL;
+    free (pc_Name), pc_Name = NULL;
+    return b_Success;
+  }
+
+  // Loading may modify the path, so hand it a copy.
+  char *pc_Path = calloc (1, strlen (pc_Input) + 1);
+  assert (pc_Path != NULL);
+  strcpy (pc_Path, pc_Input);
+
+  Tree *pt_Study = NULL;
+  Tree *pt_Serie = pt_memory_io_load_file (&pt_Study, pc_Path);
+  free (pc_Path), pc_Path = NULL;
+
+  if (pt_Serie == NULL || pt_Serie->data == NULL)
+  {
+    fprintf (stderr, "%s: cannot be loaded.\n", pc_Input);
+    memory_tree_destroy (pt_Serie);
+    return 0;
+  }
+
+  Serie *ps_Serie = pt_Serie->data;
+  char *pc_Name = batch_output_name (pc_Input);
+
+  if (ps_Options->pc_ConvertExtension != NULL)
+  {
+    char *pc_Output = batch_output_path (ps_Options, pc_Name, ps_Options->pc_ConvertExtension);
+    if (memory_io_save_file (ps_Serie, pc_Output) != 0)
+    {
+      fprintf (stderr, "%s: cannot be written to '%s'.\n", pc_Input, pc_Output);
+      b_Success = 0;
+    }
+    free (pc_Output), pc_Output = NULL;
+  }
+
+  if (ps_Options->b_Statistics)
+    b_Success = batch_statistics (ps_Run, pc_Input, ps_Serie) && b_Success;
+
+  if (ps_Run->ps_LookupTable != NULL)
+  {
+    char *pc_Output = batch_output_path (ps_Options, pc_Name, "ppm");
+    if (!batch_render (ps_Run, ps_Serie, pc_Output))
+    {
+      fprintf (stderr, "%s: cannot be rendered to '%s'.\n", pc_Input, pc_Output);
+      b_Success = 0;
+    }
+    free (pc_Output), pc_Output = NULL;
+  }
+
+  free (pc_Name), pc_Name = NULL;
+  memory_tree_destroy (pt_Serie);
+
+  return b_Success;
+}
+
+
+/*----------------------------------------------------------------------------.
+ | BATCH_WORKER                                                               |
+ | Takes inputs from the shared queue until there are none left. Inputs      |
+ | differ a lot in size, so they are handed out one at a time instead of in  |
+ | fixed chunks.                                                              |
+ '----------------------------------------------------------------------------*/
+static void
+batch_worker (UNUSED unsigned long long start, UNUSED unsigned long long end,
+              UNUSED unsigned int worker, void *user_data)
+{
+  BatchRun *ps_Run = (BatchRun *)user_data;
+  int i32_Input;
+
+  common_thread_set_thread_workers (ps_Run->ui32_WorkersPerInput);
+
+  while ((i32_Input = __atomic_fetch_add (&ps_Run->i32_NextInput, 1, __ATOMIC_RELAXED)) < ps_Run->i32_Inputs)
+  {
+    if (!batch_process (ps_Run, ps_Run->ppc_Inputs[i32_Input]))
+      __atomic_add_fetch (&ps_Run->i32_Failures, 1, __ATOMIC_RELAXED);
+  }
+}
+
+
+/******************************************************************************
+ * MAIN BATCH RUN
+ ******************************************************************************/
+
+
+short int
+batch_format_is_supported (const char *pc_Format)
+{
+  // These are the extensions memory_io_save_file() has a writer for.
+  static const char *ppc_Formats[] = { "nii", "nii.gz", "hdr", BRICK_FILE_EXTENSION + 1, NULL };
+
+  int i32_Cnt;
+  for (i32_Cnt = 0; pc_Format != NULL && ppc_Formats[i32_Cnt] != NULL; i32_Cnt++)
+    if (!strcasecmp (pc_Format, ppc_Formats[i32_Cnt]))
+      return 1;
+
+  return 0;
+}
+
+
+int
+batch_run (BatchOptions *ps_Options, char **ppc_Inputs, int i32_Inputs)
+{
+  debug_functions ();
+
+  if (ps_Options == NULL || ppc_Inputs == NULL || i32_Inputs < 1)
+  {
+    fprintf (stderr, "There are no inputs to process.\n");
+    return 1;
+  }
+
+  if (ps_Options->pc_ConvertExtension == NULL && ps_Options->pc_LookupTable == NULL
+      && !ps_Options->b_Statistics)
+  {
+    fprintf (stderr, "Nothing to do: use --format, --output, --statistics or --render.\n");
+    return 1;
+  }
+
+  if (ps_Options->pc_ConvertExtension != NULL && !batch_format_is_supported (ps_Options->pc_ConvertExtension))
+  {
+    fprintf (stderr, "Cannot convert to '%s': use nii, nii.gz, hdr or clmvb.\n", ps_Options->pc_ConvertExtension);
+    return 1;
+  }
+
+  BatchRun ts_Run;
+  memset (&ts_Run, 0, sizeof (BatchRun));
+  ts_Run.ps_Options = ps_Options;
+  ts_Run.ppc_Inputs = ppc_Inputs;
+  ts_Run.i32_Inputs = i32_Inputs;
+
+  if (ps_Options->pc_LookupTable != NULL)
+  {
+    pixeldata_lookup_table_load_from_directory (LOOKUP_TABLES_PATH);
+
+    // Accept the name of a lookup table with or without its extension.
+    ts_Run.ps_LookupTable = pixeldata_lookup_table_get_by_name (ps_Options->pc_LookupTable);
+    if (ts_Run.ps_LookupTable == NULL)
+    {
+      char *pc_Name = calloc (1, strlen (ps_Options->pc_LookupTable) + 5);
+      assert (pc_Name != NULL);
+      sprintf (pc_Name, "%s.lut", ps_Options->pc_LookupTable);
+      ts_Run.ps_LookupTable = pixeldata_lookup_table_get_by_name (pc_Name);
+      free (pc_Name), pc_Name = NULL;
+    }
+
+    if (ts_Run.ps_LookupTable == NULL || ts_Run.ps_LookupTable->table_len < sizeof (unsigned int))
+    {
+      fprintf (stderr, "The lookup table '%s' does not exist.\n", ps_Options->pc_LookupTable);
+      return 1;
+    }
+  }
+
+  if (ps_Options->b_Statistics)
+    puts ("input\tlabel\tvoxels\tvolume_mm3");
+
+  pthread_mutex_init (&ts_Run.t_OutputLock, NULL);
+
+  // The worker count bounds the number of inputs in flight, and the
+  // workers are shared between them for loading and saving, so that no
+  // more threads than that run at once.
+  common_thread_set_number_of_workers (ps_Options->ui32_Workers);
+
+  unsigned int ui32_Workers = common_thread_number_of_workers ();
+  unsigned int ui32_InFlight = ((unsigned int)i32_Inputs < ui32_Workers) ? (unsigned int)i32_Inputs : ui32_Workers;
+  ts_Run.ui32_WorkersPerInput = (ui32_Workers / ui32_InFlight > 0) ? ui32_Workers / ui32_InFlight : 1;
+
+  common_thread_parallel_for (i32_Inputs, 1, ui32_InFlight, batch_worker, &ts_Run);
+
+  pthread_mutex_destroy (&ts_Run.t_OutputLock);
+
+  IoHintCounters ts_Hints;
+  common_iohint_get_counters (&ts_Hints);
+  debug_extra ("I/O hints: %llu sequential, %llu read ahead (%llu bytes), %llu failed.",
+               ts_Hints.sequential, ts_Hints.willneed, ts_Hints.willneed_bytes, ts_Hints.failed);
+
+  if (ts_Run.i32_Failures > 0)
+    fprintf (stderr, "%d of %d inputs failed.\n", ts_Run.i32_Failures, i32_Inputs);
+
+  return (ts_Run.i32_Failures > 0);
+}
@@ -0,0 +1,109 @@
+/*
+ * Copyright (C) 2015 Marc Geerlings <m.geerlings@mumc.nl>
+ *
+ * This file is part of clmedview.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef BATCH_H
+#define BATCH_H
+
+#include "libmemory-io.h"
+
+
+/**
+ * @file   source/batch/batch.h
+ * @brief  A headless interface to process many studies at once.
+ * @author Roel Janssen
+ */
+
+/**
+ * @defgroup batch Batch
+ * @{
+ *
+ * This module processes a list of input files or DICOM directories without
+ * a display. Each input is loaded with the memory I/O module, after which
+ * it can be:
+ * - converted to another file format,
+ * - summarized with per-label statistics (for masks),
+ * - rendered through a lookup table to an image.
+ *
+ * The inputs are handed out to a bounded number of workers.
+ */
+
+
+/**
+ * This structure describes what to do for every input.
+ */
+typedef struct
+{
+  /**
+   * The directory to write converted volumes and renders to.
+   */
+  const char *pc_OutputDirectory;
+
+  /**
+   * The extension of converted volumes (one of "nii", "nii.gz", "hdr" or
+   * "clmvb"), or NULL to skip the conversion.
+   */
+  const char *pc_ConvertExtension;
+
+  /**
+   * The name of the lookup table to render with, or NULL to skip rendering.
+   */
+  const char *pc_LookupTable;
+
+  /**
+   * 1 to print per-label statistics, 0 otherwise.
+   */
+  short int b_Statistics;
+
+  /**
+   * The maximum number of inputs to process at the same time, or 0 to use
+   * the number of online processors. The inputs share these workers for
+   * loading and saving, so it bounds the number of threads as well.
+   */
+  unsigned int ui32_Workers;
+} BatchOptions;
+
+
+/**
+ * This function tells whether inputs can be converted to a format.
+ *
+ * @param pc_Format  The extension of the format, for example "nii.gz".
+ *
+ * @return 1 when the format can be written, 0 otherwise.
+ */
+short int batch_format_is_supported (const char *pc_Format);
+
+
+/**
+ * This function processes a list of inputs.
+ *
+ * @param ps_Options   What to do for each input.
+ * @param ppc_Inputs   The files or DICOM directories to process.
+ * @param i32_Inputs   The number of inputs.
+ *
+ * @return 0 when all inputs were processed, 1 otherwise (compatible with
+ *         UNIX shell standards).
+ */
+int batch_run (BatchOptions *ps_Options, char **ppc_Inputs, int i32_Inputs);
+
+
+/**
+ * @}
+ */
+
+#endif//BATCH_H
@@ -25,6 +25,7 @@
 
 #include "libcommon-list.h"
 #include "libcommon-history.h"
+#include "libcommon-accounting.h"
 #include "libcommon-tree.h"
 #include "libcommon-debug.h"
 #include "libcommon-unused.h"
@@ -34,6 +35,7 @@
 #include "libmemory-study.h"
 #include "libmemory-serie.h"
 #include "libmemory-slice.h"
+#include "libmemory-sparse.h"
 #include "libmemory-tree.h"
 
 #include <stdio.h>
@@ -160,6 +162,7 @@ GtkWidget* gui_mainwindow_sidebar_new ();
 void gui_mainwindow_sidebar_populate (Tree *pll_Patients);
 void gui_mainwindow_cell_edited (GtkCellRendererText *cell, char *pc_pathstring, char *pc_new_text, void *pv_data);
 void gui_mainwindow_sidebar_destroy ();
+gboolean gui_mainwindow_memory_readout_update (void *data);
 
 // Layout properties manager functions
 GtkWidget* gui_mainwindow_properties_manager_new ();
@@ -168,6 +171,9 @@ void gui_mainwindow_properties_manager_refresh (unsigned long long ull_serieID);
 // Other
 GtkWidget* gui_mainwindow_toolbar_new ();
 char* gui_mainwindow_file_dialog (GtkWidget* parent, GtkFileChooserAction action);
+GSList* gui_mainwindow_file_dialog_multiple (GtkWidget* parent);
+void gui_mainwindow_file_loaded (Tree *pt_serie);
+gboolean gui_mainwindow_file_load_progress (void *data);
 void gui_mainwindow_clear_viewers ();
 
 /******************************************************************************
@@ -181,6 +187,8 @@ GtkWidget *hbox_viewers;
 GtkWidget *hbox_mainmenu;
 GtkWidget *views_combo;
 GtkWidget *lbl_info;
+GtkWidget *lbl_history;
+GtkWidget *lbl_memory;
 GtkWidget *chk_follow;
 GtkWidget *chk_auto_close;
 GtkWidget *inp_brush_size;
@@ -203,8 +211,9 @@ GtkTreeStore *sidebar_TreeStore;
 
 // Application-local stuff
 List *pll_Viewers;
-List *pll_History;
 List *pl_plugins;
+List *pll_SaveJobs;
+LoadJob *ps_LoadJob;
 
 Viewer *ps_active_viewer;
 Plugin *ps_active_draw_tool;
@@ -540,6 +549,22 @@ gui_mainwindow_new (char *file)
 }
 
 
+static void
+gui_mainwindow_update_history_label ()
+{
+  debug_functions ();
+
+  if (lbl_history == NULL) return;
+
+  char pc_Usage[64];
+  snprintf (pc_Usage, sizeof (pc_Usage), "Undo: %.1f MB (%.1f MB on disk)",
+            common_history_get_memory_usage () / 1048576.0,
+            common_history_get_disk_usage () / 1048576.0);
+
+  gtk_label_set_text (GTK_LABEL (lbl_history), pc_Usage);
+}
+
+
 gboolean
 gui_mainwindow_save_undo_step (UNUSED GtkWidget *widget, UNUSED void *data)
 {
@@ -551,16 +576,54 @@ gui_mainwindow_save_undo_step (UNUSED GtkWidget *widget, UNUSED void *data)
   ps_mask = CONFIGURATION_ACTIVE_MASK(config);
   if (ps_mask == NULL) return FALSE;
 
+  // Of a sparse mask, only the bricks that changed since the last step are
+  // stored. A click that did not paint anything adds no step.
+  if (ps_mask->ps_Sparse != NULL)
+  {
+    SparseDelta *ps_Delta = memory_sparse_checkpoint (ps_mask->ps_Sparse);
 
-  ul64_SerieSize = ps_mask->matrix.i16_x * ps_mask->matrix.i16_y *
-    ps_mask->matrix.i16_z * memory_serie_get_memory_space (ps_mask);
+    if (ps_mask->pll_History == NULL)
+      ps_mask->pll_History = common_history_save_delta (NULL, NULL, 0);
 
-  pll_History = common_history_save_state (pll_History, ps_mask->data, ul64_SerieSize);
+    if (ps_Delta != NULL)
+      ps_mask->pll_History = common_history_save_delta (ps_mask->pll_History, ps_Delta,
+                                                        ps_Delta->ui64_Size);
+
+    gui_mainwindow_update_history_label ();
+    return FALSE;
+  }
+
+  ul64_SerieSize = memory_serie_get_data_size (ps_mask);
+
+  ps_mask->pll_History = common_history_save_state (ps_mask->pll_History, ps_mask->data, ul64_SerieSize);
+  gui_mainwindow_update_history_label ();
 
   return FALSE;
 }
 
 
+static void
+gui_mainwindow_load_undo_step (HistoryAction te_Action)
+{
+  debug_functions ();
+
+  Serie *ps_mask = CONFIGURATION_ACTIVE_MASK(config);
+  if (ps_mask == NULL) return;
+
+  if (ps_mask->ps_Sparse != NULL)
+  {
+    ps_mask->pll_History = common_history_apply_delta (ps_mask->pll_History, te_Action,
+                                                       memory_sparse_delta_apply, ps_mask->ps_Sparse);
+    gui_mainwindow_update_history_label ();
+    return;
+  }
+
+  ps_mask->pll_History = common_history_load_state (ps_mask->pll_History, te_Action, &ps_mask->data);
+  memory_serie_mark_dirty (ps_mask, 0, memory_serie_get_data_size (ps_mask));
+  gui_mainwindow_update_history_label ();
+}
+
+
 gboolean
 gui_mainwindow_resize (UNUSED GtkWidget *widget, UNUSED void *data)
 {
@@ -665,56 +728,139 @@ gui_mainwindow_views_activate (GtkWidget *widget, void *data)
 }
 
 
+void
+gui_mainwindow_file_loaded (Tree *pt_serie)
+{
+  debug_functions ();
+
+  Serie *ps_serie = pt_serie->data;
+  ps_serie->e_SerieType=SERIE_ORIGINAL;
+  memory_serie_set_layout (ps_serie, CONFIGURATION_SERIE_LAYOUT (config));
+
+  gui_mainwindow_load_serie(pt_serie);
+
+  gtk_widget_set_sensitive (btn_file_save, TRUE);
+  gtk_widget_set_sensitive (btn_reset_viewport, TRUE);
+  gtk_widget_set_sensitive (views_combo, TRUE);
+  gtk_widget_set_sensitive (hbox_mainmenu, TRUE);
+
+  gui_mainwindow_views_activate (views_combo, (void *)te_DisplayType);
+  gtk_tree_view_expand_all(GTK_TREE_VIEW(treeview));
+  /*
+  if (histogram == NULL)
+    histogram = histogram_new ();
+
+  histogram_set_serie (histogram, ps_serie);
+  gtk_widget_queue_draw (histogram_drawarea);
+  */
+}
+
+
+gboolean
+gui_mainwindow_file_load_progress (UNUSED void *data)
+{
+  Tree *pt_study=NULL;
+  Tree *pt_serie=NULL;
+  unsigned int ui32_Failed;
+
+  short int b_Finished;
+
+  if (ps_LoadJob == NULL) return FALSE;
+
+  // Check this before merging, so that no serie that finishes in between
+  // is left behind.
+  b_Finished = memory_io_load_job_is_finished (ps_LoadJob);
+
+  // Show every serie as soon as it is there. The job only touches the
+  // memory tree from here, on the thread that owns it.
+  pt_study=CONFIGURATION_ACTIVE_STUDY_TREE(config);
+  while ((pt_serie = memory_io_load_job_merge_next (ps_LoadJob, &pt_study)) != NULL)
+  {
+    gui_mainwindow_file_loaded (pt_serie);
+    pt_study=CONFIGURATION_ACTIVE_STUDY_TREE(config);
+  }
+
+  if (!b_Finished)
+  {
+    char pc_Message[32];
+    snprintf (pc_Message, 32, "Loading... %d%%", (int)(100 * memory_io_load_job_get_progress (ps_LoadJob)));
+    gtk_label_set_text (GTK_LABEL (lbl_info), pc_Message);
+    return TRUE;
+  }
+
+  ui32_Failed = memory_io_load_job_finish (ps_LoadJob);
+  ps_LoadJob = NULL;
+
+  gtk_label_set_text (GTK_LABEL (lbl_info), (ui32_Failed > 0)
+                      ? "Not all files could be loaded."
+                      : "The files have been loaded.");
+
+  return FALSE;
+}
+
+
 void
 gui_mainwindow_file_load (void* data)
 {
   debug_functions ();
   Tree *pt_study=NULL;
   Tree *pt_serie=NULL;
-  Serie *ps_serie = NULL;
 
   char* filename = NULL;
 
   // The filename can be passed by 'data'. Otherwise we need to show a
-  // dialog to the user to choose a file.
-  filename = (data != NULL)
-    ? (char *)data
-    : gui_mainwindow_file_dialog (window, GTK_FILE_CHOOSER_ACTION_OPEN);
-
-  if (filename != NULL)
+  // dialog to the user to choose one or more files.
+  if (data == NULL)
   {
-    char *window_title = calloc (1, 16 + strlen (filename) + 1);
-    sprintf (window_title, "clmedview: %s", filename);
+    // Don't start loading more files while the previous ones are loading.
+    if (ps_LoadJob != NULL) return;
+
+    GSList *pl_Files = gui_mainwindow_file_dialog_multiple (window);
+    GSList *pl_Iter = pl_Files;
+    unsigned int ui32_Files = g_slist_length (pl_Files);
+    unsigned int ui32_File = 0;
+
+    if (ui32_Files == 0) return;
+
+    char *window_title = calloc (1, 16 + strlen (pl_Files->data) + 1);
+    sprintf (window_title, "clmedview: %s", (char *)pl_Files->data);
     gtk_window_set_title (GTK_WINDOW (window), window_title);
 
     free (window_title);
 
-    pt_study=CONFIGURATION_ACTIVE_STUDY_TREE(config);
-    pt_serie=pt_memory_io_load_file(&pt_study,filename);
+    // The selected series are loaded concurrently. They are added to the
+    // sidebar one by one, as they finish.
+    char **ppc_Files = calloc (ui32_Files, sizeof (char *));
+    assert (ppc_Files != NULL);
 
-    if (pt_serie != NULL)
-    {
-      ps_serie = pt_serie->data;
-      ps_serie->e_SerieType=SERIE_ORIGINAL;
+    for (; pl_Iter != NULL; pl_Iter = pl_Iter->next)
+      ppc_Files[ui32_File++] = pl_Iter->data;
 
-      gui_mainwindow_load_serie(pt_serie);
+    ps_LoadJob = memory_io_load_files_async (ppc_Files, ui32_Files);
 
-      gtk_widget_set_sensitive (btn_file_save, TRUE);
-      gtk_widget_set_sensitive (btn_reset_viewport, TRUE);
-      gtk_widget_set_sensitive (views_combo, TRUE);
-      gtk_widget_set_sensitive (hbox_mainmenu, TRUE);
+    free (ppc_Files);
+    g_slist_free_full (pl_Files, g_free);
 
-      gui_mainwindow_views_activate (views_combo, (void *)te_DisplayType);
-      gtk_tree_view_expand_all(GTK_TREE_VIEW(treeview));
-      /*
-      if (histogram == NULL)
-	histogram = histogram_new ();
+    if (ps_LoadJob == NULL) return;
 
-      histogram_set_serie (histogram, ps_serie);
-      gtk_widget_queue_draw (histogram_drawarea);
-      */
-    }
+    gtk_label_set_text (GTK_LABEL (lbl_info), "Loading... 0%");
+    g_timeout_add (100, gui_mainwindow_file_load_progress, NULL);
+    return;
   }
+
+  filename = (char *)data;
+
+  char *window_title = calloc (1, 16 + strlen (filename) + 1);
+  sprintf (window_title, "clmedview: %s", filename);
+  gtk_window_set_title (GTK_WINDOW (window), window_title);
+
+  free (window_title);
+
+  pt_study=CONFIGURATION_ACTIVE_STUDY_TREE(config);
+  pt_serie=pt_memory_io_load_file(&pt_study,filename);
+
+  if (pt_serie != NULL)
+    gui_mainwindow_file_loaded (pt_serie);
 }
 
 
@@ -1122,6 +1268,85 @@ gui_mainwindow_file_dialog (GtkWidget* parent, GtkFileChooserAction action)
 }
 
 
+GSList*
+gui_mainwindow_file_dialog_multiple (GtkWidget* parent)
+{
+  debug_functions ();
+
+  GSList *pl_Filenames = NULL;
+  GtkWidget *dialog = NULL;
+
+  dialog = gtk_file_chooser_dialog_new ("Open files",
+             GTK_WINDOW (parent), GTK_FILE_CHOOSER_ACTION_OPEN,
+             "Cancel", GTK_RESPONSE_CANCEL,
+             "Open", GTK_RESPONSE_ACCEPT, NULL);
+
+  gtk_file_chooser_set_select_multiple (GTK_FILE_CHOOSER (dialog), TRUE);
+
+  if (gtk_dialog_run (GTK_DIALOG (dialog)) == GTK_RESPONSE_ACCEPT)
+    pl_Filenames = gtk_file_chooser_get_filenames (GTK_FILE_CHOOSER (dialog));
+
+  gtk_widget_destroy (dialog);
+  return pl_Filenames;
+}
+
+
+void
+gui_mainwindow_file_export_wait ()
+{
+  debug_functions ();
+
+  short int b_Failed = 0;
+  List *pll_iter = list_nth (pll_SaveJobs, 1);
+
+  while (pll_iter != NULL)
+  {
+    b_Failed |= memory_io_save_job_finish (pll_iter->data);
+    pll_iter = list_next (pll_iter);
+  }
+
+  if (pll_SaveJobs != NULL)
+    gtk_label_set_text (GTK_LABEL (lbl_info), (b_Failed)
+                        ? "Not all files could be saved."
+                        : "The files have been saved.");
+
+  list_free (pll_SaveJobs);
+  pll_SaveJobs = NULL;
+}
+
+
+gboolean
+gui_mainwindow_file_export_progress (UNUSED void *data)
+{
+  List *pll_iter = list_nth (pll_SaveJobs, 1);
+  float f_Progress = 0.0;
+  int i32_Jobs = 0;
+  short int b_Finished = 1;
+
+  while (pll_iter != NULL)
+  {
+    f_Progress += memory_io_save_job_get_progress (pll_iter->data);
+    b_Finished &= memory_io_save_job_is_finished (pll_iter->data);
+    i32_Jobs++;
+    pll_iter = list_next (pll_iter);
+  }
+
+  if (!b_Finished)
+  {
+    char pc_Message[32];
+    snprintf (pc_Message, 32, "Saving masks... %d%%", (int)(100 * f_Progress / i32_Jobs));
+    gtk_label_set_text (GTK_LABEL (lbl_info), pc_Message);
+    return TRUE;
+  }
+
+  // All jobs are done (or have been waited for already).
+  gui_mainwindow_file_export_wait ();
+  gtk_widget_set_sensitive (btn_file_save, TRUE);
+
+  return FALSE;
+}
+
+
 gboolean
 gui_mainwindow_file_export ()
 {
@@ -1129,6 +1354,10 @@ gui_mainwindow_file_export ()
 
   Tree *p_iter;
   Serie *ps_serie;
+  SaveJob *ps_Job;
+
+  // Don't start a new save while the previous one is still running.
+  if (pll_SaveJobs != NULL) return FALSE;
 
   p_iter = tree_child (CONFIGURATION_ACTIVE_STUDY_TREE(config));
   while (p_iter != NULL)
@@ -1142,11 +1371,24 @@ gui_mainwindow_file_export ()
       continue;
     }
 
-    memory_io_save_file (ps_serie, ps_serie->pc_filename);
+    // The mask is copied before this returns, so painting can continue
+    // while the copy is written to disk.
+    ps_Job = memory_io_save_file_async (ps_serie, ps_serie->pc_filename);
+    if (ps_Job != NULL)
+      pll_SaveJobs = list_append (pll_SaveJobs, ps_Job);
+
     p_iter = tree_next (p_iter);
   }
 
-  gtk_label_set_text (GTK_LABEL (lbl_info), "The files have been saved.");
+  if (pll_SaveJobs == NULL)
+  {
+    gtk_label_set_text (GTK_LABEL (lbl_info), "Nothing has been saved.");
+    return FALSE;
+  }
+
+  gtk_widget_set_sensitive (btn_file_save, FALSE);
+  gtk_label_set_text (GTK_LABEL (lbl_info), "Saving masks... 0%");
+  g_timeout_add (100, gui_mainwindow_file_export_progress, NULL);
 
   return FALSE;
 }
@@ -1446,8 +1688,6 @@ gui_mainwindow_on_key_press (UNUSED GtkWidget *widget, GdkEventKey *event,
   debug_functions ();
   debug_events ();
 
-  Serie *ps_mask;
-
   /*--------------------------------------------------------------------------.
    | KEY RESPONSES                                                            |
    '--------------------------------------------------------------------------*/
@@ -1499,21 +1739,13 @@ gui_mainwindow_on_key_press (UNUSED GtkWidget *widget, GdkEventKey *event,
   else if ((event->keyval == CONFIGURATION_KEY (config, KEY_UNDO)) &&
            (event->state & GDK_CONTROL_MASK))
   {
-    ps_mask=CONFIGURATION_ACTIVE_MASK(config);
-    if (ps_mask != NULL)
-    {
-      pll_History = common_history_load_state (pll_History, HISTORY_PREVIOUS, &ps_mask->data);
-    }
+    gui_mainwindow_load_undo_step (HISTORY_PREVIOUS);
   }
 
   else if ((event->keyval == CONFIGURATION_KEY (config, KEY_REDO)) &&
            (event->state & GDK_CONTROL_MASK))
   {
-    ps_mask=CONFIGURATION_ACTIVE_MASK(config);
-    if (ps_mask != NULL)
-    {
-      pll_History = common_history_load_state (pll_History, HISTORY_NEXT, &ps_mask->data);
-    }
+    gui_mainwindow_load_undo_step (HISTORY_NEXT);
   }
 
   /*--------------------------------------------------------------------------.
@@ -1523,7 +1755,8 @@ gui_mainwindow_on_key_press (UNUSED GtkWidget *widget, GdkEventKey *event,
   if (ps_active_viewer != NULL)
     viewer_on_key_press (ps_active_viewer, event);
 
-  if (pll_History != NULL
+  if (CONFIGURATION_ACTIVE_MASK(config) != NULL
+      && CONFIGURATION_ACTIVE_MASK(config)->pll_History != NULL
       && event->keyval != CONFIGURATION_KEY (config, KEY_TOGGLE_FOLLOW))
   {
     gui_mainwindow_redisplay_viewers (GUI_DO_REDRAW);
@@ -1662,10 +1895,6 @@ gui_mainwindow_clear_viewers ()
   // Remove Viewer objects.
   list_free_all (pll_Viewers, viewer_destroy);
   pll_Viewers = NULL;
-
-  // Remove undo-history.
-  list_free_all (pll_History, common_history_destroy_element);
-  pll_History = NULL;
 }
 
 
@@ -1674,6 +1903,13 @@ gui_mainwindow_destroy ()
 {
   debug_functions ();
 
+  // Wait for pending saves, so no mask gets lost on exit.
+  gui_mainwindow_file_export_wait ();
+
+  // Files that are still loading are thrown away.
+  memory_io_load_job_finish (ps_LoadJob);
+  ps_LoadJob = NULL;
+
   gui_mainwindow_clear_viewers ();
   gui_mainwindow_sidebar_destroy ();
 
@@ -1684,7 +1920,6 @@ gui_mainwindow_destroy ()
 
   list_free_all (pl_plugins, pixeldata_plugin_destroy);
   list_free_all (pll_Viewers, viewer_destroy);
-  list_free_all (pll_History, common_history_destroy_element);
 
   g_object_ref_sink (window);
   gtk_widget_destroy (window);
@@ -1775,6 +2010,11 @@ gui_mainwindow_toolbar_new ()
 		    G_CALLBACK (gui_mainwindow_set_brush_value),
 		    NULL);
 
+  // Each mask has an undo history of its own, but they share a budget.
+  lbl_history = gtk_label_new ("");
+  gtk_box_pack_start (GTK_BOX (hbox_toolbar), lbl_history, 0, 0, 5);
+  gui_mainwindow_update_history_label ();
+
   /*--------------------------------------------------------------------------.
    | ADD PLUGINS TO MENU BAR                                                  |
    '--------------------------------------------------------------------------*/
@@ -1945,6 +2185,10 @@ gboolean gui_mainwindow_mask_remove (unsigned long long ull_serieID )
     viewers = list_next (viewers);
   }
 
+  // A save that is still running refers to the mask.
+  gui_mainwindow_file_export_wait ();
+
+  memory_tree_unregister (pt_maskSerie);
   memory_serie_destroy (pt_maskSerie->data);
   pt_maskSerie->data = NULL;
 
@@ -2087,6 +2331,7 @@ gboolean gui_mainwindow_overlay_remove (unsigned long long ull_serieID)
     viewers = list_next (viewers);
   }
 
+  memory_tree_unregister (pt_serie);
   memory_serie_destroy (ps_serie);
   ps_serie = NULL;
 
@@ -2526,6 +2771,54 @@ gui_mainwindow_cell_edited (UNUSED GtkCellRendererText *cell, char *pc_pathstrin
 
 }
 
+gboolean
+gui_mainwindow_memory_readout_update (UNUSED void *data)
+{
+  debug_functions ();
+
+  if (lbl_memory == NULL) return FALSE;
+
+  AccountingUsage ts_Total = common_accounting_get_usage (NULL, ACCOUNTING_TOTAL);
+  unsigned long long ui64_Budget = common_accounting_get_budget ();
+  char pc_Text[128];
+  char pc_Details[1024];
+  int i32_Length = 0;
+  int i32_Category;
+
+  if (ui64_Budget > 0)
+    snprintf (pc_Text, sizeof (pc_Text), "Memory: %.0f of %.0f MB (peak %.0f MB)",
+              ts_Total.current / 1048576.0, ui64_Budget / 1048576.0, ts_Total.peak / 1048576.0);
+  else
+    snprintf (pc_Text, sizeof (pc_Text), "Memory: %.0f MB (peak %.0f MB)",
+              ts_Total.current / 1048576.0, ts_Total.peak / 1048576.0);
+
+  gtk_label_set_text (GTK_LABEL (lbl_memory), pc_Text);
+
+  // The breakdown is shown for the whole program, and for the active serie.
+  Serie *ps_Serie = CONFIGURATION_ACTIVE_SERIE (config);
+  for (i32_Category = 0; i32_Category < ACCOUNTING_TOTAL && i32_Length < (int)sizeof (pc_Details); i32_Category++)
+  {
+    AccountingUsage ts_Usage = common_accounting_get_usage (NULL, i32_Category);
+    i32_Length += snprintf (pc_Details + i32_Length, sizeof (pc_Details) - i32_Length,
+                            "%s%s: %.1f MB (peak %.1f MB)", (i32_Category > 0) ? "\n" : "",
+                            common_accounting_category_name (i32_Category),
+                            ts_Usage.current / 1048576.0, ts_Usage.peak / 1048576.0);
+  }
+
+  if (ps_Serie != NULL && i32_Length < (int)sizeof (pc_Details))
+  {
+    AccountingUsage ts_Usage = common_accounting_get_usage (&ps_Serie->ts_Accounting, ACCOUNTING_TOTAL);
+    snprintf (pc_Details + i32_Length, sizeof (pc_Details) - i32_Length,
+              "\n%s: %.1f MB (peak %.1f MB)", ps_Serie->name,
+              ts_Usage.current / 1048576.0, ts_Usage.peak / 1048576.0);
+  }
+
+  gtk_widget_set_tooltip_text (lbl_memory, pc_Details);
+
+  return TRUE;
+}
+
+
 GtkWidget*
 gui_mainwindow_sidebar_new ()
 {
@@ -2543,6 +2836,15 @@ gui_mainwindow_sidebar_new ()
   gtk_box_pack_start (GTK_BOX (wrapper), scrolled, TRUE, TRUE, 0);
   gtk_box_pack_end (GTK_BOX (wrapper), propertiesBox, FALSE, FALSE, 0);
 
+  if (CONFIGURATION_MEMORY_READOUT (config))
+  {
+    lbl_memory = gtk_label_new ("");
+    gtk_box_pack_end (GTK_BOX (wrapper), lbl_memory, FALSE, FALSE, 5);
+
+    gui_mainwindow_memory_readout_update (NULL);
+    g_timeout_add (1000, gui_mainwindow_memory_readout_update, NULL);
+  }
+
   /*--------------------------------------------------------------------------.
    | GLOBAL TREE VIEW SETTINGS                                                |
    '--------------------------------------------------------------------------*/
@@ -17,7 +17,9 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <getopt.h>
 #include <signal.h>
 #include <unistd.h>
@@ -28,7 +30,10 @@
 
 #include "libconfiguration.h"
 #include "libmemory.h"
+#include "libcommon-history.h"
+#include "libcommon-accounting.h"
 #include "gui/mainwindow.h"
+#include "batch/batch.h"
 
 // VERSION should be provided by the build system, otherwise define it here.
 #ifndef VERSION
@@ -40,6 +45,24 @@ show_help ()
 {
   puts ("\nAvailable options:\n"
         " --file, -f          A valid path to a niftii file.\n"
+        " --bricked, -b       Keep volumes in bricks, for faster sagittal\n"
+        "                     and coronal viewing.\n"
+        " --lazy, -l          Read DICOM slices when they are first viewed.\n"
+        " --batch, -B         Process the files or DICOM directories that\n"
+        "                     follow the options without starting the GUI.\n"
+        " --output, -o        The directory for batch output (default: .).\n"
+        " --format, -F        Convert batch inputs to this format (nii,\n"
+        "                     nii.gz, hdr or clmvb).\n"
+        " --statistics, -s    Print the volume of each label in batch inputs.\n"
+        " --render, -r        Render batch inputs with this lookup table.\n"
+        " --workers, -j       The number of batch inputs to process at once.\n"
+        " --undo-memory, -u   The megabytes of undo history to keep in memory\n"
+        "                     (default: 256).\n"
+        " --undo-disk, -U     The megabytes of undo history to keep on disk\n"
+        "                     when it does not fit in memory (default: 4096).\n"
+        " --memory-budget, -m The megabytes the program should stay within.\n"
+        "                     Caches give memory back when it is exceeded.\n"
+        " --memory-usage, -M  Show the memory usage in the sidebar.\n"
         #ifdef ENABLE_GREL
         " --enable-grel, -g   Start a GREL shell.\n"
         #endif
@@ -105,6 +128,13 @@ main (int argc, char** argv)
   int arg = 0;
   int index = 0;
   char start_gui = 1;
+  char start_batch = 0;
+
+  unsigned long long ui64_UndoMemory = HISTORY_MEMORY_BUDGET;
+  unsigned long long ui64_UndoDisk = HISTORY_DISK_BUDGET;
+
+  BatchOptions batch_options;
+  memset (&batch_options, 0, sizeof (BatchOptions));
 
   /*----------------------------------------------------------------------.
    | OPTIONS                                                              |
@@ -114,6 +144,18 @@ main (int argc, char** argv)
   static struct option options[] =
   {
     { "file",              required_argument, 0, 'f' },
+    { "bricked",           no_argument,       0, 'b' },
+    { "lazy",              no_argument,       0, 'l' },
+    { "batch",             no_argument,       0, 'B' },
+    { "output",            required_argument, 0, 'o' },
+    { "format",            required_argument, 0, 'F' },
+    { "statistics",        no_argument,       0, 's' },
+    { "render",            required_argument, 0, 'r' },
+    { "workers",           required_argument, 0, 'j' },
+    { "undo-memory",       required_argument, 0, 'u' },
+    { "undo-disk",         required_argument, 0, 'U' },
+    { "memory-budget",     required_argument, 0, 'm' },
+    { "memory-usage",      no_argument,       0, 'M' },
     #ifdef ENABLE_GREL
     { "enable-grel",       no_argument,       0, 'g' },
     #endif
@@ -125,12 +167,48 @@ main (int argc, char** argv)
   while (arg != -1)
   {
     // Make sure to list all short options in the string below.
-    arg = getopt_long (argc, argv, "f:gvh", options, &index);
+    arg = getopt_long (argc, argv, "f:blBo:F:sr:j:u:U:m:Mgvh", options, &index);
     switch (arg)
     {
     case 'f':
       file_path = optarg;
       break;
+    case 'b':
+      CONFIGURATION_SERIE_LAYOUT (configuration_get_default ()) = SERIE_LAYOUT_BRICKED;
+      break;
+    case 'l':
+      memory_io_set_lazy_dicom (1);
+      break;
+    case 'B':
+      start_batch = 1;
+      break;
+    case 'o':
+      batch_options.pc_OutputDirectory = optarg;
+      break;
+    case 'F':
+      batch_options.pc_ConvertExtension = optarg;
+      break;
+    case 's':
+      batch_options.b_Statistics = 1;
+      break;
+    case 'r':
+      batch_options.pc_LookupTable = optarg;
+      break;
+    case 'j':
+      batch_options.ui32_Workers = atoi (optarg);
+      break;
+    case 'u':
+      ui64_UndoMemory = strtoull (optarg, NULL, 10) << 20;
+      break;
+    case 'U':
+      ui64_UndoDisk = strtoull (optarg, NULL, 10) << 20;
+      break;
+    case 'm':
+      common_accounting_set_budget (strtoull (optarg, NULL, 10) << 20);
+      break;
+    case 'M':
+      CONFIGURATION_MEMORY_READOUT (configuration_get_default ()) = 1;
+      break;
     #ifdef ENABLE_GREL
     case 'g':
       {
@@ -150,8 +228,30 @@ main (int argc, char** argv)
     }
   }
 
+  if (start_gui && start_batch)
+  {
+    // An output directory without a format asks for a plain conversion.
+    if (batch_options.pc_OutputDirectory != NULL && batch_options.pc_ConvertExtension == NULL)
+      batch_options.pc_ConvertExtension = "nii";
+
+    if (batch_options.pc_ConvertExtension != NULL && !batch_format_is_supported (batch_options.pc_ConvertExtension))
+    {
+      fprintf (stderr, "Unknown format '%s'.\n", batch_options.pc_ConvertExtension);
+      show_help ();
+      return 1;
+    }
+
+    if (file_path != NULL && optind == argc)
+      return batch_run (&batch_options, &file_path, 1);
+
+    return batch_run (&batch_options, argv + optind, argc - optind);
+  }
+
   if (start_gui)
+  {
+    common_history_set_budget (ui64_UndoMemory, ui64_UndoDisk);
     gui_mainwindow_new (file_path);
+  }
 
   #ifdef ENABLE_MTRACE
   muntrace ();